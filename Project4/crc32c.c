@@ -0,0 +1,242 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+/*
+ * CRC-32C implementation.
+ *
+ * The hardware path runs three independent crc32 streams over adjacent
+ * stretches of the buffer so that the instruction's latency is hidden, then
+ * merges them by "shifting" the earlier CRCs over the later stretches with
+ * precomputed tables.  The software path processes eight bytes per step
+ * (slicing-by-8).  Both produce the same values.
+ */
+
+// Reflected CRC-32C polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// Length of each of the three interleaved stretches.  The medium one covers
+// the bulk of a 4 KiB block in a single pass
+#define CRC32C_LONG 8192
+#define CRC32C_MEDIUM 1024
+#define CRC32C_SHORT 256
+
+// Slicing-by-8 tables
+static uint32_t crc32c_table[8][256];
+
+// Operators that append CRC32C_LONG / CRC32C_MEDIUM / CRC32C_SHORT zero
+// bytes to a CRC
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_medium[4][256];
+static uint32_t crc32c_short[4][256];
+
+static int crc32c_use_hardware = 0;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Multiply a vector by a 32x32 matrix over GF(2)
+ */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1)
+      sum ^= *mat;
+    vec >>= 1;
+    ++mat;
+  }
+  return (sum);
+}
+
+/**
+ * square = mat * mat
+ */
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; ++n)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/**
+ * Build the matrix that feeds length zero bytes through the CRC register
+ */
+static void crc32c_zeros_op(uint32_t *even, size_t length) {
+  uint32_t odd[32];
+
+  // One zero bit
+  odd[0] = CRC32C_POLY;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; ++n) {
+    odd[n] = row;
+    row <<= 1;
+  }
+
+  // Two, then four zero bits
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+
+  // Square up to one zero byte, then keep squaring for each bit of length
+  // (length is a power of two here)
+  do {
+    gf2_matrix_square(even, odd);
+    length >>= 1;
+    if (length == 0)
+      return;
+    gf2_matrix_square(odd, even);
+    length >>= 1;
+  } while (length);
+  memcpy(even, odd, sizeof(odd));
+}
+
+/**
+ * Tabulate the zeros operator one byte of the CRC at a time
+ */
+static void crc32c_zeros(uint32_t zeros[][256], size_t length) {
+  uint32_t op[32];
+  crc32c_zeros_op(op, length);
+  for (uint32_t n = 0; n < 256; ++n) {
+    zeros[0][n] = gf2_matrix_times(op, n);
+    zeros[1][n] = gf2_matrix_times(op, n << 8);
+    zeros[2][n] = gf2_matrix_times(op, n << 16);
+    zeros[3][n] = gf2_matrix_times(op, n << 24);
+  }
+}
+
+/**
+ * Append the zero bytes described by a zeros table to crc
+ */
+static uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+  return (zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+          zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24]);
+}
+
+/**
+ * Build the tables and pick an implementation (once per process)
+ */
+static void crc32c_init() {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; ++k)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = crc32c_table[0][n];
+    for (int k = 1; k < 8; ++k) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[k][n] = crc;
+    }
+  }
+
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_medium, CRC32C_MEDIUM);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    crc32c_use_hardware = 1;
+  }
+#endif
+}
+
+/**
+ * Table-driven CRC-32C, eight bytes per step
+ */
+static uint32_t crc32c_software(uint32_t crc, const unsigned char *next,
+                                size_t length) {
+  crc = ~crc;
+  while (length > 0 && ((uintptr_t)next & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    --length;
+  }
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, next, 8);
+    word ^= crc;
+    crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+          crc32c_table[5][(word >> 16) & 0xff] ^
+          crc32c_table[4][(word >> 24) & 0xff] ^
+          crc32c_table[3][(word >> 32) & 0xff] ^
+          crc32c_table[2][(word >> 40) & 0xff] ^
+          crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    next += 8;
+    length -= 8;
+  }
+  while (length > 0) {
+    crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    --length;
+  }
+  return (~crc);
+}
+
+#if defined(__x86_64__)
+/**
+ * Run three crc32 streams over consecutive stretches of stretch bytes each
+ * and merge them into crc
+ */
+#define CRC32C_TRIPLE(crc, next, length, stretch, zeros)                       \
+  while (length >= 3 * (stretch)) {                                            \
+    uint64_t crc1 = 0, crc2 = 0;                                               \
+    const unsigned char *end = next + (stretch);                               \
+    do {                                                                       \
+      crc = _mm_crc32_u64(crc, *(const uint64_t *)next);                       \
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + (stretch)));       \
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + 2 * (stretch)));   \
+      next += 8;                                                               \
+    } while (next < end);                                                      \
+    crc = crc32c_shift(zeros, (uint32_t)crc) ^ crc1;                           \
+    crc = crc32c_shift(zeros, (uint32_t)crc) ^ crc2;                           \
+    next += 2 * (stretch);                                                     \
+    length -= 3 * (stretch);                                                   \
+  }
+
+/**
+ * CRC-32C on the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc32, const unsigned char *next, size_t length) {
+  uint64_t crc = ~crc32;
+  while (length > 0 && ((uintptr_t)next & 7) != 0) {
+    crc = _mm_crc32_u8((uint32_t)crc, *next++);
+    --length;
+  }
+  CRC32C_TRIPLE(crc, next, length, CRC32C_LONG, crc32c_long);
+  CRC32C_TRIPLE(crc, next, length, CRC32C_MEDIUM, crc32c_medium);
+  CRC32C_TRIPLE(crc, next, length, CRC32C_SHORT, crc32c_short);
+  while (length >= 8) {
+    crc = _mm_crc32_u64(crc, *(const uint64_t *)next);
+    next += 8;
+    length -= 8;
+  }
+  while (length > 0) {
+    crc = _mm_crc32_u8((uint32_t)crc, *next++);
+    --length;
+  }
+  return (~(uint32_t)crc);
+}
+#endif
+
+/**
+ * Compute or extend a CRC-32C
+ *
+ * @param crc CRC of the data that precedes this buffer (0 to start)
+ * @param data Buffer
+ * @param length Number of bytes in the buffer
+ * @return The CRC of the preceding data followed by the buffer
+ */
+unsigned int crc32c(unsigned int crc, const void *data, size_t length) {
+  pthread_once(&crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+  if (crc32c_use_hardware)
+    return (crc32c_sse42(crc, data, length));
+#endif
+  return (crc32c_software(crc, data, length));
+}
+
+/**
+ * @return 1 if crc32c() uses the SSE4.2 instruction; 0 otherwise
+ */
+int crc32c_hardware() {
+  pthread_once(&crc32c_once, crc32c_init);
+  return (crc32c_use_hardware);
+}
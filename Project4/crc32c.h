@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+
+/*
+ * CRC-32C (Castagnoli), as used for block checksums and journal
+ * transactions.  Uses the SSE4.2 crc32 instruction when the processor has
+ * it and a table-driven implementation otherwise.
+ */
+
+// Extend crc (0 to start) with length bytes of data
+unsigned int crc32c(unsigned int crc, const void *data, size_t length);
+
+// Does crc32c() run on the SSE4.2 instruction?
+int crc32c_hardware();
+
+#endif
@@ -0,0 +1,230 @@
+// Compression runs on every write to a compressed file: build this file
+// optimized regardless of the Makefile
+#pragma GCC optimize("O2")
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+/*
+ * LZ77 codec.
+ *
+ * The compressed stream is a series of sequences.  Each one starts with a
+ * token byte: the high nibble is the number of literal bytes that follow and
+ * the low nibble is the match length minus LZ_MIN_MATCH.  A nibble of 15 is
+ * extended by further bytes that are added to it until one is below 255.
+ * The literals come next, then the 2-byte (little-endian) distance back to
+ * the start of the match.  The last sequence holds literals only.
+ *
+ * Matches are found through a hash table of recent 4-byte strings; on data
+ * that does not compress the search skips ahead faster and faster.
+ */
+
+// Shortest match worth encoding
+#define LZ_MIN_MATCH 4
+
+// Longest distance a match may reach back
+#define LZ_MAX_DISTANCE 65535
+
+// Hash table of positions of recent 4-byte strings
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+/**
+ * @return The 4 bytes at p as one word
+ */
+static uint32_t lz_read32(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return (value);
+}
+
+/**
+ * @return The hash table slot for a 4-byte string
+ */
+static unsigned int lz_hash(uint32_t value) {
+  return ((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/**
+ * Append a length that did not fit in its nibble (the part above 15)
+ *
+ * @return Position after the length; -1 if dst is too small
+ */
+static int lz_put_length(unsigned char *dst, int op, int capacity,
+                         int length) {
+  while (length >= 255) {
+    if (op >= capacity)
+      return (-1);
+    dst[op++] = 255;
+    length -= 255;
+  }
+  if (op >= capacity)
+    return (-1);
+  dst[op++] = length;
+  return (op);
+}
+
+/**
+ * Append one sequence: n_literals literal bytes followed by a match (unless
+ * match_length is 0, which ends the stream)
+ *
+ * @return Position after the sequence; -1 if dst is too small
+ */
+static int lz_put_sequence(unsigned char *dst, int op, int capacity,
+                           const unsigned char *literals, int n_literals,
+                           int distance, int match_length) {
+  int match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+  if (op >= capacity)
+    return (-1);
+  dst[op++] = ((n_literals < 15 ? n_literals : 15) << 4) |
+              (match_code < 15 ? match_code : 15);
+  if (n_literals >= 15 &&
+      (op = lz_put_length(dst, op, capacity, n_literals - 15)) < 0)
+    return (-1);
+  if (op + n_literals > capacity)
+    return (-1);
+  memcpy(dst + op, literals, n_literals);
+  op += n_literals;
+
+  if (match_length == 0)
+    return (op);
+  if (op + 2 > capacity)
+    return (-1);
+  dst[op++] = distance & 0xff;
+  dst[op++] = distance >> 8;
+  if (match_code >= 15 &&
+      (op = lz_put_length(dst, op, capacity, match_code - 15)) < 0)
+    return (-1);
+  return (op);
+}
+
+/**
+ * Compress a buffer
+ *
+ * @param src Data to compress
+ * @param n Number of bytes of data
+ * @param dst Buffer for the compressed stream
+ * @param capacity Size of dst (LZ_BOUND(n) always suffices)
+ * @return Length of the compressed stream; -1 if it does not fit in dst
+ */
+int lz_compress(const unsigned char *src, int n, unsigned char *dst,
+                int capacity) {
+  int table[LZ_HASH_SIZE];
+  memset(table, 0xff, sizeof(table));
+
+  int op = 0;
+  int anchor = 0;
+  int ip = 0;
+  while (ip + LZ_MIN_MATCH <= n) {
+    uint32_t sequence = lz_read32(src + ip);
+    unsigned int slot = lz_hash(sequence);
+    int candidate = table[slot];
+    table[slot] = ip;
+
+    if (candidate < 0 || ip - candidate > LZ_MAX_DISTANCE ||
+        lz_read32(src + candidate) != sequence) {
+      // No match: step further the longer we go without one
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    // Extend the match as far as it goes
+    int length = LZ_MIN_MATCH;
+    while (ip + length < n && src[candidate + length] == src[ip + length])
+      ++length;
+
+    op = lz_put_sequence(dst, op, capacity, src + anchor, ip - anchor,
+                         ip - candidate, length);
+    if (op < 0)
+      return (-1);
+    ip += length;
+    anchor = ip;
+
+    // Remember a string near the end of the match for the next search
+    if (ip - 2 + LZ_MIN_MATCH <= n)
+      table[lz_hash(lz_read32(src + ip - 2))] = ip - 2;
+  }
+
+  // Whatever is left goes out as literals
+  return (lz_put_sequence(dst, op, capacity, src + anchor, n - anchor, 0, 0));
+}
+
+/**
+ * Read a length extension
+ *
+ * @return The value to add to the nibble; -1 if the stream ends first
+ */
+static int lz_get_length(const unsigned char *src, int *ip, int n) {
+  int length = 0;
+  unsigned char byte;
+  do {
+    if (*ip >= n)
+      return (-1);
+    byte = src[(*ip)++];
+    length += byte;
+  } while (byte == 255);
+  return (length);
+}
+
+/**
+ * Decompress a stream produced by lz_compress()
+ *
+ * @param src Compressed stream
+ * @param n Length of the stream
+ * @param dst Buffer for the data
+ * @param n_out Size of dst
+ * @return Number of bytes produced; -1 if the stream is corrupt or does not
+ *         fit in dst
+ */
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst,
+                  int n_out) {
+  int ip = 0;
+  int op = 0;
+  while (ip < n) {
+    unsigned char token = src[ip++];
+
+    // Literals
+    int n_literals = token >> 4;
+    if (n_literals == 15) {
+      int extra = lz_get_length(src, &ip, n);
+      if (extra < 0)
+        return (-1);
+      n_literals += extra;
+    }
+    if (n_literals > n - ip || n_literals > n_out - op)
+      return (-1);
+    memcpy(dst + op, src + ip, n_literals);
+    ip += n_literals;
+    op += n_literals;
+
+    // The last sequence has no match
+    if (ip == n)
+      break;
+
+    // Match
+    if (ip + 2 > n)
+      return (-1);
+    int distance = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    int length = token & 0x0f;
+    if (length == 15) {
+      int extra = lz_get_length(src, &ip, n);
+      if (extra < 0)
+        return (-1);
+      length += extra;
+    }
+    length += LZ_MIN_MATCH;
+    if (distance == 0 || distance > op || length > n_out - op)
+      return (-1);
+
+    // Copy forwards: overlapping matches repeat the bytes just produced
+    unsigned char *from = dst + op - distance;
+    if (distance >= length) {
+      memcpy(dst + op, from, length);
+    } else {
+      for (int i = 0; i < length; ++i)
+        dst[op + i] = from[i];
+    }
+    op += length;
+  }
+  return (op);
+}
@@ -0,0 +1,17 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * Small LZ77 codec (LZ4-style byte-oriented sequences) used for compressed
+ * files.  No external dependencies.
+ */
+
+// Worst-case size of the compressed form of n bytes
+#define LZ_BOUND(n) ((n) + (n) / 255 + 16)
+
+int lz_compress(const unsigned char *src, int n, unsigned char *dst,
+                int capacity);
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst,
+                  int n_out);
+
+#endif
@@ -19,14 +19,25 @@
 // Implementation of min operator
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
 
+// Implementation of max operator
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
 /**********************************************************************/
 /*
 File system layout onto disk blocks:
 
-Block 0: Master block
-Blocks 1 ... N_INODE_BLOCKS: inodes
-Blocks N_INODE_BLOCKS+1 ... N_BLOCKS_ON_DISK-1: data for files and directories
-   (Block N_BLOCKS+1 is allocated for the root directory)
+Blocks 0 ... N_MASTER_BLOCKS-1: Master blocks (superblock + allocation tables)
+Blocks N_MASTER_BLOCKS ... N_MASTER_BLOCKS+N_INODE_BLOCKS-1: inodes
+Blocks FIRST_JOURNAL_BLOCK ... FIRST_JOURNAL_BLOCK+N_JOURNAL_BLOCKS-1:
+   metadata journal (may be empty)
+Blocks FIRST_CHECKSUM_BLOCK ... FIRST_CHECKSUM_BLOCK+N_CHECKSUM_BLOCKS-1:
+   block checksums (may be empty)
+Blocks ROOT_DIRECTORY_BLOCK ... N_BLOCKS_IN_DISK-1: data for files and
+   directories (ROOT_DIRECTORY_BLOCK is allocated for the root directory)
+
+The geometry (block size, number of blocks, number of master, inode,
+journal and checksum blocks) is chosen by oufs_format_disk_geometry() and read
+back from the superblock when the disk is opened.
 */
 
 /**********************************************************************/
@@ -39,26 +50,63 @@ typedef unsigned short INODE_REFERENCE;
 #define UNALLOCATED_INODE (USHRT_MAX-1)
 
 // Value used as an index when it does not refer to a block
-#define UNALLOCATED_BLOCK USHRT_MAX
+#define UNALLOCATED_BLOCK UINT_MAX
+
+// Largest number of inodes an INODE_REFERENCE can address
+#define MAX_N_INODES UNALLOCATED_INODE
+
+// The layout depends on the geometry of the disk: the macros below take the
+//  disk (a VDISK *) they apply to
+
+// Number of master blocks on the virtual disk
+#define N_MASTER_BLOCKS(d) ((d)->superblock.n_master_blocks)
 
 // Number of inode blocks on the virtual disk
-#define N_INODE_BLOCKS 8
+#define N_INODE_BLOCKS(d) ((d)->superblock.n_inode_blocks)
+
+// The first block of inodes
+#define FIRST_INODE_BLOCK(d) N_MASTER_BLOCKS(d)
+
+// Number of journal blocks on the virtual disk
+#define N_JOURNAL_BLOCKS(d) ((d)->superblock.n_journal_blocks)
+
+// Journal blocks an operation changes besides the master blocks and the
+// blocks of the file it writes: two inode blocks and two directory blocks
+#define OPERATION_JOURNAL_BLOCKS 4
+
+// The journal picked by oufs_format_disk_geometry() takes at most this
+// fraction of the disk (1 / JOURNAL_DISK_FRACTION)
+#define JOURNAL_DISK_FRACTION 16
+
+// The first journal block
+#define FIRST_JOURNAL_BLOCK(d) (FIRST_INODE_BLOCK(d) + N_INODE_BLOCKS(d))
+
+// Number of checksum blocks on the virtual disk
+#define N_CHECKSUM_BLOCKS(d) ((d)->superblock.n_checksum_blocks)
+
+// The first checksum block
+#define FIRST_CHECKSUM_BLOCK(d) (FIRST_JOURNAL_BLOCK(d) + N_JOURNAL_BLOCKS(d))
 
 // The block on the virtual disk containing the root directory
-#define ROOT_DIRECTORY_BLOCK (N_INODE_BLOCKS + 1)
+#define ROOT_DIRECTORY_BLOCK(d) (FIRST_CHECKSUM_BLOCK(d) + N_CHECKSUM_BLOCKS(d))
+
+// Blocks per block group: as many as one block of the block allocation table
+// covers.  A block placed near another is looked for in that block's group
+// before the others
+#define BLOCKS_PER_GROUP(d) (8 * VDISK_BLOCK_SIZE(d))
 
 // Size of file/directory name
 #define FILE_NAME_SIZE (16 - sizeof(INODE_REFERENCE))
 
 // Number of data block references in an inode.  Just big enough to fit a reasonable
 //  number of inodes into a single block
-#define BLOCKS_PER_INODE (16-1)
+#define BLOCKS_PER_INODE (16-2)
 
 /**********************************************************************/
 // Data block: storage for file contents (project 4!)
 typedef struct data_block_s
 {
-  unsigned char data[BLOCK_SIZE];
+  unsigned char data[VDISK_MAX_BLOCK_SIZE];
 } DATA_BLOCK;
 
 
@@ -77,6 +125,9 @@ typedef struct inode_s
   // Number of directories references to this inode
   unsigned char n_references;
 
+  // INODE_COMPRESSED, ...
+  unsigned char flags;
+
   // Contents.  UNALLOCATED_BLOCK means that this entry is not used
   BLOCK_REFERENCE data[BLOCKS_PER_INODE];
 
@@ -84,34 +135,151 @@ typedef struct inode_s
   unsigned int size;
 } INODE;
 
+// Inode flags
+// File data is stored as one compressed stream: a COMPRESSED_HEADER followed
+//  by the compressed bytes, spread over the file's blocks in order.  The
+//  blocks are listed like those of any file (in data[], indirect blocks or
+//  an extent tree).  size is the uncompressed size
+#define INODE_COMPRESSED 0x01
+// The file has more blocks than data[] can refer to.  data[0 ...
+//  N_DIRECT_BLOCKS-1] refer to its first blocks, data[INDIRECT_SLOT] to an
+//  indirect block holding the references of the blocks that follow and
+//  data[DOUBLE_INDIRECT_SLOT] to a double indirect block holding the
+//  references of further indirect blocks.  Unused references are
+//  UNALLOCATED_BLOCK.  Without the flag every entry of data[] refers to a
+//  data block
+#define INODE_INDIRECT 0x02
+
+// Layout of data[] in a file with INODE_INDIRECT set
+#define N_DIRECT_BLOCKS (BLOCKS_PER_INODE - 2)
+#define INDIRECT_SLOT N_DIRECT_BLOCKS
+#define DOUBLE_INDIRECT_SLOT (N_DIRECT_BLOCKS + 1)
+
+// Number of block references held by an indirect block
+#define REFERENCES_PER_BLOCK(d) (VDISK_BLOCK_SIZE(d) / sizeof(BLOCK_REFERENCE))
+
+// Largest number of blocks of a file, and largest size of an uncompressed
+//  file
+#define MAX_FILE_BLOCKS(d)                                                     \
+  ((unsigned long)N_DIRECT_BLOCKS + REFERENCES_PER_BLOCK(d) +                  \
+   (unsigned long)REFERENCES_PER_BLOCK(d) * REFERENCES_PER_BLOCK(d))
+#define MAX_FILE_SIZE(d)                                                       \
+  MIN(MAX_FILE_BLOCKS(d) * VDISK_BLOCK_SIZE(d), (unsigned long)INT_MAX)
+
+// The file's blocks are described by runs of consecutive blocks (extents)
+//  kept in a B-tree whose root is an EXTENT_ROOT overlaying data[].  See
+//  EXTENT_NODE
+#define INODE_EXTENTS 0x04
+
+// A tiny file: its size bytes are kept in data[] itself, which refers to no
+//  block.  They move out to blocks when they outgrow INLINE_DATA_SIZE
+#define INODE_INLINE 0x08
+#define INLINE_DATA_SIZE (BLOCKS_PER_INODE * sizeof(BLOCK_REFERENCE))
+
+// A run of blocks.  In a node of depth 0 (a leaf), length consecutive blocks
+//  of the file starting with block start; in a node above, start is the
+//  block holding a child node and length the number of file blocks under it
+typedef struct extent_s
+{
+  BLOCK_REFERENCE start;
+  unsigned int length;
+} EXTENT;
+
+// Start of an extent tree node: n_entries entries follow, in file order
+typedef struct extent_header_s
+{
+  unsigned short n_entries;
+  unsigned short depth;
+} EXTENT_HEADER;
+
+// Root of an extent tree, in data[] of an inode with INODE_EXTENTS set
+#define EXTENTS_PER_INODE                                                      \
+  ((BLOCKS_PER_INODE * sizeof(BLOCK_REFERENCE) - sizeof(EXTENT_HEADER)) /      \
+   sizeof(EXTENT))
+typedef struct extent_root_s
+{
+  EXTENT_HEADER header;
+  EXTENT entry[EXTENTS_PER_INODE];
+} EXTENT_ROOT;
+
+// Entries held by an extent tree node in a block, and deepest tree read
+#define EXTENTS_PER_BLOCK(d)                                                   \
+  ((VDISK_BLOCK_SIZE(d) - sizeof(EXTENT_HEADER)) / sizeof(EXTENT))
+#define EXTENT_MAX_DEPTH 8
+
+// Start of the stream of a compressed file
+typedef struct compressed_header_s
+{
+  // Length of the compressed bytes that follow the header
+  unsigned int stored_size;
+} COMPRESSED_HEADER;
+
+// Largest (uncompressed) size of a compressed file: the stream must fit in
+//  a file however badly the contents compress (see LZ_BOUND())
+#define MAX_COMPRESSED_FILE_SIZE(d)                                            \
+  ((MAX_FILE_SIZE(d) - sizeof(COMPRESSED_HEADER) - 16) / 256 * 255)
+
 // Number of inodes stored in each block
-#define INODES_PER_BLOCK (BLOCK_SIZE/sizeof(INODE))
+#define INODES_PER_BLOCK(d) (VDISK_BLOCK_SIZE(d) / sizeof(INODE))
 
 // Total number of inodes in the file system
-#define N_INODES (INODES_PER_BLOCK * N_INODE_BLOCKS)
+#define N_INODES(d) (INODES_PER_BLOCK(d) * N_INODE_BLOCKS(d))
 
 // Block of inodes
 typedef struct inode_block_s
 {
-  INODE inode[INODES_PER_BLOCK];
+  INODE inode[VDISK_MAX_BLOCK_SIZE / sizeof(INODE)];
 } INODE_BLOCK;
 
+// Indirect block: references to the blocks of a file (or, for a double
+//  indirect block, to indirect blocks)
+typedef struct indirect_block_s
+{
+  BLOCK_REFERENCE ref[VDISK_MAX_BLOCK_SIZE / sizeof(BLOCK_REFERENCE)];
+} INDIRECT_BLOCK;
+
+// Extent tree node below the root (see INODE_EXTENTS)
+typedef struct extent_node_s
+{
+  EXTENT_HEADER header;
+  EXTENT entry[(VDISK_MAX_BLOCK_SIZE - sizeof(EXTENT_HEADER)) / sizeof(EXTENT)];
+} EXTENT_NODE;
+
 
 /**********************************************************************/
 // Block 0
 #define MASTER_BLOCK_REFERENCE 0
 
+// The master blocks are treated as one contiguous byte array: the superblock
+// comes first, followed (at MASTER_TABLES_OFFSET) by the allocation tables
+//
+// Inode table: 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
+//  The first inode is byte 0, bit 0
+// Block table: 8 data blocks per byte: One block per bit: 1 = allocated,
+//  0 = free.  Block 0 (the first master block) is byte 0, bit 0
+#define MASTER_TABLES_OFFSET 128
+#define INODE_TABLE_OFFSET MASTER_TABLES_OFFSET
+#define INODE_TABLE_BYTES(d) ((N_INODES(d) + 7) / 8)
+#define BLOCK_TABLE_OFFSET(d) (INODE_TABLE_OFFSET + INODE_TABLE_BYTES(d))
+#define BLOCK_TABLE_BYTES(d) ((VDISK_N_BLOCKS(d) + 7) / 8)
+
+// Marks the free counters of a master block as maintained
+#define FREE_COUNTERS_MAGIC 0x45455246 // "FREE"
+
 typedef struct master_block_s
 {
-  // 8 inodes per byte: One inode per bit: 1 = allocated, 0 = free
-  // The first inode is byte 0, bit 0
-  unsigned char inode_allocated_flag[N_INODES >> 3];
+  VDISK_SUPERBLOCK superblock;
 
-  // 8 data blocks per byte: One block per bit: 1 = allocated, 0 = free
-  // Block 0 (the master block) is byte 0, bit 0
-  unsigned char block_allocated_flag[N_BLOCKS_IN_DISK >> 3];
+  // Free data blocks and inodes, kept in step with the allocation tables
+  // (only meaningful when counters_magic is FREE_COUNTERS_MAGIC)
+  unsigned int counters_magic;
+  unsigned int n_free_blocks;
+  unsigned int n_free_inodes;
 } MASTER_BLOCK;
 
+_Static_assert(sizeof(MASTER_BLOCK) <= MASTER_TABLES_OFFSET,
+               "superblock overlaps the allocation tables");
+
 /**********************************************************************/
 // Single directory element
 typedef struct directory_entry_s
@@ -125,24 +293,29 @@ typedef struct directory_entry_s
 } DIRECTORY_ENTRY;
 
 // Number of directory entries stored in one data block
-#define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(DIRECTORY_ENTRY))
+#define DIRECTORY_ENTRIES_PER_BLOCK(d)                                         \
+  (VDISK_BLOCK_SIZE(d) / sizeof(DIRECTORY_ENTRY))
 
 // Directory block
 typedef struct directory_block_s
 {
-  DIRECTORY_ENTRY entry[DIRECTORY_ENTRIES_PER_BLOCK];
+  DIRECTORY_ENTRY entry[VDISK_MAX_BLOCK_SIZE / sizeof(DIRECTORY_ENTRY)];
 } DIRECTORY_BLOCK;
 
 /**********************************************************************/
 // All-encompassing structure for a disk block
-// The union says that all 4 of these elements occupy overlapping bytes in
-//  memory (hence, a block will only be one of these 4 at any given time)
+// The union says that all 6 of these elements occupy overlapping bytes in
+//  memory (hence, a block will only be one of these 6 at any given time)
+// It is sized for the largest supported block; only the first BLOCK_SIZE
+//  bytes are transferred to/from the disk
 typedef union block_u
 {
   DATA_BLOCK data;
   MASTER_BLOCK master;
   INODE_BLOCK inodes;
   DIRECTORY_BLOCK directory;
+  INDIRECT_BLOCK indirect;
+  EXTENT_NODE extents;
 } BLOCK;
 
 
@@ -151,9 +324,36 @@ typedef union block_u
 
 typedef struct oufile_s
 {
+  VDISK *disk;
   INODE_REFERENCE inode_reference;
   char mode;
   int offset;
+
+  // Read-ahead window of oufs_fread(): blocks ra_first .. ra_first +
+  // ra_count - 1 of the file, held in ra_data (released by oufs_fclose()).
+  // ra_window is the size of the last sequential window (0: none yet)
+  unsigned char *ra_data;
+  int ra_first;
+  int ra_count;
+  int ra_window;
+
+  // Block map of the file, loaded by the first oufs_fread() (released by
+  // oufs_fclose())
+  struct oufs_map_s *map;
+
+  // New data blocks are placed near this one: the first block of the
+  // directory the file was opened in
+  BLOCK_REFERENCE goal;
+
+  // Delayed allocation: wb_len bytes written with oufs_fwrite() and waiting
+  // in wb_data (wb_capacity bytes, released by oufs_fclose()) for
+  // oufs_fflush() or oufs_fclose() to give them blocks.  wb_room is how many
+  // more bytes the file can take, so the buffer never has to be flushed
+  // early
+  unsigned char *wb_data;
+  int wb_len;
+  int wb_capacity;
+  int wb_room;
 } OUFILE;
 
 
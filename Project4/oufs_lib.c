@@ -1,8 +1,19 @@
 #include "oufs_lib.h"
+#include "lz.h"
 #include <stdlib.h>
 
 #define debug 0
 
+// Code below works on the disk passed in as "disk"
+
+// Number of blocks handed to vdisk_write_blocks() at a time while formatting
+#define FORMAT_BATCH_BLOCKS 256
+
+// Read-ahead window of a file being read sequentially: it starts at
+// READAHEAD_MIN_BLOCKS and doubles up to READAHEAD_MAX_BLOCKS
+#define READAHEAD_MIN_BLOCKS 4
+#define READAHEAD_MAX_BLOCKS 64
+
 /**
  * Read the ZPWD and ZDISK environment variables & copy their values into cwd
  * and disk_name. If these environment variables are not set, then reasonable
@@ -52,8 +63,8 @@ void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry) {
  * @param block The block containing the directory contents
  *
  */
-void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent,
-                                BLOCK *block) {
+void oufs_clean_directory_block_at(VDISK *disk, INODE_REFERENCE self,
+                                   INODE_REFERENCE parent, BLOCK *block) {
   // Debugging output
   if (debug)
     fprintf(stderr, "New clean directory: self=%d, parent=%d\n", self, parent);
@@ -63,7 +74,7 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent,
   oufs_clean_directory_entry(&entry);
 
   // Copy empty directory entries across the entire directory list
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
+  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); ++i) {
     block->directory.entry[i] = entry;
   }
 
@@ -92,175 +103,713 @@ int oufs_find_open_bit(unsigned char value) {
   if (debug)
     fprintf(stderr, "value=%d\n", value);
 
-  // Check all bits 00:ff
-  switch (value) {
-  case 0x00:
-  case 0x02:
-  case 0x04:
-  case 0x06:
-  case 0x08:
-  case 0x0a:
-  case 0x0c:
-  case 0x0e:
-    return 0;
-  case 0x01:
-  case 0x05:
-  case 0x09:
-  case 0x0d:
-    return 1;
-  case 0x03:
-  case 0x0b:
-    return 2;
-  case 0x07:
-    return 3;
-  case 0x0f:
-  case 0x2f:
-  case 0x4f:
-  case 0x6f:
-  case 0x8f:
-  case 0xaf:
-  case 0xcf:
-  case 0xef:
-    return 4;
-  case 0x1f:
-  case 0x5f:
-  case 0x9f:
-  case 0xdf:
-    return 5;
-  case 0x3f:
-  case 0xbf:
-    return 6;
-  case 0x7f:
-    return 7;
-  default:
+  // Lowest clear bit (scan in bit order: 0 ... 7)
+  if (value == 0xff)
     return 8;
+  return __builtin_ctz(~value);
+}
+
+/*
+ * Allocation tables.
+ *
+ * The inode and block allocation tables of an open disk are loaded into
+ * memory on first use and kept there (attached to the VDISK) until the disk
+ * is closed.  Searches go 64 entries at a time, starting from where the last
+ * allocation left off (next fit).  Changed entries are written back to the
+ * master blocks once, at the end of the operation that changed them.
+ *
+ * File contents are not journaled, so a data block freed by a transaction
+ * must not be reused before that transaction has reached its checkpoint:
+ * after a crash the file that owned it could come back, pointing at someone
+ * else's data.  Such blocks are pinned: clear in the table on disk, but
+ * still taken in memory until the checkpoint.
+ */
+
+// One allocation table: bit i of words[i / 64] is entry i (1 = allocated)
+typedef struct oufs_bitmap_s {
+  unsigned long long *words;
+  unsigned int n_words;
+  unsigned int n_bits;
+  // Byte offset of the table in the master region
+  unsigned int table_offset;
+  // Word at which the next search starts
+  unsigned int hint;
+  // Clear entries
+  unsigned int n_free;
+  // Pinned entries (NULL if none), how many there are and the transaction
+  // whose checkpoint releases them.  They are also set in words, and not
+  // counted in n_free
+  unsigned long long *pinned;
+  unsigned int n_pinned;
+  unsigned long pinned_until;
+} OUFS_BITMAP;
+
+// Slots in the inode cache
+#define INODE_CACHE_SLOTS 1024
+
+// One slot of the inode cache: the inode last used among those whose
+// reference is the slot number modulo INODE_CACHE_SLOTS
+typedef struct oufs_inode_slot_s {
+  // UNALLOCATED_INODE: empty
+  INODE_REFERENCE ref;
+  // Changed since it was last written back
+  unsigned char dirty;
+  INODE inode;
+} OUFS_INODE_SLOT;
+
+// Block buffers kept for reuse.  A BLOCK is as large as the largest block
+// size, so block buffers are allocated at the size of the disk instead
+#define OUFS_SCRATCH_BLOCKS 4
+
+// File system state of an open disk
+typedef struct oufs_state_s {
+  // Operations in progress (they may nest)
+  int depth;
+
+  // Allocation tables (words are NULL until loaded) and, per master block,
+  // whether it holds entries changed since they were last written back
+  OUFS_BITMAP inodes;
+  OUFS_BITMAP blocks;
+  unsigned char *master_dirty;
+
+  // Inode cache (NULL until first used) and how many of its slots are dirty
+  OUFS_INODE_SLOT *inode_cache;
+  int n_dirty_inodes;
+
+  // Free block buffers
+  BLOCK *scratch[OUFS_SCRATCH_BLOCKS];
+  int n_scratch;
+} OUFS_STATE;
+
+/**
+ * Release the state of a disk (called by the vdisk layer)
+ */
+static void oufs_state_release(void *fs) {
+  OUFS_STATE *state = fs;
+  free(state->inodes.words);
+  free(state->blocks.words);
+  free(state->blocks.pinned);
+  free(state->master_dirty);
+  free(state->inode_cache);
+  for (int i = 0; i < state->n_scratch; ++i)
+    free(state->scratch[i]);
+  free(state);
+}
+
+/**
+ * @return The state of a disk, created on first use; NULL if out of memory
+ */
+static OUFS_STATE *oufs_state(VDISK *disk) {
+  if (disk->fs == NULL) {
+    disk->fs = calloc(1, sizeof(OUFS_STATE));
+    disk->fs_release = oufs_state_release;
   }
+  return (disk->fs);
 }
 
 /**
- * Allocate a new data block
+ * Get a buffer of one block of the disk.  Only the first block size bytes
+ * of the BLOCK may be used.  Give it back with oufs_block_put()
  *
- * If one is found, then the corresponding bit in the block allocation table is
- * set
+ * @return The buffer; NULL if out of memory
+ */
+static BLOCK *oufs_block_get(VDISK *disk) {
+  OUFS_STATE *state = oufs_state(disk);
+  if (state != NULL && state->n_scratch > 0)
+    return (state->scratch[--state->n_scratch]);
+  BLOCK *block = malloc(VDISK_BLOCK_SIZE(disk));
+  if (block == NULL)
+    fprintf(stderr, "Not enough memory\n");
+  return (block);
+}
+
+/**
+ * Give back a buffer from oufs_block_get() (NULL is ignored)
+ */
+static void oufs_block_put(VDISK *disk, BLOCK *block) {
+  OUFS_STATE *state = disk->fs;
+  if (block == NULL)
+    return;
+  if (state != NULL && state->n_scratch < OUFS_SCRATCH_BLOCKS)
+    state->scratch[state->n_scratch++] = block;
+  else
+    free(block);
+}
+
+/**
+ * Set up an allocation table from the contents of the master blocks
  *
- * @return The index of the allocated data block.  If no blocks are available,
- * then UNALLOCATED_BLOCK is returned
+ * @param master The master blocks, one after the other
+ * @return 0 on success; <0 if out of memory
+ */
+static int oufs_bitmap_load(OUFS_BITMAP *bitmap, unsigned char *master,
+                            unsigned int table_offset, unsigned int n_bits) {
+  bitmap->n_bits = n_bits;
+  bitmap->n_words = (n_bits + 63) / 64;
+  bitmap->table_offset = table_offset;
+  bitmap->hint = 0;
+  bitmap->words = calloc(bitmap->n_words ? bitmap->n_words : 1,
+                         sizeof(unsigned long long));
+  if (bitmap->words == NULL)
+    return (-5);
+
+  // Byte j of the table holds entries 8j ... 8j + 7
+  for (unsigned int j = 0; j < (n_bits + 7) / 8; ++j)
+    bitmap->words[j / 8] |= (unsigned long long)master[table_offset + j]
+                            << (8 * (j % 8));
+
+  // Count the clear entries (bits past the end of the table are clear)
+  unsigned long used = 0;
+  for (unsigned int w = 0; w < bitmap->n_words; ++w)
+    used += __builtin_popcountll(bitmap->words[w]);
+  bitmap->n_free = n_bits - used;
+  return (0);
+}
+
+/**
+ * Pin an entry that is being released, if the running transaction frees a
+ * data block (see above)
  *
+ * @return 1 if the entry was pinned (it stays set); 0 if it may be cleared
  */
-BLOCK_REFERENCE oufs_allocate_new_block() {
-  BLOCK block;
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Scan for an available block
-  int block_byte;
-  int flag;
-
-  // Loop over each byte in the allocation table.
-  for (block_byte = 0, flag = 1; flag && block_byte < N_BLOCKS_IN_DISK / 8;
-       ++block_byte) {
-    if (block.master.block_allocated_flag[block_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
+static int oufs_bitmap_pin(VDISK *disk, OUFS_STATE *state,
+                           OUFS_BITMAP *bitmap, unsigned int index) {
+  unsigned long sequence = vdisk_journal_sequence_at(disk);
+  if (bitmap != &state->blocks || sequence == 0)
+    return (0);
+  if (bitmap->pinned == NULL &&
+      (bitmap->pinned = calloc(bitmap->n_words,
+                               sizeof(unsigned long long))) == NULL)
+    return (0);
+
+  unsigned long long bit = 1ULL << (index % 64);
+  if (!(bitmap->pinned[index / 64] & bit)) {
+    bitmap->pinned[index / 64] |= bit;
+    bitmap->n_pinned++;
+  }
+  bitmap->pinned_until = sequence;
+  return (1);
+}
+
+/**
+ * Release the pinned entries once the transaction that freed the last of
+ * them has reached its checkpoint
+ */
+static void oufs_bitmap_unpin(VDISK *disk, OUFS_BITMAP *bitmap) {
+  if (bitmap->pinned == NULL ||
+      !vdisk_journal_settled_at(disk, bitmap->pinned_until))
+    return;
+  for (unsigned int w = 0; w < bitmap->n_words; ++w)
+    bitmap->words[w] &= ~bitmap->pinned[w];
+  bitmap->n_free += bitmap->n_pinned;
+  bitmap->n_pinned = 0;
+  free(bitmap->pinned);
+  bitmap->pinned = NULL;
+}
+
+/**
+ * Make sure that the allocation tables of a disk are in memory (and that
+ * blocks whose pin has expired are free again)
+ *
+ * @return The state holding them; NULL on error
+ */
+static OUFS_STATE *oufs_bitmaps(VDISK *disk) {
+  OUFS_STATE *state = oufs_state(disk);
+  if (state == NULL)
+    return (NULL);
+  if (state->blocks.words != NULL) {
+    oufs_bitmap_unpin(disk, &state->blocks);
+    return (state);
+  }
+
+  // Fetch every master block in one batch
+  unsigned char *master = malloc((size_t)N_MASTER_BLOCKS(disk) *
+                                 VDISK_BLOCK_SIZE(disk));
+  BLOCK_REFERENCE *refs = malloc(N_MASTER_BLOCKS(disk) *
+                                 sizeof(BLOCK_REFERENCE));
+  void **buffers = malloc(N_MASTER_BLOCKS(disk) * sizeof(void *));
+  state->master_dirty = calloc(N_MASTER_BLOCKS(disk), 1);
+  int ret = (master == NULL || refs == NULL || buffers == NULL ||
+             state->master_dirty == NULL)
+                ? -5
+                : 0;
+  for (unsigned int i = 0; ret == 0 && i < N_MASTER_BLOCKS(disk); ++i) {
+    refs[i] = MASTER_BLOCK_REFERENCE + i;
+    buffers[i] = master + (size_t)i * VDISK_BLOCK_SIZE(disk);
+  }
+  if (ret == 0)
+    ret = vdisk_read_blocks_at(disk, N_MASTER_BLOCKS(disk), refs, buffers);
+  free(refs);
+  free(buffers);
+  if (ret == 0)
+    ret = oufs_bitmap_load(&state->inodes, master, INODE_TABLE_OFFSET,
+                           N_INODES(disk));
+  if (ret == 0)
+    ret = oufs_bitmap_load(&state->blocks, master, BLOCK_TABLE_OFFSET(disk),
+                           VDISK_N_BLOCKS(disk));
+
+  // Free counters missing (a disk formatted without them) or out of step
+  // with the tables: write them back with the next change
+  MASTER_BLOCK *master_block = (MASTER_BLOCK *)master;
+  if (ret == 0 && (master_block->counters_magic != FREE_COUNTERS_MAGIC ||
+                   master_block->n_free_blocks != state->blocks.n_free ||
+                   master_block->n_free_inodes != state->inodes.n_free))
+    state->master_dirty[0] = 1;
+  free(master);
+  if (ret != 0) {
+    fprintf(stderr, "Could not load the allocation tables\n");
+    free(state->inodes.words);
+    free(state->blocks.words);
+    free(state->master_dirty);
+    state->inodes.words = state->blocks.words = NULL;
+    state->master_dirty = NULL;
+    return (NULL);
+  }
+  return (state);
+}
+
+/**
+ * Note that an entry of an allocation table has changed (and with it the
+ * free counters in the first master block)
+ */
+static void oufs_bitmap_touch(VDISK *disk, OUFS_STATE *state,
+                              OUFS_BITMAP *bitmap, unsigned int index) {
+  state->master_dirty[(bitmap->table_offset + index / 8) /
+                      VDISK_BLOCK_SIZE(disk)] = 1;
+  state->master_dirty[0] = 1;
+}
+
+/**
+ * Write the changed parts of the allocation tables back to the master blocks
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_bitmaps_write(VDISK *disk, OUFS_STATE *state) {
+  if (state->master_dirty == NULL)
+    return (0);
+  OUFS_BITMAP *tables[2] = {&state->inodes, &state->blocks};
+  BLOCK *block = oufs_block_get(disk);
+  if (block == NULL)
+    return (-1);
+  int ret = 0;
+  for (unsigned int i = 0; ret == 0 && i < N_MASTER_BLOCKS(disk); ++i) {
+    if (!state->master_dirty[i])
+      continue;
+    BLOCK_REFERENCE block_ref = MASTER_BLOCK_REFERENCE + i;
+    if (vdisk_read_block_at(disk, block_ref, block) != 0) {
+      ret = -1;
       break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if (flag == 1) {
-    // No
-    if (debug)
-      fprintf(stderr, "No blocks\n");
-    return (UNALLOCATED_BLOCK);
+    }
+
+    // Copy the bytes of each table that fall within this block
+    unsigned long first = (unsigned long)i * VDISK_BLOCK_SIZE(disk);
+    for (int t = 0; t < 2; ++t) {
+      OUFS_BITMAP *bitmap = tables[t];
+      unsigned long from = MAX(first, bitmap->table_offset);
+      unsigned long to = MIN(first + VDISK_BLOCK_SIZE(disk),
+                             bitmap->table_offset + (bitmap->n_bits + 7) / 8);
+      for (unsigned long p = from; p < to; ++p) {
+        unsigned int j = p - bitmap->table_offset;
+        unsigned long long word = bitmap->words[j / 8];
+        if (bitmap->pinned != NULL)
+          word &= ~bitmap->pinned[j / 8];
+        block->data.data[p - first] = word >> (8 * (j % 8));
+      }
+    }
+    if (i == 0) {
+      block->master.counters_magic = FREE_COUNTERS_MAGIC;
+      block->master.n_free_blocks =
+          state->blocks.n_free + state->blocks.n_pinned;
+      block->master.n_free_inodes = state->inodes.n_free;
+    }
+    if (vdisk_write_block_at(disk, block_ref, block) != 0)
+      ret = -1;
+    else
+      state->master_dirty[i] = 0;
   }
+  oufs_block_put(disk, block);
+  return (ret);
+}
 
-  // Found an available data block
+/**
+ * Allocation tables changed outside of an operation are written back right
+ * away; inside one, when it ends
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_bitmaps_changed(VDISK *disk, OUFS_STATE *state) {
+  return (state->depth > 0 ? 0 : oufs_bitmaps_write(disk, state));
+}
 
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int block_bit =
-      oufs_find_open_bit(block.master.block_allocated_flag[block_byte]);
+/**
+ * Find a clear entry in an allocation table, starting at the hint and
+ * wrapping around, and set it
+ *
+ * @return Index of the entry; -1 if the table is full
+ */
+static long oufs_allocate_bit(VDISK *disk, OUFS_STATE *state,
+                              OUFS_BITMAP *bitmap) {
+  if (bitmap->n_free == 0)
+    return (-1);
+  for (unsigned int n = 0; n < bitmap->n_words; ++n) {
+    unsigned int w = bitmap->hint + n;
+    if (w >= bitmap->n_words)
+      w -= bitmap->n_words;
+
+    // Clear bits of the word, ignoring those past the end of the table
+    unsigned long long open = ~bitmap->words[w];
+    if (w == bitmap->n_words - 1 && bitmap->n_bits % 64 != 0)
+      open &= (1ULL << (bitmap->n_bits % 64)) - 1;
+    if (open != 0) {
+      int bit = __builtin_ctzll(open);
+      bitmap->words[w] |= 1ULL << bit;
+      bitmap->n_free--;
+      bitmap->hint = w;
+      unsigned long index = (unsigned long)w * 64 + bit;
+      oufs_bitmap_touch(disk, state, bitmap, index);
+      return (index);
+    }
+  }
 
-  // Now set the bit in the allocation table
-  block.master.block_allocated_flag[block_byte] |= (1 << block_bit);
+  // Table is full
+  return (-1);
+}
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+/**
+ * Find the next entry at or after from that is set (or clear)
+ *
+ * @param set 1 to look for a set entry; 0 for a clear one
+ * @return Index of the entry; n_bits if there is none
+ */
+static unsigned long oufs_bitmap_next(OUFS_BITMAP *bitmap, unsigned long from,
+                                      int set) {
+  while (from < bitmap->n_bits) {
+    unsigned long long word = bitmap->words[from / 64];
+    if (!set)
+      word = ~word;
+    word &= ~0ULL << (from % 64);
+    if (word != 0)
+      return (MIN((from & ~63UL) + __builtin_ctzll(word), bitmap->n_bits));
+    from = (from | 63) + 1;
+  }
+  return (bitmap->n_bits);
+}
 
-  if (debug)
-    fprintf(stderr, "Allocating block=%d (%d)\n", block_byte, block_bit);
+/**
+ * Find a run of n clear entries in [from, to)
+ *
+ * @return Index of the first entry of the run; -1 if there is none
+ */
+static long oufs_bitmap_find_run(OUFS_BITMAP *bitmap, unsigned long from,
+                                 unsigned long to, unsigned int n) {
+  while (from < to) {
+    from = oufs_bitmap_next(bitmap, from, 0);
+    if (from + n > to)
+      break;
+    unsigned long end = oufs_bitmap_next(bitmap, from, 1);
+    if (end >= from + n)
+      return (from);
+    from = end;
+  }
+  return (-1);
+}
 
-  // Compute the block index
-  BLOCK_REFERENCE block_reference = (block_byte << 3) + block_bit;
+/**
+ * Set a clear entry of an allocation table close to near: the first one
+ * after near in its group of group_size entries, then before it in the
+ * group, then in the groups that follow and finally in those that precede
+ *
+ * @param near Entry to stay close to; past the end of the table to continue
+ *        from the previous allocation instead
+ * @param group_size Entries per group (a block group, or the inodes of one
+ *        inode block)
+ * @return Index of the entry; -1 if the table is full
+ */
+static long oufs_allocate_bit_near(VDISK *disk, OUFS_STATE *state,
+                                   OUFS_BITMAP *bitmap, unsigned long near,
+                                   unsigned long group_size) {
+  if (near >= bitmap->n_bits)
+    return (oufs_allocate_bit(disk, state, bitmap));
+  if (bitmap->n_free == 0)
+    return (-1);
 
-  if (debug)
-    fprintf(stderr, "Allocating block=%d\n", block_reference);
+  unsigned long group = near - near % group_size;
+  unsigned long end = MIN(group + group_size, bitmap->n_bits);
+  unsigned long ranges[4][2] = {
+      {near, end}, {group, near}, {end, bitmap->n_bits}, {0, group}};
+  for (int r = 0; r < 4; ++r) {
+    unsigned long index = oufs_bitmap_next(bitmap, ranges[r][0], 0);
+    if (index < ranges[r][1]) {
+      bitmap->words[index / 64] |= 1ULL << (index % 64);
+      bitmap->n_free--;
+      bitmap->hint = index / 64;
+      oufs_bitmap_touch(disk, state, bitmap, index);
+      return (index);
+    }
+  }
+  return (-1);
+}
 
-  // Done
-  return (block_reference);
+/**
+ * Clear one entry in an allocation table (or pin it)
+ */
+static void oufs_release_bit(VDISK *disk, OUFS_STATE *state,
+                             OUFS_BITMAP *bitmap, unsigned int index) {
+  unsigned long long bit = 1ULL << (index % 64);
+  if ((bitmap->words[index / 64] & bit) &&
+      !oufs_bitmap_pin(disk, state, bitmap, index)) {
+    bitmap->words[index / 64] &= ~bit;
+    bitmap->n_free++;
+  }
+  oufs_bitmap_touch(disk, state, bitmap, index);
 }
 
 /**
- * Allocate a new inode
+ * Number of free data blocks and inodes.  With the allocation tables in
+ * memory they are counted there; otherwise the counters kept in the first
+ * master block are read, and only a disk formatted without them has its
+ * tables loaded and counted.
  *
- * If one is found, then the corresponding bit in the inode allocation table is
- * set
+ * @param free_blocks Set to the number of free data blocks
+ * @param free_inodes Set to the number of free inodes
+ * @return 0 on success; <0 on error
+ */
+int oufs_free_space_at(VDISK *disk, unsigned int *free_blocks,
+                       unsigned int *free_inodes) {
+  OUFS_STATE *state = disk->fs;
+  if (state == NULL || state->blocks.words == NULL) {
+    BLOCK *block = oufs_block_get(disk);
+    if (block == NULL ||
+        vdisk_read_block_at(disk, MASTER_BLOCK_REFERENCE, block) != 0) {
+      oufs_block_put(disk, block);
+      return (-1);
+    }
+    int counted = (block->master.counters_magic == FREE_COUNTERS_MAGIC);
+    if (counted) {
+      *free_blocks = block->master.n_free_blocks;
+      *free_inodes = block->master.n_free_inodes;
+    }
+    oufs_block_put(disk, block);
+    if (counted)
+      return (0);
+    state = oufs_bitmaps(disk);
+    if (state == NULL)
+      return (-1);
+  }
+  *free_blocks = state->blocks.n_free + state->blocks.n_pinned;
+  *free_inodes = state->inodes.n_free;
+  return (0);
+}
+
+/**
+ * Check up front that count data blocks and n_inodes inodes are free, so
+ * that an operation can give up before it changes anything.  Which of the
+ * two ran out is reported.
  *
- * @return The index of the allocated inode block.  If no blocks are available,
- * then UNALLOCATED_INODE is returned
+ * @return 0 if there is room; -2 if not
+ */
+static int oufs_reserve_check(VDISK *disk, unsigned int count,
+                              unsigned int n_inodes) {
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL)
+    return (-1);
+  if (state->blocks.n_free < count) {
+    fprintf(stderr, "Disk is full\n");
+    return (-2);
+  }
+  if (state->inodes.n_free < n_inodes) {
+    fprintf(stderr, "No free inodes\n");
+    return (-2);
+  }
+  return (0);
+}
+
+/**
+ * Allocate count data blocks as close to near as they can be found: each one
+ * is looked for right after the previous, in the block group of near first.
+ * The block allocation table is updated in memory and written back once; if
+ * the disk runs out of blocks part way, the ones already taken are released
+ * again and the table is left as it was.
+ *
+ * @param near Block to place them near; UNALLOCATED_BLOCK to continue from
+ *        the previous allocation
+ * @param count Number of blocks
+ * @param out Filled in with the allocated blocks
+ * @return 0 = blocks allocated
+ *         -x = not enough free blocks (nothing is allocated)
  *
  */
-INODE_REFERENCE oufs_allocate_new_inode() {
-  BLOCK block;
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Scan for an available block
-  int inode_byte;
-  int flag;
-
-  // Loop over each byte in the allocation table.
-  for (inode_byte = 0, flag = 1; flag && inode_byte < N_INODES / 8;
-       ++inode_byte) {
-    if (block.master.inode_allocated_flag[inode_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
-      break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if (flag == 1) {
-    // No
+int oufs_allocate_blocks_near_at(VDISK *disk, BLOCK_REFERENCE near, int count,
+                                 BLOCK_REFERENCE *out) {
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL)
+    return (-1);
+  if (count > state->blocks.n_free) {
     if (debug)
       fprintf(stderr, "No blocks\n");
-    return (UNALLOCATED_INODE);
+    return (-2);
+  }
+  unsigned int hint = state->blocks.hint;
+  for (int i = 0; i < count; ++i) {
+    long block_reference =
+        oufs_allocate_bit_near(disk, state, &state->blocks, near,
+                               BLOCKS_PER_GROUP(disk));
+    if (block_reference < 0) {
+      if (debug)
+        fprintf(stderr, "No blocks\n");
+      // Roll back
+      for (int j = 0; j < i; ++j)
+        oufs_release_bit(disk, state, &state->blocks, out[j]);
+      state->blocks.hint = hint;
+      oufs_bitmaps_changed(disk, state);
+      return (-2);
+    }
+    out[i] = block_reference;
+    if (near != UNALLOCATED_BLOCK)
+      near = block_reference + 1;
+    if (debug)
+      fprintf(stderr, "Allocating block=%ld\n", block_reference);
+  }
+  return (oufs_bitmaps_changed(disk, state));
+}
+
+/**
+ * Allocate count data blocks, wherever they are free (see
+ * oufs_allocate_blocks_near_at())
+ *
+ * @return 0 = blocks allocated
+ *         -x = not enough free blocks (nothing is allocated)
+ *
+ */
+int oufs_allocate_new_blocks_at(VDISK *disk, int count, BLOCK_REFERENCE *out) {
+  return (oufs_allocate_blocks_near_at(disk, UNALLOCATED_BLOCK, count, out));
+}
+
+/**
+ * Allocate a new data block
+ *
+ * If one is found, then the corresponding bit in the block allocation table is
+ * set
+ *
+ * @return The index of the allocated data block.  If no blocks are available,
+ * then UNALLOCATED_BLOCK is returned
+ *
+ */
+BLOCK_REFERENCE oufs_allocate_new_block_at(VDISK *disk) {
+  BLOCK_REFERENCE block_reference;
+  if (oufs_allocate_new_blocks_at(disk, 1, &block_reference) != 0) {
+    return (UNALLOCATED_BLOCK);
   }
 
-  // Found an available data block
+  // Done
+  return (block_reference);
+}
 
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int inode_bit =
-      oufs_find_open_bit(block.master.inode_allocated_flag[inode_byte]);
+/**
+ * Find the extent that oufs_allocate_extent_at() would allocate, without
+ * allocating it
+ *
+ * @return The first block of the extent; -1 if there is no run of n free
+ * blocks
+ */
+static long oufs_extent_find(VDISK *disk, OUFS_BITMAP *bitmap, unsigned int n,
+                             BLOCK_REFERENCE hint) {
+  unsigned long start =
+      (hint < VDISK_N_BLOCKS(disk)) ? hint : (unsigned long)bitmap->hint * 64;
+  long first = oufs_bitmap_find_run(bitmap, start, bitmap->n_bits, n);
+  if (first < 0)
+    first = oufs_bitmap_find_run(bitmap, 0, MIN(start + n, bitmap->n_bits), n);
+  return (first);
+}
 
-  // Now set the bit in the allocation table
-  block.master.inode_allocated_flag[inode_byte] |= (1 << inode_bit);
+/**
+ * Allocate an extent: n contiguous data blocks.  The first run of free blocks
+ * long enough at or after the hint is taken, so that a file grown with the
+ * block after its last one as the hint stays contiguous; the search wraps
+ * around to the start of the disk.
+ *
+ * @param n Number of blocks
+ * @param hint Preferred first block; UNALLOCATED_BLOCK to continue from the
+ *        previous allocation
+ * @return The first block of the extent.  If there is no run of n free
+ * blocks, then UNALLOCATED_BLOCK is returned
+ *
+ */
+BLOCK_REFERENCE oufs_allocate_extent_at(VDISK *disk, unsigned int n,
+                                        BLOCK_REFERENCE hint) {
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL || n == 0 || n > state->blocks.n_free)
+    return (UNALLOCATED_BLOCK);
+  OUFS_BITMAP *bitmap = &state->blocks;
+  long first = oufs_extent_find(disk, bitmap, n, hint);
+  if (first < 0) {
+    if (debug)
+      fprintf(stderr, "No extent of %u blocks\n", n);
+    return (UNALLOCATED_BLOCK);
+  }
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+  for (unsigned long i = first; i < first + n; ++i) {
+    bitmap->words[i / 64] |= 1ULL << (i % 64);
+    oufs_bitmap_touch(disk, state, bitmap, i);
+  }
+  bitmap->n_free -= n;
+  bitmap->hint = (first + n - 1) / 64;
+  if (oufs_bitmaps_changed(disk, state) != 0)
+    return (UNALLOCATED_BLOCK);
 
   if (debug)
-    fprintf(stderr, "Allocating inode=%d (%d)\n", inode_byte, inode_bit);
+    fprintf(stderr, "Allocating extent=%ld+%u\n", first, n);
+  return (first);
+}
 
-  // Compute the block index
-  INODE_REFERENCE inode_reference = (inode_byte << 3) + inode_bit;
+/**
+ * Allocate a new inode close to another one: in the same inode block if it
+ * has a free inode, so that the inodes of a directory's entries tend to be
+ * read together with the directory's, otherwise in the inode blocks that
+ * follow (then those that precede)
+ *
+ * @param near Inode to stay close to (usually the parent directory's);
+ *        UNALLOCATED_INODE to continue from the previous allocation
+ * @return The index of the allocated inode.  If no inodes are available,
+ * then UNALLOCATED_INODE is returned
+ *
+ */
+INODE_REFERENCE oufs_allocate_inode_near_at(VDISK *disk,
+                                            INODE_REFERENCE near) {
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL)
+    return (UNALLOCATED_INODE);
+  long inode_reference = oufs_allocate_bit_near(disk, state, &state->inodes,
+                                                near, INODES_PER_BLOCK(disk));
+  if (inode_reference >= 0 && oufs_bitmaps_changed(disk, state) != 0)
+    inode_reference = -1;
+  if (inode_reference < 0) {
+    if (debug)
+      fprintf(stderr, "No inodes\n");
+    return (UNALLOCATED_INODE);
+  }
 
   if (debug)
-    fprintf(stderr, "Allocating inode=%d\n", inode_reference);
+    fprintf(stderr, "Allocating inode=%ld\n", inode_reference);
 
   // Done
   return (inode_reference);
 }
 
+/**
+ * Allocate a new inode
+ *
+ * If one is found, then the corresponding bit in the inode allocation table is
+ * set
+ *
+ * @return The index of the allocated inode block.  If no blocks are available,
+ * then UNALLOCATED_INODE is returned
+ *
+ */
+INODE_REFERENCE oufs_allocate_new_inode_at(VDISK *disk) {
+  return (oufs_allocate_inode_near_at(disk, UNALLOCATED_INODE));
+}
+
 /**
  * Deallocate a specified inode
  * The inode is found from reference, then the corresponding bit in the
@@ -272,35 +821,58 @@ INODE_REFERENCE oufs_allocate_new_inode() {
  *         -x = Error deallocating inode
  *
  */
-int oufs_deallocate_inode(INODE_REFERENCE inode_ref) {
-
-  BLOCK block;
-
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
-
-  // Scan for an specified block
-  int inode_byte = inode_ref / (8);
-  int inode_bit = inode_ref % (8);
-
-  if (inode_byte > (N_INODES >> 3)) {
+int oufs_deallocate_inode_at(VDISK *disk, INODE_REFERENCE inode_ref) {
+  if (inode_ref >= N_INODES(disk)) {
     fprintf(stderr, "Out of disk range\n");
     return (-1);
   }
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL)
+    return (-1);
+  oufs_release_bit(disk, state, &state->inodes, inode_ref);
+  return (oufs_bitmaps_changed(disk, state));
+}
 
-  // Deallocate the specified bit from the specified byte
-  block.master.inode_allocated_flag[inode_byte] &= ~(1 << (inode_bit));
-
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-  return (0);
+/**
+ * Deallocate count blocks.  UNALLOCATED_BLOCK entries are skipped, so the
+ * data[] array of an inode can be passed as it is.  The block allocation
+ * table is written back once, and nothing is released if any reference is
+ * out of range.  The blocks' contents are discarded.
+ *
+ * @param count Number of entries in refs
+ * @param refs The blocks to be deallocated
+ * @return 0 = Blocks deallocated
+ *         -x = Error deallocating blocks
+ *
+ */
+int oufs_deallocate_blocks_at(VDISK *disk, int count, BLOCK_REFERENCE *refs) {
+  for (int i = 0; i < count; ++i) {
+    if (refs[i] != UNALLOCATED_BLOCK && refs[i] >= VDISK_N_BLOCKS(disk)) {
+      fprintf(stderr, "Out of disk range\n");
+      return (-1);
+    }
+  }
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (state == NULL)
+    return (-1);
+  for (int i = 0; i < count; ++i) {
+    if (refs[i] != UNALLOCATED_BLOCK)
+      oufs_release_bit(disk, state, &state->blocks, refs[i]);
+  }
+  int ret = oufs_bitmaps_changed(disk, state);
+  for (int i = 0; ret == 0 && i < count; ++i) {
+    if (refs[i] != UNALLOCATED_BLOCK)
+      ret = vdisk_discard_block_at(disk, refs[i]);
+  }
+  return (ret);
 }
 
 /**
  * Deallocate a specified block
  * The block is found from reference, then the corresponding bit in the
- * inode allocation table is cleared.
+ * inode allocation table is cleared.  The block's contents are discarded: it
+ * reads as an empty block afterwards and, on a sparse disk, no longer takes
+ * up space in the disk file.
  *
  * @block_ref BLOCK_REFERENCE The block to be deallocated
  *
@@ -308,31 +880,895 @@ int oufs_deallocate_inode(INODE_REFERENCE inode_ref) {
  *         -x = Error deallocating block
  *
  */
-int oufs_deallocate_block(BLOCK_REFERENCE block_ref) {
+int oufs_deallocate_block_at(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (block_ref >= VDISK_N_BLOCKS(disk)) {
+    fprintf(stderr, "Out of disk range\n");
+    return (-1);
+  }
+  return (oufs_deallocate_blocks_at(disk, 1, &block_ref));
+}
 
-  BLOCK block;
+/*
+ * Block maps.  The blocks of a file are listed in its inode and, once there
+ * are more of them than data[] holds, either in an extent tree (see
+ * INODE_EXTENTS) or in indirect blocks (see INODE_INDIRECT).  In memory,
+ * whatever the format, a map is the list of runs of consecutive blocks of
+ * the file, so finding a block is a binary search.  A map is loaded with one
+ * batched read per level of the tree or of indirect blocks, and stored back
+ * writing only the blocks whose contents changed.  Files small enough for
+ * data[] never touch another block.
+ */
 
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+// Block map of a file: its runs of blocks in file order (ends[i] is the
+// file block after run i) and the blocks that describe them on disk
+typedef struct oufs_map_s {
+  EXTENT *runs;
+  unsigned long *ends;
+  unsigned long n_runs;
+  unsigned long capacity;
+  unsigned long n;
+  // INODE_INDIRECT: the indirect blocks (UNALLOCATED_BLOCK where there is
+  // none); second[] are those listed in the double indirect block
+  BLOCK_REFERENCE indirect;
+  BLOCK_REFERENCE double_indirect;
+  BLOCK_REFERENCE *second;
+  unsigned long n_second;
+  // INODE_EXTENTS: blocks holding the nodes below the root, leaves first
+  // and then a level at a time
+  BLOCK_REFERENCE *nodes;
+  unsigned long n_nodes;
+} OUFS_MAP;
 
-  // Scan for an specified block
-  int block_byte = block_ref / (8);
-  int block_bit = block_ref % (8);
+/**
+ * Start an empty block map
+ */
+static void oufs_map_init(OUFS_MAP *map) {
+  memset(map, 0, sizeof(*map));
+  map->indirect = map->double_indirect = UNALLOCATED_BLOCK;
+}
 
-  if (block_byte > (N_BLOCKS_IN_DISK >> 3)) {
-    fprintf(stderr, "Out of disk range\n");
-    return (-1);
+/**
+ * Release the memory of a block map
+ */
+static void oufs_map_free(OUFS_MAP *map) {
+  free(map->runs);
+  free(map->ends);
+  free(map->second);
+  free(map->nodes);
+  oufs_map_init(map);
+}
+
+/**
+ * Append a run of blocks to a block map, extending the last run if the new
+ * one follows it on the disk
+ *
+ * @return 0 on success; <0 if out of memory
+ */
+static int oufs_map_add_run(OUFS_MAP *map, BLOCK_REFERENCE start,
+                            unsigned long length) {
+  if (length == 0)
+    return (0);
+  if (map->n_runs > 0) {
+    EXTENT *last = &map->runs[map->n_runs - 1];
+    if (last->start + last->length == start) {
+      last->length += length;
+      map->ends[map->n_runs - 1] += length;
+      map->n += length;
+      return (0);
+    }
+  }
+  if (map->n_runs == map->capacity) {
+    unsigned long capacity = MAX(16, 2 * map->capacity);
+    EXTENT *runs = realloc(map->runs, capacity * sizeof(EXTENT));
+    if (runs != NULL)
+      map->runs = runs;
+    unsigned long *ends = realloc(map->ends, capacity * sizeof(unsigned long));
+    if (ends != NULL)
+      map->ends = ends;
+    if (runs == NULL || ends == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return (-2);
+    }
+    map->capacity = capacity;
+  }
+  map->runs[map->n_runs].start = start;
+  map->runs[map->n_runs].length = length;
+  map->n += length;
+  map->ends[map->n_runs++] = map->n;
+  return (0);
+}
+
+/**
+ * Append blocks to a block map, up to the first unused reference
+ *
+ * @return 1 if all n were used (more may follow elsewhere); 0 if not; <0 if
+ * out of memory
+ */
+static int oufs_map_append(OUFS_MAP *map, BLOCK_REFERENCE *refs,
+                           unsigned long n) {
+  unsigned long k = 0;
+  for (; k < n && refs[k] != UNALLOCATED_BLOCK; ++k) {
+    if (oufs_map_add_run(map, refs[k], 1) != 0)
+      return (-2);
+  }
+  return (k == n);
+}
+
+/**
+ * @return Index of the run holding a block of the file (block < map->n)
+ */
+static unsigned long oufs_map_find(OUFS_MAP *map, unsigned long block) {
+  unsigned long low = 0;
+  unsigned long high = map->n_runs - 1;
+  while (low < high) {
+    unsigned long middle = (low + high) / 2;
+    if (map->ends[middle] <= block)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return (low);
+}
+
+/**
+ * Look up n consecutive blocks of the file, starting with block first
+ * (first + n <= map->n)
+ *
+ * @param refs Set to their references
+ */
+static void oufs_map_get(OUFS_MAP *map, unsigned long first, unsigned long n,
+                         BLOCK_REFERENCE *refs) {
+  if (n == 0)
+    return;
+  unsigned long r = oufs_map_find(map, first);
+  unsigned long within = first - (map->ends[r] - map->runs[r].length);
+  for (unsigned long i = 0; i < n; ++i) {
+    if (within == map->runs[r].length) {
+      ++r;
+      within = 0;
+    }
+    refs[i] = map->runs[r].start + within++;
+  }
+}
+
+/**
+ * @return The file's last block
+ */
+static BLOCK_REFERENCE oufs_map_last(OUFS_MAP *map) {
+  if (map->n_runs == 0)
+    return (UNALLOCATED_BLOCK);
+  EXTENT *last = &map->runs[map->n_runs - 1];
+  return (last->start + last->length - 1);
+}
+
+/**
+ * Remove the file's last block from a block map
+ */
+static void oufs_map_drop_last(OUFS_MAP *map) {
+  if (map->n_runs == 0)
+    return;
+  --map->n;
+  --map->ends[map->n_runs - 1];
+  if (--map->runs[map->n_runs - 1].length == 0)
+    --map->n_runs;
+}
+
+/**
+ * @return Number of indirect blocks (the double indirect one and those under
+ * it included) that a file of n blocks needs
+ */
+static unsigned long oufs_map_indirect_blocks(VDISK *disk, unsigned long n) {
+  if (n <= BLOCKS_PER_INODE)
+    return (0);
+  if (n <= N_DIRECT_BLOCKS + REFERENCES_PER_BLOCK(disk))
+    return (1);
+  unsigned long rest = n - N_DIRECT_BLOCKS - REFERENCES_PER_BLOCK(disk);
+  return (2 + (rest + REFERENCES_PER_BLOCK(disk) - 1) /
+          REFERENCES_PER_BLOCK(disk));
+}
+
+/**
+ * @return Number of nodes below the root that an extent tree of n runs needs
+ */
+static unsigned long oufs_map_extent_nodes(VDISK *disk, unsigned long n) {
+  unsigned long nodes = 0;
+  while (n > EXTENTS_PER_INODE) {
+    n = (n + EXTENTS_PER_BLOCK(disk) - 1) / EXTENTS_PER_BLOCK(disk);
+    nodes += n;
+  }
+  return (nodes);
+}
+
+/**
+ * Does a file of n blocks in n_runs runs, which has outgrown data[], keep
+ * its map in an extent tree (see oufs_map_store())?
+ */
+static int oufs_map_uses_extents(INODE *inode, unsigned long n,
+                                 unsigned long n_runs) {
+  if (inode->flags & (INODE_INDIRECT | INODE_EXTENTS))
+    return ((inode->flags & INODE_EXTENTS) != 0);
+  return (2 * n_runs <= n);
+}
+
+/**
+ * @return Number of blocks a file needs to describe where its blocks are,
+ * besides its inode, after n_new blocks forming n_new_runs more runs are
+ * added to its map
+ */
+static unsigned long oufs_map_overhead(VDISK *disk, INODE *inode,
+                                       OUFS_MAP *map, unsigned long n_new,
+                                       unsigned long n_new_runs) {
+  unsigned long n = map->n + n_new;
+  unsigned long n_runs = map->n_runs + n_new_runs;
+  if (!(inode->flags & (INODE_INDIRECT | INODE_EXTENTS)) &&
+      n <= BLOCKS_PER_INODE)
+    return (0);
+  if (oufs_map_uses_extents(inode, n, n_runs))
+    return (oufs_map_extent_nodes(disk, n_runs) - map->n_nodes);
+  return (oufs_map_indirect_blocks(disk, n) -
+          oufs_map_indirect_blocks(disk, map->n));
+}
+
+/**
+ * @return Upper bound on the blocks of a file's map that oufs_map_store()
+ * writes after n_new blocks forming at most n_new_runs more runs are added
+ * to it
+ */
+static unsigned long oufs_map_writes(VDISK *disk, INODE *inode,
+                                     OUFS_MAP *map, unsigned long n_new,
+                                     unsigned long n_new_runs) {
+  unsigned long n = map->n + n_new;
+  if (!(inode->flags & (INODE_INDIRECT | INODE_EXTENTS)) &&
+      n <= BLOCKS_PER_INODE)
+    return (0);
+
+  // Extent tree: the nodes above the leaves, and the leaves from the one
+  // holding the last run on
+  unsigned long n_runs = map->n_runs + n_new_runs;
+  unsigned long extent_writes = oufs_map_extent_nodes(disk, n_runs);
+  if ((inode->flags & INODE_EXTENTS) && map->n_runs > 0 &&
+      n_runs > EXTENTS_PER_INODE) {
+    unsigned long n_leaves =
+        (n_runs + EXTENTS_PER_BLOCK(disk) - 1) / EXTENTS_PER_BLOCK(disk);
+    extent_writes -=
+        MIN((map->n_runs - 1) / EXTENTS_PER_BLOCK(disk), n_leaves - 1);
+  }
+  if (inode->flags & INODE_EXTENTS)
+    return (extent_writes);
+
+  // Indirect blocks: the single one if it lists changed references, the
+  // double one, and those under it from the one holding the first new block
+  unsigned long per_block = REFERENCES_PER_BLOCK(disk);
+  unsigned long first_second = N_DIRECT_BLOCKS + per_block;
+  unsigned long from = (inode->flags & INODE_INDIRECT)
+                           ? map->n
+                           : MIN(map->n, N_DIRECT_BLOCKS);
+  unsigned long n_second =
+      (n > first_second) ? (n - first_second + per_block - 1) / per_block : 0;
+  unsigned long kept =
+      (from > first_second) ? (from - first_second) / per_block : 0;
+  unsigned long indirect_writes =
+      (from < first_second) + (n_second > 0) + n_second - MIN(kept, n_second);
+  if (inode->flags & INODE_INDIRECT)
+    return (indirect_writes);
+  return (MAX(extent_writes, indirect_writes));
+}
+
+/**
+ * Read a batch of blocks into one buffer
+ *
+ * @return The blocks, one after the other (to be freed); NULL on error
+ */
+static unsigned char *oufs_map_read(VDISK *disk, unsigned long n,
+                                    BLOCK_REFERENCE *refs) {
+  unsigned char *data = malloc(MAX(n, 1) * VDISK_BLOCK_SIZE(disk));
+  void **buffers = malloc(MAX(n, 1) * sizeof(void *));
+  if (data != NULL && buffers != NULL) {
+    for (unsigned long i = 0; i < n; ++i) {
+      buffers[i] = data + i * VDISK_BLOCK_SIZE(disk);
+    }
+    if (vdisk_read_blocks_at(disk, n, refs, buffers) == 0) {
+      free(buffers);
+      return (data);
+    }
+  }
+  free(data);
+  free(buffers);
+  return (NULL);
+}
+
+/**
+ * Load the extent tree of a file, one batched read per level
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_load_extents(VDISK *disk, INODE *inode, OUFS_MAP *map) {
+  EXTENT_ROOT root;
+  memcpy(&root, inode->data, sizeof(root));
+  int depth = root.header.depth;
+  if (depth > EXTENT_MAX_DEPTH || root.header.n_entries > EXTENTS_PER_INODE) {
+    fprintf(stderr, "File corrupt\n");
+    return (-3);
+  }
+
+  // Entries of the current level, starting with the root's
+  unsigned long n_entries = root.header.n_entries;
+  EXTENT *entries = malloc(MAX(n_entries, 1) * sizeof(EXTENT));
+  if (entries == NULL)
+    return (-2);
+  memcpy(entries, root.entry, n_entries * sizeof(EXTENT));
+
+  // Nodes of each level below the root, read top down and kept bottom up
+  BLOCK_REFERENCE *levels[EXTENT_MAX_DEPTH];
+  unsigned long level_nodes[EXTENT_MAX_DEPTH];
+  int n_levels = 0;
+  int ret = 0;
+  for (int d = depth; d > 0 && ret == 0; --d) {
+    BLOCK_REFERENCE *refs = malloc(MAX(n_entries, 1) * sizeof(BLOCK_REFERENCE));
+    if (refs == NULL) {
+      ret = -2;
+      break;
+    }
+    for (unsigned long i = 0; i < n_entries; ++i) {
+      refs[i] = entries[i].start;
+    }
+    levels[n_levels] = refs;
+    level_nodes[n_levels++] = n_entries;
+
+    unsigned char *data = oufs_map_read(disk, n_entries, refs);
+    if (data == NULL) {
+      ret = -3;
+      break;
+    }
+    unsigned long n_next = 0;
+    for (unsigned long i = 0; i < n_entries && ret == 0; ++i) {
+      EXTENT_NODE *node = (EXTENT_NODE *)(data + i * VDISK_BLOCK_SIZE(disk));
+      if (node->header.depth != d - 1 ||
+          node->header.n_entries > EXTENTS_PER_BLOCK(disk)) {
+        fprintf(stderr, "File corrupt\n");
+        ret = -3;
+      }
+      n_next += node->header.n_entries;
+    }
+    EXTENT *next = (ret == 0) ? malloc(MAX(n_next, 1) * sizeof(EXTENT)) : NULL;
+    if (ret == 0 && next == NULL) {
+      ret = -2;
+    }
+    for (unsigned long i = 0, k = 0; ret == 0 && i < n_entries; ++i) {
+      EXTENT_NODE *node = (EXTENT_NODE *)(data + i * VDISK_BLOCK_SIZE(disk));
+      memcpy(next + k, node->entry, node->header.n_entries * sizeof(EXTENT));
+      k += node->header.n_entries;
+    }
+    free(data);
+    free(entries);
+    entries = next;
+    n_entries = n_next;
+  }
+
+  // The leaves' entries are the runs
+  for (unsigned long i = 0; ret == 0 && i < n_entries; ++i) {
+    ret = oufs_map_add_run(map, entries[i].start, entries[i].length);
+  }
+  free(entries);
+  unsigned long n_nodes = 0;
+  for (int l = 0; l < n_levels; ++l) {
+    n_nodes += level_nodes[l];
+  }
+  map->nodes = malloc(MAX(n_nodes, 1) * sizeof(BLOCK_REFERENCE));
+  if (map->nodes == NULL && ret == 0) {
+    ret = -2;
+  }
+  for (int l = n_levels - 1; l >= 0; --l) {
+    if (ret == 0) {
+      memcpy(map->nodes + map->n_nodes, levels[l],
+             level_nodes[l] * sizeof(BLOCK_REFERENCE));
+      map->n_nodes += level_nodes[l];
+    }
+    free(levels[l]);
+  }
+  return (ret);
+}
+
+/**
+ * Load the indirect blocks of a file, one batched read per level
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_load_indirect(VDISK *disk, INODE *inode, OUFS_MAP *map) {
+  map->indirect = inode->data[INDIRECT_SLOT];
+  map->double_indirect = inode->data[DOUBLE_INDIRECT_SLOT];
+  int more = oufs_map_append(map, inode->data, N_DIRECT_BLOCKS);
+  if (more <= 0 || map->indirect == UNALLOCATED_BLOCK) {
+    return (more < 0 ? -2 : 0);
   }
 
-  // Deallocate the specified bit from the specified byte
-  block.master.block_allocated_flag[block_byte] &= ~(1 << block_bit);
+  // The indirect and double indirect blocks in one batch
+  BLOCK_REFERENCE top[2] = {map->indirect, map->double_indirect};
+  int n_top = (map->double_indirect == UNALLOCATED_BLOCK) ? 1 : 2;
+  unsigned char *blocks = oufs_map_read(disk, n_top, top);
+  if (blocks == NULL) {
+    return (-3);
+  }
+  more = oufs_map_append(map, (BLOCK_REFERENCE *)blocks,
+                         REFERENCES_PER_BLOCK(disk));
+  int ret = (more < 0) ? -2 : 0;
+
+  // Then the indirect blocks under the double indirect one in another
+  if (ret == 0 && more && n_top == 2) {
+    BLOCK_REFERENCE *second = (BLOCK_REFERENCE *)(blocks +
+                                                  VDISK_BLOCK_SIZE(disk));
+    unsigned long n_second = 0;
+    while (n_second < REFERENCES_PER_BLOCK(disk) &&
+           second[n_second] != UNALLOCATED_BLOCK) {
+      ++n_second;
+    }
+    map->second = malloc(MAX(n_second, 1) * sizeof(BLOCK_REFERENCE));
+    unsigned char *data = (map->second != NULL)
+                              ? oufs_map_read(disk, n_second, second)
+                              : NULL;
+    if (data == NULL) {
+      ret = (map->second == NULL) ? -2 : -3;
+    } else {
+      memcpy(map->second, second, n_second * sizeof(BLOCK_REFERENCE));
+      map->n_second = n_second;
+      for (unsigned long j = 0; ret == 0 && more && j < n_second; ++j) {
+        BLOCK_REFERENCE *refs =
+            (BLOCK_REFERENCE *)(data + j * VDISK_BLOCK_SIZE(disk));
+        more = oufs_map_append(map, refs, REFERENCES_PER_BLOCK(disk));
+        ret = (more < 0) ? -2 : 0;
+      }
+    }
+    free(data);
+  }
+  free(blocks);
+  return (ret);
+}
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+/**
+ * Load the block map of a file
+ *
+ * @param map Filled in; release it with oufs_map_free()
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_load(VDISK *disk, INODE *inode, OUFS_MAP *map) {
+  oufs_map_init(map);
+  int ret;
+  if (inode->flags & INODE_EXTENTS) {
+    ret = oufs_map_load_extents(disk, inode, map);
+  } else if (inode->flags & INODE_INDIRECT) {
+    ret = oufs_map_load_indirect(disk, inode, map);
+  } else {
+    ret = (oufs_map_append(map, inode->data, BLOCKS_PER_INODE) < 0) ? -2 : 0;
+  }
+  if (ret != 0) {
+    oufs_map_free(map);
+  }
+  return (ret);
+}
 
+/**
+ * Allocate blocks for a map's own use, right after the file's last block
+ *
+ * @param list Grown by n new blocks
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_grow(VDISK *disk, OUFS_MAP *map, BLOCK_REFERENCE **list,
+                         unsigned long *count, unsigned long n) {
+  BLOCK_REFERENCE *grown =
+      realloc(*list, MAX(*count + n, 1) * sizeof(BLOCK_REFERENCE));
+  if (grown == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
+  }
+  *list = grown;
+  if (n > 0 && oufs_allocate_blocks_near_at(disk, oufs_map_last(map) + 1, n,
+                                            grown + *count) != 0) {
+    fprintf(stderr, "Disk is full\n");
+    return (-2);
+  }
+  *count += n;
   return (0);
 }
 
+/**
+ * Store the runs of a file as an extent tree.  The tree is rebuilt bottom
+ * up, packing each level into as few nodes as possible and reusing the
+ * file's node blocks in order; leaves before the one holding run
+ * first_changed keep their contents and are not written again.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_store_extents(VDISK *disk, INODE *inode, OUFS_MAP *map,
+                                  unsigned long first_changed) {
+  unsigned long old_nodes = map->n_nodes;
+  unsigned long n_nodes = oufs_map_extent_nodes(disk, map->n_runs);
+  if (n_nodes > old_nodes) {
+    if (oufs_map_grow(disk, map, &map->nodes, &map->n_nodes,
+                      n_nodes - old_nodes) != 0)
+      return (-2);
+  } else if (n_nodes < old_nodes) {
+    oufs_deallocate_blocks_at(disk, old_nodes - n_nodes,
+                              map->nodes + n_nodes);
+    map->n_nodes = n_nodes;
+  }
+
+  unsigned char *data = malloc(MAX(n_nodes, 1) * VDISK_BLOCK_SIZE(disk));
+  BLOCK_REFERENCE *write_refs =
+      malloc(MAX(n_nodes, 1) * sizeof(BLOCK_REFERENCE));
+  void **buffers = malloc(MAX(n_nodes, 1) * sizeof(void *));
+  EXTENT *entries = malloc(MAX(map->n_runs, 1) * sizeof(EXTENT));
+  if (data == NULL || write_refs == NULL || buffers == NULL ||
+      entries == NULL) {
+    if (n_nodes > old_nodes) {
+      oufs_deallocate_blocks_at(disk, n_nodes - old_nodes,
+                                map->nodes + old_nodes);
+      map->n_nodes = old_nodes;
+    }
+    free(data);
+    free(write_refs);
+    free(buffers);
+    free(entries);
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
+  }
+
+  // Pack a level at a time; each node becomes an entry of the level above
+  memcpy(entries, map->runs, map->n_runs * sizeof(EXTENT));
+  unsigned long n_entries = map->n_runs;
+  unsigned long node = 0;
+  int n_writes = 0;
+  int depth = 0;
+  while (n_entries > EXTENTS_PER_INODE) {
+    unsigned long n_level =
+        (n_entries + EXTENTS_PER_BLOCK(disk) - 1) / EXTENTS_PER_BLOCK(disk);
+    for (unsigned long j = 0; j < n_level; ++j, ++node) {
+      EXTENT_NODE *block = (EXTENT_NODE *)(data + node *
+                                           VDISK_BLOCK_SIZE(disk));
+      unsigned long first = j * EXTENTS_PER_BLOCK(disk);
+      unsigned long count = MIN(EXTENTS_PER_BLOCK(disk), n_entries - first);
+      memset(block, 0, VDISK_BLOCK_SIZE(disk));
+      block->header.n_entries = count;
+      block->header.depth = depth;
+      memcpy(block->entry, entries + first, count * sizeof(EXTENT));
+      unsigned int covered = 0;
+      for (unsigned long i = 0; i < count; ++i) {
+        covered += entries[first + i].length;
+      }
+      if (depth > 0 || node >= old_nodes || first + count > first_changed) {
+        write_refs[n_writes] = map->nodes[node];
+        buffers[n_writes++] = block;
+      }
+      entries[j].start = map->nodes[node];
+      entries[j].length = covered;
+    }
+    n_entries = n_level;
+    ++depth;
+  }
+  int ret = 0;
+  if (vdisk_write_blocks_at(disk, n_writes, write_refs, buffers) != 0) {
+    ret = -3;
+  }
+
+  // The root goes in the inode
+  EXTENT_ROOT root;
+  memset(&root, 0, sizeof(root));
+  root.header.n_entries = n_entries;
+  root.header.depth = depth;
+  memcpy(root.entry, entries, n_entries * sizeof(EXTENT));
+  for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+    inode->data[i] = UNALLOCATED_BLOCK;
+  }
+  memcpy(inode->data, &root, sizeof(root));
+  inode->flags |= INODE_EXTENTS;
+
+  free(data);
+  free(write_refs);
+  free(buffers);
+  free(entries);
+  return (ret);
+}
+
+/**
+ * Fill an indirect block with the references of blocks first, first + 1,
+ * ... of the file, the rest of it unused
+ */
+static void oufs_map_fill(VDISK *disk, OUFS_MAP *map, BLOCK_REFERENCE *block,
+                          unsigned long first) {
+  unsigned long n = MIN(map->n - first, REFERENCES_PER_BLOCK(disk));
+  oufs_map_get(map, first, n, block);
+  for (unsigned long i = n; i < REFERENCES_PER_BLOCK(disk); ++i) {
+    block[i] = UNALLOCATED_BLOCK;
+  }
+}
+
+/**
+ * Store the blocks of a file in data[] and indirect blocks.  Indirect blocks
+ * that only list blocks before block from keep their contents and are not
+ * written again.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_store_indirect(VDISK *disk, INODE *inode, OUFS_MAP *map,
+                                   unsigned long from) {
+  unsigned long n = map->n;
+  unsigned long per_block = REFERENCES_PER_BLOCK(disk);
+  unsigned long first_second = N_DIRECT_BLOCKS + per_block;
+  unsigned long n_second =
+      (n > first_second) ? (n - first_second + per_block - 1) / per_block : 0;
+  unsigned long old_second = map->n_second;
+
+  // Allocate the indirect blocks that are missing
+  BLOCK_REFERENCE *fresh = NULL;
+  unsigned long n_fresh = 0;
+  int new_indirect = (map->indirect == UNALLOCATED_BLOCK);
+  int new_double = (n_second > 0 && map->double_indirect == UNALLOCATED_BLOCK);
+  if (oufs_map_grow(disk, map, &fresh, &n_fresh,
+                    new_indirect + new_double + (n_second - old_second)) !=
+      0) {
+    free(fresh);
+    return (-2);
+  }
+  BLOCK_REFERENCE *second =
+      realloc(map->second, MAX(n_second, 1) * sizeof(BLOCK_REFERENCE));
+  BLOCK_REFERENCE *write_refs =
+      malloc((2 + n_second) * sizeof(BLOCK_REFERENCE));
+  void **buffers = malloc((2 + n_second) * sizeof(void *));
+  unsigned char *data = malloc((2 + n_second) * VDISK_BLOCK_SIZE(disk));
+  if (second != NULL) {
+    map->second = second;
+  }
+  if (second == NULL || write_refs == NULL || buffers == NULL ||
+      data == NULL) {
+    oufs_deallocate_blocks_at(disk, n_fresh, fresh);
+    free(fresh);
+    free(write_refs);
+    free(buffers);
+    free(data);
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
+  }
+  unsigned long k = 0;
+  if (new_indirect) {
+    map->indirect = fresh[k++];
+  }
+  if (new_double) {
+    map->double_indirect = fresh[k++];
+  }
+  while (map->n_second < n_second) {
+    map->second[map->n_second++] = fresh[k++];
+  }
+  free(fresh);
+
+  // A file switching layouts moves the references in the last slots of
+  // data[] to the indirect block
+  if (!(inode->flags & INODE_INDIRECT)) {
+    from = MIN(from, N_DIRECT_BLOCKS);
+    inode->flags |= INODE_INDIRECT;
+  }
+
+  // Write the indirect blocks that hold changed references, and the double
+  // indirect block if it lists more of them, in one batch
+  int n_writes = 0;
+  if (from < first_second) {
+    write_refs[n_writes] = map->indirect;
+    buffers[n_writes] = data + (size_t)n_writes * VDISK_BLOCK_SIZE(disk);
+    oufs_map_fill(disk, map, buffers[n_writes], N_DIRECT_BLOCKS);
+    n_writes++;
+  }
+  if (n_second != old_second) {
+    write_refs[n_writes] = map->double_indirect;
+    buffers[n_writes] = data + (size_t)n_writes * VDISK_BLOCK_SIZE(disk);
+    BLOCK_REFERENCE *block = buffers[n_writes];
+    for (unsigned long j = 0; j < per_block; ++j) {
+      block[j] = (j < n_second) ? map->second[j] : UNALLOCATED_BLOCK;
+    }
+    n_writes++;
+  }
+  for (unsigned long j = 0; j < n_second; ++j) {
+    unsigned long start = first_second + j * per_block;
+    if (from < start + per_block) {
+      write_refs[n_writes] = map->second[j];
+      buffers[n_writes] = data + (size_t)n_writes * VDISK_BLOCK_SIZE(disk);
+      oufs_map_fill(disk, map, buffers[n_writes], start);
+      n_writes++;
+    }
+  }
+  int ret = 0;
+  if (vdisk_write_blocks_at(disk, n_writes, write_refs, buffers) != 0) {
+    ret = -3;
+  }
+  free(write_refs);
+  free(buffers);
+  free(data);
+
+  for (unsigned long i = 0; i < N_DIRECT_BLOCKS; i++) {
+    inode->data[i] = UNALLOCATED_BLOCK;
+  }
+  oufs_map_get(map, 0, MIN(n, N_DIRECT_BLOCKS), inode->data);
+  inode->data[INDIRECT_SLOT] = map->indirect;
+  inode->data[DOUBLE_INDIRECT_SLOT] = map->double_indirect;
+  return (ret);
+}
+
+/**
+ * Store the block map of a file that has grown.  Blocks before from are as
+ * they were when the map was loaded.  The inode's data[] is updated (the
+ * caller writes the inode back); blocks the map needs for itself are
+ * allocated right after the file's last block.
+ *
+ * A file outgrowing data[] gets an extent tree unless its runs are on
+ * average shorter than two blocks, in which case indirect blocks take less
+ * room.  A file keeps its format from then on.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_store(VDISK *disk, INODE *inode, OUFS_MAP *map,
+                          unsigned long from) {
+  unsigned long n = map->n;
+  if (!(inode->flags & (INODE_INDIRECT | INODE_EXTENTS)) &&
+      n <= BLOCKS_PER_INODE) {
+    for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+      inode->data[i] = UNALLOCATED_BLOCK;
+    }
+    oufs_map_get(map, 0, n, inode->data);
+    return (0);
+  }
+  if (!oufs_map_uses_extents(inode, n, map->n_runs)) {
+    return (oufs_map_store_indirect(disk, inode, map, from));
+  }
+  unsigned long first_changed = 0;
+  if ((inode->flags & INODE_EXTENTS) && from > 0) {
+    first_changed = oufs_map_find(map, from - 1);
+  }
+  return (oufs_map_store_extents(disk, inode, map, first_changed));
+}
+
+/**
+ * Release every block of a file, those describing where its blocks are
+ * included, with one update of the allocation table (a tiny file has none).
+ * The inode's data[] is cleared (the caller writes the inode back).
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_map_release(VDISK *disk, INODE *inode) {
+  int ret = 0;
+  if (inode->flags & INODE_INLINE) {
+    // Nothing but the inode
+  } else if (!(inode->flags & (INODE_INDIRECT | INODE_EXTENTS))) {
+    ret = oufs_deallocate_blocks_at(disk, BLOCKS_PER_INODE, inode->data);
+  } else {
+    OUFS_MAP map;
+    ret = oufs_map_load(disk, inode, &map);
+    unsigned long n_refs = map.n + 2 + map.n_second + map.n_nodes;
+    BLOCK_REFERENCE *refs =
+        (ret == 0) ? malloc(n_refs * sizeof(BLOCK_REFERENCE)) : NULL;
+    if (ret == 0 && refs == NULL) {
+      ret = -2;
+    }
+    if (ret == 0) {
+      oufs_map_get(&map, 0, map.n, refs);
+      BLOCK_REFERENCE *rest = refs + map.n;
+      rest[0] = map.indirect;
+      rest[1] = map.double_indirect;
+      for (unsigned long i = 0; i < map.n_second; ++i) {
+        rest[2 + i] = map.second[i];
+      }
+      for (unsigned long i = 0; i < map.n_nodes; ++i) {
+        rest[2 + map.n_second + i] = map.nodes[i];
+      }
+      ret = oufs_deallocate_blocks_at(disk, n_refs, refs);
+    }
+    free(refs);
+    oufs_map_free(&map);
+  }
+  for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+    inode->data[i] = UNALLOCATED_BLOCK;
+  }
+  inode->flags &= ~(INODE_INDIRECT | INODE_EXTENTS | INODE_INLINE);
+  return (ret);
+}
+
+/*
+ * Inode cache.
+ *
+ * Inodes read or written are kept in a direct-mapped cache attached to the
+ * VDISK, so that walking a path or listing a directory again costs no inode
+ * block reads.  Writes only mark the cached inode dirty.  Dirty inodes are
+ * written back at the end of the operation that changed them (right away
+ * outside of one), all those sharing an inode block with a single
+ * read-modify-write of the block.  A dirty inode pushed out of its slot
+ * takes the rest of its block with it.
+ */
+
+/**
+ * @return The inode cache of a disk, created on first use; NULL if out of
+ * memory
+ */
+static OUFS_INODE_SLOT *oufs_inode_cache(VDISK *disk) {
+  OUFS_STATE *state = oufs_state(disk);
+  if (state == NULL)
+    return (NULL);
+  if (state->inode_cache == NULL) {
+    state->inode_cache = malloc(INODE_CACHE_SLOTS * sizeof(OUFS_INODE_SLOT));
+    if (state->inode_cache == NULL)
+      return (NULL);
+    for (int i = 0; i < INODE_CACHE_SLOTS; ++i) {
+      state->inode_cache[i].ref = UNALLOCATED_INODE;
+      state->inode_cache[i].dirty = 0;
+    }
+  }
+  return (state->inode_cache);
+}
+
+/**
+ * Write the dirty cached inodes of one inode block back to it
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_inode_block_write(VDISK *disk, OUFS_STATE *state,
+                                  BLOCK_REFERENCE block_ref) {
+  BLOCK *block = oufs_block_get(disk);
+  if (block == NULL)
+    return (-1);
+  if (vdisk_read_block_at(disk, block_ref, block) != 0) {
+    fprintf(stderr, "Failed to read inode for writing\n");
+    oufs_block_put(disk, block);
+    return (-1);
+  }
+  INODE_REFERENCE first = (block_ref - FIRST_INODE_BLOCK(disk)) *
+      INODES_PER_BLOCK(disk);
+  for (int k = 0; k < INODES_PER_BLOCK(disk); ++k) {
+    OUFS_INODE_SLOT *slot =
+        &state->inode_cache[(first + k) % INODE_CACHE_SLOTS];
+    if (slot->ref == first + k && slot->dirty) {
+      block->inodes.inode[k] = slot->inode;
+      slot->dirty = 0;
+      --state->n_dirty_inodes;
+    }
+  }
+  int ret = (vdisk_write_block_at(disk, block_ref, block) == 0) ? 0 : -1;
+  oufs_block_put(disk, block);
+  return (ret);
+}
+
+/**
+ * Write every dirty cached inode back, one write per inode block
+ *
+ * @return 0 on success; <0 on error
+ */
+static int oufs_inodes_write(VDISK *disk, OUFS_STATE *state) {
+  int ret = 0;
+  for (int i = 0; state->n_dirty_inodes > 0 && i < INODE_CACHE_SLOTS; ++i) {
+    OUFS_INODE_SLOT *slot = &state->inode_cache[i];
+    if (slot->dirty) {
+      BLOCK_REFERENCE block_ref =
+          slot->ref / INODES_PER_BLOCK(disk) + FIRST_INODE_BLOCK(disk);
+      if (oufs_inode_block_write(disk, state, block_ref) != 0)
+        ret = -1;
+    }
+  }
+  return (ret);
+}
+
+/**
+ * Give a slot of the inode cache to an inode, writing back the one it
+ * holds if that one is dirty
+ *
+ * @return The slot; NULL on error
+ */
+static OUFS_INODE_SLOT *oufs_inode_slot(VDISK *disk, INODE_REFERENCE i) {
+  OUFS_INODE_SLOT *cache = oufs_inode_cache(disk);
+  if (cache == NULL)
+    return (NULL);
+  OUFS_INODE_SLOT *slot = &cache[i % INODE_CACHE_SLOTS];
+  if (slot->ref != i && slot->dirty &&
+      oufs_inode_block_write(disk, disk->fs,
+                             slot->ref / INODES_PER_BLOCK(disk) +
+                                 FIRST_INODE_BLOCK(disk)) != 0)
+    return (NULL);
+  return (slot);
+}
+
 /**
  *  Given an inode reference, read the inode from the virtual disk.
  *
@@ -343,23 +1779,48 @@ int oufs_deallocate_block(BLOCK_REFERENCE block_ref) {
  *         -x = an error has occurred
  *
  */
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+int oufs_read_inode_by_reference_at(VDISK *disk, INODE_REFERENCE i,
+                                    INODE *inode) {
 
   if (debug)
     fprintf(stderr, "Fetching inode %d\n", i);
 
-  // Find the address of the inode block and the inode within the block
-  BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-  int element = (i % INODES_PER_BLOCK);
-
-  BLOCK b;
-  if (vdisk_read_block(block, &b) == 0) {
-    // Successfully loaded the block: copy just this inode
-    *inode = b.inodes.inode[element];
+  // Cached inode
+  OUFS_INODE_SLOT *cache = oufs_inode_cache(disk);
+  if (cache != NULL && cache[i % INODE_CACHE_SLOTS].ref == i) {
+    *inode = cache[i % INODE_CACHE_SLOTS].inode;
     return (0);
   }
-  // Error case
-  return (-1);
+
+  // Find the address of the inode block and the inode within the block
+  BLOCK_REFERENCE block = i / INODES_PER_BLOCK(disk) + FIRST_INODE_BLOCK(disk);
+  int element = (i % INODES_PER_BLOCK(disk));
+
+  // Copy the inode straight out of the mapped/cached block when possible
+  const BLOCK *in_place = vdisk_block_ptr_at(disk, block);
+  BLOCK *b = NULL;
+  if (in_place == NULL) {
+    b = oufs_block_get(disk);
+    if (b == NULL || vdisk_read_block_at(disk, block, b) != 0) {
+      // Error case
+      oufs_block_put(disk, b);
+      return (-1);
+    }
+    in_place = b;
+  }
+  *inode = in_place->inodes.inode[element];
+
+  // Cache the whole block, leaving the slots that hold dirty inodes alone
+  INODE_REFERENCE first = i - element;
+  for (int k = 0; cache != NULL && k < INODES_PER_BLOCK(disk); ++k) {
+    OUFS_INODE_SLOT *slot = &cache[(first + k) % INODE_CACHE_SLOTS];
+    if (!slot->dirty) {
+      slot->ref = first + k;
+      slot->inode = in_place->inodes.inode[k];
+    }
+  }
+  oufs_block_put(disk, b);
+  return (0);
 }
 
 /**
@@ -371,22 +1832,40 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
  *         -x = an error has occurred
  *
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+int oufs_write_inode_by_reference_at(VDISK *disk, INODE_REFERENCE i,
+                                     INODE *inode) {
 
   if (debug)
     fprintf(stderr, "Writing inode %d\n", i);
 
   // Find the address of the inode block and the inode within the block
-  BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
-  int element = (i % INODES_PER_BLOCK);
+  BLOCK_REFERENCE block = i / INODES_PER_BLOCK(disk) + FIRST_INODE_BLOCK(disk);
+  int element = (i % INODES_PER_BLOCK(disk));
+
+  // Mark it dirty in the cache: it reaches the disk when the operation ends
+  OUFS_INODE_SLOT *slot = oufs_inode_slot(disk, i);
+  if (slot != NULL) {
+    OUFS_STATE *state = disk->fs;
+    if (slot->ref != i || !slot->dirty)
+      ++state->n_dirty_inodes;
+    slot->ref = i;
+    slot->inode = *inode;
+    slot->dirty = 1;
+    return (state->depth > 0 ? 0 : oufs_inode_block_write(disk, state, block));
+  }
 
-  BLOCK b;
-  if (vdisk_read_block(block, &b) != 0) {
+  // No cache: read-modify-write the block
+  BLOCK *b = oufs_block_get(disk);
+  if (b == NULL)
+    return (-1);
+  if (vdisk_read_block_at(disk, block, b) != 0) {
     fprintf(stderr, "Failed to read inode for writing\n");
   }
-  b.inodes.inode[element] = *inode;
+  b->inodes.inode[element] = *inode;
 
-  if (vdisk_write_block(block, &b) == 0) {
+  int ret = vdisk_write_block_at(disk, block, b);
+  oufs_block_put(disk, b);
+  if (ret == 0) {
     // Successfully wrote inode
     return (0);
   }
@@ -404,26 +1883,39 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
  *         UNALLOCATED_INODE = Directory entry not found
  *
  */
-int oufs_find_directory_entry(INODE *inode, char *directory_name) {
-
-  // Read the directory block associated with the inode given
-  BLOCK block;
-  if (vdisk_read_block(inode->data[0], &block) < 0) {
-    fprintf(stderr, "Could not read current inode %d's data block",
-            inode->data[0]);
+int oufs_find_directory_entry_at(VDISK *disk, INODE *inode,
+                                 char *directory_name) {
+
+  // Search the directory block in place if possible; otherwise read a copy.
+  // Directory blocks are pointed out to the vdisk I/O counters as they are
+  // read, here and elsewhere
+  BLOCK *block = NULL;
+  vdisk_block_type_set_at(disk, inode->data[0], VDISK_BLOCK_DIRECTORY);
+  const BLOCK *directory = vdisk_block_ptr_at(disk, inode->data[0]);
+  if (directory == NULL) {
+    block = oufs_block_get(disk);
+    if (block == NULL)
+      return UNALLOCATED_INODE;
+    if (vdisk_read_block_at(disk, inode->data[0], block) < 0) {
+      fprintf(stderr, "Could not read current inode %d's data block",
+              inode->data[0]);
+    }
+    directory = block;
   }
 
-  // Loop through all directory entries and find matching Name
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-    if (!strcmp(block.directory.entry[i].name, directory_name)) {
+  // Loop through all directory entries and find matching Name.  If name is
+  // not found in current directory, return unallocated.
+  int found = UNALLOCATED_INODE;
+  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); i++) {
+    if (!strcmp(directory->directory.entry[i].name, directory_name)) {
 
       // Return the matching name
-      return block.directory.entry[i].inode_reference;
+      found = directory->directory.entry[i].inode_reference;
+      break;
     }
   }
-
-  // If name is not found in current directory, return unallocated.
-  return UNALLOCATED_INODE;
+  oufs_block_put(disk, block);
+  return found;
 }
 
 /**
@@ -448,8 +1940,9 @@ int oufs_find_directory_entry(INODE *inode, char *directory_name) {
  *         -x if an error
  *
  */
-int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
-                   INODE_REFERENCE *child, char *local_name) {
+int oufs_find_file_at(VDISK *disk, char *cwd, char *path,
+                      INODE_REFERENCE *parent, INODE_REFERENCE *child,
+                      char *local_name) {
   INODE_REFERENCE grandparent;
   char full_path[MAX_PATH_LENGTH];
 
@@ -480,7 +1973,8 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
 
   // Parse the full path
   char *directory_name;
-  directory_name = strtok(full_path, "/");
+  char *save_ptr;
+  directory_name = strtok_r(full_path, "/", &save_ptr);
   while (directory_name != NULL) {
     if (strlen(directory_name) >= FILE_NAME_SIZE - 1)
       // Truncate the name
@@ -501,7 +1995,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
       // Real next element
       INODE inode;
       // Fetch the inode that corresponds to the child
-      if (oufs_read_inode_by_reference(*child, &inode) != 0) {
+      if (oufs_read_inode_by_reference_at(disk, *child, &inode) != 0) {
         return (-3);
       }
 
@@ -514,7 +2008,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
       // Get the new inode that corresponds to the name by searching the current
       // directory
       INODE_REFERENCE new_inode =
-          oufs_find_directory_entry(&inode, directory_name);
+          oufs_find_directory_entry_at(disk, &inode, directory_name);
       grandparent = *parent;
       *parent = *child;
       *child = new_inode;
@@ -523,7 +2017,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
         //  Is there another (nontrivial) step in the path?
         //  Loop until end or we have found a nontrivial name
         do {
-          directory_name = strtok(NULL, "/");
+          directory_name = strtok_r(NULL, "/", &save_ptr);
           if (directory_name != NULL &&
               strlen(directory_name) >= FILE_NAME_SIZE - 1)
             // Truncate the name
@@ -539,7 +2033,7 @@ int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
       };
     }
     // Go on to the next directory
-    directory_name = strtok(NULL, "/");
+    directory_name = strtok_r(NULL, "/", &save_ptr);
     if (directory_name != NULL && strlen(directory_name) >= FILE_NAME_SIZE - 1)
       // Truncate the name
       directory_name[FILE_NAME_SIZE - 1] = 0;
@@ -583,14 +2077,21 @@ int comparing_func(const void *a, const void *b) {
  *          UNALLOCATED_INODE = Error exists
  *
  */
-int oufs_allocate_new_directory(INODE *parent,
-                                INODE_REFERENCE parent_reference) {
+int oufs_allocate_new_directory_at(VDISK *disk, INODE *parent,
+                                   INODE_REFERENCE parent_reference) {
 
   INODE_REFERENCE new_inode_reference;
 
-  // Allocate new block on master and return unallocated if master block is full
-  BLOCK_REFERENCE new_block_reference = oufs_allocate_new_block();
-  if (new_block_reference == UNALLOCATED_BLOCK) {
+  // Give up before touching anything unless a block and an inode are free
+  if (oufs_reserve_check(disk, 1, 1) != 0) {
+    return UNALLOCATED_INODE;
+  }
+
+  // Allocate new block on master, next to the parent's, and return
+  // unallocated if master block is full
+  BLOCK_REFERENCE new_block_reference;
+  if (oufs_allocate_blocks_near_at(disk, parent->data[0], 1,
+                                   &new_block_reference) != 0) {
     fprintf(stderr, "Out of memory\n");
     return UNALLOCATED_INODE;
   }
@@ -602,23 +2103,30 @@ int oufs_allocate_new_directory(INODE *parent,
 
       // Allocate new inode or revert and return unallocated if master block is
       // full
-      new_inode_reference = oufs_allocate_new_inode();
+      new_inode_reference = oufs_allocate_inode_near_at(disk, parent_reference);
       if (new_inode_reference == UNALLOCATED_INODE) {
-        oufs_deallocate_block(new_block_reference);
+        oufs_deallocate_block_at(disk, new_block_reference);
         parent->data[i] = UNALLOCATED_BLOCK;
         fprintf(stderr, "Out of memory\n");
         return UNALLOCATED_INODE;
       }
 
       // Make clean directory block for new reference
-      BLOCK block;
-      oufs_clean_directory_block(new_inode_reference, parent_reference, &block);
+      BLOCK *block = oufs_block_get(disk);
+      if (block != NULL) {
+        vdisk_block_type_set_at(disk, new_block_reference,
+                                VDISK_BLOCK_DIRECTORY);
+        oufs_clean_directory_block_at(disk, new_inode_reference,
+                                      parent_reference, block);
+      }
 
       // Write to disk or revert back and return unallocated if there is an
       // issue
-      if (vdisk_write_block(new_block_reference, &block) != 0) {
-        oufs_deallocate_inode(new_inode_reference);
-        oufs_deallocate_block(new_block_reference);
+      if (block == NULL ||
+          vdisk_write_block_at(disk, new_block_reference, block) != 0) {
+        oufs_block_put(disk, block);
+        oufs_deallocate_inode_at(disk, new_inode_reference);
+        oufs_deallocate_block_at(disk, new_block_reference);
         parent->data[i] = UNALLOCATED_BLOCK;
         fprintf(stderr, "Failed to write new block %d\n", new_block_reference);
         return UNALLOCATED_INODE;
@@ -628,6 +2136,7 @@ int oufs_allocate_new_directory(INODE *parent,
       INODE new_inode;
       new_inode.type = IT_DIRECTORY;
       new_inode.n_references = 1;
+      new_inode.flags = 0;
       new_inode.data[0] = new_block_reference;
       for (int j = 1; j < BLOCKS_PER_INODE; j++) {
         new_inode.data[j] = UNALLOCATED_BLOCK;
@@ -636,22 +2145,26 @@ int oufs_allocate_new_directory(INODE *parent,
 
       // Write to new inode to disk or revert back and return unallocated if
       // issue
-      if (oufs_write_inode_by_reference(new_inode_reference, &new_inode) < 0) {
-        oufs_deallocate_inode(new_inode_reference);
-        oufs_deallocate_block(new_block_reference);
+      if (oufs_write_inode_by_reference_at(disk, new_inode_reference,
+                                           &new_inode) < 0) {
+        oufs_deallocate_inode_at(disk, new_inode_reference);
+        oufs_deallocate_block_at(disk, new_block_reference);
         parent->data[i] = UNALLOCATED_BLOCK;
-        BLOCK empty;
-        if (vdisk_write_block(new_block_reference, &empty) < 0) {
+        memset(block, 0, VDISK_BLOCK_SIZE(disk));
+        if (vdisk_write_block_at(disk, new_block_reference, block) < 0) {
           // If get here, disk is corrupt
           fprintf(stderr, "VDisk Corruption: Needs Reformatted\n");
+          oufs_block_put(disk, block);
           return UNALLOCATED_INODE;
         }
       }
+      oufs_block_put(disk, block);
       return new_inode_reference;
     }
   }
 
   // If made this far, return UNALLOCATED
+  fprintf(stderr, "Disk is full\n");
   return UNALLOCATED_INODE;
 }
 
@@ -664,14 +2177,15 @@ int oufs_allocate_new_directory(INODE *parent,
  *         -x if error
  *
  */
-int oufs_mkdir(char *cwd, char *path) {
+static int oufs_do_mkdir(VDISK *disk, char *cwd, char *path) {
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
     return (-1);
@@ -679,7 +2193,7 @@ int oufs_mkdir(char *cwd, char *path) {
 
   if (child != UNALLOCATED_INODE) {
     INODE child_inode;
-    if (oufs_read_inode_by_reference(child, &child_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, child, &child_inode) != 0) {
       return (-5);
     }
     if (child_inode.type == IT_FILE) {
@@ -692,43 +2206,50 @@ int oufs_mkdir(char *cwd, char *path) {
 
     // Get the parent inode
     INODE inode;
-    if (oufs_read_inode_by_reference(parent, &inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, parent, &inode) != 0) {
       return (-5);
     }
 
     if (inode.type == IT_DIRECTORY) {
       // Parent is a directory
-      BLOCK block;
+      BLOCK *block = oufs_block_get(disk);
+      if (block == NULL) {
+        return (-6);
+      }
       // Read the directory
-      if (vdisk_read_block(inode.data[0], &block) != 0) {
+      vdisk_block_type_set_at(disk, inode.data[0], VDISK_BLOCK_DIRECTORY);
+      if (vdisk_read_block_at(disk, inode.data[0], block) != 0) {
+        oufs_block_put(disk, block);
         return (-6);
       }
       // Find a hole in the directory entry list
-      for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-        if (block.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
+      for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); ++i) {
+        if (block->directory.entry[i].inode_reference == UNALLOCATED_INODE) {
           // Found the hole: use this one
           if (debug)
             fprintf(stderr, "Making in parent inode: %d\n", parent);
 
           INODE_REFERENCE inode_reference =
-              oufs_allocate_new_directory(&inode, parent);
+              oufs_allocate_new_directory_at(disk, &inode, parent);
           if (inode_reference == UNALLOCATED_INODE) {
-            fprintf(stderr, "Disk is full\n");
+            oufs_block_put(disk, block);
             return (-4);
           }
           // Add the item to the current directory
-          block.directory.entry[i].inode_reference = inode_reference;
+          block->directory.entry[i].inode_reference = inode_reference;
           if (debug)
             fprintf(stderr, "new file: %s\n", local_name);
           for (int j = 0; j < FILE_NAME_SIZE; j++){
-            block.directory.entry[i].name[j] = '\0';
+            block->directory.entry[i].name[j] = '\0';
           }
           for (int j = 0; (j < FILE_NAME_SIZE) && (local_name[j] != 0 && local_name[j] != '\0'); j++) {
-            block.directory.entry[i].name[j] = local_name[j];
+            block->directory.entry[i].name[j] = local_name[j];
           }
 
           // Write the block back out
-          if (vdisk_write_block(inode.data[0], &block) != 0) {
+          ret = vdisk_write_block_at(disk, inode.data[0], block);
+          oufs_block_put(disk, block);
+          if (ret != 0) {
             return (-7);
           }
 
@@ -736,7 +2257,7 @@ int oufs_mkdir(char *cwd, char *path) {
           inode.size++;
 
           // Write out the  parent inode
-          if (oufs_write_inode_by_reference(parent, &inode) != 0) {
+          if (oufs_write_inode_by_reference_at(disk, parent, &inode) != 0) {
             return (-8);
           }
 
@@ -746,6 +2267,7 @@ int oufs_mkdir(char *cwd, char *path) {
       }
       // No holes
       fprintf(stderr, "Parent is full\n");
+      oufs_block_put(disk, block);
       return (-4);
     } else {
       // Parent is not a directory
@@ -776,14 +2298,15 @@ int oufs_mkdir(char *cwd, char *path) {
  *         -x = Error
  *
  */
-int oufs_rmdir(char *cwd, char *path) {
+static int oufs_do_rmdir(VDISK *disk, char *cwd, char *path) {
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
     return (-1);
@@ -793,11 +2316,11 @@ int oufs_rmdir(char *cwd, char *path) {
     // Parent exists and child Exists
     INODE parent_inode, child_inode, empty_inode;
     // Get the parent Inode
-    if (oufs_read_inode_by_reference(parent, &parent_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
       return (-3);
     }
     // Get the child inode to write new child block
-    if (oufs_read_inode_by_reference(child, &child_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, child, &child_inode) != 0) {
       return (-3);
     }
     if (parent_inode.type != 'D' || child_inode.type != 'D') {
@@ -809,35 +2332,44 @@ int oufs_rmdir(char *cwd, char *path) {
     }
 
     // Get the parent Block
-    BLOCK parent_block;
-    if (vdisk_read_block(parent_inode.data[0], &parent_block) != 0) {
+    BLOCK *parent_block = oufs_block_get(disk);
+    if (parent_block == NULL) {
+      return (-6);
+    }
+    vdisk_block_type_set_at(disk, parent_inode.data[0], VDISK_BLOCK_DIRECTORY);
+    if (vdisk_read_block_at(disk, parent_inode.data[0], parent_block) != 0) {
+      oufs_block_put(disk, parent_block);
       return (-6);
     }
 
     // Update Parent Block
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-      if (parent_block.directory.entry[i].inode_reference !=
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); i++) {
+      if (parent_block->directory.entry[i].inode_reference !=
           UNALLOCATED_INODE) {
-        if (!strcmp(parent_block.directory.entry[i].name, local_name)) {
+        if (!strcmp(parent_block->directory.entry[i].name, local_name)) {
           INODE entry_inode, empty_inode;
-          if (oufs_read_inode_by_reference(
-                  parent_block.directory.entry[i].inode_reference,
+          if (oufs_read_inode_by_reference_at(
+                  disk, parent_block->directory.entry[i].inode_reference,
                   &entry_inode) != 0) {
+            oufs_block_put(disk, parent_block);
             return (-3);
           }
           if (entry_inode.type == IT_DIRECTORY) {
             DIRECTORY_ENTRY entry = {{0}, UNALLOCATED_INODE};
             entry.inode_reference = UNALLOCATED_INODE;
-            for (int j = 0; j < MAX_PATH_LENGTH; j++)
+            for (int j = 0; j < FILE_NAME_SIZE; j++)
               entry.name[j] = '\0';
-            parent_block.directory.entry[i] = entry;
-            parent_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
+            parent_block->directory.entry[i] = entry;
+            parent_block->directory.entry[i].inode_reference =
+                UNALLOCATED_INODE;
           }
           entry_inode = empty_inode;
         }
       }
     }
-    if (vdisk_write_block(parent_inode.data[0], &parent_block) != 0) {
+    ret = vdisk_write_block_at(disk, parent_inode.data[0], parent_block);
+    oufs_block_put(disk, parent_block);
+    if (ret != 0) {
       return (-6);
     }
 
@@ -849,18 +2381,15 @@ int oufs_rmdir(char *cwd, char *path) {
         parent_inode.n_references--;
       }
     }
-    oufs_write_inode_by_reference(parent, &parent_inode);
+    oufs_write_inode_by_reference_at(disk, parent, &parent_inode);
 
     // Overwrite the child data block
     if (child_inode.n_references == 1) {
-      // Deallocate From Master
-      oufs_deallocate_block(child_inode.data[0]);
-      oufs_deallocate_inode(child);
-
-      BLOCK empty_block = {0, 0, 0, 0};
-      if (vdisk_write_block(child_inode.data[0], &empty_block) != 0) {
+      // Deallocate From Master (this also empties the block)
+      if (oufs_deallocate_block_at(disk, child_inode.data[0]) != 0) {
         return (-6);
       }
+      oufs_deallocate_inode_at(disk, child);
 
       // Overwrite the child inode
       empty_inode.type = IT_NONE;
@@ -869,12 +2398,12 @@ int oufs_rmdir(char *cwd, char *path) {
       for (int i = 0; i < BLOCKS_PER_INODE; i++) {
         empty_inode.data[i] = UNALLOCATED_BLOCK;
       }
-      if (oufs_write_inode_by_reference(child, &empty_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, child, &empty_inode) != 0) {
         return (-6);
       }
     } else {
       child_inode.n_references--;
-      if (oufs_write_inode_by_reference(child, &child_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, child, &child_inode) != 0) {
         return (-6);
       }
     }
@@ -896,14 +2425,15 @@ int oufs_rmdir(char *cwd, char *path) {
  *         -x = error
  *
  */
-int oufs_list(char *cwd, char *path) {
+int oufs_list_at(VDISK *disk, char *cwd, char *path) {
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
   char local_name[MAX_PATH_LENGTH];
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
     return (-1);
@@ -912,7 +2442,7 @@ int oufs_list(char *cwd, char *path) {
   if (parent != UNALLOCATED_INODE && child != UNALLOCATED_INODE) {
     INODE child_inode;
     // Get the parent Inode
-    if (oufs_read_inode_by_reference(child, &child_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, child, &child_inode) != 0) {
       return (-3);
     }
 
@@ -927,26 +2457,32 @@ int oufs_list(char *cwd, char *path) {
     }
 
     // Read child block
-    BLOCK block;
-    if (vdisk_read_block(child_inode.data[0], &block) != 0) {
+    BLOCK *block = oufs_block_get(disk);
+    if (block == NULL) {
+      return (-6);
+    }
+    vdisk_block_type_set_at(disk, child_inode.data[0], VDISK_BLOCK_DIRECTORY);
+    if (vdisk_read_block_at(disk, child_inode.data[0], block) != 0) {
+      oufs_block_put(disk, block);
       return (-6);
     }
 
     // Gather all entries of directory
     INODE entry_inode, empty_inode;
     char **entries =
-        (char **)malloc((DIRECTORY_ENTRIES_PER_BLOCK) * sizeof(char *));
+        (char **)malloc((DIRECTORY_ENTRIES_PER_BLOCK(disk)) * sizeof(char *));
     int j = 0;
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-      if ((block.directory.entry[i].name[0] != '\0') &&
-          (strcmp(block.directory.entry[i].name, ".")) &&
-          (strcmp(block.directory.entry[i].name, ".."))) {
-        entries[j] = malloc(sizeof(char *));
-        strcpy(entries[j], block.directory.entry[i].name);
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); ++i) {
+      if ((block->directory.entry[i].name[0] != '\0') &&
+          (strcmp(block->directory.entry[i].name, ".")) &&
+          (strcmp(block->directory.entry[i].name, ".."))) {
+        // Room for the name, a trailing '/' and the terminator
+        entries[j] = malloc(FILE_NAME_SIZE + 2);
+        strcpy(entries[j], block->directory.entry[i].name);
         entry_inode = empty_inode;
-        if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-          oufs_read_inode_by_reference(block.directory.entry[i].inode_reference,
-                                       &entry_inode);
+        if (block->directory.entry[i].inode_reference != UNALLOCATED_INODE) {
+          oufs_read_inode_by_reference_at(
+              disk, block->directory.entry[i].inode_reference, &entry_inode);
           if (entry_inode.type == IT_DIRECTORY) {
             strcat(entries[j], "/");
           }
@@ -956,15 +2492,15 @@ int oufs_list(char *cwd, char *path) {
     }
 
     // Print '.' and '..' directories and then sort all others and print them
-    fprintf(stdout, "%s/\n", block.directory.entry[0].name);
-    fprintf(stdout, "%s/\n", block.directory.entry[1].name);
+    fprintf(stdout, "%s/\n", block->directory.entry[0].name);
+    fprintf(stdout, "%s/\n", block->directory.entry[1].name);
     qsort(entries, j, (sizeof(char *)), comparing_func);
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-      if (entries[i])
-        fprintf(stdout, "%s\n", entries[i]);
+    for (int i = 0; i < j; i++) {
+      fprintf(stdout, "%s\n", entries[i]);
       free(entries[i]);
     }
     free(entries);
+    oufs_block_put(disk, block);
 
     return (0);
 
@@ -984,7 +2520,7 @@ int oufs_list(char *cwd, char *path) {
  *         -1 = an error has occurred
  *
  */
-int oufs_allocate_new_file(char *cwd, char *path) {
+static int oufs_do_allocate_new_file(VDISK *disk, char *cwd, char *path) {
 
   if (debug)
     fprintf(stderr, "passed trailing test\n");
@@ -995,7 +2531,8 @@ int oufs_allocate_new_file(char *cwd, char *path) {
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
     return (-1);
@@ -1007,7 +2544,10 @@ int oufs_allocate_new_file(char *cwd, char *path) {
   if (parent != UNALLOCATED_INODE && child == UNALLOCATED_INODE) {
 
     // Allocate new child inode
-    child = oufs_allocate_new_inode();
+    if (oufs_reserve_check(disk, 0, 1) != 0) {
+      return (-2);
+    }
+    child = oufs_allocate_inode_near_at(disk, parent);
 
     if (debug)
       fprintf(stderr, "child = %d\n", child);
@@ -1016,7 +2556,7 @@ int oufs_allocate_new_file(char *cwd, char *path) {
     INODE new_inode = {0};
     new_inode.type = IT_FILE;
     new_inode.n_references = 1;
-    for (int i = 0; i <= BLOCKS_PER_INODE; i++) {
+    for (int i = 0; i < BLOCKS_PER_INODE; i++) {
       new_inode.data[i] = UNALLOCATED_BLOCK;
     }
     new_inode.size = 0;
@@ -1024,14 +2564,14 @@ int oufs_allocate_new_file(char *cwd, char *path) {
       fprintf(stderr, "type = (%c), ref = (%d), size = (%d)", new_inode.type,
               new_inode.n_references, new_inode.size);
     }
-    oufs_write_inode_by_reference(child, &new_inode);
+    oufs_write_inode_by_reference_at(disk, child, &new_inode);
 
     if (debug)
       fprintf(stderr, "wrote inode to disk\n");
 
     // Read parent inode for updating
     INODE parent_inode;
-    if (oufs_read_inode_by_reference(parent, &parent_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
       return (-3);
     }
 
@@ -1039,8 +2579,13 @@ int oufs_allocate_new_file(char *cwd, char *path) {
       fprintf(stderr, "read parent inode from disk\n");
 
     // Read parent block for updating
-    BLOCK block;
-    if (vdisk_read_block(parent_inode.data[0], &block) != 0) {
+    BLOCK *block = oufs_block_get(disk);
+    if (block == NULL) {
+      return (-3);
+    }
+    vdisk_block_type_set_at(disk, parent_inode.data[0], VDISK_BLOCK_DIRECTORY);
+    if (vdisk_read_block_at(disk, parent_inode.data[0], block) != 0) {
+      oufs_block_put(disk, block);
       return (-3);
     }
 
@@ -1057,43 +2602,55 @@ int oufs_allocate_new_file(char *cwd, char *path) {
     }
 
     // Check for same name entries
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-      if (!strncmp(block.directory.entry[i].name, local_name,
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); i++) {
+      if (!strncmp(block->directory.entry[i].name, local_name,
                    FILE_NAME_SIZE - 1)) {
         if (debug)
           fprintf(stderr, "found matching name\n");
-        if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
+        if (block->directory.entry[i].inode_reference != UNALLOCATED_INODE) {
           if (debug)
             fprintf(stderr, "entry is allocated\n");
 
           INODE inode;
-          oufs_read_inode_by_reference(block.directory.entry[i].inode_reference,
-                                       &inode);
+          oufs_read_inode_by_reference_at(
+              disk, block->directory.entry[i].inode_reference, &inode);
           if (inode.type == IT_FILE || inode.type == IT_NONE) {
             if (debug)
               fprintf(stderr, "Entry is file, exiting\n");
+            oufs_block_put(disk, block);
             return (0);
           }
         } else {
           if (debug)
             fprintf(stderr, "Entry is unallocated?\n");
+          oufs_block_put(disk, block);
           return (0);
         }
       }
     }
 
     // Add entry to directory
-    for (int i = 0; (i < DIRECTORY_ENTRIES_PER_BLOCK); i++) {
-      if (block.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
+    int added = 0;
+    for (int i = 0; (i < DIRECTORY_ENTRIES_PER_BLOCK(disk)); i++) {
+      if (block->directory.entry[i].inode_reference == UNALLOCATED_INODE) {
         if (debug)
           fprintf(stderr, "Added Entry\n");
-        block.directory.entry[i] = new_entry;
+        block->directory.entry[i] = new_entry;
+        added = 1;
         break;
       }
     }
+    if (!added) {
+      fprintf(stderr, "Directory is full\n");
+      oufs_deallocate_inode_at(disk, child);
+      oufs_block_put(disk, block);
+      return (-2);
+    }
 
     // Write back parent block
-    if (vdisk_write_block(parent_inode.data[0], &block) != 0) {
+    ret = vdisk_write_block_at(disk, parent_inode.data[0], block);
+    oufs_block_put(disk, block);
+    if (ret != 0) {
       return (-3);
     }
 
@@ -1102,7 +2659,7 @@ int oufs_allocate_new_file(char *cwd, char *path) {
 
     // Increment parent inode size and write back
     parent_inode.size = parent_inode.size + 1;
-    if (oufs_write_inode_by_reference(parent, &parent_inode) != 0) {
+    if (oufs_write_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
       return (-3);
     }
 
@@ -1120,7 +2677,7 @@ int oufs_allocate_new_file(char *cwd, char *path) {
 
       // Read child inode
       INODE child_inode;
-      if (oufs_read_inode_by_reference(child, &child_inode) != 0) {
+      if (oufs_read_inode_by_reference_at(disk, child, &child_inode) != 0) {
         return (-3);
       }
 
@@ -1133,20 +2690,14 @@ int oufs_allocate_new_file(char *cwd, char *path) {
           fprintf(stderr, "Child file already exists\n");
 
         // Truncate file
-        for (int i = 0; i < BLOCKS_PER_INODE; i++) {
-          if (child_inode.data[i] != UNALLOCATED_BLOCK) {
-            BLOCK empty_block;
-            if (vdisk_write_block(child_inode.data[i], &empty_block) != 0) {
-              return (-3);
-            }
-            oufs_deallocate_block(child_inode.data[i]);
-            child_inode.data[i] = UNALLOCATED_BLOCK;
-          }
+        if (oufs_map_release(disk, &child_inode) != 0) {
+          return (-3);
         }
         child_inode.size = 0;
+        child_inode.flags = 0;
 
         // Write back to disk
-        if (oufs_write_inode_by_reference(child, &child_inode) != 0) {
+        if (oufs_write_inode_by_reference_at(disk, child, &child_inode) != 0) {
           return (-3);
         }
 
@@ -1164,13 +2715,14 @@ int oufs_allocate_new_file(char *cwd, char *path) {
  *
  *  @param cwd the current working directory
  *  @param path The path of the file
- *  @param mode the access mode of the file
+ *  @param mode the access mode of the file: 'r' (read), 'w' (write), 'a'
+ *              (append) or 'z' (write; an empty file becomes compressed)
  *  @return 0 = successfully opened file
  *         -1 = an error has occurred
  *
  */
-OUFILE oufs_fopen(char *cwd, char *path, char mode) {
-  OUFILE empty;
+static OUFILE oufs_do_fopen(VDISK *disk, char *cwd, char *path, char mode) {
+  OUFILE empty = {disk, UNALLOCATED_INODE, mode, 0};
 
   if (debug)
     fprintf(stderr, "passed trailing / test\n");
@@ -1181,7 +2733,8 @@ OUFILE oufs_fopen(char *cwd, char *path, char mode) {
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_mkdir(): ret = %d\n", ret);
     return empty;
@@ -1193,13 +2746,21 @@ OUFILE oufs_fopen(char *cwd, char *path, char mode) {
   if (parent != UNALLOCATED_INODE && child != UNALLOCATED_INODE) {
 
     // Read file inode and create file pointer
-    OUFILE f;
+    OUFILE f = empty;
+    f.disk = disk;
     f.inode_reference = child;
     f.mode = mode;
     f.offset = 0;
+
+    // Data goes near the directory
+    INODE parent_inode;
+    if (oufs_read_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
+      return empty;
+    }
+    f.goal = parent_inode.data[0];
     if (mode == 'a') {
       INODE inode;
-      if (oufs_read_inode_by_reference(child, &inode) != 0) {
+      if (oufs_read_inode_by_reference_at(disk, child, &inode) != 0) {
         return empty;
       }
       f.offset = inode.size;
@@ -1215,14 +2776,14 @@ OUFILE oufs_fopen(char *cwd, char *path, char mode) {
     if (debug)
       fprintf(stderr, "Child doesnt exist\n");
     // Allocated new file
-    if (oufs_allocate_new_file(cwd, path) != 0) {
+    if (oufs_do_allocate_new_file(disk, cwd, path) != 0) {
       return empty;
     }
     if (debug)
       fprintf(stderr, "New file allocated and recursed\n");
 
     // Recurse back to top and create pointer for allocated file
-    return (oufs_fopen(cwd, path, mode));
+    return (oufs_do_fopen(disk, cwd, path, mode));
   }
 }
 
@@ -1234,41 +2795,66 @@ OUFILE oufs_fopen(char *cwd, char *path, char mode) {
  *         -1 = an error has occurred
  *
  */
-void oufs_fclose(OUFILE *fp) {
+static void oufs_do_fclose(OUFILE *fp) {
+  VDISK *disk = fp->disk;
+
+  // Drop the read-ahead window and the write buffer (already flushed)
+  free(fp->ra_data);
+  fp->ra_data = NULL;
+  fp->ra_count = 0;
+  free(fp->wb_data);
+  fp->wb_data = NULL;
+  fp->wb_len = fp->wb_capacity = 0;
+  if (fp->map != NULL) {
+    oufs_map_free(fp->map);
+    free(fp->map);
+    fp->map = NULL;
+  }
 
   // Read inode by fp
   INODE inode;
-  if (oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  if (oufs_read_inode_by_reference_at(disk, fp->inode_reference, &inode) != 0) {
     return;
   }
 
   if (debug)
     fprintf(stderr, "Inode read from block by file pointer\n");
 
-  // Find empty blocks in the inode and deallocate them
-  for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+  // Find empty blocks in the inode and deallocate them together.  A
+  // compressed stream may legitimately contain 0xff bytes anywhere, a file
+  // with indirect blocks or extents never holds an empty one and a tiny
+  // file has no blocks
+  BLOCK_REFERENCE empty[BLOCKS_PER_INODE];
+  int n_empty = 0;
+  int sweep = !(inode.flags & (INODE_COMPRESSED | INODE_INDIRECT |
+                               INODE_EXTENTS | INODE_INLINE));
+  BLOCK *block = sweep ? oufs_block_get(disk) : NULL;
+  for (int i = 0; block != NULL && i < BLOCKS_PER_INODE; i++) {
     if (inode.data[i] != UNALLOCATED_BLOCK) {
-      BLOCK block;
       if (debug)
         fprintf(stderr, "block: (%d)\n", inode.data[i]);
-      if (vdisk_read_block(inode.data[i], &block) != 0) {
+      if (vdisk_read_block_at(disk, inode.data[i], block) != 0) {
+        oufs_block_put(disk, block);
         return;
       }
       if (debug)
         fprintf(stderr, "block read from inode\n");
-      if (block.data.data[0] == 0xff) {
-        inode.data[i] = UNALLOCATED_BLOCK;
+      if (block->data.data[0] == 0xff) {
         if (debug)
           fprintf(stderr, "Unallocating found empty block\n");
-        oufs_deallocate_block(inode.data[i]);
-        if (debug)
-          fprintf(stderr, "Block unallocated\n");
+        empty[n_empty++] = inode.data[i];
+        inode.data[i] = UNALLOCATED_BLOCK;
       }
     }
   }
+  oufs_block_put(disk, block);
+  if (n_empty > 0 && oufs_deallocate_blocks_at(disk, n_empty, empty) != 0) {
+    return;
+  }
 
   // Write inode back to disk and return
-  if (oufs_write_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  if (oufs_write_inode_by_reference_at(disk, fp->inode_reference, &inode) !=
+      0) {
     return;
   }
 
@@ -1278,193 +2864,743 @@ void oufs_fclose(OUFILE *fp) {
 }
 
 /**
- *  write to file using a buffer
+ *  Load and decompress the contents of a compressed file
  *
- *  @param fp the filepointer that is being wrote to
+ *  @param inode the file's inode
+ *  @param data buffer for the contents (at least inode->size bytes)
+ *  @return 0 = successfully read the file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_read_compressed(VDISK *disk, INODE *inode,
+                                unsigned char *data) {
+  if (inode->size == 0) {
+    return (0);
+  }
+
+  // Read the whole stream in one batch
+  OUFS_MAP map;
+  if (oufs_map_load(disk, inode, &map) != 0) {
+    return (-3);
+  }
+  unsigned long n_blocks = map.n;
+  BLOCK_REFERENCE *refs = malloc(MAX(n_blocks, 1) * sizeof(BLOCK_REFERENCE));
+  if (refs == NULL) {
+    oufs_map_free(&map);
+    return (-2);
+  }
+  oufs_map_get(&map, 0, n_blocks, refs);
+  oufs_map_free(&map);
+  if (n_blocks == 0) {
+    fprintf(stderr, "File corrupt\n");
+    free(refs);
+    return (-3);
+  }
+  unsigned char *stored = oufs_map_read(disk, n_blocks, refs);
+  free(refs);
+  if (stored == NULL) {
+    return (-3);
+  }
+
+  COMPRESSED_HEADER header;
+  memcpy(&header, stored, sizeof(header));
+  int ret = 0;
+  if (header.stored_size > (size_t)n_blocks * VDISK_BLOCK_SIZE(disk) -
+      sizeof(header) ||
+      lz_decompress(stored + sizeof(header), header.stored_size, data,
+                    inode->size) != (int)inode->size) {
+    fprintf(stderr, "File corrupt\n");
+    ret = -3;
+  }
+  free(stored);
+  return (ret);
+}
+
+/**
+ *  Allocate the blocks a write adds to a file: an extent right after the
+ *  file's last block (or, for a file without blocks, near its directory)
+ *  when there is room, otherwise one block at a time as close as possible
+ *
+ *  @param last the file's last block (UNALLOCATED_BLOCK if it has none)
+ *  @param goal the block near which a file without blocks is placed
+ *  @param n number of blocks to allocate
+ *  @param refs filled in with the blocks
+ *  @return 0 = successfully allocated
+ *         -x = the disk is full (nothing is left allocated)
+ *
+ */
+static int oufs_allocate_file_blocks(VDISK *disk, BLOCK_REFERENCE last,
+                                     BLOCK_REFERENCE goal, int n,
+                                     BLOCK_REFERENCE *refs) {
+  if (n <= 0) {
+    return (0);
+  }
+  BLOCK_REFERENCE hint = (last == UNALLOCATED_BLOCK) ? goal : last + 1;
+  BLOCK_REFERENCE first = oufs_allocate_extent_at(disk, n, hint);
+  if (first != UNALLOCATED_BLOCK) {
+    for (int i = 0; i < n; i++) {
+      refs[i] = first + i;
+    }
+    return (0);
+  }
+
+  // Fragmented: take whatever blocks are free
+  if (oufs_allocate_blocks_near_at(disk, hint, n, refs) != 0) {
+    fprintf(stderr, "Disk is full\n");
+    return (-2);
+  }
+  return (0);
+}
+
+/**
+ *  Count the runs that the blocks oufs_allocate_file_blocks() is about to
+ *  allocate add to a file's map: none if the extent they get continues the
+ *  map's last run, otherwise one.  On a fragmented disk they are taken one
+ *  at a time, and each may start a run of its own.
+ *
+ *  @param map the file's map, without the new blocks
+ *  @param last, goal, n as for oufs_allocate_file_blocks()
+ *  @return Number of new runs; n (the most there can be) if fragmented
+ *
+ */
+static unsigned long oufs_file_runs(VDISK *disk, OUFS_MAP *map,
+                                    BLOCK_REFERENCE last, BLOCK_REFERENCE goal,
+                                    int n) {
+  OUFS_STATE *state = oufs_bitmaps(disk);
+  if (n <= 0 || state == NULL || (unsigned int)n > state->blocks.n_free) {
+    return (MAX(n, 0));
+  }
+  BLOCK_REFERENCE hint = (last == UNALLOCATED_BLOCK) ? goal : last + 1;
+  long first = oufs_extent_find(disk, &state->blocks, n, hint);
+  if (first < 0) {
+    return (n);
+  }
+  return ((map->n_runs > 0 && first == oufs_map_last(map) + 1) ? 0 : 1);
+}
+
+/**
+ *  Append to a compressed file.  The contents are decompressed, extended
+ *  and compressed again as a whole.  The new stream goes to new blocks,
+ *  listed by the same kind of block map as any other file; only once it is
+ *  written does the inode switch to it and the old blocks are released, so
+ *  the file is never left half rewritten.
+ *
+ *  @param inode_reference the file's inode reference
+ *  @param inode the file's inode (updated and written back)
+ *  @param goal the block near which new blocks are placed
  *  @param buf the characters being wrote
  *  @param len the length of buffer
  *  @return 0 = successfully write to file
  *         -x = an error has occurred
  *
  */
-int oufs_fwrite(OUFILE *fp, unsigned char *buf, int len) {
+static int oufs_write_compressed(VDISK *disk, INODE_REFERENCE inode_reference,
+                                 INODE *inode, BLOCK_REFERENCE goal,
+                                 unsigned char *buf, int len) {
+  unsigned long size = (unsigned long)inode->size + len;
+  if (size > MAX_COMPRESSED_FILE_SIZE(disk)) {
+    fprintf(stderr, "File too large\n");
+    return (-2);
+  }
 
-  if (debug) {
-    fprintf(stderr, "file ref: (%d)\n", fp->inode_reference);
-    fprintf(stderr, "file mode: (%c)\n", fp->mode);
+  // Room for the stream however badly the contents compress, in whole
+  // blocks
+  size_t capacity = sizeof(COMPRESSED_HEADER) + LZ_BOUND(size);
+  capacity = (capacity + VDISK_BLOCK_SIZE(disk) - 1) /
+             VDISK_BLOCK_SIZE(disk) * VDISK_BLOCK_SIZE(disk);
+  unsigned char *data = malloc(size > 0 ? size : 1);
+  unsigned char *stored = calloc(1, capacity);
+  if (data == NULL || stored == NULL) {
+    free(data);
+    free(stored);
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
   }
 
-  // Check file pointer permissions
-  if (fp->mode == 'r') {
-    fprintf(stderr, "Invalid permission to write\n");
-    return (-1);
+  // New contents: the old ones followed by buf
+  int ret = oufs_read_compressed(disk, inode, data);
+  int n_stored = 0;
+  if (ret == 0) {
+    memcpy(data + inode->size, buf, len);
+    n_stored = lz_compress(data, size, stored + sizeof(COMPRESSED_HEADER),
+                           capacity - sizeof(COMPRESSED_HEADER));
+    if (n_stored < 0) {
+      fprintf(stderr, "Not enough memory\n");
+      ret = -2;
+    }
+  }
+  free(data);
+  if (ret != 0) {
+    free(stored);
+    return (ret);
+  }
+  COMPRESSED_HEADER header = {n_stored};
+  memcpy(stored, &header, sizeof(header));
+
+  // The stream starts over in a file of its own: no blocks, no map yet
+  int n_blocks = (sizeof(header) + n_stored + VDISK_BLOCK_SIZE(disk) - 1) /
+      VDISK_BLOCK_SIZE(disk);
+  INODE old = *inode;
+  OUFS_MAP map;
+  oufs_map_init(&map);
+  inode->flags &= ~(INODE_INDIRECT | INODE_EXTENTS);
+  for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+    inode->data[i] = UNALLOCATED_BLOCK;
   }
 
-  if (debug)
-    fprintf(stderr, "file pointer passed permissions\n");
+  // Fail before anything is written if the new blocks, and the blocks
+  // listing them, are not there (the old ones only come back at the next
+  // checkpoint), or if the journal has no room for the master blocks, the
+  // inode's and those of the map.  The map is counted for the runs the
+  // blocks will form; on a fragmented disk it is only known once they are
+  // allocated, so the least it can need is checked here and storing it
+  // backs the write out if the rest is not there
+  unsigned long n_runs = oufs_file_runs(disk, &map, UNALLOCATED_BLOCK, goal,
+                                        n_blocks);
+  unsigned long overhead =
+      oufs_map_overhead(disk, inode, &map, n_blocks, MIN(n_runs, 1));
+  if (oufs_reserve_check(disk, n_blocks + overhead, 0) != 0) {
+    ret = -2;
+  } else if (vdisk_journal_reserve_at(
+                 disk, N_MASTER_BLOCKS(disk) + 1 +
+                           oufs_map_writes(disk, inode, &map, n_blocks,
+                                           n_runs)) != 0) {
+    ret = -2;
+  }
 
-  // Read file pointer inode
-  INODE inode;
-  INODE empty_inode;
-  if (oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  BLOCK_REFERENCE *refs = malloc(MAX(n_blocks, 1) * sizeof(BLOCK_REFERENCE));
+  void **block_buffers = malloc(MAX(n_blocks, 1) * sizeof(void *));
+  if (ret == 0 && (refs == NULL || block_buffers == NULL)) {
+    fprintf(stderr, "Not enough memory\n");
+    ret = -2;
+  }
+  if (ret == 0 && oufs_allocate_file_blocks(disk, UNALLOCATED_BLOCK, goal,
+                                            n_blocks, refs) != 0) {
+    ret = -2;
+  }
+  if (ret == 0) {
+    for (int i = 0; ret == 0 && i < n_blocks; i++) {
+      block_buffers[i] = stored + (size_t)i * VDISK_BLOCK_SIZE(disk);
+      ret = oufs_map_add_run(&map, refs[i], 1);
+    }
+    int listed = 0;
+    if (ret == 0) {
+      ret = oufs_map_store(disk, inode, &map, 0);
+      listed = (ret == 0);
+    }
+
+    // Write the stream in one batch
+    if (ret == 0 && vdisk_write_data_blocks_at(disk, n_blocks, refs,
+                                               block_buffers) != 0) {
+      ret = -3;
+    }
+    if (ret != 0 && listed) {
+      oufs_map_release(disk, inode);
+    } else if (ret != 0) {
+      oufs_deallocate_blocks_at(disk, n_blocks, refs);
+    }
+  }
+  free(refs);
+  free(block_buffers);
+  free(stored);
+  oufs_map_free(&map);
+  if (ret != 0) {
+    *inode = old;
+    return (ret);
+  }
+
+  // Switch the inode over, then let the old stream go
+  inode->size = size;
+  inode->flags |= INODE_COMPRESSED;
+  inode->type = IT_FILE;
+  if (oufs_write_inode_by_reference_at(disk, inode_reference, inode) != 0 ||
+      oufs_map_release(disk, &old) != 0) {
+    return (-3);
+  }
+  return (0);
+}
+
+/**
+ *  Number of bytes a file occupies in its data blocks: the compressed stream
+ *  (header included) for a compressed file, the file size otherwise
+ *
+ *  @param inode the file's inode
+ *  @return the stored size
+ *         -x = an error has occurred
+ *
+ */
+long oufs_stored_size_at(VDISK *disk, INODE *inode) {
+  if (!(inode->flags & INODE_COMPRESSED) || inode->size == 0) {
+    return (inode->size);
+  }
+
+  // The header is at the start of the file's first block
+  OUFS_MAP map;
+  if (oufs_map_load(disk, inode, &map) != 0) {
+    return (-3);
+  }
+  BLOCK_REFERENCE first = (map.n > 0) ? map.runs[0].start : UNALLOCATED_BLOCK;
+  oufs_map_free(&map);
+  if (first == UNALLOCATED_BLOCK) {
+    return (inode->size);
+  }
+
+  BLOCK *block = oufs_block_get(disk);
+  if (block == NULL || vdisk_read_block_at(disk, first, block) != 0) {
+    oufs_block_put(disk, block);
     return (-3);
   }
+  COMPRESSED_HEADER header;
+  memcpy(&header, block, sizeof(header));
+  oufs_block_put(disk, block);
+  return (sizeof(header) + header.stored_size);
+}
+
+/**
+ *  Write to a file kept in blocks, allocating the new blocks now
+ *
+ *  @param fp the file pointer
+ *  @param inode the file's inode, written back with the new size
+ *  @param buf the characters being written
+ *  @param len the length of buffer
+ *  @return 0 = successfully write to file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_write_blocks(OUFILE *fp, INODE *inode, unsigned char *buf,
+                             int len) {
+  VDISK *disk = fp->disk;
 
   // Memory check
-  if ((inode.size + len) > ((BLOCK_SIZE - 1) * BLOCKS_PER_INODE)) {
+  if ((unsigned long)inode->size + len > MAX_FILE_SIZE(disk)) {
     fprintf(stderr, "Not enough memory\n");
     return (-2);
   }
 
   // Get blocks allocated and last block size
-  int blocks_allocated = inode.size / (BLOCK_SIZE); // TOTAL SIZE / 254
-  int last_block_size = inode.size % (BLOCK_SIZE);  // TOTAL SIZE % 254
+  int last_block_size = inode->size % VDISK_BLOCK_SIZE(disk); // SIZE % 254
 
   int touched_blocks =
-      (last_block_size + len) / (BLOCK_SIZE); // Touched Total Size / 254
-  if (((last_block_size + len) % (BLOCK_SIZE)) > 0) {
+      (last_block_size + len) / VDISK_BLOCK_SIZE(disk); // Touched Total / 254
+  if (((last_block_size + len) % (VDISK_BLOCK_SIZE(disk))) > 0) {
     touched_blocks = touched_blocks + 1;
   }
 
-  // Declare N blocks for reading
-  BLOCK_REFERENCE allocated_block_references[touched_blocks];
-  BLOCK allocated_block[touched_blocks];
-  BLOCK empty_block;
+  // Either the last block is topped up or whole new blocks are added
+  int appending = (last_block_size > 0 && fp->mode == 'a');
+  if (!appending && last_block_size != 0) {
+    fprintf(stderr, "Do not have permission to write\n");
+    return (-1);
+  }
+
+  // Blocks the file already has: new ones go right after the last of them
+  OUFS_MAP map;
+  if (oufs_map_load(disk, inode, &map) != 0) {
+    return (-3);
+  }
+  BLOCK_REFERENCE last = oufs_map_last(&map);
+  if (appending && map.n == 0) {
+    fprintf(stderr, "File corrupt\n");
+    oufs_map_free(&map);
+    return (-3);
+  }
+
+  // The last block is topped up in place, unless the disk keeps checksums:
+  // its new checksum only reaches the disk after the data, so a crash in
+  // between would leave committed contents failing verification.  It is
+  // then copied to a new block along with the new data, and let go once
+  // the map no longer lists it
+  int copying = appending && VDISK_CHECKSUMMED(disk);
+  if (copying) {
+    oufs_map_drop_last(&map);
+  }
+  int in_place = appending && !copying;
+  unsigned long n_used = map.n;
+
+  // Fail before anything is read or written if the new blocks, and the
+  // blocks listing them, are not there.  The map is counted for the runs
+  // the new blocks will form; on a fragmented disk they are only known once
+  // the blocks are allocated, so the least the map can need is checked here
+  // and storing it backs the write out if the rest is not there
+  int new_blocks = touched_blocks - in_place;
+  unsigned long n_runs =
+      oufs_file_runs(disk, &map, last, fp->goal, new_blocks);
+  unsigned long overhead =
+      oufs_map_overhead(disk, inode, &map, new_blocks, MIN(n_runs, 1));
+  if (oufs_reserve_check(disk, new_blocks + overhead, 0) != 0) {
+    oufs_map_free(&map);
+    return (-2);
+  }
+
+  // Or if the journal has no room for the blocks the write changes: the
+  // master blocks, the inode's and those of the map
+  overhead = oufs_map_overhead(disk, inode, &map, new_blocks, n_runs);
+  unsigned long n_metadata =
+      MIN(N_MASTER_BLOCKS(disk), 1 + copying + new_blocks + overhead) + 1 +
+      oufs_map_writes(disk, inode, &map, new_blocks, n_runs);
+  if (vdisk_journal_reserve_at(disk, n_metadata) != 0) {
+    oufs_map_free(&map);
+    return (-2);
+  }
 
-  // Allocate all blocks
+  // Declare N blocks for reading
+  size_t n_buffers = (touched_blocks > 0) ? touched_blocks : 1;
+  BLOCK_REFERENCE *allocated_block_references =
+      malloc(n_buffers * sizeof(BLOCK_REFERENCE));
+  void **allocated_block_buffers = malloc(n_buffers * sizeof(void *));
+  unsigned char *allocated_data = malloc(n_buffers * VDISK_BLOCK_SIZE(disk));
+  if (allocated_block_references == NULL || allocated_block_buffers == NULL ||
+      allocated_data == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    free(allocated_block_references);
+    free(allocated_block_buffers);
+    free(allocated_data);
+    oufs_map_free(&map);
+    return (-2);
+  }
   for (int i = 0; i < touched_blocks; i++) {
-    for (int j = 0; j < BLOCK_SIZE; j++) {
-      allocated_block[i].data.data[j] = 0xff;
-    }
+    allocated_block_buffers[i] = allocated_data + (size_t)i *
+        VDISK_BLOCK_SIZE(disk);
   }
+  memset(allocated_data, 0xff, (size_t)touched_blocks * VDISK_BLOCK_SIZE(disk));
 
+  int ret = 0;
   // Grab last block if it is there
-  if (last_block_size > 0 && fp->mode == 'a') {
+  if (appending) {
+    if (vdisk_read_block_at(disk, last, allocated_data) != 0) {
+      ret = -3;
+    }
+    allocated_block_references[0] = last;
+  }
+
+  // Allocate the new blocks
+  BLOCK_REFERENCE *new_references = allocated_block_references + in_place;
+  if (ret == 0 && oufs_allocate_file_blocks(disk, last, fp->goal, new_blocks,
+                                            new_references) != 0) {
+    ret = -2;
+  }
+
+  if (ret == 0) {
+    // Write data to blocks (after what the last block already holds)
+    memcpy(allocated_data + last_block_size, buf, len);
 
-    // Grab last block from disk
-    int i = 0;
-    while (inode.data[i] != UNALLOCATED_BLOCK && i < BLOCKS_PER_INODE) {
-      i = i + 1;
+    // List the new blocks after the ones already in use
+    for (int j = 0; ret == 0 && j < new_blocks; j++) {
+      ret = oufs_map_add_run(&map, new_references[j], 1);
     }
-    i = i - 1;
-    allocated_block[0] = empty_block;
-    if (vdisk_read_block(inode.data[i], &allocated_block[0]) != 0) {
-      return (-3);
+    if (ret == 0) {
+      ret = oufs_map_store(disk, inode, &map, n_used);
+    }
+    if (ret != 0) {
+      oufs_deallocate_blocks_at(disk, new_blocks, new_references);
     }
-    allocated_block_references[0] = inode.data[i];
+  }
 
-    // Allocate rest of blocks
-    for (i = 1; i < touched_blocks; i++) {
-      allocated_block_references[i] = oufs_allocate_new_block();
-      for (int j = 0; j < BLOCK_SIZE; j++) {
-        allocated_block[i].data.data[j] = 0xff;
-      }
+  // Write all new blocks plus last previous block if used in one batch
+  if (ret == 0 &&
+      vdisk_write_data_blocks_at(disk, touched_blocks,
+                                 allocated_block_references,
+                                 allocated_block_buffers) != 0) {
+    ret = -3;
+  }
+
+  if (ret == 0) {
+    // Add to size and set to IT_FILE and write back
+    inode->size = inode->size + len;
+    inode->type = IT_FILE;
+    if (oufs_write_inode_by_reference_at(disk, fp->inode_reference, inode) !=
+        0) {
+      ret = -3;
+    }
+  }
+  if (ret == 0 && copying && oufs_deallocate_blocks_at(disk, 1, &last) != 0) {
+    ret = -3;
+  }
+
+  free(allocated_block_references);
+  free(allocated_block_buffers);
+  free(allocated_data);
+  oufs_map_free(&map);
+  return (ret);
+}
+
+/**
+ *  Write to a tiny file whose bytes are kept in its inode's data[]
+ *  (INODE_INLINE).  When they no longer fit, they move out to blocks along
+ *  with the new ones.
+ *
+ *  @param fp the file pointer
+ *  @param inode the file's inode (empty or inline), written back
+ *  @param buf the characters being written
+ *  @param len the length of buffer
+ *  @return 0 = successfully write to file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_write_inline(OUFILE *fp, INODE *inode, unsigned char *buf,
+                             int len) {
+  VDISK *disk = fp->disk;
+  int size = inode->size;
+
+  // Still fits
+  if (size + len <= INLINE_DATA_SIZE) {
+    if (!(inode->flags & INODE_INLINE)) {
+      memset(inode->data, 0, sizeof(inode->data));
+      inode->flags |= INODE_INLINE;
+    }
+    memcpy((unsigned char *)inode->data + size, buf, len);
+    inode->size = size + len;
+    inode->type = IT_FILE;
+    if (oufs_write_inode_by_reference_at(disk, fp->inode_reference, inode) !=
+        0) {
+      return (-3);
     }
+    return (0);
+  }
+  if (!(inode->flags & INODE_INLINE)) {
+    return (oufs_write_blocks(fp, inode, buf, len));
+  }
+
+  // Move out: the old bytes are written to blocks ahead of the new ones
+  unsigned char *data = malloc((size_t)size + len);
+  if (data == NULL) {
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
+  }
+  memcpy(data, inode->data, size);
+  memcpy(data + size, buf, len);
+  inode->flags &= ~INODE_INLINE;
+  inode->size = 0;
+  for (int i = 0; i < BLOCKS_PER_INODE; i++) {
+    inode->data[i] = UNALLOCATED_BLOCK;
+  }
+  int ret = oufs_write_blocks(fp, inode, data, size + len);
+  free(data);
+  return (ret);
+}
+
+/**
+ *  write to file using a buffer, allocating its blocks now
+ *
+ *  @param fp the filepointer that is being wrote to
+ *  @param buf the characters being wrote
+ *  @param len the length of buffer
+ *  @return 0 = successfully write to file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_do_fwrite(OUFILE *fp, unsigned char *buf, int len) {
+  VDISK *disk = fp->disk;
+
+  if (debug) {
+    fprintf(stderr, "file ref: (%d)\n", fp->inode_reference);
+    fprintf(stderr, "file mode: (%c)\n", fp->mode);
+  }
+
+  // Check file pointer permissions
+  if (fp->mode == 'r') {
+    fprintf(stderr, "Invalid permission to write\n");
+    return (-1);
+  }
+
+  if (debug)
+    fprintf(stderr, "file pointer passed permissions\n");
+
+  // Read file pointer inode
+  INODE inode;
+  INODE empty_inode;
+  if (oufs_read_inode_by_reference_at(disk, fp->inode_reference, &inode) != 0) {
+    return (-3);
+  }
+
+  // Compressed file, or a new one opened with mode 'z'
+  if ((inode.flags & INODE_COMPRESSED) || (fp->mode == 'z' && inode.size == 0)) {
+    return (oufs_write_compressed(disk, fp->inode_reference, &inode, fp->goal,
+                                  buf, len));
+  }
+
+  // Tiny file, or an empty one that may become one
+  int mapped = INODE_INDIRECT | INODE_EXTENTS;
+  if ((inode.flags & INODE_INLINE) ||
+      (inode.size == 0 && !(inode.flags & mapped) &&
+       inode.data[0] == UNALLOCATED_BLOCK)) {
+    return (oufs_write_inline(fp, &inode, buf, len));
+  }
+  return (oufs_write_blocks(fp, &inode, buf, len));
+}
+
+/**
+ *  Write the bytes held back by oufs_fwrite() to the disk.  This is when
+ *  their blocks are allocated: all of them at once, as one extent if there
+ *  is room.  The buffer is emptied even if the write fails.
+ *
+ *  @param fp the file pointer
+ *  @return 0 = successfully write to file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_do_fflush(OUFILE *fp) {
+  if (fp->wb_len == 0) {
+    return (0);
+  }
+  int ret = oufs_do_fwrite(fp, fp->wb_data, fp->wb_len);
+  fp->wb_len = 0;
 
-    // Write data to blocks
-    int block_count = 0;
-    int data_count = last_block_size + 1;
-    for (i = 0; i < len; i++) {
-      allocated_block[block_count].data.data[data_count] = buf[i];
-      data_count = data_count + 1;
-      if (data_count >= (BLOCK_SIZE)) {
-        data_count = 0;
-        block_count = block_count + 1;
-      }
-    }
+  // Once something has been written, a file opened with mode 'w' carries on
+  // after it
+  if (ret == 0 && fp->mode == 'w') {
+    fp->mode = 'a';
+  }
+  return (ret);
+}
 
-    // Go to last allocated block
-    i = 0;
-    while (inode.data[i] != UNALLOCATED_BLOCK && i < BLOCKS_PER_INODE) {
-      i = i + 1;
-    }
-    i = i - 1;
+/**
+ *  Write to a file.  The bytes are only copied into the file pointer's
+ *  buffer (after checking that the file can take them); blocks are
+ *  allocated when the buffer is flushed, by oufs_fflush() or oufs_fclose().
+ *  Many small writes thus end up in the same few contiguous blocks, and a
+ *  compressed file is compressed once instead of once per write.
+ *
+ *  @param fp the filepointer that is being wrote to
+ *  @param buf the characters being wrote
+ *  @param len the length of buffer
+ *  @return 0 = successfully write to file
+ *         -x = an error has occurred
+ *
+ */
+static int oufs_do_fwrite_buffered(OUFILE *fp, unsigned char *buf, int len) {
+  VDISK *disk = fp->disk;
 
-    // Write all new blocks plus last previous block if used
-    for (int j = 0; j < touched_blocks; j++) {
-      inode.data[i] = allocated_block_references[j];
-      if (vdisk_write_block(inode.data[i], &allocated_block[j]) != 0) {
-        return (-3);
-      }
-      i++;
-    }
+  // Check file pointer permissions
+  if (fp->mode == 'r') {
+    fprintf(stderr, "Invalid permission to write\n");
+    return (-1);
+  }
 
-    // Add to inode size and write inode back
-    inode.size = inode.size + len;
-    if (oufs_write_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  // First write: set up the buffer and find out how much the file can take
+  if (fp->wb_data == NULL) {
+    INODE inode;
+    if (oufs_read_inode_by_reference_at(disk, fp->inode_reference, &inode) !=
+        0) {
       return (-3);
     }
-
-    // Return success
-    return (0);
-
-  } else if (last_block_size == 0 && fp->mode != 'r') {
-
-    // Allocate all blocks
-    for (int i = 0; i < touched_blocks; i++) {
-      allocated_block_references[i] = oufs_allocate_new_block();
-      for (int j = 0; j < BLOCK_SIZE; j++) {
-        allocated_block[i].data.data[j] = 0xff;
-      }
+    int compressed = (inode.flags & INODE_COMPRESSED) ||
+                     (fp->mode == 'z' && inode.size == 0);
+    long limit = compressed ? MAX_COMPRESSED_FILE_SIZE(disk) :
+        (long)MAX_FILE_SIZE(disk);
+    fp->wb_data = malloc(VDISK_BLOCK_SIZE(disk));
+    if (fp->wb_data == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return (-2);
     }
+    fp->wb_capacity = VDISK_BLOCK_SIZE(disk);
+    fp->wb_len = 0;
+    fp->wb_room = MAX(limit - (long)inode.size, 0);
+  }
 
-    // Write data to blocks
-    int block_count = 0;
-    int data_count = 0;
-    for (int i = 0; i < len; i++) {
-      allocated_block[block_count].data.data[data_count] = buf[i];
-      data_count = data_count + 1;
-      if (data_count >= (BLOCK_SIZE)) {
-        data_count = 0;
-        block_count = block_count + 1;
-      }
-    }
+  // Memory check
+  if (len < 0 || len > fp->wb_room) {
+    fprintf(stderr, "Not enough memory\n");
+    return (-2);
+  }
 
-    // Write all new blocks to disk
-    for (int j = 0; j < touched_blocks; j++) {
-      if (vdisk_write_block(allocated_block_references[j],
-                            &allocated_block[j]) != 0) {
-        return (-3);
-      }
+  // Make room in the buffer
+  if (fp->wb_len + len > fp->wb_capacity) {
+    int capacity = MAX(2 * fp->wb_capacity, fp->wb_len + len);
+    unsigned char *data = realloc(fp->wb_data, capacity);
+    if (data == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return (-2);
     }
+    fp->wb_data = data;
+    fp->wb_capacity = capacity;
+  }
+  memcpy(fp->wb_data + fp->wb_len, buf, len);
+  fp->wb_len += len;
+  fp->wb_room -= len;
+  return (0);
+}
 
-    // Read fp inode
-    INODE write_inode;
-    if (oufs_read_inode_by_reference(fp->inode_reference, &write_inode) != 0) {
-      return (-3);
-    }
+/**
+ *  Find a block of a file in the file pointer's read-ahead window, refilling
+ *  the window on a miss.  A miss just past the window continues a sequential
+ *  read: the next window is twice the size of the last one (from
+ *  READAHEAD_MIN_BLOCKS up to READAHEAD_MAX_BLOCKS) and is fetched with one
+ *  batched read.  Any other miss only fetches the blocks the read needs and
+ *  starts the sequence over.  The window is looked up in the file's block
+ *  map; each run of consecutive blocks in it is one vectored transfer for
+ *  the disk.
+ *
+ *  @param map the file's block map
+ *  @param block index of the block within the file
+ *  @param n_needed blocks the read still needs, starting with this one
+ *  @param n_blocks blocks to read from, at most map->n
+ *  @return the block's contents; NULL if an error has occurred
+ *
+ */
+static unsigned char *oufs_readahead(OUFILE *fp, OUFS_MAP *map, int block,
+                                     int n_needed, int n_blocks) {
+  VDISK *disk = fp->disk;
+
+  if (fp->ra_data != NULL && block >= fp->ra_first &&
+      block < fp->ra_first + fp->ra_count) {
+    return (fp->ra_data + (size_t)(block - fp->ra_first) *
+            VDISK_BLOCK_SIZE(disk));
+  }
 
-    // Add refs to inode block
-    for (int j = 0; j < touched_blocks; j++) {
-      write_inode.data[j] = allocated_block_references[j];
-    }
+  // Size the window
+  int window;
+  if (block == fp->ra_first + fp->ra_count) {
+    window = (fp->ra_window == 0) ? READAHEAD_MIN_BLOCKS
+                                  : MIN(2 * fp->ra_window, READAHEAD_MAX_BLOCKS);
+    fp->ra_window = window;
+  } else {
+    window = 1;
+    fp->ra_window = 0;
+  }
+  window = MIN(MAX(window, n_needed), READAHEAD_MAX_BLOCKS);
+  int n = MIN(window, n_blocks - block);
+  if (n <= 0) {
+    fprintf(stderr, "File corrupt\n");
+    return (NULL);
+  }
 
-    // Add to size and set to IT_FILE and write back
-    write_inode.size = write_inode.size + len;
-    write_inode.type = IT_FILE;
-    if (oufs_write_inode_by_reference(fp->inode_reference, &write_inode) != 0) {
-      return (-3);
+  // Fetch it in one batch
+  if (fp->ra_data == NULL) {
+    fp->ra_data = malloc((size_t)READAHEAD_MAX_BLOCKS * VDISK_BLOCK_SIZE(disk));
+    if (fp->ra_data == NULL) {
+      return (NULL);
     }
-
-    // Return successful
-    return (0);
-  } else {
-    fprintf(stderr, "Do not have permission to write\n");
-    return (-1);
   }
+  void *block_buffers[n];
+  BLOCK_REFERENCE refs[n];
+  for (int i = 0; i < n; i++) {
+    block_buffers[i] = fp->ra_data + (size_t)i * VDISK_BLOCK_SIZE(disk);
+  }
+  oufs_map_get(map, block, n, refs);
+  fp->ra_count = 0;
+  if (vdisk_read_blocks_at(disk, n, refs, block_buffers) != 0) {
+    return (NULL);
+  }
+  fp->ra_first = block;
+  fp->ra_count = n;
+  return (fp->ra_data);
 }
 
 /**
- *  Read from file inot buffer
+ *  Read from file inot buffer, starting at the file pointer's offset.  The
+ *  offset moves past the bytes read.  Sequential reads are served from a
+ *  read-ahead window that grows as long as the reads stay sequential.
  *
  *  @param fp the filepointer that is being read from
  *  @param buf the characters being read
  *  @param len the length of buffer
- *  @return 0 = successfully read from file
+ *  @return number of bytes read (0 at the end of the file)
  *         -x = an error has occurred
  *
  */
 int oufs_fread(OUFILE *fp, unsigned char *buf, int len) {
+  VDISK *disk = fp->disk;
 
   if (debug)
     fprintf(stderr, "Length: (%d)\n", len);
@@ -1477,35 +3613,88 @@ int oufs_fread(OUFILE *fp, unsigned char *buf, int len) {
 
   // Read inode by file pointer
   INODE inode;
-  if (oufs_read_inode_by_reference(fp->inode_reference, &inode) != 0) {
+  if (oufs_read_inode_by_reference_at(disk, fp->inode_reference, &inode) != 0) {
     fprintf(stderr, "Inode Ref: (%d) not found\n", fp->inode_reference);
     return (-3);
   }
 
   int length = inode.size;
-  int blocks_allocated = length / (BLOCK_SIZE);
-  if (blocks_allocated > BLOCKS_PER_INODE) {
-    fprintf(stderr, "File corrupt\n");
+  int block_count = (length + VDISK_BLOCK_SIZE(disk) - 1) /
+      VDISK_BLOCK_SIZE(disk);
+  if (inode.flags & INODE_INLINE) {
+    // Tiny file: straight out of the inode
+    length = MIN(length, (int)INLINE_DATA_SIZE);
+    int n = (fp->offset < length) ? MIN(len, length - fp->offset) : 0;
+    memcpy(buf, (unsigned char *)inode.data + fp->offset, n);
+    fp->offset += n;
+    return (n);
   }
+  if (inode.flags & INODE_COMPRESSED) {
+    // Whole file at once: decompress straight into buf
+    if (fp->offset == 0 && len >= length && fp->ra_data == NULL) {
+      int ret = oufs_read_compressed(disk, &inode, buf);
+      if (ret != 0) {
+        return (ret);
+      }
+      fp->offset = length;
+      return (length);
+    }
 
-  // Read all blocks and populate buffer with data
-  BLOCK block, empty_block;
-  int block_count = 0;
-  int j = 0;
-  for (int i = 0; i < length; i++) {
-    if (i % (BLOCK_SIZE) == 0) {
-      if (vdisk_read_block(inode.data[block_count], &block) != 0) {
+    // Otherwise the decompressed file becomes the window
+    if (fp->ra_data == NULL && length > 0) {
+      fp->ra_data = malloc((size_t)block_count * VDISK_BLOCK_SIZE(disk));
+      if (fp->ra_data == NULL) {
+        return (-2);
+      }
+      int ret = oufs_read_compressed(disk, &inode, fp->ra_data);
+      if (ret != 0) {
+        free(fp->ra_data);
+        fp->ra_data = NULL;
+        return (ret);
+      }
+      fp->ra_first = 0;
+      fp->ra_count = block_count;
+    }
+  } else {
+    // The block map is loaded by the first read, so later reads need no
+    // extent tree or indirect block
+    if (fp->map == NULL) {
+      fp->map = malloc(sizeof(OUFS_MAP));
+      if (fp->map == NULL) {
+        return (-2);
+      }
+      if (oufs_map_load(disk, &inode, fp->map) != 0) {
+        free(fp->map);
+        fp->map = NULL;
         return (-3);
       }
-      block_count++;
-      j = 0;
     }
-    buf[i] = block.data.data[j];
-    j++;
+    if (block_count > fp->map->n) {
+      fprintf(stderr, "File corrupt\n");
+      block_count = fp->map->n;
+      length = block_count * VDISK_BLOCK_SIZE(disk);
+    }
   }
 
-  // Return successful
-  return (0);
+  // Copy out block by block
+  int n = (fp->offset < length) ? MIN(len, length - fp->offset) : 0;
+  for (int copied = 0; copied < n;) {
+    int block = fp->offset / VDISK_BLOCK_SIZE(disk);
+    int within = fp->offset % VDISK_BLOCK_SIZE(disk);
+    int n_needed = (within + n - copied + VDISK_BLOCK_SIZE(disk) - 1) /
+        VDISK_BLOCK_SIZE(disk);
+    unsigned char *data =
+        oufs_readahead(fp, fp->map, block, n_needed, block_count);
+    if (data == NULL) {
+      return (-3);
+    }
+    int chunk = MIN(VDISK_BLOCK_SIZE(disk) - within, n - copied);
+    memcpy(buf + copied, data + within, chunk);
+    copied += chunk;
+    fp->offset += chunk;
+  }
+
+  return (n);
 }
 
 /**
@@ -1517,7 +3706,7 @@ int oufs_fread(OUFILE *fp, unsigned char *buf, int len) {
  *         -x = an error has occurred
  *
  */
-int oufs_remove(char *cwd, char *path) {
+static int oufs_do_remove(VDISK *disk, char *cwd, char *path) {
 
   // Check for trailing /
   if (path[strlen(path) - 1] == '/') {
@@ -1531,7 +3720,8 @@ int oufs_remove(char *cwd, char *path) {
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path, &parent, &child, local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path, &parent, &child,
+                               local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_remove(): ret = %d\n", ret);
     return (-1);
@@ -1541,7 +3731,7 @@ int oufs_remove(char *cwd, char *path) {
 
     // Read child inode
     INODE child_inode;
-    if (oufs_read_inode_by_reference(child, &child_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, child, &child_inode) != 0) {
       return (-3);
     }
 
@@ -1552,30 +3742,36 @@ int oufs_remove(char *cwd, char *path) {
 
     // Read parent inode
     INODE parent_inode;
-    if (oufs_read_inode_by_reference(parent, &parent_inode) != 0) {
+    if (oufs_read_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
       return (-3);
     }
 
     // Increment size and write parent back
     parent_inode.size--;
-    if (oufs_write_inode_by_reference(parent, &parent_inode) != 0) {
+    if (oufs_write_inode_by_reference_at(disk, parent, &parent_inode) != 0) {
       return (-3);
     }
 
     // Read parent block
-    BLOCK block;
-    if (vdisk_read_block(parent_inode.data[0], &block) != 0) {
+    BLOCK *block = oufs_block_get(disk);
+    if (block == NULL) {
+      return (-3);
+    }
+    vdisk_block_type_set_at(disk, parent_inode.data[0], VDISK_BLOCK_DIRECTORY);
+    if (vdisk_read_block_at(disk, parent_inode.data[0], block) != 0) {
+      oufs_block_put(disk, block);
       return (-3);
     }
 
     // Remove directory entry from parent block
     DIRECTORY_ENTRY entry;
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-      entry = block.directory.entry[i];
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); i++) {
+      entry = block->directory.entry[i];
       if (!strcmp(entry.name, local_name)) {
         INODE entry_inode;
-        if (oufs_read_inode_by_reference(entry.inode_reference, &entry_inode) !=
-            0) {
+        if (oufs_read_inode_by_reference_at(disk, entry.inode_reference,
+                                            &entry_inode) != 0) {
+          oufs_block_put(disk, block);
           return (-3);
         }
         if (entry_inode.type == IT_FILE) {
@@ -1586,12 +3782,14 @@ int oufs_remove(char *cwd, char *path) {
             entry.name[j] = '\0';
           }
         }
-        block.directory.entry[i] = entry;
+        block->directory.entry[i] = entry;
       }
     }
 
     // Write the parent block back
-    if (vdisk_write_block(parent_inode.data[0], &block) != 0) {
+    ret = vdisk_write_block_at(disk, parent_inode.data[0], block);
+    oufs_block_put(disk, block);
+    if (ret != 0) {
       return (-3);
     }
 
@@ -1600,32 +3798,22 @@ int oufs_remove(char *cwd, char *path) {
       child_inode.type = IT_NONE;
       child_inode.n_references = 0;
       child_inode.size = 0;
-      for (int i = 0; i < BLOCKS_PER_INODE; i++) {
-        if (child_inode.data[i] != UNALLOCATED_BLOCK) {
-          if (oufs_deallocate_block(child_inode.data[i]) != 0) {
-            return (-3);
-          }
-
-          // Write child block as empty
-          BLOCK empty_block = {0, 0, 0, 0};
-          if (vdisk_write_block(child_inode.data[i], &empty_block) != 0) {
-            return (-3);
-          }
-          child_inode.data[i] = UNALLOCATED_BLOCK;
-        }
+      // Deallocating also empties the blocks, indirect ones included
+      if (oufs_map_release(disk, &child_inode) != 0) {
+        return (-3);
       }
 
       // Write child inode back
-      if (oufs_write_inode_by_reference(child, &child_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, child, &child_inode) != 0) {
         return (-3);
       }
-      if (oufs_deallocate_inode(child) != 0) {
+      if (oufs_deallocate_inode_at(disk, child) != 0) {
         return (-3);
       }
     } else {
       // Decrement references and write child back
       child_inode.n_references--;
-      if (oufs_write_inode_by_reference(child, &child_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, child, &child_inode) != 0) {
         return (-3);
       }
     }
@@ -1647,7 +3835,8 @@ int oufs_remove(char *cwd, char *path) {
  *         -x = an error has occurred
  *
  */
-int oufs_link(char *cwd, char *path_src, char *path_dst) {
+static int oufs_do_link(VDISK *disk, char *cwd, char *path_src,
+                        char *path_dst) {
 
   INODE_REFERENCE src_parent, dst_parent;
   INODE_REFERENCE src_child, dst_child;
@@ -1655,8 +3844,8 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
   int ret;
 
   // Attempt to find the specified directory
-  if ((ret = oufs_find_file(cwd, path_src, &src_parent, &src_child,
-                            src_local_name)) < -1) {
+  if ((ret = oufs_find_file_at(disk, cwd, path_src, &src_parent, &src_child,
+                               src_local_name)) < -1) {
     if (debug)
       fprintf(stderr, "oufs_remove(): ret = %d\n", ret);
     return (-1);
@@ -1665,8 +3854,8 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
   if (src_parent != UNALLOCATED_INODE && src_child != UNALLOCATED_INODE) {
 
     // Attempt to find the specified directory
-    if ((ret = oufs_find_file(cwd, path_dst, &dst_parent, &dst_child,
-                              dst_local_name)) < -1) {
+    if ((ret = oufs_find_file_at(disk, cwd, path_dst, &dst_parent, &dst_child,
+                                 dst_local_name)) < -1) {
       if (debug)
         fprintf(stderr, "oufs_remove(): ret = %d\n", ret);
       return (-1);
@@ -1676,7 +3865,8 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
 
       // Read parent inode of dst
       INODE dst_parent_inode;
-      if (oufs_read_inode_by_reference(dst_parent, &dst_parent_inode) != 0) {
+      if (oufs_read_inode_by_reference_at(disk, dst_parent,
+                                          &dst_parent_inode) != 0) {
         return (-3);
       }
 
@@ -1686,8 +3876,14 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
       }
 
       // Read parent block
-      BLOCK block;
-      if (vdisk_read_block(dst_parent_inode.data[0], &block) != 0) {
+      BLOCK *block = oufs_block_get(disk);
+      if (block == NULL) {
+        return (-3);
+      }
+      vdisk_block_type_set_at(disk, dst_parent_inode.data[0],
+                              VDISK_BLOCK_DIRECTORY);
+      if (vdisk_read_block_at(disk, dst_parent_inode.data[0], block) != 0) {
+        oufs_block_put(disk, block);
         return (-3);
       }
 
@@ -1701,50 +3897,57 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
       }
 
       // Find open entry placement
-      for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++) {
-        if (!strncmp(block.directory.entry[i].name, dst_local_name,
+      for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(disk); i++) {
+        if (!strncmp(block->directory.entry[i].name, dst_local_name,
                      FILE_NAME_SIZE - 1)) {
-          if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
+          if (block->directory.entry[i].inode_reference != UNALLOCATED_INODE) {
             INODE inode;
-            oufs_read_inode_by_reference(
-                block.directory.entry[i].inode_reference, &inode);
+            oufs_read_inode_by_reference_at(
+                disk, block->directory.entry[i].inode_reference, &inode);
             if (inode.type == IT_FILE || inode.type == IT_NONE) {
+              oufs_block_put(disk, block);
               return (0);
             }
           } else {
+            oufs_block_put(disk, block);
             return (0);
           }
         }
       }
 
       // add entry to parent block
-      for (int i = 0; (i < DIRECTORY_ENTRIES_PER_BLOCK); i++) {
-        if (block.directory.entry[i].inode_reference == UNALLOCATED_INODE) {
+      for (int i = 0; (i < DIRECTORY_ENTRIES_PER_BLOCK(disk)); i++) {
+        if (block->directory.entry[i].inode_reference == UNALLOCATED_INODE) {
           if (debug)
             fprintf(stderr, "Added Entry\n");
-          block.directory.entry[i] = new_entry;
+          block->directory.entry[i] = new_entry;
           break;
         }
       }
 
       // Write parent dst block
-      if (vdisk_write_block(dst_parent_inode.data[0], &block) != 0) {
+      ret = vdisk_write_block_at(disk, dst_parent_inode.data[0], block);
+      oufs_block_put(disk, block);
+      if (ret != 0) {
         return (-3);
       }
 
       // add to size and write parent dst inode
       dst_parent_inode.size = dst_parent_inode.size + 1;
-      if (oufs_write_inode_by_reference(dst_parent, &dst_parent_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, dst_parent,
+                                           &dst_parent_inode) != 0) {
         return (-3);
       }
 
       // Add a reference to src inode
       INODE src_child_inode;
-      if (oufs_read_inode_by_reference(src_child, &src_child_inode) != 0) {
+      if (oufs_read_inode_by_reference_at(disk, src_child,
+                                          &src_child_inode) != 0) {
         return (-3);
       }
       src_child_inode.n_references = src_child_inode.n_references + 1;
-      if (oufs_write_inode_by_reference(src_child, &src_child_inode) != 0) {
+      if (oufs_write_inode_by_reference_at(disk, src_child,
+                                           &src_child_inode) != 0) {
         return (-3);
       }
 
@@ -1762,14 +3965,98 @@ int oufs_link(char *cwd, char *path_src, char *path_dst) {
 }
 
 /**
- *  Given a virtual disk name, create and format virtual disk
+ * Write the same buffer to a run of consecutive blocks, in batches
+ *
+ * @param first First block of the run
+ * @param n Number of blocks
+ * @param block Contents for every block
+ * @return 0 on success; <0 on error
+ */
+static int oufs_fill_blocks(VDISK *disk, BLOCK_REFERENCE first,
+                            unsigned int n, void *block) {
+  BLOCK_REFERENCE references[FORMAT_BATCH_BLOCKS];
+  void *buffers[FORMAT_BATCH_BLOCKS];
+
+  for (unsigned int done = 0; done < n;) {
+    int batch = MIN(n - done, FORMAT_BATCH_BLOCKS);
+    for (int i = 0; i < batch; i++) {
+      references[i] = first + done + i;
+      buffers[i] = block;
+    }
+    if (vdisk_write_blocks_at(disk, batch, references, buffers) != 0) {
+      return (-1);
+    }
+    done += batch;
+  }
+  return (0);
+}
+
+/**
+ *  Journal blocks that hold the largest transaction on a disk: writing a
+ *  file as large as the disk, which changes the master blocks, its inode
+ *  and every block of its map (indirect blocks, or extent nodes for as many
+ *  runs as the file has blocks, as oufs_map_writes() counts them)
+ *
+ *  @return Number of blocks, the journal's descriptor included
+ */
+static unsigned int oufs_journal_blocks(unsigned int block_size,
+                                        unsigned int n_blocks,
+                                        unsigned int n_master_blocks) {
+  unsigned long per_block = block_size / sizeof(BLOCK_REFERENCE);
+  unsigned long per_node = (block_size - sizeof(EXTENT_HEADER)) /
+                           sizeof(EXTENT);
+  unsigned long n = MIN(n_blocks, N_DIRECT_BLOCKS + per_block +
+                                      per_block * per_block);
+
+  unsigned long indirect_blocks = 0;
+  if (n > N_DIRECT_BLOCKS + per_block) {
+    indirect_blocks =
+        2 + (n - N_DIRECT_BLOCKS - per_block + per_block - 1) / per_block;
+  } else if (n > N_DIRECT_BLOCKS) {
+    indirect_blocks = 1;
+  }
+  unsigned long extent_nodes = 0;
+  for (unsigned long runs = n; runs > EXTENTS_PER_INODE;) {
+    runs = (runs + per_node - 1) / per_node;
+    extent_nodes += runs;
+  }
+
+  unsigned long largest =
+      n_master_blocks +
+      MAX(1 + MAX(indirect_blocks, extent_nodes), OPERATION_JOURNAL_BLOCKS);
+  return (vdisk_journal_blocks(block_size, largest));
+}
+
+/**
+ *  Given a virtual disk name, create and format virtual disk with the
+ *  given geometry
  *
  *  @param virtual_disk_name Name of disk to be created
+ *  @param block_size Bytes per block (a power of two between
+ *                    VDISK_MIN_BLOCK_SIZE and VDISK_MAX_BLOCK_SIZE)
+ *  @param n_blocks Number of blocks on the disk
+ *  @param n_inode_blocks Number of blocks of inodes; 0 picks one inode block
+ *                        for every 16 blocks on the disk
+ *  @param n_journal_blocks Number of journal blocks; 0 formats a disk without
+ *                          a journal and <0 picks enough for the largest
+ *                          transaction (see oufs_journal_blocks())
+ *  @param checksums 1 to reserve a checksum area (one CRC-32C per block);
+ *                   0 to format a disk without block checksums
+ *  @param sparse 1 to write only the blocks that hold something, leaving the
+ *                rest of the disk file as holes (freed blocks are punched
+ *                out again); 0 to write every block
+ *  @param stripe_unit Blocks per stripe unit when virtual_disk_name lists
+ *                     several files to stripe the disk over; 0 picks
+ *                     VDISK_DEFAULT_STRIPE_UNIT
  *  @return 0 = successfully formatted disk
  *         -x = Error
  *
  */
-int oufs_format_disk(char *virtual_disk_name) {
+int oufs_format_disk_geometry(char *virtual_disk_name, unsigned int block_size,
+                              unsigned int n_blocks,
+                              unsigned int n_inode_blocks,
+                              int n_journal_blocks, int checksums,
+                              int sparse, unsigned int stripe_unit) {
 
   // Check disk name length
   if (strlen(virtual_disk_name) > (MAX_PATH_LENGTH - 1)) {
@@ -1777,77 +4064,404 @@ int oufs_format_disk(char *virtual_disk_name) {
     return (-1);
   }
 
+  // Check the geometry
+  if (block_size < VDISK_MIN_BLOCK_SIZE || block_size > VDISK_MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0) {
+    fprintf(stderr, "Block size must be a power of two from %d to %d\n",
+            VDISK_MIN_BLOCK_SIZE, VDISK_MAX_BLOCK_SIZE);
+    return (-3);
+  }
+  unsigned int inodes_per_block = block_size / sizeof(INODE);
+  if (n_inode_blocks == 0) {
+    n_inode_blocks = MAX(n_blocks / 16, 1);
+  }
+  n_inode_blocks = MIN(n_inode_blocks, MAX_N_INODES / inodes_per_block);
+  unsigned long table_bytes = MASTER_TABLES_OFFSET +
+                              (n_inode_blocks * inodes_per_block + 7) / 8 +
+                              ((unsigned long)n_blocks + 7) / 8;
+  unsigned int n_master_blocks = (table_bytes + block_size - 1) / block_size;
+  unsigned int min_journal_blocks =
+      vdisk_journal_blocks(block_size,
+                           n_master_blocks + OPERATION_JOURNAL_BLOCKS);
+  if (n_journal_blocks < 0) {
+    // Default journal, left out if it would take more than a quarter of the
+    // disk
+    n_journal_blocks = MIN(oufs_journal_blocks(block_size, n_blocks,
+                                               n_master_blocks),
+                           MAX(n_blocks / JOURNAL_DISK_FRACTION,
+                               min_journal_blocks));
+    if (n_journal_blocks > n_blocks / 4) {
+      n_journal_blocks = 0;
+    }
+  } else if (n_journal_blocks > 0 &&
+             (unsigned int)n_journal_blocks < min_journal_blocks) {
+    fprintf(stderr, "A journal needs at least %u blocks\n",
+            min_journal_blocks);
+    return (-3);
+  }
+  unsigned int n_checksum_blocks = 0;
+  if (checksums) {
+    n_checksum_blocks =
+        ((unsigned long)n_blocks * VDISK_CHECKSUM_SIZE + block_size - 1) /
+        block_size;
+  }
+  if (n_blocks == 0 || n_blocks >= UNALLOCATED_BLOCK ||
+      (unsigned long)n_master_blocks + n_inode_blocks + n_journal_blocks +
+              n_checksum_blocks >=
+          n_blocks) {
+    fprintf(stderr, "%u blocks is not enough for the file system\n",
+            n_blocks);
+    return (-3);
+  }
+
   // If vdisk creation fails
-  if (vdisk_disk_open(virtual_disk_name)) {
+  VDISK_SUPERBLOCK superblock = {VDISK_MAGIC,
+                                 block_size,
+                                 n_blocks,
+                                 n_master_blocks,
+                                 n_inode_blocks,
+                                 n_master_blocks + n_inode_blocks,
+                                 n_journal_blocks,
+                                 n_master_blocks + n_inode_blocks +
+                                     n_journal_blocks,
+                                 n_checksum_blocks,
+                                 sparse ? VDISK_SPARSE : 0,
+                                 0,
+                                 stripe_unit};
+  VDISK *disk = vdisk_create(virtual_disk_name, &superblock);
+  if (disk == NULL) {
     fprintf(stderr, "Unable to format Disk %s\n", virtual_disk_name);
     return (-2);
   }
 
   // Init a varying block and an empty block for reinitiallization
-  BLOCK empty_block = {0, 0, 0, 0};
-  BLOCK block = empty_block;
-
-  ////////////////////* INITIALIZE MASTER BLOCK *///////////////////
-  // Initialize the master block with Zero Inode and Root Directory
-  block = empty_block;
-  block.master.inode_allocated_flag[0] |= (1 << 0);
-  block.master.block_allocated_flag[0] = 0xff;
-  block.master.block_allocated_flag[1] |= (1 << 0);
-  block.master.block_allocated_flag[1] |= (1 << 1);
-  vdisk_write_block(0, &block);
-  //////////////////////////////////////////////////////////////////
-
-  ///////////////* INITIALIZE FIRST INODE BLOCK *///////////////////
-  // Initialize the Zero Inode with Root Directory
-  block = empty_block;
-  block.inodes.inode[0].type = IT_DIRECTORY;
-  block.inodes.inode[0].n_references = 1;
-  block.inodes.inode[0].data[0] = ROOT_DIRECTORY_BLOCK;
-  for (int i = 1; i <= BLOCKS_PER_INODE; i++) {
-    block.inodes.inode[0].data[i] = UNALLOCATED_BLOCK;
-  }
-  block.inodes.inode[0].size = 2;
-
-  // Initialize the Rest of the First inode Block
-  for (int j = 1; j < INODES_PER_BLOCK; j++) {
-    block.inodes.inode[j].type = IT_NONE;
-    block.inodes.inode[j].n_references = 0;
-    block.inodes.inode[j].size = 0;
-    for (int i = 0; i < BLOCKS_PER_INODE; i++) {
-      block.inodes.inode[j].data[i] = UNALLOCATED_BLOCK;
-    }
+  BLOCK *empty_block = calloc(1, VDISK_BLOCK_SIZE(disk));
+  BLOCK *block = calloc(1, VDISK_BLOCK_SIZE(disk));
+
+  ////////////////////* INITIALIZE MASTER BLOCKS *//////////////////
+  // Superblock, then the tables with the Zero Inode and every block up to
+  // and including the Root Directory allocated
+  unsigned char *master = calloc(n_master_blocks, VDISK_BLOCK_SIZE(disk));
+  if (master == NULL || empty_block == NULL || block == NULL) {
+    free(master);
+    free(empty_block);
+    free(block);
+    vdisk_close(disk);
+    return (-2);
   }
-  vdisk_write_block(1, &block);
-  /////////////////////////////////////////////////////////////////
+  MASTER_BLOCK *master_block = (MASTER_BLOCK *)master;
+  master_block->superblock = disk->superblock;
+  master[INODE_TABLE_OFFSET] |= (1 << 0);
+  for (BLOCK_REFERENCE i = 0; i <= ROOT_DIRECTORY_BLOCK(disk); i++) {
+    master[BLOCK_TABLE_OFFSET(disk) + i / 8] |= (1 << (i % 8));
+  }
+  master_block->counters_magic = FREE_COUNTERS_MAGIC;
+  master_block->n_free_blocks = VDISK_N_BLOCKS(disk) -
+      (ROOT_DIRECTORY_BLOCK(disk) + 1);
+  master_block->n_free_inodes = N_INODES(disk) - 1;
+  for (unsigned int i = 0; i < n_master_blocks; i++) {
+    vdisk_write_block_at(disk, MASTER_BLOCK_REFERENCE + i,
+                         master + (size_t)i * VDISK_BLOCK_SIZE(disk));
+  }
+  free(master);
+  //////////////////////////////////////////////////////////////////
 
   ///////////////* ALLOCATE ALL INODE BLOCKS */////////////////////
-  block = empty_block;
-  for (int i = 0; i < INODES_PER_BLOCK; i++) {
-    block.inodes.inode[i].type = IT_NONE;
-    block.inodes.inode[i].n_references = 0;
-    block.inodes.inode[i].size = 0;
+  for (int i = 0; i < INODES_PER_BLOCK(disk); i++) {
+    block->inodes.inode[i].type = IT_NONE;
+    block->inodes.inode[i].n_references = 0;
+    block->inodes.inode[i].size = 0;
     for (int j = 0; j < BLOCKS_PER_INODE; j++) {
-      block.inodes.inode[i].data[j] = UNALLOCATED_BLOCK;
+      block->inodes.inode[i].data[j] = UNALLOCATED_BLOCK;
     }
   }
-  for (int i = 2; i <= N_INODE_BLOCKS; i++) {
-    vdisk_write_block(i, &block);
+  oufs_fill_blocks(disk, FIRST_INODE_BLOCK(disk) + 1, N_INODE_BLOCKS(disk) - 1,
+                   block);
+  /////////////////////////////////////////////////////////////////
+
+  ////////////////////* CLEAR THE JOURNAL *////////////////////////
+  // (A sparse disk already reads as zeros)
+  if (!sparse) {
+    oufs_fill_blocks(disk, FIRST_JOURNAL_BLOCK(disk), N_JOURNAL_BLOCKS(disk),
+                     empty_block);
   }
   /////////////////////////////////////////////////////////////////
 
+  // The checksum area is maintained by the vdisk layer as blocks are written
+
+  ///////////////* INITIALIZE FIRST INODE BLOCK *///////////////////
+  // Initialize the Zero Inode with Root Directory
+  block->inodes.inode[0].type = IT_DIRECTORY;
+  block->inodes.inode[0].n_references = 1;
+  block->inodes.inode[0].data[0] = ROOT_DIRECTORY_BLOCK(disk);
+  block->inodes.inode[0].size = 2;
+  vdisk_write_block_at(disk, FIRST_INODE_BLOCK(disk), block);
+  /////////////////////////////////////////////////////////////////
+
   //////////////* INITIALIZE ROOT DIRECTORY BLOCK *////////////////
-  block = empty_block;
-  oufs_clean_directory_block(0, 0, &block);
-  vdisk_write_block(ROOT_DIRECTORY_BLOCK, &block);
+  memset(block, 0, VDISK_BLOCK_SIZE(disk));
+  oufs_clean_directory_block_at(disk, 0, 0, block);
+  vdisk_block_type_set_at(disk, ROOT_DIRECTORY_BLOCK(disk),
+                          VDISK_BLOCK_DIRECTORY);
+  vdisk_write_block_at(disk, ROOT_DIRECTORY_BLOCK(disk), block);
   /////////////////////////////////////////////////////////////////
 
   /////////* FILL REST OF DISK WITH UNALLOCATED BLOCKS *///////////
-  block = empty_block;
-  int i = ROOT_DIRECTORY_BLOCK + 1;
-  for (; i < N_BLOCKS_IN_DISK; i++) {
-    vdisk_write_block(i, &block);
+  // (Left as holes on a sparse disk)
+  if (!sparse) {
+    oufs_fill_blocks(disk, ROOT_DIRECTORY_BLOCK(disk) + 1,
+                     VDISK_N_BLOCKS(disk) - (ROOT_DIRECTORY_BLOCK(disk) + 1),
+                     empty_block);
   }
   //////////////////////////////////////////////////////////////////
 
-  vdisk_disk_close();
+  free(empty_block);
+  free(block);
+  return (vdisk_close(disk));
+}
+
+/**
+ *  Given a virtual disk name, create and format virtual disk with the
+ *  default geometry
+ *
+ *  @param virtual_disk_name Name of disk to be created
+ *  @return 0 = successfully formatted disk
+ *         -x = Error
+ *
+ */
+int oufs_format_disk(char *virtual_disk_name) {
+  return (oufs_format_disk_geometry(virtual_disk_name, VDISK_DEFAULT_BLOCK_SIZE,
+                                    VDISK_DEFAULT_N_BLOCKS, 0, -1, 1, 1, 0));
+}
+
+/*
+ * Operations that modify the file system.  Each one runs as a journal
+ * operation, so that all of the blocks it writes reach the disk together
+ * (on disks formatted with a journal).  The inodes and allocation tables it
+ * changed are written back just before it ends.
+ *
+ * Room in the journal is reserved up front: every operation may change the
+ * master blocks, two inode blocks and two directory blocks, and a write
+ * reserves what it needs on top of that before it changes anything.
+ */
+
+/**
+ * Start an operation
+ *
+ * @return 0 on success; <0 if there is no room for it in the journal (it
+ *         must be ended all the same)
+ */
+static int oufs_operation_begin(VDISK *disk) {
+  vdisk_journal_begin_at(disk);
+  OUFS_STATE *state = oufs_state(disk);
+  if (state != NULL && state->depth++ > 0)
+    return (0);
+  return (vdisk_journal_reserve_at(disk, N_MASTER_BLOCKS(disk) +
+                                             OPERATION_JOURNAL_BLOCKS));
+}
+
+/**
+ * End an operation
+ *
+ * @return 0 on success; <0 if its blocks could not be written
+ */
+static int oufs_operation_end(VDISK *disk) {
+  int ret = 0;
+  OUFS_STATE *state = disk->fs;
+  if (state != NULL && --state->depth == 0) {
+    if (oufs_inodes_write(disk, state) != 0)
+      ret = -1;
+    if (oufs_bitmaps_write(disk, state) != 0)
+      ret = -1;
+  }
+  if (vdisk_journal_end_at(disk) != 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_mkdir_at(VDISK *disk, char *cwd, char *path) {
+  int ret = oufs_operation_begin(disk);
+  if (ret == 0)
+    ret = oufs_do_mkdir(disk, cwd, path);
+  if (oufs_operation_end(disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_rmdir_at(VDISK *disk, char *cwd, char *path) {
+  int ret = oufs_operation_begin(disk);
+  if (ret == 0)
+    ret = oufs_do_rmdir(disk, cwd, path);
+  if (oufs_operation_end(disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_allocate_new_file_at(VDISK *disk, char *cwd, char *path) {
+  int ret = oufs_operation_begin(disk);
+  if (ret == 0)
+    ret = oufs_do_allocate_new_file(disk, cwd, path);
+  if (oufs_operation_end(disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+OUFILE oufs_fopen_at(VDISK *disk, char *cwd, char *path, char mode) {
+  OUFILE f = {disk, UNALLOCATED_INODE, mode, 0};
+  if (oufs_operation_begin(disk) == 0)
+    f = oufs_do_fopen(disk, cwd, path, mode);
+  if (oufs_operation_end(disk) != 0)
+    f.inode_reference = UNALLOCATED_INODE;
+  return (f);
+}
+
+void oufs_fclose(OUFILE *fp) {
+  VDISK *disk = fp->disk;
+  if (oufs_operation_begin(disk) == 0)
+    oufs_do_fflush(fp);
+  oufs_do_fclose(fp);
+  oufs_operation_end(disk);
+}
+
+int oufs_fwrite(OUFILE *fp, unsigned char *buf, int len) {
+  int ret = oufs_operation_begin(fp->disk);
+  if (ret == 0)
+    ret = oufs_do_fwrite_buffered(fp, buf, len);
+  if (oufs_operation_end(fp->disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_fflush(OUFILE *fp) {
+  int ret = oufs_operation_begin(fp->disk);
+  if (ret == 0)
+    ret = oufs_do_fflush(fp);
+  if (oufs_operation_end(fp->disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_remove_at(VDISK *disk, char *cwd, char *path) {
+  int ret = oufs_operation_begin(disk);
+  if (ret == 0)
+    ret = oufs_do_remove(disk, cwd, path);
+  if (oufs_operation_end(disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+int oufs_link_at(VDISK *disk, char *cwd, char *path_src, char *path_dst) {
+  int ret = oufs_operation_begin(disk);
+  if (ret == 0)
+    ret = oufs_do_link(disk, cwd, path_src, path_dst);
+  if (oufs_operation_end(disk) != 0 && ret == 0)
+    ret = -4;
+  return (ret);
+}
+
+/*
+ * Single-disk interface: the calls below operate on the disk opened with
+ * vdisk_disk_open()
+ */
+
+void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent,
+                                BLOCK *block) {
+  oufs_clean_directory_block_at(vdisk_default, self, parent, block);
+}
+
+BLOCK_REFERENCE oufs_allocate_new_block() {
+  return (oufs_allocate_new_block_at(vdisk_default));
+}
+
+int oufs_allocate_blocks_near(BLOCK_REFERENCE near, int count,
+                              BLOCK_REFERENCE *out) {
+  return (oufs_allocate_blocks_near_at(vdisk_default, near, count, out));
+}
+
+int oufs_allocate_new_blocks(int count, BLOCK_REFERENCE *out) {
+  return (oufs_allocate_new_blocks_at(vdisk_default, count, out));
+}
+
+int oufs_free_space(unsigned int *free_blocks, unsigned int *free_inodes) {
+  return (oufs_free_space_at(vdisk_default, free_blocks, free_inodes));
+}
+
+BLOCK_REFERENCE oufs_allocate_extent(unsigned int n, BLOCK_REFERENCE hint) {
+  return (oufs_allocate_extent_at(vdisk_default, n, hint));
+}
+
+INODE_REFERENCE oufs_allocate_inode_near(INODE_REFERENCE near) {
+  return (oufs_allocate_inode_near_at(vdisk_default, near));
+}
+
+INODE_REFERENCE oufs_allocate_new_inode() {
+  return (oufs_allocate_new_inode_at(vdisk_default));
+}
+
+int oufs_deallocate_inode(INODE_REFERENCE inode_ref) {
+  return (oufs_deallocate_inode_at(vdisk_default, inode_ref));
+}
+
+int oufs_deallocate_block(BLOCK_REFERENCE block_ref) {
+  return (oufs_deallocate_block_at(vdisk_default, block_ref));
+}
+
+int oufs_deallocate_blocks(int count, BLOCK_REFERENCE *refs) {
+  return (oufs_deallocate_blocks_at(vdisk_default, count, refs));
+}
+
+int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+  return (oufs_read_inode_by_reference_at(vdisk_default, i, inode));
+}
+
+int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode) {
+  return (oufs_write_inode_by_reference_at(vdisk_default, i, inode));
+}
+
+int oufs_find_directory_entry(INODE *inode, char *directory_name) {
+  return (oufs_find_directory_entry_at(vdisk_default, inode, directory_name));
+}
+
+int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
+                   INODE_REFERENCE *child, char *local_name) {
+  return (oufs_find_file_at(vdisk_default, cwd, path, parent, child,
+                            local_name));
+}
+
+int oufs_allocate_new_directory(INODE *parent,
+                                INODE_REFERENCE parent_reference) {
+  return (oufs_allocate_new_directory_at(vdisk_default, parent,
+                                         parent_reference));
+}
+
+int oufs_allocate_new_file(char *cwd, char *path) {
+  return (oufs_allocate_new_file_at(vdisk_default, cwd, path));
+}
+
+int oufs_mkdir(char *cwd, char *path) {
+  return (oufs_mkdir_at(vdisk_default, cwd, path));
+}
+
+int oufs_list(char *cwd, char *path) {
+  return (oufs_list_at(vdisk_default, cwd, path));
+}
+
+int oufs_rmdir(char *cwd, char *path) {
+  return (oufs_rmdir_at(vdisk_default, cwd, path));
+}
+
+OUFILE oufs_fopen(char *cwd, char *path, char mode) {
+  return (oufs_fopen_at(vdisk_default, cwd, path, mode));
+}
+
+int oufs_remove(char *cwd, char *path) {
+  return (oufs_remove_at(vdisk_default, cwd, path));
+}
+
+int oufs_link(char *cwd, char *path_src, char *path_dst) {
+  return (oufs_link_at(vdisk_default, cwd, path_src, path_dst));
+}
+
+long oufs_stored_size(INODE *inode) {
+  return (oufs_stored_size_at(vdisk_default, inode));
 }
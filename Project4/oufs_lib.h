@@ -6,30 +6,85 @@
 
 void oufs_get_environment(char *cwd, char *disk_name);
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
+int oufs_find_open_bit(unsigned char value);
+int comparing_func(const void *a, const void *b);
+void oufs_fclose(OUFILE *fp);
+int oufs_fwrite(OUFILE *fp, unsigned char *buf, int len);
+int oufs_fflush(OUFILE *fp);
+int oufs_fread(OUFILE *fp, unsigned char *buf, int len);
+
+// Operations on an open disk
+void oufs_clean_directory_block_at(VDISK *disk, INODE_REFERENCE self,
+                                   INODE_REFERENCE parent, BLOCK *block);
+BLOCK_REFERENCE oufs_allocate_new_block_at(VDISK *disk);
+int oufs_allocate_new_blocks_at(VDISK *disk, int count, BLOCK_REFERENCE *out);
+int oufs_allocate_blocks_near_at(VDISK *disk, BLOCK_REFERENCE near, int count,
+                                 BLOCK_REFERENCE *out);
+BLOCK_REFERENCE oufs_allocate_extent_at(VDISK *disk, unsigned int n,
+                                        BLOCK_REFERENCE hint);
+INODE_REFERENCE oufs_allocate_new_inode_at(VDISK *disk);
+INODE_REFERENCE oufs_allocate_inode_near_at(VDISK *disk,
+                                            INODE_REFERENCE near);
+int oufs_deallocate_inode_at(VDISK *disk, INODE_REFERENCE inode_ref);
+int oufs_deallocate_block_at(VDISK *disk, BLOCK_REFERENCE block_ref);
+int oufs_deallocate_blocks_at(VDISK *disk, int count, BLOCK_REFERENCE *refs);
+int oufs_free_space_at(VDISK *disk, unsigned int *free_blocks,
+                       unsigned int *free_inodes);
+int oufs_read_inode_by_reference_at(VDISK *disk, INODE_REFERENCE i,
+                                    INODE *inode);
+int oufs_write_inode_by_reference_at(VDISK *disk, INODE_REFERENCE i,
+                                     INODE *inode);
+int oufs_find_directory_entry_at(VDISK *disk, INODE *inode,
+                                 char *directory_name);
+int oufs_find_file_at(VDISK *disk, char *cwd, char *path,
+                      INODE_REFERENCE *parent, INODE_REFERENCE *child,
+                      char *local_name);
+int oufs_allocate_new_directory_at(VDISK *disk, INODE *parent,
+                                   INODE_REFERENCE parent_reference);
+int oufs_allocate_new_file_at(VDISK *disk, char *cwd, char *path);
+int oufs_mkdir_at(VDISK *disk, char *cwd, char *path);
+int oufs_list_at(VDISK *disk, char *cwd, char *path);
+int oufs_rmdir_at(VDISK *disk, char *cwd, char *path);
+OUFILE oufs_fopen_at(VDISK *disk, char *cwd, char *path, char mode);
+int oufs_remove_at(VDISK *disk, char *cwd, char *path);
+int oufs_link_at(VDISK *disk, char *cwd, char *path_src, char *path_dst);
+long oufs_stored_size_at(VDISK *disk, INODE *inode);
+
+// The same operations on the disk opened with vdisk_disk_open()
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent,
                                 BLOCK *block);
-int oufs_find_open_bit(unsigned char value);
 BLOCK_REFERENCE oufs_allocate_new_block();
+int oufs_allocate_new_blocks(int count, BLOCK_REFERENCE *out);
+int oufs_allocate_blocks_near(BLOCK_REFERENCE near, int count,
+                              BLOCK_REFERENCE *out);
+BLOCK_REFERENCE oufs_allocate_extent(unsigned int n, BLOCK_REFERENCE hint);
 INODE_REFERENCE oufs_allocate_new_inode();
+INODE_REFERENCE oufs_allocate_inode_near(INODE_REFERENCE near);
 int oufs_deallocate_inode(INODE_REFERENCE inode_ref);
 int oufs_deallocate_block(BLOCK_REFERENCE block_ref);
+int oufs_deallocate_blocks(int count, BLOCK_REFERENCE *refs);
+int oufs_free_space(unsigned int *free_blocks, unsigned int *free_inodes);
 int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
 int oufs_find_directory_entry(INODE *inode, char *directory_name);
 int oufs_find_file(char *cwd, char *path, INODE_REFERENCE *parent,
                    INODE_REFERENCE *child, char *local_name);
-int comparing_func(const void *a, const void *b);
 int oufs_allocate_new_directory(INODE *parent, INODE_REFERENCE parent_reference);
 int oufs_allocate_new_file(char *cwd, char *path);
 int oufs_mkdir(char *cwd, char *path);
 int oufs_list(char *cwd, char *path);
 int oufs_rmdir(char *cwd, char *path);
 OUFILE oufs_fopen(char *cwd, char *path, char mode);
-void oufs_fclose(OUFILE *fp);
-int oufs_fwrite(OUFILE *fp, unsigned char *buf, int len);
-int oufs_fread(OUFILE *fp, unsigned char *buf, int len);
 int oufs_remove(char *cwd, char *path);
 int oufs_link(char *cwd, char *path_src, char *path_dst);
+long oufs_stored_size(INODE *inode);
+
+// Formatting creates its own disk
 int oufs_format_disk(char *virtual_disk_name);
+int oufs_format_disk_geometry(char *virtual_disk_name, unsigned int block_size,
+                              unsigned int n_blocks,
+                              unsigned int n_inode_blocks,
+                              int n_journal_blocks, int checksums,
+                              int sparse, unsigned int stripe_unit);
 
 #endif
@@ -1,142 +1,3481 @@
+#define _GNU_SOURCE
 #include "vdisk.h"
+#include "crc32c.h"
+#include "vdisk_pool.h"
+#include "vdisk_snap.h"
+#include "vdisk_uring.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
 /*
  * Virtual disk implementation.
  *
  * The disk is implemented on top of a file.  Access provided by this
  * library is on a block-by-block basis
+ *
+ * Blocks pass through a small write-back cache: reads of a resident block are
+ * served from memory and repeated writes of the same block are coalesced until
+ * the block is evicted or vdisk_flush() is called.
+ *
+ * Alternatively (ZDISK_BACKEND=mmap), the whole disk file is mapped into
+ * memory and blocks are accessed with plain memory copies.  The mapping takes
+ * the place of the cache; vdisk_flush() becomes an msync().
+ *
+ * With ZDISK_BACKEND=uring, everything that reaches the backing file is
+ * issued through an io_uring submission queue instead of one blocking system
+ * call at a time.  Batched requests are queued together and reaped together,
+ * and vdisk_read_block_async()/vdisk_write_block_async() expose the queue
+ * directly.  When io_uring is not available the pread path is used.
+ *
+ * Disks formatted with a journal region get crash-consistent operations:
+ * blocks written between vdisk_journal_begin() and vdisk_journal_end() are
+ * held in memory, logged to the journal together with one sync when the
+ * transaction commits, and only then written to their home locations.  A
+ * committed transaction that did not reach its home blocks is replayed when
+ * the disk is next opened.  Several operations may share one commit (group
+ * commit, ZJOURNAL_GROUP).
+ *
+ * Disks formatted with a checksum area get a CRC-32C per block: computed when
+ * a block is written to the backing file and verified when it is read back,
+ * so that corruption below the file system is reported instead of being
+ * silently used.  vdisk_scrub() checks the whole disk.
+ *
+ * Disks formatted as sparse (VDISK_SPARSE) only store the blocks that hold
+ * something: the file is sized with ftruncate() and blocks discarded by the
+ * file system are punched out of it again.
+ *
+ * A disk may also be striped over several files, given as a comma-separated
+ * list of names; batched transfers then drive the files in parallel.
+ *
+ * Snapshots stack copy-on-write overlay files on top of the disk file(s)
+ * (vdisk_snap.c): once a snapshot is taken, every block written goes to the
+ * newest overlay and the older layers stay as they were.
+ *
+ * Block reads and writes are counted by block type, both as requested by the
+ * caller and as transferred to and from the backing file(s), and the calls
+ * that reach the file(s) are timed in log2 histograms.  With ZSTATS set, the
+ * counters are printed when the disk is closed and added to <disk>.iostats.
+ *
+ * Every open disk is described by its own VDISK handle (file, geometry, cache,
+ * mapping and ring), so several disks can be open in one process.  The *_at()
+ * functions take the handle explicitly; the original single-disk calls
+ * operate on vdisk_default.  A handle must not be used by more than one
+ * thread at a time.
  */
 
 // Debug flag
 #define debug 0
 
-// File descriptor for virtual disk.  Private to this file
-// Yes, global variables are generally a bad idea...
+// Code below works on the disk passed in as "disk"
+
+// Bytes read at a time by vdisk_scrub()
+#define VDISK_SCRUB_CHUNK (1 << 20)
+
+// Disk used by the single-disk interface
+VDISK *vdisk_default = NULL;
+
+// Open disks (flushed at exit)
+static VDISK *vdisk_open_disks = NULL;
+static pthread_mutex_t vdisk_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One cached block.  Entries are kept both on a hash chain (for lookup) and
+// on a doubly linked LRU list (head = most recently used)
+typedef struct vdisk_cache_entry_s {
+  BLOCK_REFERENCE block_ref;
+  int valid;
+  int dirty;
+  struct vdisk_cache_entry_s *hash_next;
+  struct vdisk_cache_entry_s *lru_prev;
+  struct vdisk_cache_entry_s *lru_next;
+  unsigned char data[];
+} VDISK_CACHE_ENTRY;
+
+// Requested cache size (in blocks); -1 means "use ZCACHE or the default"
+static int vdisk_cache_requested = -1;
+
+// Requested backend; -1 means "use ZDISK_BACKEND or pread"
+static int vdisk_backend_requested = -1;
 
-int vdisk_fd = 0;
+// Requested operations per journal commit; -1 means "use ZJOURNAL_GROUP or
+// the default"
+static int vdisk_journal_group_requested = -1;
+
+// io_uring engine: requested queue depth (-1 means "use ZDISK_QUEUE_DEPTH or
+// the default")
+static int vdisk_queue_depth_requested = -1;
+
+// Completion record for engine requests that the caller waits on
+typedef struct vdisk_wait_s {
+  int pending;
+  int result;
+} VDISK_WAIT;
 
 /**
- * Open the virtual disk
+ * Engine completion function for VDISK_WAIT records
+ */
+static void vdisk_wait_done(void *context, int result) {
+  VDISK_WAIT *wait = context;
+  --wait->pending;
+  if (result != 0)
+    wait->result = result;
+}
+
+/**
+ * Reap engine completions until every request of a VDISK_WAIT record is done
  *
- * @param virtual_disk_name Name of the file containing the virtual disk
- * @return 0 on success; < 0 on error
+ * @return 0 if all requests succeeded; <0 on error
+ */
+static int vdisk_wait_for(VDISK *disk, VDISK_WAIT *wait) {
+  while (wait->pending > 0) {
+    if (vdisk_uring_wait(disk->ring, 1) < 0)
+      return (-4);
+  }
+  return (wait->result);
+}
+
+/*
+ * Striping.
  *
+ * Blocks are dealt out to the backing files stripe_unit blocks at a time,
+ * round robin: stripe unit u (blocks u * unit ... u * unit + unit - 1) is
+ * the (u / n_stripes)-th unit of file u % n_stripes.  The superblock is in
+ * block 0 and so at the start of the first file.  Consecutive units of one
+ * file are adjacent in it, so a long run of blocks becomes one long transfer
+ * per file.  A disk in a single file is the case of one stripe.
  */
-int vdisk_disk_open(char *virtual_disk_name) {
-  if (vdisk_fd != 0) {
-    fprintf(stderr, "A disk is already opened\n");
-    return (-1);
-  };
 
-  // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
-                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+/**
+ * @return The number of backing files of a disk
+ */
+static int vdisk_n_stripes(VDISK *disk) {
+  return (disk->stripe_fds == NULL ? 1 : (int)disk->superblock.n_stripes);
+}
 
-  // Check code
-  if (fd <= 0) {
-    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
-    return (-1);
-  };
+/**
+ * @return The number of files of a disk: its stripes, then its snapshot
+ *         overlays
+ */
+static int vdisk_n_files(VDISK *disk) {
+  return (vdisk_n_stripes(disk) +
+          (disk->snap == NULL ? 0 : disk->snap->n_layers));
+}
 
-  // Remember the fd in the global variable
-  vdisk_fd = fd;
-  return (0);
-};
+/**
+ * Locate a block in the backing files, ignoring snapshots
+ *
+ * @param offset Set to the position of the block within its file
+ * @return The index of the file holding the block
+ */
+static int vdisk_locate_base(VDISK *disk, BLOCK_REFERENCE block_ref,
+                             off_t *offset) {
+  if (disk->stripe_fds == NULL) {
+    *offset = (off_t)block_ref * VDISK_BLOCK_SIZE(disk);
+    return (0);
+  }
+
+  unsigned int unit = disk->superblock.stripe_unit;
+  unsigned int n_stripes = disk->superblock.n_stripes;
+  unsigned int u = block_ref / unit;
+  *offset = ((off_t)(u / n_stripes) * unit + block_ref % unit) *
+      VDISK_BLOCK_SIZE(disk);
+  return (u % n_stripes);
+}
 
 /**
- * Close the virtual disk
+ * Locate a block.  On a disk with snapshots the newest layer that holds the
+ * block is used, and a block that is about to be written is first given a
+ * slot in the top overlay if it has none there (copy on write: the whole
+ * block is always written, so nothing needs copying).
  *
- * @return 0 on success; <0 for an error
+ * @param write 1 if the block is about to be written
+ * @param offset Set to the position of the block within its file
+ * @return The index of the file holding the block
  */
-int vdisk_disk_close() {
-  // Must be initialized to clos it
-  if (vdisk_fd == 0) {
-    fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
-    exit(-1);
-  };
+static int vdisk_locate(VDISK *disk, BLOCK_REFERENCE block_ref, int write,
+                        off_t *offset) {
+  VDISK_SNAP *snap = disk->snap;
+  if (snap != NULL) {
+    if (write && snap->layer[block_ref] != snap->n_layers)
+      vdisk_snap_allocate(snap, block_ref);
+    int layer = snap->layer[block_ref];
+    if (layer > 0) {
+      *offset = vdisk_snap_offset(snap, snap->slot[block_ref]);
+      return (vdisk_n_stripes(disk) + layer - 1);
+    }
+  }
+  return (vdisk_locate_base(disk, block_ref, offset));
+}
 
-  // Close the file
-  close(vdisk_fd);
+/**
+ * Locate a run of blocks that follow each other in one file
+ *
+ * @param n Number of blocks wanted
+ * @param offset Set to the position of the first block within its file
+ * @param n_run Set to the number of blocks in the run (1 ... n)
+ * @return The index of the file holding the run
+ */
+static int vdisk_locate_run(VDISK *disk, BLOCK_REFERENCE first_ref,
+                            unsigned int n, int write, off_t *offset,
+                            unsigned int *n_run) {
+  int file = vdisk_locate(disk, first_ref, write, offset);
+  if (disk->stripe_fds == NULL && disk->snap == NULL) {
+    *n_run = n;
+    return (file);
+  }
 
-  // Mark as closed
-  vdisk_fd = 0;
-  return (0);
+  unsigned int run = 1;
+  off_t next;
+  while (run < n &&
+         vdisk_locate(disk, first_ref + run, write, &next) == file &&
+         next == *offset + (off_t)run * VDISK_BLOCK_SIZE(disk))
+    ++run;
+  *n_run = run;
+  return (file);
 }
 
 /**
- *  Read a disk block into the provided buffer
+ * @return The descriptor of the i-th file of a disk
+ */
+static int vdisk_file_fd(VDISK *disk, int i) {
+  int n_stripes = vdisk_n_stripes(disk);
+  if (i >= n_stripes)
+    return (disk->snap->fds[i - n_stripes]);
+  return (disk->stripe_fds == NULL ? disk->fd : disk->stripe_fds[i]);
+}
+
+/*
+ * I/O statistics.
  *
- * @param block_ref Index of the block that is to be loaded
- * @param block Pointer to the buffer that the read block will be placed into
- * @return 0 on success; <0 on error
+ * Blocks are counted as they are requested through the public calls and again
+ * as they are transferred to or from the backing file(s), so that the two can
+ * be compared.  Transfers to the file(s) and syncs are also timed.  Snapshot
+ * maintenance (remap tables, merges) is not counted.
+ */
+
+// Names of the block types in reports
+static const char *vdisk_block_type_names[VDISK_N_BLOCK_TYPES] = {
+    "master", "inode", "directory", "data", "journal", "checksum"};
+
+// Number of counters in a VDISK_IO_STATS (all of them unsigned long)
+#define VDISK_IO_COUNTERS (sizeof(VDISK_IO_STATS) / sizeof(unsigned long))
+
+/**
+ * @return The type of a block (VDISK_BLOCK_*)
+ */
+static int vdisk_block_type(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  VDISK_SUPERBLOCK *superblock = &disk->superblock;
+  if (block_ref == 0 || block_ref < superblock->n_master_blocks)
+    return (VDISK_BLOCK_MASTER);
+  if (block_ref < superblock->n_master_blocks + superblock->n_inode_blocks)
+    return (VDISK_BLOCK_INODE);
+
+  // Blocks before a region wrap around to large values
+  if (block_ref - superblock->journal_start < superblock->n_journal_blocks)
+    return (VDISK_BLOCK_JOURNAL);
+  if (block_ref - superblock->checksum_start < superblock->n_checksum_blocks)
+    return (VDISK_BLOCK_CHECKSUM);
+  if (disk->directory_blocks != NULL &&
+      (disk->directory_blocks[block_ref / 8] & (1 << (block_ref % 8))))
+    return (VDISK_BLOCK_DIRECTORY);
+  return (VDISK_BLOCK_DATA);
+}
+
+/**
+ * Count n consecutive blocks
  *
+ * @param counters One of the per-type arrays of disk->io_stats
  */
-int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block) {
-  if (debug)
-    fprintf(stderr, "##Reading block %d\n", block_ref);
+static void vdisk_io_count(VDISK *disk, unsigned long *counters,
+                           BLOCK_REFERENCE first_ref, unsigned int n) {
+  for (unsigned int i = 0; i < n; ++i)
+    ++counters[vdisk_block_type(disk, first_ref + i)];
+}
 
-  // Make sure that the disk is initialized
-  if (vdisk_fd == 0) {
-    fprintf(stderr, "vdisk_read_block(): disk not initialized\n");
-    exit(-1);
-  };
+/**
+ * @return Monotonic clock in ns
+ */
+static unsigned long vdisk_clock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ((unsigned long)now.tv_sec * 1000000000UL + now.tv_nsec);
+}
 
-  // Make sure that we have a valid block request
-  if (block_ref >= N_BLOCKS_IN_DISK) {
-    fprintf(stderr, "vdisk_read_block(): bad block_ref(%d)\n", block_ref);
-    return (-2);
+/**
+ * Add the time elapsed since start to a latency histogram
+ */
+static void vdisk_io_time(unsigned long *histogram, unsigned long start) {
+  unsigned long elapsed = vdisk_clock() - start;
+  int bucket = (elapsed == 0) ? 0 : 63 - __builtin_clzl(elapsed);
+  if (bucket >= VDISK_LATENCY_BUCKETS)
+    bucket = VDISK_LATENCY_BUCKETS - 1;
+  ++histogram[bucket];
+}
+
+/**
+ * Split a transfer over the files of a striped disk or a disk with snapshots
+ * (see vdisk_file_io())
+ */
+static ssize_t vdisk_file_split_io(VDISK *disk, int write, void *buffer,
+                                   size_t length, off_t position) {
+  size_t done = 0;
+  while (done < length) {
+    off_t offset;
+    unsigned int n;
+    BLOCK_REFERENCE block_ref = (position + done) / VDISK_BLOCK_SIZE(disk);
+    size_t within = (position + done) % VDISK_BLOCK_SIZE(disk);
+    unsigned int n_blocks =
+        (within + length - done + VDISK_BLOCK_SIZE(disk) - 1) /
+        VDISK_BLOCK_SIZE(disk);
+    int fd = vdisk_file_fd(
+        disk, vdisk_locate_run(disk, block_ref, n_blocks, write, &offset, &n));
+    size_t piece = (size_t)n * VDISK_BLOCK_SIZE(disk) - within;
+    if (piece > length - done)
+      piece = length - done;
+    unsigned char *at = (unsigned char *)buffer + done;
+    ssize_t ret = write ? pwrite(fd, at, piece, offset + within)
+                        : pread(fd, at, piece, offset + within);
+    if (ret < 0)
+      return (done > 0 ? (ssize_t)done : -1);
+    done += ret;
+    if ((size_t)ret < piece)
+      break;
   }
+  return (done);
+}
 
-  // Lsek to the correct point in the file
-  if (lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return (-3);
+/**
+ * pread()/pwrite() on the disk as a whole: position counts from the start of
+ * block 0 and the transfer is split over the backing files as needed
+ *
+ * @return Number of bytes transferred; -1 on error
+ */
+static ssize_t vdisk_file_io(VDISK *disk, int write, void *buffer,
+                             size_t length, off_t position) {
+  unsigned long start = vdisk_clock();
+  VDISK_IO_STATS *stats = &disk->io_stats;
+  vdisk_io_count(disk, write ? stats->device_writes : stats->device_reads,
+                 position / VDISK_BLOCK_SIZE(disk),
+                 (position % VDISK_BLOCK_SIZE(disk) + length +
+                  VDISK_BLOCK_SIZE(disk) - 1) /
+                     VDISK_BLOCK_SIZE(disk));
+
+  ssize_t done;
+  if (disk->stripe_fds == NULL && disk->snap == NULL)
+    done = write ? pwrite(disk->fd, buffer, length, position)
+                 : pread(disk->fd, buffer, length, position);
+  else
+    done = vdisk_file_split_io(disk, write, buffer, length, position);
+  vdisk_io_time(write ? stats->write_latency : stats->read_latency, start);
+  return (done);
+}
+
+/**
+ * Pool task: fdatasync() the i-th backing file
+ */
+static void vdisk_sync_task(void *arg, int i) {
+  int *results = arg;
+  results[i] = fdatasync(results[i]);
+}
+
+/**
+ * fdatasync() every backing file that may have been written (in parallel on a
+ * striped disk).  The snapshot remap table is written out first.
+ *
+ * @return 0 on success; -1 on error
+ */
+static int vdisk_file_sync(VDISK *disk) {
+  unsigned long start = vdisk_clock();
+  int ret = 0;
+  if (disk->stripe_fds == NULL && disk->snap == NULL) {
+    ret = fdatasync(disk->fd);
+  } else if (vdisk_snap_flush(disk->snap) != 0) {
+    ret = -1;
+  } else {
+    // Each slot holds a descriptor on the way in and the result on the way
+    // out; the stripes come first, then the top overlay (the rest are frozen)
+    int n_files = vdisk_n_stripes(disk) + (disk->snap != NULL);
+    int results[n_files];
+    for (int i = 0; i < n_files; ++i)
+      results[i] = vdisk_file_fd(disk, i < vdisk_n_stripes(disk)
+                                           ? i
+                                           : vdisk_n_files(disk) - 1);
+    vdisk_pool_run(disk->pool, n_files, vdisk_sync_task, results);
+    for (int i = 0; i < n_files; ++i) {
+      if (results[i] != 0)
+        ret = -1;
+    }
   }
+  ++disk->io_stats.syncs;
+  vdisk_io_time(disk->io_stats.sync_latency, start);
+  return (ret);
+}
 
-  // Read the block
-  if (read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_read_block(): read failed\n");
+/**
+ * Transfer one block through the io_uring engine and wait for it
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_uring_block(VDISK *disk, int write, BLOCK_REFERENCE block_ref,
+                             void *block) {
+  struct iovec iov = {block, VDISK_BLOCK_SIZE(disk)};
+  VDISK_WAIT wait = {1, 0};
+  off_t offset;
+  int fd = vdisk_file_fd(disk, vdisk_locate(disk, block_ref, write, &offset));
+  if (vdisk_uring_queue(disk->ring, write, fd, offset, &iov, 1,
+                        VDISK_BLOCK_SIZE(disk),
+                        vdisk_wait_done, &wait) != 0)
     return (-4);
+  return (vdisk_wait_for(disk, &wait));
+}
+
+/*
+ * Block checksums.
+ *
+ * The checksum area holds one CRC-32C per block of the disk.  It is loaded
+ * when the disk is opened and kept in memory; entries that change are
+ * written back together with the cache.  The checksum of a block is computed
+ * when the block is written to the backing file (or the mapping) and checked
+ * when it is read from there, so blocks served from the cache or the running
+ * transaction cost nothing.  The backing file only changes through its
+ * handle, so it is trusted like a cache as well: a block is checked the first
+ * time it is read from the file and not again until it is written, and a
+ * block just written is known to match.  Journal images carry their checksum
+ * from the commit, so installing them computes nothing.
+ *
+ * The journal region (protected by its own checksum) and the checksum area
+ * itself are not covered.  An entry of 0 means that no checksum has been
+ * recorded and is not checked.
+ */
+
+/**
+ * Is a block covered by a checksum?
+ */
+static int vdisk_checksummed(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  VDISK_SUPERBLOCK *superblock = &disk->superblock;
+  // Unsigned arithmetic: blocks before a region also land outside it
+  return (disk->checksums != NULL &&
+          block_ref - superblock->checksum_start >=
+              superblock->n_checksum_blocks &&
+          block_ref - superblock->journal_start >=
+              superblock->n_journal_blocks);
+}
+
+/**
+ * Blocks of the checksum area are owned by the vdisk layer: reads are served
+ * from the in-memory copy and writes are refused
+ *
+ * @return The in-memory copy of the block; NULL if the block is not part of
+ *         the checksum area
+ */
+static const void *vdisk_checksum_area_block(VDISK *disk,
+                                             BLOCK_REFERENCE block_ref) {
+  unsigned int i = block_ref - disk->superblock.checksum_start;
+  if (disk->checksums == NULL || i >= disk->superblock.n_checksum_blocks)
+    return (NULL);
+  return ((unsigned char *)disk->checksums + (size_t)i *
+          VDISK_BLOCK_SIZE(disk));
+}
+
+/**
+ * Record the already known checksum of a block that is about to reach the
+ * backing file
+ */
+static void vdisk_checksum_store(VDISK *disk, BLOCK_REFERENCE block_ref,
+                                 unsigned int crc) {
+  if (!vdisk_checksummed(disk, block_ref))
+    return;
+  disk->checksum_verified[block_ref] = 0;
+  if (disk->checksums[block_ref] != crc) {
+    disk->checksums[block_ref] = crc;
+    disk->checksum_dirty[block_ref /
+                         (VDISK_BLOCK_SIZE(disk) / VDISK_CHECKSUM_SIZE)] = 1;
   }
+}
+
+/**
+ * Record the checksum of a block that is about to reach the backing file
+ */
+static void vdisk_checksum_set(VDISK *disk, BLOCK_REFERENCE block_ref,
+                               const void *block) {
+  if (vdisk_checksummed(disk, block_ref))
+    vdisk_checksum_store(disk, block_ref,
+                         crc32c(0, block, VDISK_BLOCK_SIZE(disk)));
+}
+
+/**
+ * Check a block just read from the backing file against its checksum
+ *
+ * @return 0 if it matches (or is not covered); VDISK_CHECKSUM_ERROR otherwise
+ */
+static int vdisk_checksum_verify(VDISK *disk, BLOCK_REFERENCE block_ref,
+                                 const void *block) {
+  if (!vdisk_checksummed(disk, block_ref))
+    return (0);
+  unsigned int expected = disk->checksums[block_ref];
+  if (expected == 0 || crc32c(0, block, VDISK_BLOCK_SIZE(disk)) == expected)
+    return (0);
+  fprintf(stderr, "vdisk_read_block(): checksum mismatch in block %u\n",
+          block_ref);
+  return (VDISK_CHECKSUM_ERROR);
+}
+
+/**
+ * Check a block read from the backing file (or the mapping) against its
+ * checksum, unless it has already been found intact since it last changed
+ *
+ * @return 0 if it matches (or is not covered); VDISK_CHECKSUM_ERROR otherwise
+ */
+static int vdisk_checksum_verify_once(VDISK *disk, BLOCK_REFERENCE block_ref,
+                                      const void *block) {
+  if (!vdisk_checksummed(disk, block_ref) ||
+      disk->checksum_verified[block_ref])
+    return (0);
+  int ret = vdisk_checksum_verify(disk, block_ref, block);
+  disk->checksum_verified[block_ref] = (ret == 0);
+  return (ret);
+}
+
+/**
+ * Note that a block was just written to the backing file (or the mapping):
+ * its checksum was computed from what the disk now holds
+ */
+static void vdisk_checksum_written(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (vdisk_checksummed(disk, block_ref))
+    disk->checksum_verified[block_ref] = 1;
+}
+
+/**
+ * Write the changed parts of the checksum area to the backing file
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_checksum_flush(VDISK *disk) {
+  if (disk->checksums == NULL)
+    return (0);
 
-  // Success
+  unsigned int n = disk->superblock.n_checksum_blocks;
+  for (unsigned int i = 0; i < n;) {
+    if (!disk->checksum_dirty[i]) {
+      ++i;
+      continue;
+    }
+
+    // One write per run of changed blocks
+    unsigned int start = i;
+    while (i < n && disk->checksum_dirty[i])
+      ++i;
+    ssize_t length = (ssize_t)(i - start) * VDISK_BLOCK_SIZE(disk);
+    if (vdisk_file_io(disk, 1,
+                      (unsigned char *)disk->checksums +
+                          (size_t)start * VDISK_BLOCK_SIZE(disk),
+                      length,
+                      (off_t)(disk->superblock.checksum_start + start) *
+                          VDISK_BLOCK_SIZE(disk)) != length) {
+      fprintf(stderr, "vdisk_flush(): checksum write failed\n");
+      return (-4);
+    }
+    memset(disk->checksum_dirty + start, 0, i - start);
+  }
   return (0);
 }
 
 /**
- *  Write a disk block to the virtual disk
+ * Drop the in-memory checksum state of a disk
+ */
+static void vdisk_checksum_free(VDISK *disk) {
+  free(disk->checksums);
+  free(disk->checksum_dirty);
+  free(disk->checksum_verified);
+  disk->checksums = NULL;
+  disk->checksum_dirty = NULL;
+  disk->checksum_verified = NULL;
+}
+
+/**
+ * Load the checksum area of a freshly opened disk
+ */
+static void vdisk_checksum_init(VDISK *disk) {
+  VDISK_SUPERBLOCK *superblock = &disk->superblock;
+  unsigned int n = superblock->n_checksum_blocks;
+  if (n == 0)
+    return;
+  if (superblock->checksum_start == 0 ||
+      (unsigned long)superblock->checksum_start + n > superblock->n_blocks ||
+      (unsigned long)n * (VDISK_BLOCK_SIZE(disk) / VDISK_CHECKSUM_SIZE) <
+          superblock->n_blocks) {
+    fprintf(stderr, "vdisk: bad checksum area; running without checksums\n");
+    return;
+  }
+
+  disk->checksums = calloc(n, VDISK_BLOCK_SIZE(disk));
+  disk->checksum_dirty = calloc(n, 1);
+  disk->checksum_verified = calloc(superblock->n_blocks, 1);
+  // A new disk may be shorter than the area: the rest reads as "no checksum"
+  if (disk->checksums == NULL || disk->checksum_dirty == NULL ||
+      disk->checksum_verified == NULL ||
+      vdisk_file_io(disk, 0, disk->checksums, (size_t)n *
+                    VDISK_BLOCK_SIZE(disk),
+                    (off_t)superblock->checksum_start *
+                        VDISK_BLOCK_SIZE(disk)) < 0) {
+    fprintf(stderr, "vdisk: unable to load checksums; running without them\n");
+    vdisk_checksum_free(disk);
+  }
+}
+
+/**
+ * Write a block straight to the backing file
  *
- * @param block_ref Index to the block to be written
- * @param block Memory in which the block is currently stored
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_write(VDISK *disk, BLOCK_REFERENCE block_ref,
+                              void *block) {
+  if (debug)
+    fprintf(stderr, "##Writing block %d to device\n", block_ref);
+
+  vdisk_checksum_set(disk, block_ref, block);
+  unsigned long start = vdisk_clock();
+  vdisk_io_count(disk, disk->io_stats.device_writes, block_ref, 1);
+  int ret = 0;
+  if (disk->ring != NULL) {
+    ret = vdisk_uring_block(disk, 1, block_ref, block);
+  } else {
+    // Write the block at its position in its file
+    off_t offset;
+    int fd = vdisk_file_fd(disk, vdisk_locate(disk, block_ref, 1, &offset));
+    if (pwrite(fd, block, VDISK_BLOCK_SIZE(disk), offset) !=
+        VDISK_BLOCK_SIZE(disk)) {
+      fprintf(stderr, "vdisk_write_block(): write failed\n");
+      ret = -4;
+    }
+  }
+  vdisk_io_time(disk->io_stats.write_latency, start);
+  if (ret == 0)
+    vdisk_checksum_written(disk, block_ref);
+  return (ret);
+}
+
+/**
+ * Read a block straight from the backing file
  *
+ * @return 0 on success; <0 on error
  */
-int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block) {
+static int vdisk_device_read(VDISK *disk, BLOCK_REFERENCE block_ref,
+                             void *block) {
   if (debug)
-    fprintf(stderr, "##Writing block %d\n", block_ref);
+    fprintf(stderr, "##Reading block %d from device\n", block_ref);
 
-  // File open?
-  if (vdisk_fd == 0) {
-    fprintf(stderr, "vdisk_write_block(): disk not initialized\n");
-    exit(-1);
-  };
+  unsigned long start = vdisk_clock();
+  vdisk_io_count(disk, disk->io_stats.device_reads, block_ref, 1);
+  int ret = 0;
+  if (disk->ring != NULL) {
+    ret = vdisk_uring_block(disk, 0, block_ref, block);
+  } else {
+    // Read the block from its position in its file
+    off_t offset;
+    int fd = vdisk_file_fd(disk, vdisk_locate(disk, block_ref, 0, &offset));
+    if (pread(fd, block, VDISK_BLOCK_SIZE(disk), offset) !=
+        VDISK_BLOCK_SIZE(disk)) {
+      fprintf(stderr, "vdisk_read_block(): read failed\n");
+      ret = -4;
+    }
+  }
+  vdisk_io_time(disk->io_stats.read_latency, start);
+  if (ret != 0)
+    return (ret);
+  return (vdisk_checksum_verify_once(disk, block_ref, block));
+}
 
-  // Is it a valid block request?
-  if (block_ref >= N_BLOCKS_IN_DISK) {
-    fprintf(stderr, "vdisk_write_block(): bad block_ref(%d)\n", block_ref);
-    return (-2);
+/**
+ * Transfer a run of blocks that are adjacent in their file with a single
+ * preadv/pwritev
+ *
+ * @param write 1 to write the blocks; 0 to read them
+ * @param fd Descriptor of the file holding the run
+ * @param offset Position of the run in the file
+ * @param iov One VDISK_BLOCK_SIZE(disk) buffer per block in the run
+ * @param n Number of blocks in the run (at most IOV_MAX)
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_run(VDISK *disk, int write, int fd, off_t offset,
+                            struct iovec *iov, int n) {
+  if (debug)
+    fprintf(stderr, "##%s %d blocks at %ld on device\n",
+            write ? "Writing" : "Reading", n, (long)offset);
+
+  ssize_t expected = (ssize_t)n * VDISK_BLOCK_SIZE(disk);
+  ssize_t done =
+      write ? pwritev(fd, iov, n, offset) : preadv(fd, iov, n, offset);
+  if (done != expected) {
+    fprintf(stderr, "vdisk_%s_blocks(): %s failed\n", write ? "write" : "read",
+            write ? "write" : "read");
+    return (-4);
   }
+  return (0);
+}
 
-  // Move to the beginning of the block
-  if (lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return (-3);
+// One element of a batched request, sorted by block before being issued
+typedef struct vdisk_request_s {
+  BLOCK_REFERENCE block_ref;
+  int index;
+  void *block;
+} VDISK_REQUEST;
+
+/**
+ * Order batched requests by block reference, then by position in the batch
+ */
+static int vdisk_request_compare(const void *a, const void *b) {
+  const VDISK_REQUEST *ra = a;
+  const VDISK_REQUEST *rb = b;
+  if (ra->block_ref != rb->block_ref)
+    return ((ra->block_ref > rb->block_ref) - (ra->block_ref < rb->block_ref));
+  return (ra->index - rb->index);
+}
+
+/**
+ * Length of the run of requests starting at requests[0]: blocks that follow
+ * each other in the same file (at most IOV_MAX)
+ *
+ * @param file Set to the index of the file holding the run
+ * @param offset Set to the position of the run in that file
+ */
+static int vdisk_run_length(VDISK *disk, int write, VDISK_REQUEST *requests,
+                            int n, int *file, off_t *offset) {
+  *file = vdisk_locate(disk, requests[0].block_ref, write, offset);
+  int run = 1;
+  while (run < n && run < IOV_MAX) {
+    off_t next;
+    if (vdisk_locate(disk, requests[run].block_ref, write, &next) != *file ||
+        next != *offset + (off_t)run * VDISK_BLOCK_SIZE(disk))
+      break;
+    ++run;
   }
+  return (run);
+}
 
-  // Read the block
-  if (write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): read failed\n");
-    return (-4);
+/**
+ * Issue a batch of requests one run at a time with preadv/pwritev
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_runs(VDISK *disk, int write, VDISK_REQUEST *requests,
+                             int n) {
+  struct iovec iov[IOV_MAX];
+  int ret = 0;
+  for (int i = 0; ret == 0 && i < n;) {
+    int file;
+    off_t offset;
+    int run =
+        vdisk_run_length(disk, write, &requests[i], n - i, &file, &offset);
+    for (int j = 0; j < run; ++j) {
+      iov[j].iov_base = requests[i + j].block;
+      iov[j].iov_len = VDISK_BLOCK_SIZE(disk);
+    }
+    ret = vdisk_device_run(disk, write, vdisk_file_fd(disk, file), offset, iov,
+                           run);
+    i += run;
   }
+  return (ret);
+}
 
-  // Success
-  return (0);
+// The requests of a batch, grouped by file
+typedef struct vdisk_stripe_batch_s {
+  VDISK *disk;
+  int write;
+  VDISK_REQUEST *requests;
+  int *start;
+  int *result;
+} VDISK_STRIPE_BATCH;
+
+/**
+ * Pool task: issue the requests that go to the i-th file
+ */
+static void vdisk_stripe_task(void *arg, int i) {
+  VDISK_STRIPE_BATCH *batch = arg;
+  batch->result[i] =
+      vdisk_device_runs(batch->disk, batch->write,
+                        &batch->requests[batch->start[i]],
+                        batch->start[i + 1] - batch->start[i]);
+}
+
+/**
+ * Issue a batch of requests against the backing files, coalescing runs of
+ * blocks that are adjacent in their file into single vectored calls.  The
+ * files of a striped disk are driven in parallel.  Blocks about to be written
+ * get their place in the top snapshot overlay here, in block order.
+ *
+ * @param write 1 to write the blocks; 0 to read them
+ * @param requests Requests, already sorted by block reference
+ * @param n Number of requests
+ * @param checksums Checksums of the blocks to write, by request index; NULL
+ *                  to compute them here
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_device_batch(VDISK *disk, int write, VDISK_REQUEST *requests,
+                              int n, const unsigned int *checksums) {
+  int ret = 0;
+
+  // A block repeated within the batch keeps the checksum of its last buffer
+  if (write) {
+    for (int i = 0; i < n; ++i) {
+      if (checksums != NULL)
+        vdisk_checksum_store(disk, requests[i].block_ref,
+                             checksums[requests[i].index]);
+      else
+        vdisk_checksum_set(disk, requests[i].block_ref, requests[i].block);
+    }
+  }
+  unsigned long started = vdisk_clock();
+  VDISK_IO_STATS *stats = &disk->io_stats;
+  for (int i = 0; i < n; ++i)
+    vdisk_io_count(disk, write ? stats->device_writes : stats->device_reads,
+                   requests[i].block_ref, 1);
+
+  // Several files (stripes or snapshot overlays): group the requests by file,
+  // keeping their order within each file, so that runs only have to be looked
+  // for within a group
+  int n_files = vdisk_n_files(disk);
+  int start[n_files + 1];
+  VDISK_REQUEST *grouped = requests;
+  start[0] = 0;
+  start[n_files] = n;
+  if (n_files > 1 && n > 1) {
+    grouped = malloc(n * sizeof(VDISK_REQUEST));
+    if (grouped == NULL)
+      return (-5);
+    int count[n_files];
+    memset(count, 0, sizeof(count));
+    off_t offset;
+    for (int i = 0; i < n; ++i)
+      ++count[vdisk_locate(disk, requests[i].block_ref, write, &offset)];
+    for (int i = 0; i < n_files; ++i)
+      start[i + 1] = start[i] + count[i];
+    int next[n_files];
+    memcpy(next, start, sizeof(next));
+    for (int i = 0; i < n; ++i)
+      grouped[next[vdisk_locate(disk, requests[i].block_ref, write,
+                                &offset)]++] = requests[i];
+  } else {
+    for (int i = 1; i < n_files; ++i)
+      start[i] = n;
+  }
+
+  if (disk->ring != NULL) {
+    // Engine: queue every run, then reap them together
+    struct iovec *batch_iov = malloc((n > 0 ? n : 1) * sizeof(struct iovec));
+    if (batch_iov == NULL) {
+      if (grouped != requests)
+        free(grouped);
+      return (-5);
+    }
+    VDISK_WAIT wait = {0, 0};
+    for (int i = 0; i < n;) {
+      int file;
+      off_t offset;
+      int run =
+          vdisk_run_length(disk, write, &grouped[i], n - i, &file, &offset);
+      for (int j = i; j < i + run; ++j) {
+        batch_iov[j].iov_base = grouped[j].block;
+        batch_iov[j].iov_len = VDISK_BLOCK_SIZE(disk);
+      }
+      ++wait.pending;
+      if (vdisk_uring_queue(disk->ring, write, vdisk_file_fd(disk, file),
+                            offset, &batch_iov[i], run,
+                            (ssize_t)run * VDISK_BLOCK_SIZE(disk),
+                            vdisk_wait_done, &wait) != 0) {
+        --wait.pending;
+        wait.result = -4;
+        break;
+      }
+      i += run;
+    }
+    ret = vdisk_wait_for(disk, &wait);
+    free(batch_iov);
+  } else if (grouped != requests) {
+    // Threads: one file per task
+    int result[n_files];
+    VDISK_STRIPE_BATCH batch = {disk, write, grouped, start, result};
+    vdisk_pool_run(disk->pool, n_files, vdisk_stripe_task, &batch);
+    for (int i = 0; ret == 0 && i < n_files; ++i)
+      ret = result[i];
+  } else {
+    ret = vdisk_device_runs(disk, write, requests, n);
+  }
+  if (grouped != requests)
+    free(grouped);
+  if (n > 0)
+    vdisk_io_time(write ? stats->write_latency : stats->read_latency,
+                  started);
+
+  for (int i = 0; ret == 0 && i < n; ++i) {
+    if (write)
+      vdisk_checksum_written(disk, requests[i].block_ref);
+    else
+      ret = vdisk_checksum_verify_once(disk, requests[i].block_ref,
+                                       requests[i].block);
+  }
+  return (ret);
+}
+
+/**
+ * Unlink a cache entry from the LRU list
+ */
+static void vdisk_lru_remove(VDISK *disk, VDISK_CACHE_ENTRY *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    disk->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    disk->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+/**
+ * Place a cache entry at the most recently used end of the LRU list
+ */
+static void vdisk_lru_push(VDISK *disk, VDISK_CACHE_ENTRY *entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = disk->lru_head;
+  if (disk->lru_head)
+    disk->lru_head->lru_prev = entry;
+  disk->lru_head = entry;
+  if (disk->lru_tail == NULL)
+    disk->lru_tail = entry;
+}
+
+/**
+ * Find a resident block in the cache
+ *
+ * @return The cache entry, or NULL if the block is not resident
+ */
+static VDISK_CACHE_ENTRY *vdisk_cache_lookup(VDISK *disk,
+                                             BLOCK_REFERENCE block_ref) {
+  if (disk->cache_size == 0)
+    return (NULL);
+
+  VDISK_CACHE_ENTRY *entry =
+      disk->cache_hash[block_ref & (disk->cache_buckets - 1)];
+  while (entry != NULL && entry->block_ref != block_ref)
+    entry = entry->hash_next;
+  return (entry);
+}
+
+/**
+ * Remove an entry from its hash chain
+ */
+static void vdisk_hash_remove(VDISK *disk, VDISK_CACHE_ENTRY *entry) {
+  VDISK_CACHE_ENTRY **link =
+      &disk->cache_hash[entry->block_ref & (disk->cache_buckets - 1)];
+  while (*link != NULL && *link != entry)
+    link = &(*link)->hash_next;
+  if (*link == entry)
+    *link = entry->hash_next;
+  entry->hash_next = NULL;
+}
+
+/**
+ * Claim a cache entry for a block, evicting the least recently used block if
+ * necessary.  A dirty victim is written back before it is reused.
+ *
+ * @return The (now invalid) entry bound to block_ref, or NULL on a write-back
+ *         error
+ */
+static VDISK_CACHE_ENTRY *vdisk_cache_claim(VDISK *disk,
+                                            BLOCK_REFERENCE block_ref) {
+  VDISK_CACHE_ENTRY *entry = disk->lru_tail;
+
+  if (entry->valid) {
+    if (entry->dirty) {
+      if (vdisk_device_write(disk, entry->block_ref, entry->data) != 0)
+        return (NULL);
+      ++disk->stats.writebacks;
+    }
+    vdisk_hash_remove(disk, entry);
+    ++disk->stats.evictions;
+  }
+
+  // Bind the entry to the new block
+  entry->block_ref = block_ref;
+  entry->valid = 0;
+  entry->dirty = 0;
+  VDISK_CACHE_ENTRY **bucket =
+      &disk->cache_hash[block_ref & (disk->cache_buckets - 1)];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+
+  vdisk_lru_remove(disk, entry);
+  vdisk_lru_push(disk, entry);
+  return (entry);
+}
+
+/**
+ * @return The i-th entry of the cache
+ */
+static VDISK_CACHE_ENTRY *vdisk_cache_entry(VDISK *disk, int i) {
+  return ((VDISK_CACHE_ENTRY *)(disk->cache + i * disk->cache_stride));
+}
+
+/**
+ * Release the cache.  Dirty blocks must already have been flushed.
+ */
+static void vdisk_cache_free(VDISK *disk) {
+  free(disk->cache);
+  free(disk->cache_hash);
+  disk->cache = NULL;
+  disk->cache_hash = NULL;
+  disk->cache_size = disk->cache_buckets = 0;
+  disk->lru_head = disk->lru_tail = NULL;
+}
+
+/**
+ * Allocate the cache for a newly opened disk.  The size comes from
+ * vdisk_cache_set_size() or, failing that, the ZCACHE environment variable.
+ */
+static void vdisk_cache_init(VDISK *disk) {
+  int size = vdisk_cache_requested;
+  if (size < 0) {
+    char *str = getenv("ZCACHE");
+    size = (str == NULL) ? VDISK_CACHE_DEFAULT_SIZE : atoi(str);
+  }
+  if (size > VDISK_N_BLOCKS(disk))
+    size = VDISK_N_BLOCKS(disk);
+  if (size <= 0)
+    return;
+
+  // Hash table size: smallest power of two that covers the cache
+  int buckets = 1;
+  while (buckets < size)
+    buckets <<= 1;
+
+  size_t stride = (sizeof(VDISK_CACHE_ENTRY) + VDISK_BLOCK_SIZE(disk) +
+                   15) & ~(size_t)15;
+  disk->cache = calloc(size, stride);
+  disk->cache_hash = calloc(buckets, sizeof(VDISK_CACHE_ENTRY *));
+  if (disk->cache == NULL || disk->cache_hash == NULL) {
+    fprintf(stderr, "vdisk: unable to allocate block cache; running uncached\n");
+    vdisk_cache_free(disk);
+    return;
+  }
+  disk->cache_size = size;
+  disk->cache_buckets = buckets;
+  disk->cache_stride = stride;
+  for (int i = 0; i < size; ++i)
+    vdisk_lru_push(disk, vdisk_cache_entry(disk, i));
+}
+
+/**
+ * Order cache entries by block reference (for sequential write-back)
+ */
+static int vdisk_entry_compare(const void *a, const void *b) {
+  const VDISK_CACHE_ENTRY *ea = *(const VDISK_CACHE_ENTRY **)a;
+  const VDISK_CACHE_ENTRY *eb = *(const VDISK_CACHE_ENTRY **)b;
+  return ((ea->block_ref > eb->block_ref) - (ea->block_ref < eb->block_ref));
+}
+
+/**
+ * Write every dirty cached block back to the backing file.  Blocks remain
+ * resident (and clean) afterwards.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_cache_writeback(VDISK *disk) {
+  if (disk->cache_size == 0)
+    return (0);
+
+  // Collect the dirty blocks and write them in disk order
+  VDISK_CACHE_ENTRY *dirty[disk->cache_size];
+  int n_dirty = 0;
+  for (int i = 0; i < disk->cache_size; ++i) {
+    VDISK_CACHE_ENTRY *entry = vdisk_cache_entry(disk, i);
+    if (entry->valid && entry->dirty)
+      dirty[n_dirty++] = entry;
+  }
+  qsort(dirty, n_dirty, sizeof(VDISK_CACHE_ENTRY *), vdisk_entry_compare);
+
+  VDISK_REQUEST requests[n_dirty > 0 ? n_dirty : 1];
+  for (int i = 0; i < n_dirty; ++i) {
+    requests[i].block_ref = dirty[i]->block_ref;
+    requests[i].index = i;
+    requests[i].block = dirty[i]->data;
+  }
+  int ret = vdisk_device_batch(disk, 1, requests, n_dirty, NULL);
+  if (ret != 0)
+    return (ret);
+
+  for (int i = 0; i < n_dirty; ++i)
+    dirty[i]->dirty = 0;
+  disk->stats.writebacks += n_dirty;
+  return (0);
+}
+
+/**
+ * Store a block in the mapping, the cache or the backing file (whichever the
+ * disk uses), bypassing the journal
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_cache_write(VDISK *disk, BLOCK_REFERENCE block_ref,
+                             void *block) {
+  // Mapped disk
+  if (disk->map != NULL) {
+    vdisk_io_count(disk, disk->io_stats.device_writes, block_ref, 1);
+    vdisk_checksum_set(disk, block_ref, block);
+    memcpy(disk->map + (size_t)block_ref * VDISK_BLOCK_SIZE(disk), block,
+           VDISK_BLOCK_SIZE(disk));
+    vdisk_checksum_written(disk, block_ref);
+    return (0);
+  }
+
+  // Uncached disk
+  if (disk->cache_size == 0)
+    return (vdisk_device_write(disk, block_ref, block));
+
+  // Whole-block write: no need to read the old contents on a miss
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  if (entry == NULL) {
+    if ((entry = vdisk_cache_claim(disk, block_ref)) == NULL)
+      return (-4);
+  } else {
+    vdisk_lru_remove(disk, entry);
+    vdisk_lru_push(disk, entry);
+  }
+  memcpy(entry->data, block, VDISK_BLOCK_SIZE(disk));
+  entry->valid = 1;
+  entry->dirty = 1;
+  return (0);
+}
+
+/**
+ * Write blocks straight to their home locations, bypassing the journal: they
+ * are copied into the mapping, or written with one pwritev per run of
+ * consecutive blocks, with resident copies refreshed (and made clean)
+ *
+ * @param requests The blocks (sorted here)
+ * @param checksums Checksums of the blocks, by request index; NULL to compute
+ *                  them here
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_write_home(VDISK *disk, VDISK_REQUEST *requests, int n,
+                            const unsigned int *checksums) {
+  // A block repeated within the batch ends up with its last buffer
+  qsort(requests, n, sizeof(VDISK_REQUEST), vdisk_request_compare);
+
+  // Mapped disk: plain copies
+  if (disk->map != NULL) {
+    for (int i = 0; i < n; ++i) {
+      BLOCK_REFERENCE block_ref = requests[i].block_ref;
+      vdisk_io_count(disk, disk->io_stats.device_writes, block_ref, 1);
+      if (checksums != NULL)
+        vdisk_checksum_store(disk, block_ref, checksums[requests[i].index]);
+      else
+        vdisk_checksum_set(disk, block_ref, requests[i].block);
+      memcpy(disk->map + (size_t)block_ref * VDISK_BLOCK_SIZE(disk),
+             requests[i].block, VDISK_BLOCK_SIZE(disk));
+      vdisk_checksum_written(disk, block_ref);
+    }
+    return (0);
+  }
+
+  // Keep resident copies coherent with what is about to hit the file
+  for (int i = 0; i < n; ++i) {
+    VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, requests[i].block_ref);
+    if (entry != NULL && entry->valid) {
+      memcpy(entry->data, requests[i].block, VDISK_BLOCK_SIZE(disk));
+      entry->dirty = 0;
+    }
+  }
+  return (vdisk_device_batch(disk, 1, requests, n, checksums));
+}
+
+/**
+ * Find a block in the cache, loading it from the backing file on a miss
+ *
+ * @param found Set to the entry holding the block
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_cache_read(VDISK *disk, BLOCK_REFERENCE block_ref,
+                            VDISK_CACHE_ENTRY **found) {
+  // Served from memory?
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  if (entry != NULL && entry->valid) {
+    ++disk->stats.hits;
+    vdisk_lru_remove(disk, entry);
+    vdisk_lru_push(disk, entry);
+    *found = entry;
+    return (0);
+  }
+
+  // Miss: load the block into the cache
+  ++disk->stats.misses;
+  if ((entry = vdisk_cache_claim(disk, block_ref)) == NULL)
+    return (-4);
+  int ret = vdisk_device_read(disk, block_ref, entry->data);
+  if (ret != 0) {
+    // Give the entry back as the next victim
+    vdisk_hash_remove(disk, entry);
+    vdisk_lru_remove(disk, entry);
+    entry->lru_prev = disk->lru_tail;
+    disk->lru_tail->lru_next = entry;
+    disk->lru_tail = entry;
+    return (ret);
+  }
+  entry->valid = 1;
+  *found = entry;
+  return (0);
+}
+
+/*
+ * Discarded blocks.
+ *
+ * On a sparse disk a discarded block is punched out of the backing file (a
+ * hole reads as zeros and has no checksum recorded); otherwise it is
+ * overwritten with zeros.  Blocks discarded inside a transaction are only
+ * punched out or zeroed once the transaction has committed and its home
+ * blocks (and the cleared checksums) have been synced: until then a crash
+ * could bring back a file system that still uses them.  Writing a block
+ * again cancels its pending discard.
+ */
+
+/**
+ * Drop a block from the cache without writing it back and clear its
+ * checksum.  The cache entry is the first to be reused.
+ */
+static void vdisk_forget(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (vdisk_checksummed(disk, block_ref) && disk->checksums[block_ref] != 0) {
+    disk->checksums[block_ref] = 0;
+    disk->checksum_verified[block_ref] = 0;
+    disk->checksum_dirty[block_ref /
+                         (VDISK_BLOCK_SIZE(disk) / VDISK_CHECKSUM_SIZE)] = 1;
+  }
+
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  if (entry == NULL)
+    return;
+  vdisk_hash_remove(disk, entry);
+  entry->valid = 0;
+  entry->dirty = 0;
+
+  vdisk_lru_remove(disk, entry);
+  entry->lru_prev = disk->lru_tail;
+  if (disk->lru_tail)
+    disk->lru_tail->lru_next = entry;
+  else
+    disk->lru_head = entry;
+  disk->lru_tail = entry;
+}
+
+/**
+ * Overwrite a run of blocks that are adjacent in one backing file with zeros
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_zero_file(VDISK *disk, int fd, off_t offset,
+                           unsigned int n) {
+  unsigned char *zeros = calloc(1, VDISK_BLOCK_SIZE(disk));
+  if (zeros == NULL)
+    return (-5);
+  int ret = 0;
+  for (unsigned int i = 0; ret == 0 && i < n; ++i) {
+    if (pwrite(fd, zeros, VDISK_BLOCK_SIZE(disk),
+               offset + (off_t)i * VDISK_BLOCK_SIZE(disk)) !=
+        VDISK_BLOCK_SIZE(disk)) {
+      fprintf(stderr, "vdisk_discard_block(): write failed\n");
+      ret = -4;
+    }
+  }
+  free(zeros);
+  return (ret);
+}
+
+/**
+ * Punch a run of blocks that are adjacent in one backing file out of it
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_punch_file(VDISK *disk, int fd, off_t offset,
+                            unsigned int n) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset,
+                (off_t)n * VDISK_BLOCK_SIZE(disk)) == 0)
+    return (0);
+
+  // The host file system cannot punch holes: zero the blocks instead
+  return (vdisk_zero_file(disk, fd, offset, n));
+}
+
+/**
+ * Punch a run of blocks out of the backing files (or zero them, on a disk
+ * that is not sparse)
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_punch(VDISK *disk, BLOCK_REFERENCE first_ref, unsigned int n) {
+  if (debug)
+    fprintf(stderr, "##Punching blocks %d..%d\n", first_ref, first_ref + n - 1);
+
+  // One piece per stretch that is contiguous in a file.  On a disk with
+  // snapshots the blocks are punched out of (new slots in) the top overlay,
+  // leaving the older layers alone
+  int ret = 0;
+  while (ret == 0 && n > 0) {
+    off_t offset;
+    unsigned int piece;
+    int file = vdisk_locate_run(disk, first_ref, n, 1, &offset, &piece);
+    int fd = vdisk_file_fd(disk, file);
+    ret = (disk->superblock.flags & VDISK_SPARSE)
+              ? vdisk_punch_file(disk, fd, offset, piece)
+              : vdisk_zero_file(disk, fd, offset, piece);
+    first_ref += piece;
+    n -= piece;
+  }
+  return (ret);
+}
+
+/**
+ * Order block references
+ */
+static int vdisk_block_compare(const void *a, const void *b) {
+  BLOCK_REFERENCE ra = *(const BLOCK_REFERENCE *)a;
+  BLOCK_REFERENCE rb = *(const BLOCK_REFERENCE *)b;
+  return ((ra > rb) - (ra < rb));
+}
+
+/**
+ * Punch out (or zero) the discards of the committed transaction, one call
+ * per run of consecutive blocks.  They must have been forgotten and synced
+ * already.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_discard_apply(VDISK *disk) {
+  int n = disk->n_discards_committed;
+  if (n == 0)
+    return (0);
+  qsort(disk->discards, n, sizeof(BLOCK_REFERENCE), vdisk_block_compare);
+
+  int ret = 0;
+  for (int i = 0; ret == 0 && i < n;) {
+    BLOCK_REFERENCE first_ref = disk->discards[i];
+    unsigned int run = 0;
+    while (i < n && disk->discards[i] <= first_ref + run) {
+      if (disk->discards[i] == first_ref + run)
+        ++run;
+      ++i;
+    }
+    ret = vdisk_punch(disk, first_ref, run);
+  }
+
+  // Keep the running transaction's discards
+  disk->n_discards -= n;
+  memmove(disk->discards, disk->discards + n,
+          disk->n_discards * sizeof(BLOCK_REFERENCE));
+  disk->n_discards_committed = 0;
+  return (ret);
+}
+
+/**
+ * A block that is being written is in use again: drop any pending discard
+ */
+static void vdisk_discard_cancel(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  for (int i = 0; i < disk->n_discards;) {
+    if (disk->discards[i] != block_ref) {
+      ++i;
+      continue;
+    }
+    // Fill the gap while keeping the committed discards in front
+    if (i < disk->n_discards_committed) {
+      int last_committed = --disk->n_discards_committed;
+      disk->discards[i] = disk->discards[last_committed];
+      disk->discards[last_committed] = disk->discards[--disk->n_discards];
+    } else {
+      disk->discards[i] = disk->discards[--disk->n_discards];
+    }
+  }
+}
+
+/**
+ * Drop the state the file system keeps for a disk
+ */
+static void vdisk_fs_release(VDISK *disk) {
+  if (disk->fs != NULL && disk->fs_release != NULL)
+    disk->fs_release(disk->fs);
+  disk->fs = NULL;
+}
+
+/*
+ * Metadata journal.
+ *
+ * The journal region starts with the descriptor (the magic number, the
+ * transaction's sequence number, the number of blocks, a checksum and, per
+ * block, its home block reference and the checksum of its image), as many
+ * blocks of it as it takes to list a full journal, followed by one image per
+ * block.  In memory the running transaction is kept in exactly that layout,
+ * so a commit is a single write of the whole transaction followed by one
+ * fdatasync().  The descriptor checksum covers the descriptor; each image is
+ * covered by its own.  A transaction that was only partly written is ignored
+ * by recovery.  The image checksums are the block checksums of the home
+ * blocks, so installing a transaction does not compute them again.
+ *
+ * An operation is never split over two transactions.  The file system
+ * reserves room for the blocks an operation may write before it writes any
+ * (vdisk_journal_reserve_at()); an operation that writes more than fits
+ * anyway is dropped as a whole when it ends.
+ *
+ * Only metadata is journaled.  File contents (vdisk_write_data_blocks())
+ * go straight home, and they are synced before the commit record of the
+ * transaction that makes them part of a file is written.
+ *
+ * The journal holds one transaction at a time.  Before a new transaction
+ * overwrites it, the home blocks of the previous one are written back and
+ * synced; vdisk_flush() does the same and then marks the journal empty.
+ * That is the transaction's checkpoint: only then may the file system hand
+ * out the blocks it freed again.
+ */
+typedef struct vdisk_journal_entry_s {
+  BLOCK_REFERENCE block_ref;
+  unsigned int checksum;
+} VDISK_JOURNAL_ENTRY;
+
+typedef struct vdisk_journal_descriptor_s {
+  unsigned int magic;
+  unsigned int n_blocks;
+  unsigned long sequence;
+  unsigned int checksum;
+  VDISK_JOURNAL_ENTRY entries[];
+} VDISK_JOURNAL_DESCRIPTOR;
+
+/**
+ * @return The descriptor of the running transaction
+ */
+static VDISK_JOURNAL_DESCRIPTOR *vdisk_journal_descriptor(VDISK *disk) {
+  return ((VDISK_JOURNAL_DESCRIPTOR *)disk->journal);
+}
+
+/**
+ * @return The image of the i-th block of the running transaction
+ */
+static unsigned char *vdisk_journal_image(VDISK *disk, int i) {
+  return (disk->journal + (size_t)(disk->journal_descriptor_blocks + i) *
+                             VDISK_BLOCK_SIZE(disk));
+}
+
+/**
+ * Find a block in the running transaction
+ *
+ * @return Its position in the transaction; -1 if it is not part of it
+ */
+static int vdisk_journal_find(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (disk->journal == NULL)
+    return (-1);
+
+  VDISK_JOURNAL_DESCRIPTOR *descriptor = vdisk_journal_descriptor(disk);
+  for (int i = descriptor->n_blocks - 1; i >= 0; --i) {
+    if (descriptor->entries[i].block_ref == block_ref)
+      return (i);
+  }
+  return (-1);
+}
+
+/**
+ * Is a transaction running (an operation in progress or a group waiting to
+ * be committed)?  Writes are then captured by the journal.
+ */
+static int vdisk_journal_running(VDISK *disk) {
+  return (disk->journal != NULL &&
+          (disk->journal_depth > 0 ||
+           vdisk_journal_descriptor(disk)->n_blocks > 0));
+}
+
+/**
+ * @return Length in bytes of a transaction of n_blocks blocks, descriptor
+ *         included
+ */
+static size_t vdisk_journal_length(VDISK *disk, unsigned int n_blocks) {
+  return ((size_t)(disk->journal_descriptor_blocks + n_blocks) *
+          VDISK_BLOCK_SIZE(disk));
+}
+
+/**
+ * Checksum (CRC-32C) of the descriptor of the transaction held in the
+ * journal buffer.  The checksum field must be 0.
+ */
+static unsigned int vdisk_journal_checksum(VDISK *disk) {
+  return (crc32c(0, disk->journal, vdisk_journal_length(disk, 0)));
+}
+
+/**
+ * Mark the on-disk journal as holding no transaction
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_journal_clear(VDISK *disk) {
+  VDISK_JOURNAL_DESCRIPTOR *descriptor = calloc(1, VDISK_BLOCK_SIZE(disk));
+  if (descriptor == NULL)
+    return (-5);
+  descriptor->magic = VDISK_JOURNAL_MAGIC;
+  descriptor->sequence = disk->journal_sequence;
+  int ret = 0;
+  if (vdisk_file_io(disk, 1, descriptor, VDISK_BLOCK_SIZE(disk),
+                    (off_t)disk->superblock.journal_start *
+                        VDISK_BLOCK_SIZE(disk)) != VDISK_BLOCK_SIZE(disk)) {
+    fprintf(stderr, "vdisk_flush(): journal write failed\n");
+    ret = -4;
+  }
+  free(descriptor);
+  return (ret);
+}
+
+/**
+ * Make the home blocks of the last committed transaction, and the file
+ * contents written since, durable
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_journal_settle(VDISK *disk) {
+  for (int i = 0; i < disk->n_discards_committed; ++i)
+    vdisk_forget(disk, disk->discards[i]);
+
+  int ret = vdisk_cache_writeback(disk);
+  if (ret == 0)
+    ret = vdisk_checksum_flush(disk);
+  if (ret != 0)
+    return (ret);
+  if (vdisk_file_sync(disk) != 0) {
+    fprintf(stderr, "vdisk_flush(): sync failed\n");
+    return (-4);
+  }
+  disk->journal_home_pending = 0;
+  disk->journal_data_pending = 0;
+  disk->journal_checkpoint = disk->journal_sequence;
+
+  // The blocks the transaction freed can go now
+  return (vdisk_discard_apply(disk));
+}
+
+/**
+ * Replay a transaction that was committed but may not have reached its home
+ * blocks (the disk was not flushed before the process ended)
+ */
+static void vdisk_journal_recover(VDISK *disk) {
+  VDISK_JOURNAL_DESCRIPTOR *descriptor = vdisk_journal_descriptor(disk);
+  off_t start = (off_t)disk->superblock.journal_start * VDISK_BLOCK_SIZE(disk);
+
+  int valid = 0;
+  if (vdisk_file_io(disk, 0, disk->journal, VDISK_BLOCK_SIZE(disk), start) ==
+      VDISK_BLOCK_SIZE(disk) &&
+      descriptor->magic == VDISK_JOURNAL_MAGIC) {
+    disk->journal_sequence = descriptor->sequence;
+    unsigned int n_blocks = descriptor->n_blocks;
+    ssize_t length = vdisk_journal_length(disk, n_blocks);
+    if (n_blocks > 0 && n_blocks <= (unsigned int)disk->journal_capacity &&
+        vdisk_file_io(disk, 0, disk->journal, length, start) == length) {
+      unsigned int checksum = descriptor->checksum;
+      descriptor->checksum = 0;
+      valid = (vdisk_journal_checksum(disk) == checksum);
+      for (unsigned int i = 0; valid && i < n_blocks; ++i)
+        valid = (crc32c(0, vdisk_journal_image(disk, i),
+                        VDISK_BLOCK_SIZE(disk)) ==
+                 descriptor->entries[i].checksum);
+    }
+  }
+
+  if (valid) {
+    for (unsigned int i = 0; i < descriptor->n_blocks; ++i) {
+      BLOCK_REFERENCE block_ref = descriptor->entries[i].block_ref;
+      if (block_ref >= VDISK_N_BLOCKS(disk) ||
+          vdisk_checksum_area_block(disk, block_ref) != NULL ||
+          vdisk_file_io(disk, 1, vdisk_journal_image(disk, i),
+                        VDISK_BLOCK_SIZE(disk),
+                        (off_t)block_ref * VDISK_BLOCK_SIZE(disk)) !=
+              VDISK_BLOCK_SIZE(disk)) {
+        fprintf(stderr, "vdisk: journal replay failed\n");
+        valid = 0;
+        break;
+      }
+      vdisk_checksum_store(disk, block_ref, descriptor->entries[i].checksum);
+    }
+    if (valid) {
+      fprintf(stderr, "vdisk: replayed journal transaction %lu (%u blocks)\n",
+              descriptor->sequence, descriptor->n_blocks);
+      if (vdisk_checksum_flush(disk) == 0 && vdisk_file_sync(disk) == 0)
+        vdisk_journal_clear(disk);
+    }
+  }
+
+  // Start with an empty transaction; everything before it is at home
+  memset(disk->journal, 0, VDISK_BLOCK_SIZE(disk));
+  disk->journal_checkpoint = disk->journal_sequence;
+}
+
+/**
+ * Set up the journal of a freshly opened disk and recover it
+ */
+static void vdisk_journal_init(VDISK *disk) {
+  VDISK_SUPERBLOCK *superblock = &disk->superblock;
+  if (superblock->n_journal_blocks < 2 || superblock->journal_start == 0 ||
+      (unsigned long)superblock->journal_start + superblock->n_journal_blocks >
+          superblock->n_blocks)
+    return;
+
+  // The descriptor takes as many blocks as it needs to list the images
+  // that fit in the rest
+  int n_descriptor = 1;
+  while (sizeof(VDISK_JOURNAL_DESCRIPTOR) +
+             (size_t)(superblock->n_journal_blocks - n_descriptor) *
+                 sizeof(VDISK_JOURNAL_ENTRY) >
+         (size_t)n_descriptor * VDISK_BLOCK_SIZE(disk))
+    ++n_descriptor;
+  int capacity = superblock->n_journal_blocks - n_descriptor;
+
+  disk->journal = calloc(n_descriptor + capacity, VDISK_BLOCK_SIZE(disk));
+  if (disk->journal == NULL) {
+    fprintf(stderr, "vdisk: unable to allocate journal; running without it\n");
+    return;
+  }
+  disk->journal_descriptor_blocks = n_descriptor;
+  disk->journal_capacity = capacity;
+
+  int group = vdisk_journal_group_requested;
+  if (group < 0) {
+    char *str = getenv("ZJOURNAL_GROUP");
+    group = (str == NULL) ? VDISK_JOURNAL_DEFAULT_GROUP : atoi(str);
+  }
+  disk->journal_group = (group > 0) ? group : 1;
+
+  vdisk_journal_recover(disk);
+}
+
+/**
+ * Add a block to the running transaction (or update its image)
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_journal_capture(VDISK *disk, BLOCK_REFERENCE block_ref,
+                                 void *block) {
+  VDISK_JOURNAL_DESCRIPTOR *descriptor = vdisk_journal_descriptor(disk);
+  if (disk->journal_aborted)
+    return (VDISK_JOURNAL_FULL);
+  int i = vdisk_journal_find(disk, block_ref);
+  if (i < 0 && descriptor->n_blocks == (unsigned int)disk->journal_capacity) {
+    // Outside of an operation the waiting group can simply be committed.
+    // An operation that wrote more than it reserved cannot be committed in
+    // part: it is dropped when it ends
+    int ret = (disk->journal_depth == 0) ? vdisk_journal_commit_at(disk)
+                                         : VDISK_JOURNAL_FULL;
+    if (ret != 0) {
+      fprintf(stderr, "vdisk: operation does not fit in the journal\n");
+      disk->journal_aborted = (disk->journal_depth > 0);
+      return (ret);
+    }
+  }
+  if (i < 0) {
+    i = descriptor->n_blocks++;
+    descriptor->entries[i].block_ref = block_ref;
+  }
+  memcpy(vdisk_journal_image(disk, i), block, VDISK_BLOCK_SIZE(disk));
+  return (0);
+}
+
+/**
+ * Commit the running transaction: sync the file contents written for it, log
+ * it, sync, then install its blocks at their home locations in one batch
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_commit_at(VDISK *disk) {
+  if (disk->journal == NULL)
+    return (0);
+  VDISK_JOURNAL_DESCRIPTOR *descriptor = vdisk_journal_descriptor(disk);
+  disk->journal_ops = 0;
+  if (descriptor->n_blocks == 0)
+    return (0);
+
+  // The journal is about to be overwritten: the previous transaction must be
+  // safely at home first, as must the file contents the new one refers to
+  int ret;
+  if ((disk->journal_home_pending || disk->journal_data_pending) &&
+      (ret = vdisk_journal_settle(disk)) != 0)
+    return (ret);
+
+  // Each image is checksummed once, here: recovery checks it and installing
+  // the image records it as the checksum of the home block
+  for (unsigned int i = 0; i < descriptor->n_blocks; ++i)
+    descriptor->entries[i].checksum =
+        crc32c(0, vdisk_journal_image(disk, i), VDISK_BLOCK_SIZE(disk));
+  descriptor->magic = VDISK_JOURNAL_MAGIC;
+  descriptor->sequence = ++disk->journal_sequence;
+  descriptor->checksum = 0;
+  descriptor->checksum = vdisk_journal_checksum(disk);
+  ssize_t length = vdisk_journal_length(disk, descriptor->n_blocks);
+  if (vdisk_file_io(disk, 1, disk->journal, length,
+                    (off_t)disk->superblock.journal_start *
+                        VDISK_BLOCK_SIZE(disk)) != length ||
+      vdisk_file_sync(disk) != 0) {
+    fprintf(stderr, "vdisk_journal_commit(): journal write failed\n");
+    return (-4);
+  }
+
+  // Committed: the home writes may now happen in any order
+  int n_blocks = descriptor->n_blocks;
+  VDISK_REQUEST *requests = malloc(n_blocks * sizeof(VDISK_REQUEST));
+  unsigned int *checksums = malloc(n_blocks * sizeof(unsigned int));
+  if (requests == NULL || checksums == NULL) {
+    free(requests);
+    free(checksums);
+    return (-5);
+  }
+  for (int i = 0; i < n_blocks; ++i) {
+    requests[i].block_ref = descriptor->entries[i].block_ref;
+    requests[i].index = i;
+    requests[i].block = vdisk_journal_image(disk, i);
+    checksums[i] = descriptor->entries[i].checksum;
+  }
+  descriptor->n_blocks = 0;
+  disk->journal_op_start = 0;
+  disk->journal_home_pending = 1;
+  ret = vdisk_write_home(disk, requests, n_blocks, checksums);
+  free(requests);
+  free(checksums);
+  if (ret != 0)
+    return (ret);
+
+  // Its discards wait for the home blocks to be synced
+  disk->n_discards_committed = disk->n_discards;
+  return (0);
+}
+
+/**
+ * Start an operation.  Until the matching vdisk_journal_end(), every block
+ * written to the disk belongs to the running transaction.  Operations nest.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_begin_at(VDISK *disk) {
+  if (disk->journal != NULL && disk->journal_depth++ == 0)
+    disk->journal_op_start = vdisk_journal_descriptor(disk)->n_blocks;
+  return (0);
+}
+
+/**
+ * Make sure that the running transaction has room for n_blocks more blocks,
+ * so that the operation in progress can give up before it writes anything
+ * rather than overflow the journal.  If the operation has not written
+ * anything yet, the operations grouped ahead of it are committed to make
+ * room.
+ *
+ * @return 0 on success; VDISK_JOURNAL_FULL if the blocks cannot fit; <0 if
+ *         a commit failed
+ */
+int vdisk_journal_reserve_at(VDISK *disk, int n_blocks) {
+  if (disk->journal == NULL)
+    return (0);
+  unsigned int n_held = vdisk_journal_descriptor(disk)->n_blocks;
+  if (n_held + n_blocks <= (unsigned int)disk->journal_capacity)
+    return (0);
+  if (n_held == (unsigned int)disk->journal_op_start &&
+      n_blocks <= disk->journal_capacity)
+    return (vdisk_journal_commit_at(disk));
+  fprintf(stderr, "vdisk: operation does not fit in the journal\n");
+  return (VDISK_JOURNAL_FULL);
+}
+
+/**
+ * Drop the running transaction after an operation overflowed it.  The
+ * blocks it holds and the discards it made are forgotten, and so is the
+ * state of the file system, which reloads what was last committed.
+ *
+ * @return VDISK_JOURNAL_FULL
+ */
+static int vdisk_journal_abort(VDISK *disk) {
+  vdisk_journal_descriptor(disk)->n_blocks = 0;
+  disk->journal_op_start = 0;
+  disk->journal_ops = 0;
+  disk->journal_aborted = 0;
+  disk->n_discards = disk->n_discards_committed;
+  vdisk_fs_release(disk);
+  return (VDISK_JOURNAL_FULL);
+}
+
+/**
+ * Finish an operation.  The transaction is committed once it holds
+ * journal_group operations.
+ *
+ * @return 0 on success; VDISK_JOURNAL_FULL if the operation did not fit and
+ *         was dropped; <0 if the commit failed
+ */
+int vdisk_journal_end_at(VDISK *disk) {
+  if (disk->journal == NULL || disk->journal_depth == 0)
+    return (0);
+  if (--disk->journal_depth > 0)
+    return (0);
+  if (disk->journal_aborted)
+    return (vdisk_journal_abort(disk));
+
+  ++disk->journal_ops;
+  if (disk->journal_ops >= disk->journal_group)
+    return (vdisk_journal_commit_at(disk));
+  return (0);
+}
+
+/**
+ * Set the number of operations that share one journal commit on
+ * subsequently opened disks.  Overrides the ZJOURNAL_GROUP environment
+ * variable.
+ */
+void vdisk_journal_set_group(int n_operations) {
+  vdisk_journal_group_requested = n_operations;
+}
+
+/**
+ * Size of a journal that holds transactions of up to n_blocks blocks
+ *
+ * @return Number of journal blocks, the descriptor included
+ */
+unsigned int vdisk_journal_blocks(unsigned int block_size,
+                                  unsigned int n_blocks) {
+  size_t descriptor = sizeof(VDISK_JOURNAL_DESCRIPTOR) +
+                      (size_t)n_blocks * sizeof(VDISK_JOURNAL_ENTRY);
+  return (n_blocks + (descriptor + block_size - 1) / block_size);
+}
+
+/**
+ * @return Sequence number of the running transaction; 0 if no transaction is
+ *         running (or the disk has no journal)
+ */
+unsigned long vdisk_journal_sequence_at(VDISK *disk) {
+  return (vdisk_journal_running(disk) ? disk->journal_sequence + 1 : 0);
+}
+
+/**
+ * Has a transaction reached its checkpoint (its home blocks, and the
+ * discards it made, are durable)?
+ *
+ * @param sequence Sequence number of the transaction
+ * @return 1 if so (always, on a disk without a journal); 0 if not
+ */
+int vdisk_journal_settled_at(VDISK *disk, unsigned long sequence) {
+  return (disk->journal == NULL || disk->journal_checkpoint >= sequence);
+}
+
+/**
+ * Write every block held in memory to the virtual disk (see vdisk_flush())
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_flush_blocks(VDISK *disk) {
+  int ret;
+  if (disk->journal_depth == 0 && (ret = vdisk_journal_commit_at(disk)) != 0)
+    return (ret);
+
+  if (disk->journal_home_pending) {
+    if ((ret = vdisk_journal_settle(disk)) != 0)
+      return (ret);
+    return (vdisk_journal_clear(disk));
+  }
+
+  if (disk->map != NULL) {
+    if ((ret = vdisk_checksum_flush(disk)) != 0)
+      return (ret);
+    unsigned long start = vdisk_clock();
+    ret = msync(disk->map, disk->map_size, MS_SYNC);
+    ++disk->io_stats.syncs;
+    vdisk_io_time(disk->io_stats.sync_latency, start);
+    if (ret != 0) {
+      fprintf(stderr, "vdisk_flush(): msync failed\n");
+      return (-4);
+    }
+    return (0);
+  }
+  if ((ret = vdisk_cache_writeback(disk)) != 0)
+    return (ret);
+  return (vdisk_checksum_flush(disk));
+}
+
+/**
+ * Write everything to the virtual disk: commit the running transaction
+ * (unless an operation is still in progress) and write every dirty cached
+ * block back.  Blocks remain resident (and clean) afterwards.  With a
+ * journal, the blocks are also synced and the journal is emptied.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_flush_at(VDISK *disk) {
+  int ret = vdisk_flush_blocks(disk);
+  if (ret == 0)
+    ret = vdisk_snap_flush(disk->snap);
+  return (ret);
+}
+
+/**
+ * Report the I/O counters of a disk
+ *
+ * @param stats Structure to be filled in
+ */
+void vdisk_io_stats_at(VDISK *disk, VDISK_IO_STATS *stats) {
+  *stats = disk->io_stats;
+}
+
+/**
+ * Tell the I/O counters what a block holds.  The file system marks its
+ * directory blocks; the other types follow from the layout of the disk.
+ * Discarding a block clears its mark.
+ *
+ * @param type VDISK_BLOCK_DIRECTORY or VDISK_BLOCK_DATA
+ */
+void vdisk_block_type_set_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                             int type) {
+  if (block_ref >= VDISK_N_BLOCKS(disk))
+    return;
+  if (type == VDISK_BLOCK_DIRECTORY) {
+    if (disk->directory_blocks == NULL)
+      disk->directory_blocks = calloc((size_t)VDISK_N_BLOCKS(disk) / 8 + 1, 1);
+    if (disk->directory_blocks != NULL)
+      disk->directory_blocks[block_ref / 8] |= 1 << (block_ref % 8);
+  } else if (disk->directory_blocks != NULL) {
+    disk->directory_blocks[block_ref / 8] &= ~(1 << (block_ref % 8));
+  }
+}
+
+/**
+ * Name of the file accumulating the I/O counters of a disk (<disk>.iostats,
+ * next to the first file of a striped disk)
+ *
+ * @return 0 on success; <0 if the name is too long
+ */
+static int vdisk_io_stats_file_name(char *path, char *disk_name) {
+  size_t length = strcspn(disk_name, ",");
+  if (length + sizeof(".iostats") > PATH_MAX)
+    return (-1);
+  memcpy(path, disk_name, length);
+  strcpy(path + length, ".iostats");
+  return (0);
+}
+
+/**
+ * Read the counters kept in a record file: every counter of a VDISK_IO_STATS
+ * in order, separated by white space.  An empty or damaged record counts as
+ * all zeros.
+ */
+static void vdisk_io_stats_load(FILE *file, VDISK_IO_STATS *stats) {
+  unsigned long *counters = (unsigned long *)stats;
+  for (size_t i = 0; i < VDISK_IO_COUNTERS; ++i) {
+    if (fscanf(file, "%lu", &counters[i]) != 1) {
+      memset(stats, 0, sizeof(VDISK_IO_STATS));
+      return;
+    }
+  }
+}
+
+/**
+ * Add the counters of a disk to its record.  The record is locked while it
+ * is updated so that tools finishing together do not lose each other's
+ * counts.
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_io_stats_record(VDISK *disk) {
+  char path[PATH_MAX];
+  if (vdisk_io_stats_file_name(path, disk->name) != 0)
+    return (-1);
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0)
+    return (-1);
+  FILE *file = fdopen(fd, "r+");
+  if (file == NULL) {
+    close(fd);
+    return (-1);
+  }
+  flock(fd, LOCK_EX);
+
+  VDISK_IO_STATS total;
+  vdisk_io_stats_load(file, &total);
+  unsigned long *counters = (unsigned long *)&total;
+  unsigned long *added = (unsigned long *)&disk->io_stats;
+  for (size_t i = 0; i < VDISK_IO_COUNTERS; ++i)
+    counters[i] += added[i];
+
+  rewind(file);
+  for (size_t i = 0; i < VDISK_IO_COUNTERS; ++i)
+    fprintf(file, "%lu%c", counters[i],
+            ((i + 1) % 8 && i + 1 < VDISK_IO_COUNTERS) ? ' ' : '\n');
+  int ret = (fflush(file) == 0 && ftruncate(fd, ftell(file)) == 0) ? 0 : -1;
+  if (fclose(file) != 0)
+    ret = -1;
+  return (ret);
+}
+
+/**
+ * Report the I/O counters accumulated in the record of a disk (all zeros if
+ * there is none).  Every process that used the disk with ZSTATS set has
+ * added its counters to the record; formatting the disk starts a new one.
+ *
+ * @param stats Structure to be filled in
+ * @return 0 on success; <0 on error
+ */
+int vdisk_io_stats_recorded_at(VDISK *disk, VDISK_IO_STATS *stats) {
+  memset(stats, 0, sizeof(VDISK_IO_STATS));
+  char path[PATH_MAX];
+  if (vdisk_io_stats_file_name(path, disk->name) != 0)
+    return (-1);
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return (errno == ENOENT ? 0 : -1);
+  flock(fileno(file), LOCK_SH);
+  vdisk_io_stats_load(file, stats);
+  fclose(file);
+  return (0);
+}
+
+/**
+ * Print a latency histogram: the lower bound in ns and the count of every
+ * bucket that is not empty
+ */
+static void vdisk_histogram_print(FILE *stream, char *name,
+                                  unsigned long *histogram, int json) {
+  fprintf(stream, json ? "  \"%s_ns\": {" : "%s latency (ns):", name);
+  int first = 1;
+  for (int i = 0; i < VDISK_LATENCY_BUCKETS; ++i) {
+    if (histogram[i] == 0)
+      continue;
+    if (json)
+      fprintf(stream, "%s\"%lu\": %lu", first ? "" : ", ", 1UL << i,
+              histogram[i]);
+    else
+      fprintf(stream, " %lu+:%lu", 1UL << i, histogram[i]);
+    first = 0;
+  }
+  fprintf(stream, json ? "}" : "\n");
+}
+
+/**
+ * Print I/O counters, as a table or as a JSON object
+ *
+ * @param stream Where to print them
+ * @param json 1 for JSON; 0 for text
+ */
+void vdisk_io_stats_print(FILE *stream, VDISK_IO_STATS *stats, int json) {
+  unsigned long *counts[4] = {stats->reads, stats->writes,
+                              stats->device_reads, stats->device_writes};
+  char *names[4] = {"reads", "writes", "device_reads", "device_writes"};
+  unsigned long *histograms[3] = {stats->read_latency, stats->write_latency,
+                                  stats->sync_latency};
+  char *histogram_names[3] = {"read_latency", "write_latency",
+                              "sync_latency"};
+
+  if (json) {
+    fprintf(stream, "{\n");
+    for (int k = 0; k < 4; ++k) {
+      fprintf(stream, "  \"%s\": {", names[k]);
+      for (int t = 0; t < VDISK_N_BLOCK_TYPES; ++t)
+        fprintf(stream, "%s\"%s\": %lu", t ? ", " : "",
+                vdisk_block_type_names[t], counts[k][t]);
+      fprintf(stream, "},\n");
+    }
+    fprintf(stream, "  \"syncs\": %lu,\n", stats->syncs);
+    for (int k = 0; k < 3; ++k) {
+      vdisk_histogram_print(stream, histogram_names[k], histograms[k], 1);
+      fprintf(stream, k < 2 ? ",\n" : "\n");
+    }
+    fprintf(stream, "}\n");
+    return;
+  }
+
+  fprintf(stream, "%-10s %10s %10s %13s %13s\n", "blocks", "reads", "writes",
+          "device reads", "device writes");
+  unsigned long total[4] = {0, 0, 0, 0};
+  for (int t = 0; t < VDISK_N_BLOCK_TYPES; ++t) {
+    fprintf(stream, "%-10s %10lu %10lu %13lu %13lu\n",
+            vdisk_block_type_names[t], counts[0][t], counts[1][t],
+            counts[2][t], counts[3][t]);
+    for (int k = 0; k < 4; ++k)
+      total[k] += counts[k][t];
+  }
+  fprintf(stream, "%-10s %10lu %10lu %13lu %13lu\n", "total", total[0],
+          total[1], total[2], total[3]);
+  fprintf(stream, "syncs: %lu\n", stats->syncs);
+  char *labels[3] = {"read", "write", "sync"};
+  for (int k = 0; k < 3; ++k)
+    vdisk_histogram_print(stream, labels[k], histograms[k], 0);
+}
+
+/**
+ * ZSTATS: print the I/O counters of a disk on stderr and add them to its
+ * record
+ */
+static void vdisk_io_stats_report(VDISK *disk) {
+  if (getenv("ZSTATS") == NULL)
+    return;
+  fprintf(stderr, "vdisk I/O statistics (%s):\n", disk->name);
+  vdisk_io_stats_print(stderr, &disk->io_stats, 0);
+  if (vdisk_io_stats_record(disk) != 0)
+    fprintf(stderr, "vdisk: unable to record I/O statistics\n");
+}
+
+/**
+ * Flush every open disk at process exit so that tools that return without
+ * closing the disk do not lose cached writes
+ */
+static void vdisk_flush_at_exit() {
+  pthread_mutex_lock(&vdisk_open_lock);
+  for (VDISK *disk = vdisk_open_disks; disk != NULL; disk = disk->next_open) {
+    vdisk_flush_at(disk);
+    vdisk_io_stats_report(disk);
+  }
+  pthread_mutex_unlock(&vdisk_open_lock);
+}
+
+/**
+ * Set the number of blocks held by the cache of subsequently opened disks.
+ * 0 disables caching.  Overrides the ZCACHE environment variable.
+ */
+void vdisk_cache_set_size(int n_blocks) { vdisk_cache_requested = n_blocks; }
+
+/**
+ * Report cache hit/miss counters for a disk
+ *
+ * @param stats Structure to be filled in
+ */
+void vdisk_cache_stats_at(VDISK *disk, VDISK_CACHE_STATS *stats) {
+  *stats = disk->stats;
+}
+
+/**
+ * Is a block currently held in the cache?
+ *
+ * @return 1 if resident; 0 otherwise
+ */
+int vdisk_cache_resident_at(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  return (entry != NULL && entry->valid);
+}
+
+/**
+ * Select the backend used for subsequently opened disks.  Overrides the
+ * ZDISK_BACKEND environment variable ("pread" or "mmap").
+ *
+ * @param backend VDISK_BACKEND_PREAD or VDISK_BACKEND_MMAP
+ */
+void vdisk_backend_select(int backend) { vdisk_backend_requested = backend; }
+
+/**
+ * Map the whole virtual disk into memory, growing the file to the full disk
+ * size first if necessary
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_map_disk(VDISK *disk) {
+  size_t size = (size_t)VDISK_N_BLOCKS(disk) * VDISK_BLOCK_SIZE(disk);
+  struct stat st;
+
+
+  if (fstat(disk->fd, &st) != 0)
+    return (-1);
+  if ((size_t)st.st_size < size && ftruncate(disk->fd, size) != 0)
+    return (-1);
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+  if (map == MAP_FAILED)
+    return (-1);
+
+  disk->map = map;
+  disk->map_size = size;
+  return (0);
+}
+
+/**
+ * Zero-copy access to a block.
+ *
+ * With the mmap backend the pointer refers to the mapped file; otherwise it
+ * refers to the cached copy of the block.  Either way it must be treated as
+ * read-only and is only valid until the next vdisk call.
+ *
+ * @param block_ref Index of the block
+ * @return Pointer to the block contents, or NULL if the block cannot be
+ *         accessed in place (uncached disk or error)
+ */
+const void *vdisk_block_ptr_at(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (block_ref >= VDISK_N_BLOCKS(disk))
+    return (NULL);
+  vdisk_io_count(disk, disk->io_stats.reads, block_ref, 1);
+
+  int i = vdisk_journal_find(disk, block_ref);
+  if (i >= 0)
+    return (vdisk_journal_image(disk, i));
+  const void *area = vdisk_checksum_area_block(disk, block_ref);
+  if (area != NULL)
+    return (area);
+
+  if (disk->map != NULL) {
+    ++disk->stats.hits;
+    vdisk_io_count(disk, disk->io_stats.device_reads, block_ref, 1);
+    unsigned char *mapped = disk->map + (size_t)block_ref *
+        VDISK_BLOCK_SIZE(disk);
+    if (vdisk_checksum_verify_once(disk, block_ref, mapped) != 0)
+      return (NULL);
+    return (mapped);
+  }
+  if (disk->cache_size == 0)
+    return (NULL);
+
+  // Make the block resident, then hand out the cached copy
+  VDISK_CACHE_ENTRY *entry;
+  if (vdisk_cache_read(disk, block_ref, &entry) != 0)
+    return (NULL);
+  return (entry->data);
+}
+
+/**
+ * @return The backend in use for the open disk (VDISK_BACKEND_*)
+ */
+int vdisk_backend_active_at(VDISK *disk) {
+  if (disk->map != NULL)
+    return (VDISK_BACKEND_MMAP);
+  if (disk->ring != NULL)
+    return (VDISK_BACKEND_URING);
+  return (VDISK_BACKEND_PREAD);
+}
+
+/**
+ * Set the io_uring submission queue depth for subsequently opened disks.
+ * Overrides the ZDISK_QUEUE_DEPTH environment variable.
+ */
+void vdisk_queue_depth_set(int depth) { vdisk_queue_depth_requested = depth; }
+
+/**
+ * Is a superblock's geometry usable?
+ *
+ * @return 1 if valid; 0 otherwise
+ */
+static int vdisk_geometry_valid(VDISK_SUPERBLOCK *superblock) {
+  unsigned int size = superblock->block_size;
+  return (size >= VDISK_MIN_BLOCK_SIZE && size <= VDISK_MAX_BLOCK_SIZE &&
+          (size & (size - 1)) == 0 && superblock->n_blocks > 0 &&
+          superblock->n_blocks < (BLOCK_REFERENCE)-1 &&
+          superblock->n_stripes <= VDISK_MAX_STRIPES &&
+          (superblock->n_stripes <= 1 || superblock->stripe_unit > 0));
+}
+
+/**
+ * Open the backing files of a disk
+ *
+ * @param virtual_disk_name File name, or a comma-separated list of file names
+ *                          for a striped disk
+ * @param flags Flags for open()
+ * @param fds Set to the descriptors (VDISK_MAX_STRIPES entries)
+ * @return Number of files opened; <0 on error
+ */
+static int vdisk_open_files(char *virtual_disk_name, int flags, int *fds) {
+  char names[strlen(virtual_disk_name) + 1];
+  strcpy(names, virtual_disk_name);
+
+  int n = 0;
+  char *save;
+  for (char *name = strtok_r(names, ",", &save); name != NULL;
+       name = strtok_r(NULL, ",", &save)) {
+    int fd = -1;
+    if (n < VDISK_MAX_STRIPES)
+      fd = open(name, flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+      if (n == VDISK_MAX_STRIPES)
+        fprintf(stderr, "vdisk: at most %d files per disk\n",
+                VDISK_MAX_STRIPES);
+      while (n > 0)
+        close(fds[--n]);
+      return (-1);
+    }
+    fds[n++] = fd;
+  }
+  return (n > 0 ? n : -1);
+}
+
+/**
+ * Set up the backend and the cache for freshly opened disk files.  The
+ * superblock must already be in place.
+ *
+ * @param fds Descriptors of the backing files, in stripe order
+ * @param n_files Number of backing files
+ */
+static void vdisk_disk_attach(VDISK *disk, int *fds, int n_files,
+                              char *virtual_disk_name) {
+  static int exit_hook = 0;
+
+  disk->name = strdup(virtual_disk_name);
+  disk->fd = fds[0];
+  if (n_files > 1) {
+    // One worker per file besides the caller's
+    disk->stripe_fds = malloc(n_files * sizeof(int));
+    memcpy(disk->stripe_fds, fds, n_files * sizeof(int));
+    disk->pool = vdisk_pool_open(n_files - 1);
+  }
+
+  // Pick the backend
+  int backend = vdisk_backend_requested;
+  if (backend < 0) {
+    char *str = getenv("ZDISK_BACKEND");
+    if (str != NULL && strcmp(str, "mmap") == 0)
+      backend = VDISK_BACKEND_MMAP;
+    else if (str != NULL && strcmp(str, "uring") == 0)
+      backend = VDISK_BACKEND_URING;
+    else
+      backend = VDISK_BACKEND_PREAD;
+  }
+  if (backend == VDISK_BACKEND_MMAP &&
+      (disk->stripe_fds != NULL || disk->snap != NULL)) {
+    fprintf(stderr, "vdisk: striped disks and disks with snapshots cannot be "
+                    "mapped; using pread backend\n");
+    backend = VDISK_BACKEND_PREAD;
+  } else if (backend == VDISK_BACKEND_MMAP && vdisk_map_disk(disk) != 0) {
+    fprintf(stderr, "vdisk: unable to map %s; using pread backend\n",
+            virtual_disk_name);
+    backend = VDISK_BACKEND_PREAD;
+  }
+
+  if (backend == VDISK_BACKEND_URING) {
+    int depth = vdisk_queue_depth_requested;
+    if (depth <= 0) {
+      char *str = getenv("ZDISK_QUEUE_DEPTH");
+      depth = (str == NULL) ? VDISK_DEFAULT_QUEUE_DEPTH : atoi(str);
+    }
+    if (depth > 0)
+      disk->ring = vdisk_uring_open(depth);
+    if (disk->ring == NULL) {
+      if (debug)
+        fprintf(stderr, "vdisk: io_uring unavailable; using pread backend\n");
+      backend = VDISK_BACKEND_PREAD;
+    }
+  }
+
+  // Set up the block cache (the mapping already lives in memory)
+  if (backend != VDISK_BACKEND_MMAP)
+    vdisk_cache_init(disk);
+  vdisk_checksum_init(disk);
+
+  // Finish any transaction interrupted by a crash
+  vdisk_journal_init(disk);
+
+  // Make sure the disk gets flushed at exit
+  pthread_mutex_lock(&vdisk_open_lock);
+  disk->next_open = vdisk_open_disks;
+  vdisk_open_disks = disk;
+  if (!exit_hook) {
+    atexit(vdisk_flush_at_exit);
+    exit_hook = 1;
+  }
+  pthread_mutex_unlock(&vdisk_open_lock);
+}
+
+/**
+ * Open the virtual disk
+ *
+ * The geometry is taken from the superblock at the start of the file.  A file
+ * without one (e.g., a disk that is about to be formatted) gets the default
+ * geometry.
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @return The disk; NULL on error
+ *
+ */
+VDISK *vdisk_open(char *virtual_disk_name) {
+  // Open file(s)
+  int fds[VDISK_MAX_STRIPES];
+  int n_files = vdisk_open_files(virtual_disk_name, O_RDWR | O_CREAT, fds);
+
+  // Check code
+  VDISK *disk = calloc(1, sizeof(VDISK));
+  if (n_files < 0 || disk == NULL) {
+    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
+    for (int i = 0; i < n_files; ++i)
+      close(fds[i]);
+    free(disk);
+    return (NULL);
+  };
+
+  // Load the geometry
+  VDISK_SUPERBLOCK superblock;
+  if (pread(fds[0], &superblock, sizeof(superblock), 0) ==
+          sizeof(superblock) &&
+      superblock.magic == VDISK_MAGIC && vdisk_geometry_valid(&superblock)) {
+    // The files must be the ones the disk was striped over
+    int n_stripes = superblock.n_stripes > 1 ? superblock.n_stripes : 1;
+    if (n_stripes != n_files) {
+      fprintf(stderr,
+              "Unable to open virtual disk (%s): striped over %d files, %d "
+              "given\n",
+              virtual_disk_name, n_stripes, n_files);
+      for (int i = 0; i < n_files; ++i)
+        close(fds[i]);
+      free(disk);
+      return (NULL);
+    }
+    disk->superblock = superblock;
+
+    // Stack the snapshot overlays, if any, on top
+    if (vdisk_snap_open(&disk->snap, virtual_disk_name, superblock.block_size,
+                        superblock.n_blocks) != 0) {
+      fprintf(stderr, "Unable to open snapshots of virtual disk (%s)\n",
+              virtual_disk_name);
+      for (int i = 0; i < n_files; ++i)
+        close(fds[i]);
+      free(disk);
+      return (NULL);
+    }
+  } else {
+    disk->superblock.block_size = VDISK_DEFAULT_BLOCK_SIZE;
+    disk->superblock.n_blocks = VDISK_DEFAULT_N_BLOCKS;
+    if (n_files > 1) {
+      disk->superblock.n_stripes = n_files;
+      disk->superblock.stripe_unit = VDISK_DEFAULT_STRIPE_UNIT;
+    }
+  }
+
+  vdisk_disk_attach(disk, fds, n_files, virtual_disk_name);
+  return (disk);
+}
+
+/**
+ * Create (or recreate) a virtual disk with the given geometry
+ *
+ * Any existing contents of the file (its snapshots and I/O record included)
+ * are discarded and the file is sized to hold the whole disk, every block
+ * reading as zeros until it is written.  The superblock is only installed in
+ * memory: the caller is responsible for writing block 0, which must start
+ * with it.
+ *
+ * Given a comma-separated list of files, the disk is striped over them
+ * stripe_unit blocks at a time (VDISK_DEFAULT_STRIPE_UNIT if 0); n_stripes is
+ * taken from the list.
+ *
+ * @param virtual_disk_name Name of the file(s) containing the virtual disk
+ * @param superblock Geometry and layout of the new disk
+ * @return The disk; NULL on error
+ *
+ */
+VDISK *vdisk_create(char *virtual_disk_name, VDISK_SUPERBLOCK *superblock) {
+  // The snapshots and I/O record of the old disk go with it
+  vdisk_snap_remove(virtual_disk_name);
+  char path[PATH_MAX];
+  if (vdisk_io_stats_file_name(path, virtual_disk_name) == 0)
+    unlink(path);
+
+  int fds[VDISK_MAX_STRIPES];
+  int n_files =
+      vdisk_open_files(virtual_disk_name, O_RDWR | O_CREAT | O_TRUNC, fds);
+  if (n_files > 1) {
+    superblock->n_stripes = n_files;
+    if (superblock->stripe_unit == 0)
+      superblock->stripe_unit = VDISK_DEFAULT_STRIPE_UNIT;
+  } else {
+    superblock->n_stripes = superblock->stripe_unit = 0;
+  }
+
+  if (!vdisk_geometry_valid(superblock)) {
+    fprintf(stderr, "vdisk_create(): bad geometry (%u blocks of %u bytes)\n",
+            superblock->n_blocks, superblock->block_size);
+    for (int i = 0; i < n_files; ++i)
+      close(fds[i]);
+    return (NULL);
+  }
+
+  // Each file holds an equal share of the stripe units
+  off_t file_size = (off_t)superblock->n_blocks * superblock->block_size;
+  if (n_files > 1) {
+    unsigned int unit = superblock->stripe_unit;
+    off_t n_units = (superblock->n_blocks + unit - 1) / unit;
+    file_size = (n_units + n_files - 1) / n_files * unit *
+                (off_t)superblock->block_size;
+  }
+
+  VDISK *disk = calloc(1, sizeof(VDISK));
+  int ret = (n_files < 0 || disk == NULL) ? -1 : 0;
+  for (int i = 0; ret == 0 && i < n_files; ++i)
+    ret = ftruncate(fds[i], file_size);
+  if (ret != 0) {
+    fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
+    for (int i = 0; i < n_files; ++i)
+      close(fds[i]);
+    free(disk);
+    return (NULL);
+  };
+
+  disk->superblock = *superblock;
+  disk->superblock.magic = VDISK_MAGIC;
+  vdisk_disk_attach(disk, fds, n_files, virtual_disk_name);
+  return (disk);
+}
+
+/**
+ * Close a virtual disk and release its handle
+ *
+ * Dirty cached blocks are written back before the file is closed.  If the
+ * ZCACHE_STATS environment variable is set, the cache counters are reported
+ * on stderr; if ZSTATS is set, so are the I/O counters, which are also added
+ * to the record of the disk.
+ *
+ * @return 0 on success; <0 for an error
+ */
+int vdisk_close(VDISK *disk) {
+  // No longer flushed at exit
+  pthread_mutex_lock(&vdisk_open_lock);
+  VDISK **link = &vdisk_open_disks;
+  while (*link != NULL && *link != disk)
+    link = &(*link)->next_open;
+  if (*link == disk)
+    *link = disk->next_open;
+  pthread_mutex_unlock(&vdisk_open_lock);
+
+  int ret = vdisk_flush_at(disk);
+
+  if (getenv("ZCACHE_STATS") != NULL) {
+    fprintf(stderr,
+            "vdisk cache: size=%d hits=%lu misses=%lu writebacks=%lu "
+            "evictions=%lu\nresident:",
+            disk->cache_size, disk->stats.hits, disk->stats.misses,
+            disk->stats.writebacks, disk->stats.evictions);
+    for (VDISK_CACHE_ENTRY *e = disk->lru_head; e != NULL; e = e->lru_next) {
+      if (e->valid)
+        fprintf(stderr, " %d", e->block_ref);
+    }
+    fprintf(stderr, "\n");
+  }
+  vdisk_io_stats_report(disk);
+  vdisk_fs_release(disk);
+  vdisk_cache_free(disk);
+  free(disk->directory_blocks);
+  free(disk->journal);
+  vdisk_checksum_free(disk);
+  free(disk->discards);
+  if (disk->ring != NULL)
+    vdisk_uring_close(disk->ring);
+  if (disk->map != NULL)
+    munmap(disk->map, disk->map_size);
+
+  // Close the file(s)
+  if (disk->pool != NULL)
+    vdisk_pool_close(disk->pool);
+  for (int i = 0; i < vdisk_n_stripes(disk); ++i)
+    close(vdisk_file_fd(disk, i));
+  if (disk->snap != NULL)
+    vdisk_snap_close(disk->snap);
+  free(disk->name);
+  free(disk->stripe_fds);
+  free(disk);
+  return (ret);
+}
+
+/**
+ *  Read a disk block into the provided buffer
+ *
+ * @param block_ref Index of the block that is to be loaded
+ * @param block Pointer to the buffer that the read block will be placed into
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_block_at(VDISK *disk, BLOCK_REFERENCE block_ref, void *block) {
+  if (debug)
+    fprintf(stderr, "##Reading block %d\n", block_ref);
+
+
+  // Make sure that we have a valid block request
+  if (block_ref >= VDISK_N_BLOCKS(disk)) {
+    fprintf(stderr, "vdisk_read_block(): bad block_ref(%u)\n", block_ref);
+    return (-2);
+  }
+  vdisk_io_count(disk, disk->io_stats.reads, block_ref, 1);
+
+  // Written by the running transaction?
+  int i = vdisk_journal_find(disk, block_ref);
+  if (i >= 0) {
+    memcpy(block, vdisk_journal_image(disk, i), VDISK_BLOCK_SIZE(disk));
+    return (0);
+  }
+
+  // Part of the checksum area
+  const void *area = vdisk_checksum_area_block(disk, block_ref);
+  if (area != NULL) {
+    memcpy(block, area, VDISK_BLOCK_SIZE(disk));
+    return (0);
+  }
+
+  // Mapped disk
+  if (disk->map != NULL) {
+    ++disk->stats.hits;
+    vdisk_io_count(disk, disk->io_stats.device_reads, block_ref, 1);
+    memcpy(block, disk->map + (size_t)block_ref * VDISK_BLOCK_SIZE(disk),
+           VDISK_BLOCK_SIZE(disk));
+    return (vdisk_checksum_verify_once(disk, block_ref, block));
+  }
+
+  // Uncached disk
+  if (disk->cache_size == 0) {
+    ++disk->stats.misses;
+    return (vdisk_device_read(disk, block_ref, block));
+  }
+
+  // Through the cache
+  VDISK_CACHE_ENTRY *entry;
+  int ret = vdisk_cache_read(disk, block_ref, &entry);
+  if (ret == 0)
+    memcpy(block, entry->data, VDISK_BLOCK_SIZE(disk));
+  return (ret);
+}
+
+/**
+ *  Write a disk block to the virtual disk
+ *
+ *  The write is absorbed by the cache; the block reaches the backing file when
+ *  it is evicted or the disk is flushed.
+ *
+ * @param block_ref Index to the block to be written
+ * @param block Memory in which the block is currently stored
+ *
+ */
+int vdisk_write_block_at(VDISK *disk, BLOCK_REFERENCE block_ref, void *block) {
+  if (debug)
+    fprintf(stderr, "##Writing block %d\n", block_ref);
+
+
+  // Is it a valid block request?
+  if (block_ref >= VDISK_N_BLOCKS(disk) ||
+      vdisk_checksum_area_block(disk, block_ref) != NULL) {
+    fprintf(stderr, "vdisk_write_block(): bad block_ref(%u)\n", block_ref);
+    return (-2);
+  }
+  vdisk_io_count(disk, disk->io_stats.writes, block_ref, 1);
+  if (disk->n_discards > 0)
+    vdisk_discard_cancel(disk, block_ref);
+
+  // Inside a transaction the journal holds on to the block
+  if (vdisk_journal_running(disk))
+    return (vdisk_journal_capture(disk, block_ref, block));
+
+  return (vdisk_cache_write(disk, block_ref, block));
+}
+
+/**
+ *  Read a set of disk blocks.  Resident blocks are copied out of the cache;
+ *  the remaining blocks are read directly, with each run of consecutive
+ *  blocks fetched by a single preadv.  Blocks read this way are not added to
+ *  the cache, so bulk file data does not push out hot metadata.
+ *
+ * @param n Number of blocks
+ * @param block_refs Indices of the blocks to be loaded
+ * @param blocks One buffer per block
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                         void **blocks) {
+  if (n <= 0)
+    return (0);
+
+  VDISK_REQUEST *requests = malloc(n * sizeof(VDISK_REQUEST));
+  if (requests == NULL)
+    return (-5);
+
+  int n_requests = 0;
+  for (int i = 0; i < n; ++i) {
+    if (block_refs[i] >= VDISK_N_BLOCKS(disk)) {
+      fprintf(stderr, "vdisk_read_blocks(): bad block_ref(%d)\n",
+              block_refs[i]);
+      free(requests);
+      return (-2);
+    }
+    vdisk_io_count(disk, disk->io_stats.reads, block_refs[i], 1);
+
+    // Written by the running transaction
+    int j = vdisk_journal_find(disk, block_refs[i]);
+    if (j >= 0) {
+      memcpy(blocks[i], vdisk_journal_image(disk, j), VDISK_BLOCK_SIZE(disk));
+      continue;
+    }
+    const void *area = vdisk_checksum_area_block(disk, block_refs[i]);
+    if (area != NULL) {
+      memcpy(blocks[i], area, VDISK_BLOCK_SIZE(disk));
+      continue;
+    }
+
+    // Mapped: copy now, checking the checksum
+    if (disk->map != NULL) {
+      ++disk->stats.hits;
+      vdisk_io_count(disk, disk->io_stats.device_reads, block_refs[i], 1);
+      memcpy(blocks[i], disk->map + (size_t)block_refs[i] *
+             VDISK_BLOCK_SIZE(disk),
+             VDISK_BLOCK_SIZE(disk));
+      int ret = vdisk_checksum_verify_once(disk, block_refs[i], blocks[i]);
+      if (ret != 0) {
+        free(requests);
+        return (ret);
+      }
+      continue;
+    }
+
+    // Resident: copy now
+    VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_refs[i]);
+    if (entry != NULL && entry->valid) {
+      ++disk->stats.hits;
+      memcpy(blocks[i], entry->data, VDISK_BLOCK_SIZE(disk));
+      continue;
+    }
+    ++disk->stats.misses;
+    requests[n_requests].block_ref = block_refs[i];
+    requests[n_requests].index = i;
+    requests[n_requests].block = blocks[i];
+    ++n_requests;
+  }
+
+  qsort(requests, n_requests, sizeof(VDISK_REQUEST), vdisk_request_compare);
+  int ret = vdisk_device_batch(disk, 0, requests, n_requests, NULL);
+  free(requests);
+  return (ret);
+}
+
+/**
+ * Write a set of blocks, holding metadata in the running transaction (if
+ * any) and sending everything else straight home
+ *
+ * @param metadata 1 for file system structures; 0 for file contents
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_write_set(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                           void **blocks, int metadata) {
+  if (n <= 0)
+    return (0);
+
+  VDISK_REQUEST *requests = malloc(n * sizeof(VDISK_REQUEST));
+  if (requests == NULL)
+    return (-5);
+
+  int n_requests = 0;
+  for (int i = 0; i < n; ++i) {
+    if (block_refs[i] >= VDISK_N_BLOCKS(disk) ||
+        vdisk_checksum_area_block(disk, block_refs[i]) != NULL) {
+      fprintf(stderr, "vdisk_write_blocks(): bad block_ref(%d)\n",
+              block_refs[i]);
+      free(requests);
+      return (-2);
+    }
+    vdisk_io_count(disk, disk->io_stats.writes, block_refs[i], 1);
+    if (disk->n_discards > 0)
+      vdisk_discard_cancel(disk, block_refs[i]);
+
+    // Inside a transaction the journal holds on to metadata
+    if (metadata && vdisk_journal_running(disk)) {
+      int ret = vdisk_journal_capture(disk, block_refs[i], blocks[i]);
+      if (ret != 0) {
+        free(requests);
+        return (ret);
+      }
+      continue;
+    }
+
+    // File contents go home now and must be durable before the next commit.
+    // An image of the block in the running transaction is kept up to date,
+    // so that installing it does not bring back the old contents
+    if (!metadata && disk->journal != NULL) {
+      int j = vdisk_journal_find(disk, block_refs[i]);
+      if (j >= 0)
+        memcpy(vdisk_journal_image(disk, j), blocks[i],
+               VDISK_BLOCK_SIZE(disk));
+      disk->journal_data_pending = 1;
+    }
+    requests[n_requests].block_ref = block_refs[i];
+    requests[n_requests].index = i;
+    requests[n_requests].block = blocks[i];
+    ++n_requests;
+  }
+
+  int ret = vdisk_write_home(disk, requests, n_requests, NULL);
+  free(requests);
+  return (ret);
+}
+
+/**
+ *  Write a set of disk blocks.  Runs of consecutive blocks are written with a
+ *  single pwritev.  The writes go straight to the backing file; cached copies
+ *  of the blocks are refreshed (and become clean).  Inside a transaction the
+ *  blocks are journaled instead.
+ *
+ * @param n Number of blocks
+ * @param block_refs Indices of the blocks to be written
+ * @param blocks One buffer per block
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_write_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                          void **blocks) {
+  return (vdisk_write_set(disk, n, block_refs, blocks, 1));
+}
+
+/**
+ *  Write a set of blocks holding file contents.  They are never journaled:
+ *  like vdisk_write_blocks() outside a transaction, they go straight to the
+ *  backing file, and they are synced before the running transaction
+ *  commits, so that a committed file never points at blocks whose contents
+ *  did not make it to the disk.
+ *
+ * @param n Number of blocks
+ * @param block_refs Indices of the blocks to be written
+ * @param blocks One buffer per block
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_write_data_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                               void **blocks) {
+  return (vdisk_write_set(disk, n, block_refs, blocks, 0));
+}
+
+// An asynchronous request handed to the engine
+typedef struct vdisk_async_s {
+  VDISK *disk;
+  int write;
+  BLOCK_REFERENCE block_ref;
+  void *block;
+  VDISK_CALLBACK callback;
+  void *arg;
+  struct iovec iov;
+  unsigned long start;
+} VDISK_ASYNC;
+
+/**
+ * Engine completion function for asynchronous requests
+ */
+static void vdisk_async_done(void *context, int result) {
+  VDISK_ASYNC *request = context;
+  VDISK_IO_STATS *stats = &request->disk->io_stats;
+  vdisk_io_time(request->write ? stats->write_latency : stats->read_latency,
+                request->start);
+  if (result == 0 && request->write)
+    vdisk_checksum_written(request->disk, request->block_ref);
+  else if (result == 0)
+    result = vdisk_checksum_verify_once(request->disk, request->block_ref,
+                                        request->block);
+  if (request->callback != NULL)
+    request->callback(request->block_ref, request->block, result, request->arg);
+  free(request);
+}
+
+/**
+ * Queue an asynchronous block transfer on the engine
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_async_queue(VDISK *disk, int write, BLOCK_REFERENCE block_ref,
+                             void *block, VDISK_CALLBACK callback, void *arg) {
+  VDISK_ASYNC *request = malloc(sizeof(VDISK_ASYNC));
+  if (request == NULL)
+    return (-5);
+  request->disk = disk;
+  request->write = write;
+  request->block_ref = block_ref;
+  request->block = block;
+  request->callback = callback;
+  request->arg = arg;
+  request->iov.iov_base = block;
+  request->iov.iov_len = VDISK_BLOCK_SIZE(disk);
+  request->start = vdisk_clock();
+  vdisk_io_count(disk,
+                 write ? disk->io_stats.device_writes
+                       : disk->io_stats.device_reads,
+                 block_ref, 1);
+
+  off_t offset;
+  int fd = vdisk_file_fd(disk, vdisk_locate(disk, block_ref, write, &offset));
+  if (vdisk_uring_queue(disk->ring, write, fd, offset, &request->iov, 1,
+                        VDISK_BLOCK_SIZE(disk), vdisk_async_done,
+                        request) != 0) {
+    free(request);
+    return (-4);
+  }
+  return (0);
+}
+
+/**
+ *  Start reading a disk block.
+ *
+ *  The callback runs once the block has been read, from within vdisk_wait()
+ *  or vdisk_drain().  Blocks held by the cache, and every request when the
+ *  io_uring engine is not in use, complete immediately: the callback runs
+ *  before this function returns.
+ *
+ * @param block_ref Index of the block that is to be loaded
+ * @param block Buffer to read into; must stay valid until completion
+ * @param callback Completion function (may be NULL)
+ * @param arg Passed to the callback
+ * @return 0 if the request was accepted; <0 on error
+ *
+ */
+int vdisk_read_block_async_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                              void *block, VDISK_CALLBACK callback, void *arg) {
+  if (block_ref >= VDISK_N_BLOCKS(disk)) {
+    fprintf(stderr, "vdisk_read_block_async(): bad block_ref(%d)\n",
+            block_ref);
+    return (-2);
+  }
+
+  // Resident blocks and synchronous backends complete right away
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  if (disk->ring == NULL || (entry != NULL && entry->valid) ||
+      vdisk_journal_find(disk, block_ref) >= 0 ||
+      vdisk_checksum_area_block(disk, block_ref) != NULL) {
+    int ret = vdisk_read_block_at(disk, block_ref, block);
+    if (callback != NULL)
+      callback(block_ref, block, ret, arg);
+    return (0);
+  }
+
+  ++disk->stats.misses;
+  vdisk_io_count(disk, disk->io_stats.reads, block_ref, 1);
+  return (vdisk_async_queue(disk, 0, block_ref, block, callback, arg));
+}
+
+/**
+ *  Start writing a disk block.
+ *
+ *  The write bypasses the block cache (a resident copy is refreshed).  The
+ *  callback runs once the block is in the backing file, from within
+ *  vdisk_wait() or vdisk_drain(); without the io_uring engine the write goes
+ *  through the cache and the callback runs before this function returns.
+ *
+ * @param block_ref Index of the block to be written
+ * @param block Buffer holding the block; must stay valid until completion
+ * @param callback Completion function (may be NULL)
+ * @param arg Passed to the callback
+ * @return 0 if the request was accepted; <0 on error
+ *
+ */
+int vdisk_write_block_async_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                               void *block, VDISK_CALLBACK callback,
+                               void *arg) {
+  if (block_ref >= VDISK_N_BLOCKS(disk) ||
+      vdisk_checksum_area_block(disk, block_ref) != NULL) {
+    fprintf(stderr, "vdisk_write_block_async(): bad block_ref(%d)\n",
+            block_ref);
+    return (-2);
+  }
+  if (disk->n_discards > 0)
+    vdisk_discard_cancel(disk, block_ref);
+
+  // Synchronous backends and transactions complete right away
+  if (disk->ring == NULL || vdisk_journal_running(disk)) {
+    int ret = vdisk_write_block_at(disk, block_ref, block);
+    if (callback != NULL)
+      callback(block_ref, block, ret, arg);
+    return (0);
+  }
+
+  VDISK_CACHE_ENTRY *entry = vdisk_cache_lookup(disk, block_ref);
+  if (entry != NULL && entry->valid) {
+    memcpy(entry->data, block, VDISK_BLOCK_SIZE(disk));
+    entry->dirty = 0;
+  }
+  vdisk_io_count(disk, disk->io_stats.writes, block_ref, 1);
+  vdisk_checksum_set(disk, block_ref, block);
+  return (vdisk_async_queue(disk, 1, block_ref, block, callback, arg));
+}
+
+/**
+ * Hand all queued asynchronous requests to the kernel without waiting
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_submit_at(VDISK *disk) {
+  if (disk->ring == NULL)
+    return (0);
+  return (vdisk_uring_submit(disk->ring));
+}
+
+/**
+ * Submit queued requests and run the callbacks of completed ones
+ *
+ * @param min_complete Number of completions to wait for
+ * @return Number of requests completed; <0 on error
+ */
+int vdisk_wait_at(VDISK *disk, int min_complete) {
+  if (disk->ring == NULL)
+    return (0);
+  return (vdisk_uring_wait(disk->ring, min_complete > 0 ? min_complete : 0));
+}
+
+/**
+ * Wait for every outstanding asynchronous request
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_drain_at(VDISK *disk) {
+  while (disk->ring != NULL && vdisk_uring_inflight(disk->ring) > 0) {
+    if (vdisk_uring_wait(disk->ring, vdisk_uring_inflight(disk->ring)) < 0)
+      return (-4);
+  }
+  return (0);
+}
+
+/**
+ * Verify every block of the disk against its checksum.  The disk is flushed
+ * first so that the backing file is current; it is then read sequentially in
+ * large chunks.  Blocks that fail are reported on stderr.
+ *
+ * @param n_checked Set to the number of blocks checked (may be NULL)
+ * @return Number of blocks that failed their checksum; <0 on error
+ */
+long vdisk_scrub_at(VDISK *disk, unsigned long *n_checked) {
+  if (n_checked != NULL)
+    *n_checked = 0;
+  if (disk->checksums == NULL)
+    return (0);
+
+  int ret = vdisk_flush_at(disk);
+  if (ret != 0)
+    return (ret);
+
+  unsigned int chunk = VDISK_SCRUB_CHUNK / VDISK_BLOCK_SIZE(disk);
+  if (chunk == 0)
+    chunk = 1;
+  unsigned char *buffer = NULL;
+  if (disk->map == NULL) {
+    buffer = malloc((size_t)chunk * VDISK_BLOCK_SIZE(disk));
+    if (buffer == NULL)
+      return (-5);
+    for (int i = 0; i < vdisk_n_files(disk); ++i)
+      posix_fadvise(vdisk_file_fd(disk, i), 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  long errors = 0;
+  unsigned long checked = 0;
+  for (BLOCK_REFERENCE first = 0; first < VDISK_N_BLOCKS(disk);
+       first += chunk) {
+    unsigned int n = VDISK_N_BLOCKS(disk) - first;
+    if (n > chunk)
+      n = chunk;
+
+    const unsigned char *data;
+    if (disk->map != NULL) {
+      data = disk->map + (size_t)first * VDISK_BLOCK_SIZE(disk);
+    } else {
+      ssize_t length = (ssize_t)n * VDISK_BLOCK_SIZE(disk);
+      if (vdisk_file_io(disk, 0, buffer, length,
+                        (off_t)first * VDISK_BLOCK_SIZE(disk)) != length) {
+        fprintf(stderr, "vdisk_scrub(): read failed\n");
+        free(buffer);
+        return (-4);
+      }
+      data = buffer;
+    }
+
+    for (unsigned int i = 0; i < n; ++i) {
+      BLOCK_REFERENCE block_ref = first + i;
+      if (!vdisk_checksummed(disk, block_ref) ||
+          disk->checksums[block_ref] == 0)
+        continue;
+      ++checked;
+      if (crc32c(0, data + (size_t)i * VDISK_BLOCK_SIZE(disk),
+                 VDISK_BLOCK_SIZE(disk)) != disk->checksums[block_ref]) {
+        fprintf(stderr, "vdisk_scrub(): checksum mismatch in block %u\n",
+                block_ref);
+        ++errors;
+      }
+    }
+  }
+
+  free(buffer);
+  if (n_checked != NULL)
+    *n_checked = checked;
+  return (errors);
+}
+
+/**
+ * Discard a block: its contents are no longer needed and it reads as zeros
+ * afterwards.  On a sparse disk the block is punched out of the backing file;
+ * otherwise it is overwritten with zeros.  Inside a transaction that happens
+ * once the transaction has committed and settled.
+ *
+ * @param block_ref Index of the block
+ * @return 0 on success; <0 on error
+ */
+int vdisk_discard_block_at(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  if (block_ref >= VDISK_N_BLOCKS(disk) ||
+      vdisk_checksum_area_block(disk, block_ref) != NULL) {
+    fprintf(stderr, "vdisk_discard_block(): bad block_ref(%u)\n", block_ref);
+    return (-2);
+  }
+  vdisk_block_type_set_at(disk, block_ref, VDISK_BLOCK_DATA);
+
+  if (!vdisk_journal_running(disk)) {
+    if (!(disk->superblock.flags & VDISK_SPARSE)) {
+      void *zeros = calloc(1, VDISK_BLOCK_SIZE(disk));
+      if (zeros == NULL)
+        return (-5);
+      int ret = vdisk_write_block_at(disk, block_ref, zeros);
+      free(zeros);
+      return (ret);
+    }
+    vdisk_forget(disk, block_ref);
+    return (vdisk_punch(disk, block_ref, 1));
+  }
+
+  // Hold on to it until the transaction commits
+  if (disk->n_discards == disk->discard_capacity) {
+    int capacity = disk->discard_capacity ? 2 * disk->discard_capacity : 64;
+    BLOCK_REFERENCE *discards =
+        realloc(disk->discards, capacity * sizeof(BLOCK_REFERENCE));
+    if (discards == NULL)
+      return (-5);
+    disk->discards = discards;
+    disk->discard_capacity = capacity;
+  }
+  disk->discards[disk->n_discards++] = block_ref;
+  return (0);
+}
+
+/**
+ * @param block_ref Index of the block
+ * @return Index of the backing file that holds the block (0 unless the disk
+ *         is striped)
+ */
+int vdisk_stripe_at(VDISK *disk, BLOCK_REFERENCE block_ref) {
+  off_t offset;
+  return (vdisk_locate_base(disk, block_ref, &offset));
+}
+
+/**
+ * Take a snapshot of the disk: the disk is flushed and its current contents
+ * are frozen under the given name.  Only the blocks written afterwards take
+ * space.
+ *
+ * @param name Name of the snapshot (no white space)
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snapshot_create_at(VDISK *disk, char *name) {
+  // The frozen layer must be complete on disk
+  int ret = vdisk_flush_at(disk);
+  if (ret == 0 && vdisk_file_sync(disk) != 0)
+    ret = -4;
+
+  // Writes must go through the overlays from now on: leave the mapping for
+  // the pread backend
+  if (ret == 0 && disk->map != NULL) {
+    munmap(disk->map, disk->map_size);
+    disk->map = NULL;
+    vdisk_cache_init(disk);
+  }
+  if (ret == 0)
+    ret = vdisk_snap_push(&disk->snap, disk->name, VDISK_BLOCK_SIZE(disk),
+                          VDISK_N_BLOCKS(disk), name);
+  return (ret);
+}
+
+/**
+ * List the snapshots of the disk, oldest first
+ *
+ * @param snapshots Filled in (room for VDISK_MAX_SNAPSHOTS entries)
+ * @return Number of snapshots
+ */
+int vdisk_snapshot_list_at(VDISK *disk, VDISK_SNAPSHOT *snapshots) {
+  VDISK_SNAP *snap = disk->snap;
+  if (snap == NULL)
+    return (0);
+  for (int k = 1; k <= snap->n_layers; ++k) {
+    strcpy(snapshots[k - 1].name, snap->names[k - 1]);
+    snapshots[k - 1].n_blocks = snap->held[k];
+  }
+  return (snap->n_layers);
+}
+
+/**
+ * @return Index of the named snapshot; 0 (after reporting it) if there is none
+ */
+static int vdisk_snapshot_find(VDISK *disk, char *name) {
+  int k = (disk->snap == NULL) ? 0 : vdisk_snap_find(disk->snap, name);
+  if (k == 0)
+    fprintf(stderr, "No snapshot named %s\n", name);
+  return (k);
+}
+
+/**
+ * Return the disk to a snapshot.  Everything written since the snapshot was
+ * taken is lost, and so are the snapshots taken after it; the snapshot itself
+ * is kept.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snapshot_rollback_at(VDISK *disk, char *name) {
+  int k = vdisk_snapshot_find(disk, name);
+  if (k == 0)
+    return (-3);
+  int ret = vdisk_flush_at(disk);
+  if (ret == 0)
+    ret = vdisk_snap_rollback(disk->snap, k);
+  if (ret != 0)
+    return (ret);
+
+  // What is held in memory belongs to the abandoned contents
+  vdisk_fs_release(disk);
+  vdisk_cache_free(disk);
+  vdisk_cache_init(disk);
+  vdisk_checksum_free(disk);
+  vdisk_checksum_init(disk);
+  return (0);
+}
+
+/**
+ * Write a block of a merged overlay to the disk file(s) themselves
+ */
+static int vdisk_snapshot_write_base(void *context, BLOCK_REFERENCE block_ref,
+                                     void *block) {
+  VDISK *disk = context;
+  off_t offset;
+  int fd = vdisk_file_fd(disk, vdisk_locate_base(disk, block_ref, &offset));
+  if (pwrite(fd, block, VDISK_BLOCK_SIZE(disk), offset) !=
+      VDISK_BLOCK_SIZE(disk)) {
+    fprintf(stderr, "vdisk_snapshot_delete(): write failed\n");
+    return (-4);
+  }
+  return (0);
+}
+
+/**
+ * Delete a snapshot.  The blocks written after it are merged into the layer
+ * below, so the contents of the disk and of the other snapshots do not
+ * change.
+ *
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snapshot_delete_at(VDISK *disk, char *name) {
+  int k = vdisk_snapshot_find(disk, name);
+  if (k == 0)
+    return (-3);
+  int ret = vdisk_flush_at(disk);
+  if (ret == 0 && vdisk_file_sync(disk) != 0)
+    ret = -4;
+  if (ret == 0)
+    ret = vdisk_snap_merge(disk->snap, k, vdisk_snapshot_write_base, disk);
+
+  // Merged into the disk file(s): make that durable before the overlay goes
+  for (int i = 0; ret == 0 && k == 1 && i < vdisk_n_stripes(disk); ++i) {
+    if (fdatasync(vdisk_file_fd(disk, i)) != 0)
+      ret = -4;
+  }
+  if (ret == 0)
+    ret = vdisk_snap_drop(disk->snap, k);
+  if (disk->snap->n_layers == 0) {
+    vdisk_snap_close(disk->snap);
+    disk->snap = NULL;
+  }
+  return (ret);
+}
+
+/*
+ * Single-disk interface.
+ *
+ * The functions below keep the original one-disk-per-process calls working:
+ * each one operates on vdisk_default, the disk opened by vdisk_disk_open() or
+ * vdisk_disk_create().
+ */
+
+/**
+ * Open the default virtual disk
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @return 0 on success; < 0 on error
+ *
+ */
+int vdisk_disk_open(char *virtual_disk_name) {
+  if (vdisk_default != NULL) {
+    fprintf(stderr, "A disk is already opened\n");
+    return (-1);
+  };
+
+  vdisk_default = vdisk_open(virtual_disk_name);
+  return (vdisk_default == NULL ? -1 : 0);
+}
+
+/**
+ * Create (or recreate) the default virtual disk with the given geometry
+ *
+ * @param virtual_disk_name Name of the file containing the virtual disk
+ * @param superblock Geometry and layout of the new disk
+ * @return 0 on success; < 0 on error
+ *
+ */
+int vdisk_disk_create(char *virtual_disk_name, VDISK_SUPERBLOCK *superblock) {
+  if (vdisk_default != NULL) {
+    fprintf(stderr, "A disk is already opened\n");
+    return (-1);
+  };
+
+  vdisk_default = vdisk_create(virtual_disk_name, superblock);
+  return (vdisk_default == NULL ? -1 : 0);
+}
+
+/**
+ * Close the default virtual disk
+ *
+ * @return 0 on success; <0 for an error
+ */
+int vdisk_disk_close() {
+  // Must be initialized to close it
+  if (vdisk_default == NULL) {
+    fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
+    exit(-1);
+  };
+
+  int ret = vdisk_close(vdisk_default);
+  vdisk_default = NULL;
+  return (ret);
+}
+
+/**
+ * Exit if the default disk has not been opened
+ */
+static void vdisk_default_check(char *caller) {
+  if (vdisk_default == NULL) {
+    fprintf(stderr, "%s(): disk not initialized\n", caller);
+    exit(-1);
+  };
+}
+
+int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block) {
+  vdisk_default_check("vdisk_read_block");
+  return (vdisk_read_block_at(vdisk_default, block_ref, block));
+}
+
+int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block) {
+  vdisk_default_check("vdisk_write_block");
+  return (vdisk_write_block_at(vdisk_default, block_ref, block));
+}
+
+int vdisk_read_blocks(int n, BLOCK_REFERENCE *block_refs, void **blocks) {
+  vdisk_default_check("vdisk_read_blocks");
+  return (vdisk_read_blocks_at(vdisk_default, n, block_refs, blocks));
+}
+
+int vdisk_write_blocks(int n, BLOCK_REFERENCE *block_refs, void **blocks) {
+  vdisk_default_check("vdisk_write_blocks");
+  return (vdisk_write_blocks_at(vdisk_default, n, block_refs, blocks));
+}
+
+int vdisk_write_data_blocks(int n, BLOCK_REFERENCE *block_refs,
+                            void **blocks) {
+  vdisk_default_check("vdisk_write_data_blocks");
+  return (vdisk_write_data_blocks_at(vdisk_default, n, block_refs, blocks));
+}
+
+int vdisk_flush() {
+  if (vdisk_default == NULL)
+    return (0);
+  return (vdisk_flush_at(vdisk_default));
+}
+
+int vdisk_backend_active() {
+  if (vdisk_default == NULL)
+    return (VDISK_BACKEND_PREAD);
+  return (vdisk_backend_active_at(vdisk_default));
+}
+
+int vdisk_read_block_async(BLOCK_REFERENCE block_ref, void *block,
+                           VDISK_CALLBACK callback, void *arg) {
+  vdisk_default_check("vdisk_read_block_async");
+  return (vdisk_read_block_async_at(vdisk_default, block_ref, block, callback,
+                                    arg));
+}
+
+int vdisk_write_block_async(BLOCK_REFERENCE block_ref, void *block,
+                            VDISK_CALLBACK callback, void *arg) {
+  vdisk_default_check("vdisk_write_block_async");
+  return (vdisk_write_block_async_at(vdisk_default, block_ref, block, callback,
+                                     arg));
+}
+
+int vdisk_submit() {
+  if (vdisk_default == NULL)
+    return (0);
+  return (vdisk_submit_at(vdisk_default));
+}
+
+int vdisk_wait(int min_complete) {
+  if (vdisk_default == NULL)
+    return (0);
+  return (vdisk_wait_at(vdisk_default, min_complete));
+}
+
+int vdisk_drain() {
+  if (vdisk_default == NULL)
+    return (0);
+  return (vdisk_drain_at(vdisk_default));
+}
+
+const void *vdisk_block_ptr(BLOCK_REFERENCE block_ref) {
+  if (vdisk_default == NULL)
+    return (NULL);
+  return (vdisk_block_ptr_at(vdisk_default, block_ref));
+}
+
+void vdisk_cache_stats(VDISK_CACHE_STATS *stats) {
+  if (vdisk_default == NULL) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+  vdisk_cache_stats_at(vdisk_default, stats);
+}
+
+int vdisk_cache_resident(BLOCK_REFERENCE block_ref) {
+  if (vdisk_default == NULL)
+    return (0);
+  return (vdisk_cache_resident_at(vdisk_default, block_ref));
+}
+
+long vdisk_scrub(unsigned long *n_checked) {
+  vdisk_default_check("vdisk_scrub");
+  return (vdisk_scrub_at(vdisk_default, n_checked));
+}
+
+int vdisk_discard_block(BLOCK_REFERENCE block_ref) {
+  vdisk_default_check("vdisk_discard_block");
+  return (vdisk_discard_block_at(vdisk_default, block_ref));
+}
+
+int vdisk_stripe(BLOCK_REFERENCE block_ref) {
+  vdisk_default_check("vdisk_stripe");
+  return (vdisk_stripe_at(vdisk_default, block_ref));
+}
+
+int vdisk_snapshot_create(char *name) {
+  vdisk_default_check("vdisk_snapshot_create");
+  return (vdisk_snapshot_create_at(vdisk_default, name));
+}
+
+int vdisk_snapshot_list(VDISK_SNAPSHOT *snapshots) {
+  vdisk_default_check("vdisk_snapshot_list");
+  return (vdisk_snapshot_list_at(vdisk_default, snapshots));
+}
+
+int vdisk_snapshot_rollback(char *name) {
+  vdisk_default_check("vdisk_snapshot_rollback");
+  return (vdisk_snapshot_rollback_at(vdisk_default, name));
+}
+
+int vdisk_snapshot_delete(char *name) {
+  vdisk_default_check("vdisk_snapshot_delete");
+  return (vdisk_snapshot_delete_at(vdisk_default, name));
+}
+
+void vdisk_io_stats(VDISK_IO_STATS *stats) {
+  vdisk_default_check("vdisk_io_stats");
+  vdisk_io_stats_at(vdisk_default, stats);
+}
+
+int vdisk_io_stats_recorded(VDISK_IO_STATS *stats) {
+  vdisk_default_check("vdisk_io_stats_recorded");
+  return (vdisk_io_stats_recorded_at(vdisk_default, stats));
+}
+
+void vdisk_block_type_set(BLOCK_REFERENCE block_ref, int type) {
+  vdisk_default_check("vdisk_block_type_set");
+  vdisk_block_type_set_at(vdisk_default, block_ref, type);
 }
@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -7,17 +8,340 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-typedef unsigned short BLOCK_REFERENCE;
+typedef unsigned int BLOCK_REFERENCE;
 
-// Size of block in bytes
-#define BLOCK_SIZE 256
+/*
+ * Disk geometry is decided when the disk is formatted and recorded in the
+ * superblock at the start of block 0.  vdisk_disk_open() loads it; a file
+ * without a superblock gets the default geometry.
+ */
+#define VDISK_MAGIC 0x5346554f // "OUFS"
 
-// Total number of blocks on the virtual disk
-#define N_BLOCKS_IN_DISK 128
+// Limits on the block size (a power of two) and defaults
+#define VDISK_MIN_BLOCK_SIZE 256
+#define VDISK_MAX_BLOCK_SIZE 65536
+#define VDISK_DEFAULT_BLOCK_SIZE 256
+#define VDISK_DEFAULT_N_BLOCKS 128
 
+typedef struct vdisk_superblock_s {
+  unsigned int magic;
+
+  // Size of a block in bytes
+  unsigned int block_size;
+
+  // Total number of blocks on the virtual disk
+  unsigned int n_blocks;
+
+  // File system layout (maintained by oufs_format_disk)
+  // Blocks holding the superblock and the allocation tables
+  unsigned int n_master_blocks;
+  // Blocks holding inodes
+  unsigned int n_inode_blocks;
+
+  // Metadata journal: first block and length (0 blocks: no journal)
+  unsigned int journal_start;
+  unsigned int n_journal_blocks;
+
+  // Block checksums: first block and length of the checksum area (0 blocks:
+  // no checksums)
+  unsigned int checksum_start;
+  unsigned int n_checksum_blocks;
+
+  // VDISK_SPARSE etc.
+  unsigned int flags;
+
+  // Striping: number of backing files (0 or 1: a single file) and blocks per
+  // stripe unit
+  unsigned int n_stripes;
+  unsigned int stripe_unit;
+} VDISK_SUPERBLOCK;
+
+// Superblock flag: blocks that hold nothing are holes in the backing file
+#define VDISK_SPARSE 0x1
+
+// A disk may be striped over up to VDISK_MAX_STRIPES files (a comma-separated
+// list of names); blocks per stripe unit unless the format asks otherwise
+#define VDISK_MAX_STRIPES 16
+#define VDISK_DEFAULT_STRIPE_UNIT 16
+
+// Copy-on-write snapshots: at most VDISK_MAX_SNAPSHOTS per disk, named with
+// up to VDISK_SNAPSHOT_NAME_LENGTH - 1 characters (no white space)
+#define VDISK_MAX_SNAPSHOTS 32
+#define VDISK_SNAPSHOT_NAME_LENGTH 32
+
+// A snapshot as listed by vdisk_snapshot_list()
+typedef struct vdisk_snapshot_s {
+  char name[VDISK_SNAPSHOT_NAME_LENGTH];
+  // Blocks written after the snapshot was taken (until the next one)
+  unsigned int n_blocks;
+} VDISK_SNAPSHOT;
+
+// Block cache counters
+typedef struct vdisk_cache_stats_s {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long writebacks;
+  unsigned long evictions;
+} VDISK_CACHE_STATS;
+
+// Kinds of block told apart by the I/O counters.  Blocks are classified by
+// the region of the disk they lie in; directory blocks are pointed out by the
+// file system with vdisk_block_type_set()
+#define VDISK_BLOCK_MASTER 0
+#define VDISK_BLOCK_INODE 1
+#define VDISK_BLOCK_DIRECTORY 2
+#define VDISK_BLOCK_DATA 3
+#define VDISK_BLOCK_JOURNAL 4
+#define VDISK_BLOCK_CHECKSUM 5
+#define VDISK_N_BLOCK_TYPES 6
+
+// Buckets of a latency histogram: bucket i counts the calls that took from
+// 2^i to 2^(i+1) - 1 ns (the last one also counts anything slower)
+#define VDISK_LATENCY_BUCKETS 32
+
+// Block I/O counters
+typedef struct vdisk_io_stats_s {
+  // Blocks read and written by the callers of the vdisk layer, by type
+  unsigned long reads[VDISK_N_BLOCK_TYPES];
+  unsigned long writes[VDISK_N_BLOCK_TYPES];
+
+  // Blocks transferred from and to the backing file(s), by type
+  unsigned long device_reads[VDISK_N_BLOCK_TYPES];
+  unsigned long device_writes[VDISK_N_BLOCK_TYPES];
+
+  // Syncs of the backing file(s) (fdatasync or msync)
+  unsigned long syncs;
+
+  // Latency of each call that reads from, writes to or syncs the backing
+  // file(s); a batch counts as one call
+  unsigned long read_latency[VDISK_LATENCY_BUCKETS];
+  unsigned long write_latency[VDISK_LATENCY_BUCKETS];
+  unsigned long sync_latency[VDISK_LATENCY_BUCKETS];
+} VDISK_IO_STATS;
+
+/*
+ * An open virtual disk.  Every disk has its own file, cache, mapping and
+ * io_uring ring, so several disks can be open at once, and different disks
+ * may be used from different threads (one thread per disk at a time).
+ * Only the superblock and the file system state are meant to be used outside
+ * vdisk.c.
+ */
+typedef struct vdisk_s {
+  // Geometry and layout of the disk
+  VDISK_SUPERBLOCK superblock;
+
+  // State kept in memory by the file system for this disk (NULL if none).
+  // fs_release() is called on it when the disk is closed or a snapshot
+  // rollback replaces the contents of the disk
+  void *fs;
+  void (*fs_release)(void *fs);
+
+  // Everything below is private to vdisk.c
+  char *name;
+  int fd;
+
+  // Striped disks: one descriptor per backing file (fd is the first) and the
+  // threads that drive them in parallel.  NULL for a single file
+  int *stripe_fds;
+  struct vdisk_pool_s *pool;
+
+  // Snapshot overlays stacked on the file(s); NULL without snapshots
+  struct vdisk_snap_s *snap;
+
+  // Block cache.  Entries are BLOCK_SIZE-dependent, so they are laid out
+  // cache_stride bytes apart
+  unsigned char *cache;
+  size_t cache_stride;
+  struct vdisk_cache_entry_s **cache_hash;
+  int cache_size;
+  int cache_buckets;
+  struct vdisk_cache_entry_s *lru_head;
+  struct vdisk_cache_entry_s *lru_tail;
+  VDISK_CACHE_STATS stats;
+
+  // I/O counters, and one bit per block marking the directory blocks (NULL
+  // until the first one is marked)
+  VDISK_IO_STATS io_stats;
+  unsigned char *directory_blocks;
+
+  // Memory mapping of the disk (mmap backend only)
+  unsigned char *map;
+  size_t map_size;
+
+  // io_uring engine (NULL unless the uring backend is in use)
+  struct vdisk_uring_s *ring;
+
+  // Metadata journal (NULL if the disk has none).  The buffer holds the
+  // descriptor block followed by the images of the blocks written by the
+  // running transaction.  Op start: blocks it held when the operation in
+  // progress began.  Aborted: that operation overflowed the journal.  Data
+  // pending: file contents written since the last sync.  Checkpoint: the
+  // last transaction known to be at home
+  unsigned char *journal;
+  int journal_descriptor_blocks;
+  int journal_capacity;
+  int journal_depth;
+  int journal_op_start;
+  int journal_aborted;
+  int journal_ops;
+  int journal_group;
+  int journal_home_pending;
+  int journal_data_pending;
+  unsigned long journal_sequence;
+  unsigned long journal_checkpoint;
+
+  // Block checksums (NULL if the disk has none): the contents of the
+  // checksum area, one CRC-32C per block, a dirty flag per area block and,
+  // per block, whether its mapped copy has been verified since it last changed
+  unsigned int *checksums;
+  unsigned char *checksum_dirty;
+  unsigned char *checksum_verified;
+
+  // Blocks discarded inside transactions.  The first n_discards_committed
+  // belong to the committed transaction and are punched out of the backing
+  // file (or zeroed) once its home blocks are durable; the rest belong to
+  // the running transaction
+  BLOCK_REFERENCE *discards;
+  int n_discards;
+  int n_discards_committed;
+  int discard_capacity;
+
+  // Open disks are chained together so that they can be flushed at exit
+  struct vdisk_s *next_open;
+} VDISK;
+
+// The disk opened by vdisk_disk_open().  The single-disk interface below
+// (vdisk_read_block() etc.) operates on it
+extern VDISK *vdisk_default;
+
+// Size of a block of a disk in bytes
+#define VDISK_BLOCK_SIZE(d) ((d)->superblock.block_size)
+
+// Total number of blocks on a disk
+#define VDISK_N_BLOCKS(d) ((d)->superblock.n_blocks)
+
+// Does a disk keep (and verify) block checksums?
+#define VDISK_CHECKSUMMED(d) ((d)->checksums != NULL)
+
+// The same for the disk opened by vdisk_disk_open(), for users of the
+// single-disk interface.  Code working on a VDISK handle uses the above
+#define BLOCK_SIZE VDISK_BLOCK_SIZE(vdisk_default)
+#define N_BLOCKS_IN_DISK VDISK_N_BLOCKS(vdisk_default)
+
+// Default number of blocks held by the block cache (override with ZCACHE)
+#define VDISK_CACHE_DEFAULT_SIZE 64
+
+// Backends: pread/pwrite through the block cache, a memory mapping of the
+// whole disk file, or io_uring queues behind the block cache
+// (select with ZDISK_BACKEND=pread|mmap|uring)
+#define VDISK_BACKEND_PREAD 0
+#define VDISK_BACKEND_MMAP 1
+#define VDISK_BACKEND_URING 2
+
+// Default io_uring submission queue depth (override with ZDISK_QUEUE_DEPTH)
+#define VDISK_DEFAULT_QUEUE_DEPTH 64
+
+// Magic number of a journal descriptor block
+#define VDISK_JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+
+// Operations per journal commit unless overridden with ZJOURNAL_GROUP
+#define VDISK_JOURNAL_DEFAULT_GROUP 1
+
+// Size of one entry of the checksum area
+#define VDISK_CHECKSUM_SIZE sizeof(unsigned int)
+
+// Returned when a block read from the backing file fails its checksum
+#define VDISK_CHECKSUM_ERROR (-6)
+
+// Returned when an operation does not fit in the journal
+#define VDISK_JOURNAL_FULL (-7)
+
+// Completion callback for asynchronous block I/O: result is 0 on success and
+// <0 on error
+typedef void (*VDISK_CALLBACK)(BLOCK_REFERENCE block_ref, void *block,
+                               int result, void *arg);
+
+// Settings for subsequently opened disks
+void vdisk_backend_select(int backend);
+void vdisk_queue_depth_set(int depth);
+void vdisk_cache_set_size(int n_blocks);
+void vdisk_journal_set_group(int n_operations);
+unsigned int vdisk_journal_blocks(unsigned int block_size,
+                                  unsigned int n_blocks);
+
+// Disk handles
+VDISK *vdisk_open(char *virtual_disk_name);
+VDISK *vdisk_create(char *virtual_disk_name, VDISK_SUPERBLOCK *superblock);
+int vdisk_close(VDISK *disk);
+int vdisk_read_block_at(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_write_block_at(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                         void **blocks);
+int vdisk_write_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                          void **blocks);
+int vdisk_write_data_blocks_at(VDISK *disk, int n, BLOCK_REFERENCE *block_refs,
+                               void **blocks);
+int vdisk_flush_at(VDISK *disk);
+int vdisk_backend_active_at(VDISK *disk);
+int vdisk_read_block_async_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                              void *block, VDISK_CALLBACK callback, void *arg);
+int vdisk_write_block_async_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                               void *block, VDISK_CALLBACK callback, void *arg);
+int vdisk_submit_at(VDISK *disk);
+int vdisk_wait_at(VDISK *disk, int min_complete);
+int vdisk_drain_at(VDISK *disk);
+const void *vdisk_block_ptr_at(VDISK *disk, BLOCK_REFERENCE block_ref);
+void vdisk_cache_stats_at(VDISK *disk, VDISK_CACHE_STATS *stats);
+int vdisk_cache_resident_at(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_journal_begin_at(VDISK *disk);
+int vdisk_journal_end_at(VDISK *disk);
+int vdisk_journal_reserve_at(VDISK *disk, int n_blocks);
+int vdisk_journal_commit_at(VDISK *disk);
+unsigned long vdisk_journal_sequence_at(VDISK *disk);
+int vdisk_journal_settled_at(VDISK *disk, unsigned long sequence);
+long vdisk_scrub_at(VDISK *disk, unsigned long *n_checked);
+int vdisk_discard_block_at(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_stripe_at(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_snapshot_create_at(VDISK *disk, char *name);
+int vdisk_snapshot_list_at(VDISK *disk, VDISK_SNAPSHOT *snapshots);
+int vdisk_snapshot_rollback_at(VDISK *disk, char *name);
+int vdisk_snapshot_delete_at(VDISK *disk, char *name);
+void vdisk_io_stats_at(VDISK *disk, VDISK_IO_STATS *stats);
+int vdisk_io_stats_recorded_at(VDISK *disk, VDISK_IO_STATS *stats);
+void vdisk_block_type_set_at(VDISK *disk, BLOCK_REFERENCE block_ref,
+                             int type);
+void vdisk_io_stats_print(FILE *stream, VDISK_IO_STATS *stats, int json);
+
+// Single-disk interface (operates on vdisk_default)
 int vdisk_disk_open(char *virtual_disk_name);
+int vdisk_disk_create(char *virtual_disk_name, VDISK_SUPERBLOCK *superblock);
 int vdisk_disk_close();
 int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
 int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(int n, BLOCK_REFERENCE *block_refs, void **blocks);
+int vdisk_write_blocks(int n, BLOCK_REFERENCE *block_refs, void **blocks);
+int vdisk_write_data_blocks(int n, BLOCK_REFERENCE *block_refs, void **blocks);
+int vdisk_flush();
+int vdisk_backend_active();
+int vdisk_read_block_async(BLOCK_REFERENCE block_ref, void *block,
+                           VDISK_CALLBACK callback, void *arg);
+int vdisk_write_block_async(BLOCK_REFERENCE block_ref, void *block,
+                            VDISK_CALLBACK callback, void *arg);
+int vdisk_submit();
+int vdisk_wait(int min_complete);
+int vdisk_drain();
+const void *vdisk_block_ptr(BLOCK_REFERENCE block_ref);
+void vdisk_cache_stats(VDISK_CACHE_STATS *stats);
+int vdisk_cache_resident(BLOCK_REFERENCE block_ref);
+long vdisk_scrub(unsigned long *n_checked);
+int vdisk_discard_block(BLOCK_REFERENCE block_ref);
+int vdisk_stripe(BLOCK_REFERENCE block_ref);
+int vdisk_snapshot_create(char *name);
+int vdisk_snapshot_list(VDISK_SNAPSHOT *snapshots);
+int vdisk_snapshot_rollback(char *name);
+int vdisk_snapshot_delete(char *name);
+void vdisk_io_stats(VDISK_IO_STATS *stats);
+int vdisk_io_stats_recorded(VDISK_IO_STATS *stats);
+void vdisk_block_type_set(BLOCK_REFERENCE block_ref, int type);
 
 #endif
@@ -0,0 +1,136 @@
+#include "vdisk_pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+/*
+ * Thread pool for the virtual disk.
+ *
+ * vdisk_pool_run() posts a batch of tasks and takes part in it: the calling
+ * thread and the workers claim task indices one at a time until none are
+ * left, then the caller waits for the last task to finish.  Workers sleep
+ * between batches.  Only one batch runs at a time.
+ */
+
+struct vdisk_pool_s {
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+
+  // Current batch: tasks next .. n_tasks - 1 are still unclaimed and
+  // running of them are in progress
+  VDISK_POOL_TASK task;
+  void *arg;
+  int n_tasks;
+  int next;
+  int running;
+  int shutdown;
+
+  pthread_t *threads;
+  int n_threads;
+};
+
+/**
+ * Claim and run tasks of the current batch until none are left.  Called with
+ * the lock held; returns with it held.
+ */
+static void vdisk_pool_drain(VDISK_POOL *pool) {
+  while (pool->next < pool->n_tasks) {
+    int i = pool->next++;
+    ++pool->running;
+    pthread_mutex_unlock(&pool->lock);
+    pool->task(pool->arg, i);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0 && pool->next == pool->n_tasks)
+      pthread_cond_signal(&pool->done);
+  }
+}
+
+/**
+ * Worker thread
+ */
+static void *vdisk_pool_worker(void *context) {
+  VDISK_POOL *pool = context;
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->shutdown) {
+    if (pool->next < pool->n_tasks)
+      vdisk_pool_drain(pool);
+    else
+      pthread_cond_wait(&pool->work, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return (NULL);
+}
+
+/**
+ * Start a pool
+ *
+ * @param n_threads Number of worker threads (besides the calling thread)
+ * @return The pool; NULL on error
+ */
+VDISK_POOL *vdisk_pool_open(int n_threads) {
+  VDISK_POOL *pool = calloc(1, sizeof(VDISK_POOL));
+  if (pool == NULL)
+    return (NULL);
+  pool->threads = calloc(n_threads > 0 ? n_threads : 1, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    free(pool);
+    return (NULL);
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (int i = 0; i < n_threads; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, vdisk_pool_worker, pool) != 0)
+      break;
+    ++pool->n_threads;
+  }
+  return (pool);
+}
+
+/**
+ * Stop the workers and release the pool
+ */
+void vdisk_pool_close(VDISK_POOL *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->n_threads; ++i)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
+
+/**
+ * Run task(arg, 0) .. task(arg, n_tasks - 1) in parallel and wait for all of
+ * them (one after the other if pool is NULL)
+ */
+void vdisk_pool_run(VDISK_POOL *pool, int n_tasks, VDISK_POOL_TASK task,
+                    void *arg) {
+  // Nothing to share
+  if (n_tasks <= 1 || pool == NULL || pool->n_threads == 0) {
+    for (int i = 0; i < n_tasks; ++i)
+      task(arg, i);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->arg = arg;
+  pool->n_tasks = n_tasks;
+  pool->next = 0;
+  pool->running = 0;
+  pthread_cond_broadcast(&pool->work);
+
+  vdisk_pool_drain(pool);
+  while (pool->running > 0)
+    pthread_cond_wait(&pool->done, &pool->lock);
+
+  // Leave the workers nothing to pick up
+  pool->n_tasks = pool->next = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,20 @@
+#ifndef VDISK_POOL_H
+#define VDISK_POOL_H
+
+/*
+ * Small thread pool used by vdisk.c to drive the files of a striped disk in
+ * parallel.  Private to the vdisk layer.
+ */
+
+// One task of a parallel run: i is the index of the task
+typedef void (*VDISK_POOL_TASK)(void *arg, int i);
+
+// A set of worker threads.  Each striped disk has its own
+typedef struct vdisk_pool_s VDISK_POOL;
+
+VDISK_POOL *vdisk_pool_open(int n_threads);
+void vdisk_pool_close(VDISK_POOL *pool);
+void vdisk_pool_run(VDISK_POOL *pool, int n_tasks, VDISK_POOL_TASK task,
+                    void *arg);
+
+#endif
@@ -0,0 +1,570 @@
+#include "vdisk_snap.h"
+#include <errno.h>
+#include <string.h>
+/*
+ * Copy-on-write snapshots for the virtual disk.
+ *
+ * The manifest (<disk>.snap, next to the first disk file) lists the
+ * snapshots, oldest first, one "<seq> <name>" line each; the overlay pushed
+ * with a snapshot is <disk>.snap.<seq>.  The manifest is replaced atomically
+ * (written aside, then renamed), and always after the overlays it names are
+ * on disk, so a crash leaves either the old chain or the new one.
+ */
+
+/**
+ * Name of the manifest of a disk (the first file of a striped disk)
+ *
+ * @return 0 on success; <0 if the name is too long
+ */
+static int vdisk_snap_manifest_name(char *path, char *disk_name) {
+  size_t length = strcspn(disk_name, ",");
+  if (length + sizeof(".snap") > PATH_MAX)
+    return (-1);
+  memcpy(path, disk_name, length);
+  strcpy(path + length, ".snap");
+  return (0);
+}
+
+/**
+ * Name of the overlay file with the given sequence number
+ */
+static void vdisk_snap_overlay_name(char *name, char *path, unsigned int seq) {
+  snprintf(name, PATH_MAX + 16, "%s.%u", path, seq);
+}
+
+/**
+ * Read a manifest
+ *
+ * @return Number of snapshots listed (0 if there is no manifest); <0 on error
+ */
+static int vdisk_snap_read_manifest(char *path, unsigned int *seqs,
+                                    char names[][VDISK_SNAPSHOT_NAME_LENGTH]) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return (errno == ENOENT ? 0 : -1);
+
+  int n = 0;
+  unsigned int seq;
+  char name[VDISK_SNAPSHOT_NAME_LENGTH];
+  while (fscanf(file, "%u %31s", &seq, name) == 2) {
+    if (n == VDISK_MAX_SNAPSHOTS) {
+      n = -1;
+      break;
+    }
+    seqs[n] = seq;
+    strcpy(names[n++], name);
+  }
+  fclose(file);
+  return (n);
+}
+
+/**
+ * Replace the manifest with the chain as it stands (remove it if there are
+ * no snapshots left)
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_snap_write_manifest(VDISK_SNAP *snap) {
+  if (snap->n_layers == 0)
+    return (unlink(snap->path) == 0 || errno == ENOENT ? 0 : -1);
+
+  char aside[PATH_MAX + 16];
+  snprintf(aside, sizeof(aside), "%s.new", snap->path);
+  FILE *file = fopen(aside, "w");
+  if (file == NULL)
+    return (-1);
+  for (int i = 0; i < snap->n_layers; ++i)
+    fprintf(file, "%u %s\n", snap->seqs[i], snap->names[i]);
+  int ret = (fflush(file) == 0 && fsync(fileno(file)) == 0) ? 0 : -1;
+  if (fclose(file) != 0 || ret != 0 || rename(aside, snap->path) != 0) {
+    unlink(aside);
+    return (-1);
+  }
+  return (0);
+}
+
+/**
+ * Allocate an empty chain (no snapshots)
+ *
+ * @return The chain; NULL on error
+ */
+static VDISK_SNAP *vdisk_snap_new(char *path, unsigned int block_size,
+                                  unsigned int n_blocks) {
+  VDISK_SNAP *snap = calloc(1, sizeof(VDISK_SNAP));
+  if (snap == NULL)
+    return (NULL);
+  strcpy(snap->path, path);
+  snap->block_size = block_size;
+  snap->n_blocks = n_blocks;
+  snap->table_blocks =
+      ((unsigned long)n_blocks * sizeof(unsigned int) + block_size - 1) /
+      block_size;
+  snap->layer = calloc(n_blocks, 1);
+  snap->slot = calloc(n_blocks, sizeof(unsigned int));
+  snap->table_dirty = calloc(snap->table_blocks, 1);
+  if (snap->layer == NULL || snap->slot == NULL || snap->table_dirty == NULL) {
+    vdisk_snap_close(snap);
+    return (NULL);
+  }
+  return (snap);
+}
+
+/**
+ * Read the remap table of overlay k
+ *
+ * @param table n_blocks entries; the part the file does not hold reads as 0
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_snap_read_table(VDISK_SNAP *snap, int k, unsigned int *table) {
+  size_t length = (size_t)snap->n_blocks * sizeof(unsigned int);
+  memset(table, 0, length);
+  return (pread(snap->fds[k - 1], table, length, snap->block_size) < 0 ? -1
+                                                                        : 0);
+}
+
+/**
+ * Make the top overlay cover every slot handed out, so that a slot that has
+ * never been written reads as zeros.  The file grows geometrically (it is
+ * sparse, so this costs nothing on the host).
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_snap_extend(VDISK_SNAP *snap) {
+  if (snap->next_slot - 1 <= snap->n_slots)
+    return (0);
+  unsigned int n_slots = snap->n_slots * 2;
+  if (n_slots < snap->next_slot - 1)
+    n_slots = snap->next_slot - 1;
+  if (n_slots < 64)
+    n_slots = 64;
+  if (ftruncate(snap->fds[snap->n_layers - 1],
+                vdisk_snap_offset(snap, n_slots + 1)) != 0) {
+    fprintf(stderr, "vdisk: unable to extend snapshot overlay\n");
+    return (-4);
+  }
+  snap->n_slots = n_slots;
+  return (0);
+}
+
+/**
+ * Resolve the chain: find the newest layer holding each block
+ *
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_snap_resolve(VDISK_SNAP *snap) {
+  memset(snap->layer, 0, snap->n_blocks);
+  memset(snap->slot, 0, (size_t)snap->n_blocks * sizeof(unsigned int));
+  memset(snap->held, 0, sizeof(snap->held));
+  memset(snap->table_dirty, 0, snap->table_blocks);
+  snap->next_slot = 1;
+  snap->n_slots = 0;
+  if (snap->n_layers == 0)
+    return (0);
+
+  unsigned int *table = malloc((size_t)snap->n_blocks * sizeof(unsigned int));
+  if (table == NULL)
+    return (-5);
+  for (int k = 1; k <= snap->n_layers; ++k) {
+    if (vdisk_snap_read_table(snap, k, table) != 0) {
+      free(table);
+      return (-4);
+    }
+    for (BLOCK_REFERENCE i = 0; i < snap->n_blocks; ++i) {
+      if (table[i] == 0)
+        continue;
+      snap->layer[i] = k;
+      snap->slot[i] = table[i];
+      ++snap->held[k];
+      if (k == snap->n_layers && table[i] >= snap->next_slot)
+        snap->next_slot = table[i] + 1;
+    }
+  }
+  free(table);
+
+  struct stat st;
+  int top = snap->fds[snap->n_layers - 1];
+  if (fstat(top, &st) == 0 && st.st_size > vdisk_snap_offset(snap, 0))
+    snap->n_slots =
+        (st.st_size - vdisk_snap_offset(snap, 0)) / snap->block_size;
+  return (vdisk_snap_extend(snap));
+}
+
+/**
+ * Create an empty overlay: its header and a remap table of holes
+ *
+ * @return Descriptor of the overlay; <0 on error
+ */
+static int vdisk_snap_create_overlay(VDISK_SNAP *snap, unsigned int seq) {
+  char name[PATH_MAX + 16];
+  vdisk_snap_overlay_name(name, snap->path, seq);
+  int fd = open(name, O_RDWR | O_CREAT | O_TRUNC,
+                S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd < 0)
+    return (-1);
+
+  VDISK_SNAP_HEADER header = {VDISK_SNAP_MAGIC, snap->block_size,
+                              snap->n_blocks};
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      ftruncate(fd, vdisk_snap_offset(snap, 1)) != 0 || fdatasync(fd) != 0) {
+    close(fd);
+    unlink(name);
+    return (-1);
+  }
+  return (fd);
+}
+
+/**
+ * Open the snapshot chain of a disk
+ *
+ * @param snap Set to the chain; NULL if the disk has no snapshots
+ * @param disk_name Name of the disk (a comma-separated list if striped)
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_open(VDISK_SNAP **snap, char *disk_name,
+                    unsigned int block_size, unsigned int n_blocks) {
+  *snap = NULL;
+  char path[PATH_MAX];
+  unsigned int seqs[VDISK_MAX_SNAPSHOTS];
+  char names[VDISK_MAX_SNAPSHOTS][VDISK_SNAPSHOT_NAME_LENGTH];
+  if (vdisk_snap_manifest_name(path, disk_name) != 0)
+    return (-1);
+  int n = vdisk_snap_read_manifest(path, seqs, names);
+  if (n <= 0)
+    return (n);
+
+  VDISK_SNAP *chain = vdisk_snap_new(path, block_size, n_blocks);
+  if (chain == NULL)
+    return (-5);
+  for (int i = 0; i < n; ++i) {
+    char name[PATH_MAX + 16];
+    vdisk_snap_overlay_name(name, path, seqs[i]);
+    int fd = open(name, O_RDWR);
+    VDISK_SNAP_HEADER header;
+    if (fd >= 0 &&
+        (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+         header.magic != VDISK_SNAP_MAGIC || header.block_size != block_size ||
+         header.n_blocks != n_blocks)) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd < 0) {
+      fprintf(stderr, "vdisk: bad snapshot overlay %s\n", name);
+      vdisk_snap_close(chain);
+      return (-1);
+    }
+    chain->fds[i] = fd;
+    chain->seqs[i] = seqs[i];
+    strcpy(chain->names[i], names[i]);
+    chain->n_layers = i + 1;
+  }
+
+  if (vdisk_snap_resolve(chain) != 0) {
+    vdisk_snap_close(chain);
+    return (-4);
+  }
+  *snap = chain;
+  return (0);
+}
+
+/**
+ * Close the overlays and release the chain
+ */
+void vdisk_snap_close(VDISK_SNAP *snap) {
+  for (int i = 0; i < snap->n_layers; ++i)
+    close(snap->fds[i]);
+  free(snap->layer);
+  free(snap->slot);
+  free(snap->table_dirty);
+  free(snap);
+}
+
+/**
+ * Delete every snapshot of a disk (when it is formatted again)
+ */
+void vdisk_snap_remove(char *disk_name) {
+  char path[PATH_MAX];
+  unsigned int seqs[VDISK_MAX_SNAPSHOTS];
+  char names[VDISK_MAX_SNAPSHOTS][VDISK_SNAPSHOT_NAME_LENGTH];
+  if (vdisk_snap_manifest_name(path, disk_name) != 0)
+    return;
+  int n = vdisk_snap_read_manifest(path, seqs, names);
+  for (int i = 0; i < n; ++i) {
+    char name[PATH_MAX + 16];
+    vdisk_snap_overlay_name(name, path, seqs[i]);
+    unlink(name);
+  }
+  unlink(path);
+}
+
+/**
+ * Give a block a slot of its own in the top overlay.  The block must not be
+ * there already.
+ */
+void vdisk_snap_allocate(VDISK_SNAP *snap, BLOCK_REFERENCE block_ref) {
+  unsigned int per_block = snap->block_size / sizeof(unsigned int);
+  snap->layer[block_ref] = snap->n_layers;
+  snap->slot[block_ref] = snap->next_slot++;
+  ++snap->held[snap->n_layers];
+  snap->table_dirty[block_ref / per_block] = 1;
+  vdisk_snap_extend(snap);
+}
+
+/**
+ * Write the changed parts of the top overlay's remap table
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_flush(VDISK_SNAP *snap) {
+  if (snap == NULL)
+    return (0);
+
+  unsigned int per_block = snap->block_size / sizeof(unsigned int);
+  unsigned int table[per_block];
+  int top = snap->n_layers;
+  for (unsigned int j = 0; j < snap->table_blocks; ++j) {
+    if (!snap->table_dirty[j])
+      continue;
+    memset(table, 0, sizeof(table));
+    for (unsigned int i = 0; i < per_block; ++i) {
+      BLOCK_REFERENCE block_ref = j * per_block + i;
+      if (block_ref < snap->n_blocks && snap->layer[block_ref] == top)
+        table[i] = snap->slot[block_ref];
+    }
+    if (pwrite(snap->fds[top - 1], table, snap->block_size,
+               (off_t)(j + 1) * snap->block_size) != snap->block_size) {
+      fprintf(stderr, "vdisk: snapshot table write failed\n");
+      return (-4);
+    }
+    snap->table_dirty[j] = 0;
+  }
+  return (0);
+}
+
+/**
+ * Take a snapshot: freeze the top layer and push an empty overlay.  The disk
+ * must have been flushed.
+ *
+ * @param snap The chain; created if NULL
+ * @param name Name of the snapshot
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_push(VDISK_SNAP **snap, char *disk_name,
+                    unsigned int block_size, unsigned int n_blocks,
+                    char *name) {
+  VDISK_SNAP *chain = *snap;
+  if (strlen(name) == 0 || strlen(name) >= VDISK_SNAPSHOT_NAME_LENGTH ||
+      strpbrk(name, " \t\n") != NULL) {
+    fprintf(stderr, "Bad snapshot name (%s)\n", name);
+    return (-3);
+  }
+  if (chain != NULL && vdisk_snap_find(chain, name) > 0) {
+    fprintf(stderr, "Snapshot %s already exists\n", name);
+    return (-3);
+  }
+  if (chain != NULL && chain->n_layers == VDISK_MAX_SNAPSHOTS) {
+    fprintf(stderr, "Too many snapshots (at most %d)\n", VDISK_MAX_SNAPSHOTS);
+    return (-3);
+  }
+
+  if (chain == NULL) {
+    char path[PATH_MAX];
+    if (vdisk_snap_manifest_name(path, disk_name) != 0)
+      return (-1);
+    chain = vdisk_snap_new(path, block_size, n_blocks);
+    if (chain == NULL)
+      return (-5);
+  } else if (vdisk_snap_flush(chain) != 0 ||
+             fdatasync(chain->fds[chain->n_layers - 1]) != 0) {
+    return (-4);
+  }
+
+  // Next sequence number
+  unsigned int seq = 1;
+  for (int i = 0; i < chain->n_layers; ++i) {
+    if (chain->seqs[i] >= seq)
+      seq = chain->seqs[i] + 1;
+  }
+  int fd = vdisk_snap_create_overlay(chain, seq);
+  int k = chain->n_layers;
+  if (fd >= 0) {
+    chain->fds[k] = fd;
+    chain->seqs[k] = seq;
+    strcpy(chain->names[k], name);
+    chain->n_layers = k + 1;
+    if (vdisk_snap_write_manifest(chain) != 0) {
+      char overlay[PATH_MAX + 16];
+      vdisk_snap_overlay_name(overlay, chain->path, seq);
+      close(fd);
+      unlink(overlay);
+      chain->n_layers = k;
+      fd = -1;
+    }
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Unable to create snapshot %s\n", name);
+    if (*snap == NULL)
+      vdisk_snap_close(chain);
+    return (-4);
+  }
+
+  // Everything stays where it is; new writes go to the new overlay
+  chain->held[k + 1] = 0;
+  chain->next_slot = 1;
+  chain->n_slots = 0;
+  memset(chain->table_dirty, 0, chain->table_blocks);
+  *snap = chain;
+  return (0);
+}
+
+/**
+ * @return Index (1 ... n_layers) of the named snapshot; 0 if there is none
+ */
+int vdisk_snap_find(VDISK_SNAP *snap, char *name) {
+  for (int i = 0; i < snap->n_layers; ++i) {
+    if (strcmp(snap->names[i], name) == 0)
+      return (i + 1);
+  }
+  return (0);
+}
+
+/**
+ * Return to snapshot k: overlays k ... n_layers are replaced by one empty
+ * overlay, and the later snapshots are deleted.  The disk must have been
+ * flushed; its cached contents are stale afterwards.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_rollback(VDISK_SNAP *snap, int k) {
+  unsigned int seq = 1;
+  for (int i = 0; i < snap->n_layers; ++i) {
+    if (snap->seqs[i] >= seq)
+      seq = snap->seqs[i] + 1;
+  }
+  int fd = vdisk_snap_create_overlay(snap, seq);
+  if (fd < 0)
+    return (-4);
+
+  // Switch the manifest over, then drop the old overlays
+  int n_layers = snap->n_layers;
+  int fds[VDISK_MAX_SNAPSHOTS];
+  unsigned int seqs[VDISK_MAX_SNAPSHOTS];
+  memcpy(fds, snap->fds, sizeof(fds));
+  memcpy(seqs, snap->seqs, sizeof(seqs));
+  snap->fds[k - 1] = fd;
+  snap->seqs[k - 1] = seq;
+  snap->n_layers = k;
+  if (vdisk_snap_write_manifest(snap) != 0) {
+    char name[PATH_MAX + 16];
+    vdisk_snap_overlay_name(name, snap->path, seq);
+    close(fd);
+    unlink(name);
+    memcpy(snap->fds, fds, sizeof(fds));
+    memcpy(snap->seqs, seqs, sizeof(seqs));
+    snap->n_layers = n_layers;
+    return (-4);
+  }
+  for (int i = k - 1; i < n_layers; ++i) {
+    char name[PATH_MAX + 16];
+    vdisk_snap_overlay_name(name, snap->path, seqs[i]);
+    close(fds[i]);
+    unlink(name);
+  }
+  return (vdisk_snap_resolve(snap));
+}
+
+/**
+ * First half of deleting snapshot k: copy the blocks of overlay k into the
+ * layer below it (through write_base for the disk file itself).  The current
+ * contents of the disk do not change.  The layer below must be made durable
+ * before vdisk_snap_drop() is called.
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_merge(VDISK_SNAP *snap, int k, VDISK_SNAP_WRITE write_base,
+                     void *context) {
+  size_t length = (size_t)snap->n_blocks * sizeof(unsigned int);
+  unsigned int *table = malloc(length);
+  unsigned int *below = (k > 1) ? malloc(length) : NULL;
+  unsigned char *block = malloc(snap->block_size);
+  int ret = (table == NULL || block == NULL || (k > 1 && below == NULL)) ? -5
+                                                                          : 0;
+  if (ret == 0 && (vdisk_snap_read_table(snap, k, table) != 0 ||
+                   (k > 1 && vdisk_snap_read_table(snap, k - 1, below) != 0)))
+    ret = -4;
+
+  // Slots of the layer below are reused; new ones go after the last
+  unsigned int next_slot = 1;
+  for (BLOCK_REFERENCE i = 0; ret == 0 && below != NULL && i < snap->n_blocks;
+       ++i) {
+    if (below[i] >= next_slot)
+      next_slot = below[i] + 1;
+  }
+
+  for (BLOCK_REFERENCE i = 0; ret == 0 && i < snap->n_blocks; ++i) {
+    if (table[i] == 0)
+      continue;
+    memset(block, 0, snap->block_size);
+    if (pread(snap->fds[k - 1], block, snap->block_size,
+              vdisk_snap_offset(snap, table[i])) < 0) {
+      ret = -4;
+    } else if (below == NULL) {
+      ret = write_base(context, i, block);
+    } else {
+      if (below[i] == 0)
+        below[i] = next_slot++;
+      if (pwrite(snap->fds[k - 2], block, snap->block_size,
+                 vdisk_snap_offset(snap, below[i])) != snap->block_size)
+        ret = -4;
+    }
+  }
+
+  if (ret == 0 && below != NULL &&
+      (pwrite(snap->fds[k - 2], below, length, snap->block_size) !=
+           (ssize_t)length ||
+       fdatasync(snap->fds[k - 2]) != 0))
+    ret = -4;
+  if (ret == -4)
+    fprintf(stderr, "vdisk: snapshot merge failed\n");
+  free(table);
+  free(below);
+  free(block);
+  return (ret);
+}
+
+/**
+ * Second half of deleting snapshot k: take overlay k out of the chain
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_snap_drop(VDISK_SNAP *snap, int k) {
+  int fd = snap->fds[k - 1];
+  unsigned int seq = snap->seqs[k - 1];
+  char dropped[VDISK_SNAPSHOT_NAME_LENGTH];
+  strcpy(dropped, snap->names[k - 1]);
+  for (int i = k; i < snap->n_layers; ++i) {
+    snap->fds[i - 1] = snap->fds[i];
+    snap->seqs[i - 1] = snap->seqs[i];
+    strcpy(snap->names[i - 1], snap->names[i]);
+  }
+  --snap->n_layers;
+  if (vdisk_snap_write_manifest(snap) != 0) {
+    // Put the overlay back
+    for (int i = snap->n_layers; i >= k; --i) {
+      snap->fds[i] = snap->fds[i - 1];
+      snap->seqs[i] = snap->seqs[i - 1];
+      strcpy(snap->names[i], snap->names[i - 1]);
+    }
+    snap->fds[k - 1] = fd;
+    snap->seqs[k - 1] = seq;
+    strcpy(snap->names[k - 1], dropped);
+    ++snap->n_layers;
+    fprintf(stderr, "vdisk: unable to update snapshot list\n");
+    return (-4);
+  }
+
+  char name[PATH_MAX + 16];
+  vdisk_snap_overlay_name(name, snap->path, seq);
+  close(fd);
+  unlink(name);
+  return (vdisk_snap_resolve(snap));
+}
@@ -0,0 +1,86 @@
+#ifndef VDISK_SNAP_H
+#define VDISK_SNAP_H
+
+#include "vdisk.h"
+#include <limits.h>
+
+/*
+ * Copy-on-write snapshot chain used by vdisk.c.  Private to the vdisk layer:
+ * the public snapshot interface is declared in vdisk.h.
+ *
+ * A disk with snapshots is a stack of layers.  Layer 0 is the disk file
+ * itself; layer k (1 ... n_layers) is the overlay file created along with
+ * snapshot k.  Only the top layer is written: taking a snapshot freezes it
+ * and pushes an empty overlay above it.  An overlay holds a block header,
+ * then a remap table with one slot number per disk block (0: not in this
+ * layer), then the blocks themselves, slot 1 first.
+ *
+ * The chain is resolved once, when the disk is opened: layer[] and slot[]
+ * give, for every block, the newest layer that holds it and where.
+ */
+
+// Magic number of an overlay header
+#define VDISK_SNAP_MAGIC 0x4e534f55 // "UOSN"
+
+// Block header of an overlay
+typedef struct vdisk_snap_header_s {
+  unsigned int magic;
+  unsigned int block_size;
+  unsigned int n_blocks;
+} VDISK_SNAP_HEADER;
+
+typedef struct vdisk_snap_s {
+  // Manifest listing the snapshots; overlays are named after it
+  char path[PATH_MAX];
+  unsigned int block_size;
+  unsigned int n_blocks;
+
+  // Blocks of remap table per overlay; the data slots follow them
+  unsigned int table_blocks;
+
+  // Snapshots, oldest first: snapshot k was taken just before overlay k was
+  // pushed.  held[k] counts the blocks held by overlay k
+  int n_layers;
+  int fds[VDISK_MAX_SNAPSHOTS];
+  unsigned int seqs[VDISK_MAX_SNAPSHOTS];
+  char names[VDISK_MAX_SNAPSHOTS][VDISK_SNAPSHOT_NAME_LENGTH];
+  unsigned int held[VDISK_MAX_SNAPSHOTS + 1];
+
+  // Resolved chain: newest layer holding each block and its slot there
+  unsigned char *layer;
+  unsigned int *slot;
+
+  // Top overlay: next free slot, slots covered by the file and the table
+  // blocks not yet written back
+  unsigned int next_slot;
+  unsigned int n_slots;
+  unsigned char *table_dirty;
+} VDISK_SNAP;
+
+// Writes a block to the disk file(s) underneath the chain
+typedef int (*VDISK_SNAP_WRITE)(void *context, BLOCK_REFERENCE block_ref,
+                                void *block);
+
+int vdisk_snap_open(VDISK_SNAP **snap, char *disk_name,
+                    unsigned int block_size, unsigned int n_blocks);
+void vdisk_snap_close(VDISK_SNAP *snap);
+void vdisk_snap_remove(char *disk_name);
+void vdisk_snap_allocate(VDISK_SNAP *snap, BLOCK_REFERENCE block_ref);
+int vdisk_snap_flush(VDISK_SNAP *snap);
+int vdisk_snap_push(VDISK_SNAP **snap, char *disk_name,
+                    unsigned int block_size, unsigned int n_blocks,
+                    char *name);
+int vdisk_snap_find(VDISK_SNAP *snap, char *name);
+int vdisk_snap_rollback(VDISK_SNAP *snap, int k);
+int vdisk_snap_merge(VDISK_SNAP *snap, int k, VDISK_SNAP_WRITE write_base,
+                     void *context);
+int vdisk_snap_drop(VDISK_SNAP *snap, int k);
+
+/**
+ * @return Position of a slot in its overlay
+ */
+static inline off_t vdisk_snap_offset(VDISK_SNAP *snap, unsigned int slot) {
+  return ((off_t)(snap->table_blocks + slot) * snap->block_size);
+}
+
+#endif
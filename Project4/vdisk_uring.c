@@ -0,0 +1,305 @@
+#include "vdisk_uring.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+/*
+ * Minimal io_uring driver for the virtual disk.
+ *
+ * Requests are placed on the submission queue by vdisk_uring_queue() and
+ * handed to the kernel in bulk by vdisk_uring_submit(); vdisk_uring_wait()
+ * reaps the completion queue and runs the per-request completion functions.
+ * The ring is driven with raw system calls so that no external library is
+ * needed.
+ */
+
+// Debug flag
+#define debug 0
+
+// One request in flight
+typedef struct vdisk_uring_slot_s {
+  int in_use;
+  ssize_t expected;
+  VDISK_URING_DONE done;
+  void *context;
+  struct vdisk_uring_slot_s *next_free;
+} VDISK_URING_SLOT;
+
+// Ring state.  One ring per open disk
+struct vdisk_uring_s {
+  int ring_fd;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned sq_entries;
+  unsigned to_submit;
+  unsigned inflight;
+  int reaping;
+
+  VDISK_URING_SLOT *slots;
+  unsigned n_slots;
+  VDISK_URING_SLOT *free_slots;
+};
+
+/**
+ * Thin wrappers around the io_uring system calls
+ */
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return ((int)syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned submit, unsigned min_complete,
+                              unsigned flags) {
+  return ((int)syscall(__NR_io_uring_enter, fd, submit, min_complete, flags,
+                       NULL, 0));
+}
+
+/**
+ * Create a ring
+ *
+ * @param depth Number of submission queue entries
+ * @return The ring; NULL if io_uring is not available
+ */
+VDISK_URING *vdisk_uring_open(unsigned depth) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  VDISK_URING *ring = calloc(1, sizeof(VDISK_URING));
+  if (ring == NULL)
+    return (NULL);
+  ring->ring_fd = -1;
+
+  int fd = sys_io_uring_setup(depth, &params);
+  if (fd < 0) {
+    if (debug)
+      fprintf(stderr, "io_uring_setup: %s\n", strerror(errno));
+    free(ring);
+    return (NULL);
+  }
+
+  // Map the submission ring, the completion ring and the SQE array
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    ring->ring_fd = fd;
+    vdisk_uring_close(ring);
+    return (NULL);
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes =
+      (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+  // Never have more requests in flight than the completion queue can hold
+  ring->n_slots = params.cq_entries;
+  ring->slots = calloc(ring->n_slots, sizeof(VDISK_URING_SLOT));
+  if (ring->slots == NULL) {
+    ring->ring_fd = fd;
+    vdisk_uring_close(ring);
+    return (NULL);
+  }
+  ring->free_slots = NULL;
+  for (unsigned i = 0; i < ring->n_slots; ++i) {
+    ring->slots[i].next_free = ring->free_slots;
+    ring->free_slots = &ring->slots[i];
+  }
+
+  ring->ring_fd = fd;
+  ring->sq_entries = params.sq_entries;
+  ring->to_submit = ring->inflight = 0;
+  return (ring);
+}
+
+/**
+ * Tear down a ring.  Outstanding requests are completed first.
+ */
+void vdisk_uring_close(VDISK_URING *ring) {
+  if (ring->ring_fd >= 0 && ring->slots != NULL) {
+    while (ring->inflight > 0 && vdisk_uring_wait(ring, 1) >= 0)
+      ;
+  }
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring_fd >= 0)
+    close(ring->ring_fd);
+  free(ring->slots);
+  free(ring);
+}
+
+/**
+ * Hand all queued submission entries to the kernel
+ *
+ * @return 0 on success; <0 on error
+ */
+int vdisk_uring_submit(VDISK_URING *ring) {
+  while (ring->to_submit > 0) {
+    int ret = sys_io_uring_enter(ring->ring_fd, ring->to_submit, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      fprintf(stderr, "vdisk_uring_submit(): %s\n", strerror(errno));
+      return (-1);
+    }
+    ring->to_submit -= ret;
+  }
+  return (0);
+}
+
+/**
+ * Queue one vectored read or write
+ *
+ * @param ring Ring to queue on
+ * @param write 1 for a write; 0 for a read
+ * @param fd File to transfer to/from
+ * @param offset Byte offset in the file
+ * @param iov Buffers; must stay valid until the request completes
+ * @param n_iov Number of buffers
+ * @param expected Number of bytes the request must transfer
+ * @param done Completion function
+ * @param context Passed to the completion function
+ * @return 0 on success; <0 on error
+ */
+int vdisk_uring_queue(VDISK_URING *ring, int write, int fd, off_t offset,
+                      struct iovec *iov, int n_iov, ssize_t expected,
+                      VDISK_URING_DONE done, void *context) {
+  // Out of request slots: make room (not possible from a completion function)
+  while (ring->free_slots == NULL) {
+    if (ring->reaping || vdisk_uring_wait(ring, 1) < 0) {
+      fprintf(stderr, "vdisk_uring_queue(): queue is full\n");
+      return (-1);
+    }
+  }
+
+  // Submission queue full: push it to the kernel
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries) {
+    if (vdisk_uring_submit(ring) != 0)
+      return (-1);
+  }
+
+  VDISK_URING_SLOT *slot = ring->free_slots;
+  ring->free_slots = slot->next_free;
+  slot->in_use = 1;
+  slot->expected = expected;
+  slot->done = done;
+  slot->context = context;
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = (unsigned long)iov;
+  sqe->len = n_iov;
+  sqe->user_data = (unsigned long)slot;
+  ring->sq_array[index] = index;
+
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->to_submit;
+  ++ring->inflight;
+  return (0);
+}
+
+/**
+ * Submit anything queued, then reap completions
+ *
+ * @param min_complete Number of completions to wait for (capped at the
+ *                     number of requests in flight)
+ * @return Number of requests completed; <0 on error
+ */
+int vdisk_uring_wait(VDISK_URING *ring, unsigned min_complete) {
+  if (min_complete > ring->inflight)
+    min_complete = ring->inflight;
+
+  // Submit and wait in one call
+  if (ring->to_submit > 0 || min_complete > 0) {
+    int ret;
+    do {
+      ret = sys_io_uring_enter(ring->ring_fd, ring->to_submit, min_complete,
+                               min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+      fprintf(stderr, "vdisk_uring_wait(): %s\n", strerror(errno));
+      return (-1);
+    }
+    ring->to_submit -= ret;
+  }
+
+  // Reap everything that is ready.  The head is re-read on every pass in case
+  // a completion function waited on the ring itself.
+  int completed = 0;
+  int was_reaping = ring->reaping;
+  ring->reaping = 1;
+  unsigned head;
+  while ((head = *ring->cq_head) !=
+         __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    VDISK_URING_SLOT *slot = (VDISK_URING_SLOT *)(unsigned long)cqe->user_data;
+    int result = (cqe->res == slot->expected) ? 0 : -4;
+    if (debug && result != 0)
+      fprintf(stderr, "io_uring request: res=%d expected=%ld\n", cqe->res,
+              (long)slot->expected);
+
+    ++head;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Release the slot before the completion function may queue more work
+    VDISK_URING_DONE done = slot->done;
+    void *context = slot->context;
+    slot->in_use = 0;
+    slot->next_free = ring->free_slots;
+    ring->free_slots = slot;
+    --ring->inflight;
+    ++completed;
+
+    if (done != NULL)
+      done(context, result);
+  }
+  ring->reaping = was_reaping;
+  return (completed);
+}
+
+/**
+ * @return Number of requests queued or in flight
+ */
+unsigned vdisk_uring_inflight(VDISK_URING *ring) { return (ring->inflight); }
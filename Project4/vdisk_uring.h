@@ -0,0 +1,28 @@
+#ifndef VDISK_URING_H
+#define VDISK_URING_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * io_uring engine used by vdisk.c.  Private to the vdisk layer: the public
+ * asynchronous interface is declared in vdisk.h.
+ */
+
+// Called once per completed request: result is 0 if all expected bytes were
+// transferred, <0 otherwise
+typedef void (*VDISK_URING_DONE)(void *context, int result);
+
+// A submission/completion ring.  Each open disk has its own
+typedef struct vdisk_uring_s VDISK_URING;
+
+VDISK_URING *vdisk_uring_open(unsigned depth);
+void vdisk_uring_close(VDISK_URING *ring);
+int vdisk_uring_queue(VDISK_URING *ring, int write, int fd, off_t offset,
+                      struct iovec *iov, int n_iov, ssize_t expected,
+                      VDISK_URING_DONE done, void *context);
+int vdisk_uring_submit(VDISK_URING *ring);
+int vdisk_uring_wait(VDISK_URING *ring, unsigned min_complete);
+unsigned vdisk_uring_inflight(VDISK_URING *ring);
+
+#endif
@@ -6,6 +6,7 @@ CS3113
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "oufs_lib.h"
@@ -23,7 +24,9 @@ int main(int argc, char **argv) {
   // Check arguments
   if (argc == 2) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if (vdisk_disk_open(disk_name) != 0) {
+      return (-1);
+    }
 
     if(debug)
       fprintf(stderr, "opened disk\n");
@@ -56,26 +59,18 @@ int main(int argc, char **argv) {
     }
     f.offset = inode.size - 1;
 
+    // Hand stdin to the library a line at a time: it holds the bytes back
+    // and allocates the file's blocks in one go when the file is flushed
     char buf[MAX_BUFFER];
-    char fullbuf[MAX_BUFFER];
-    int len = 0;
-    while(!feof(stdin)){
-      if(fgets(buf, MAX_BUFFER, stdin)){
-        int i = 0;
-        while(buf[i] != '\0'){
-          fullbuf[len] = buf[i];
-          i++;
-          len++;
-          if(len == MAX_BUFFER){
-            fprintf(stderr, "Out of memory\n");
-            return (0);
-          }
-        }
-      }
+    int ret = 0;
+    while(ret == 0 && fgets(buf, MAX_BUFFER, stdin)){
+      ret = oufs_fwrite(fp, (unsigned char *)buf, strlen(buf));
+    }
+    if(ret == 0){
+      ret = oufs_fflush(fp);
     }
-    fullbuf[len] = '\0';
 
-    if(oufs_fwrite(fp, fullbuf, len) < 0){
+    if(ret < 0){
       fprintf(stderr, "Could not open file\n");
       oufs_fclose(fp);
       return -1;
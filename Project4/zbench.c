@@ -0,0 +1,439 @@
+/**
+Benchmark the vdisk I/O engines.
+
+Random block reads and writes are issued through the asynchronous vdisk
+interface while keeping a fixed number of requests in flight.  Each engine
+(pread, io_uring) is measured at queue depths of 1, 8 and 64.  The cost of
+block checksums is then measured by repeating the depth 1 and 64 runs on an
+image with a checksum area, followed by a scrub of that image.
+
+Finally the file system itself is timed with and without checksums: files
+are written, flushed and read back through the oufs library on the pread
+and mmap backends.  Block checksum results are the mean of several runs; the
+file workload is run in pairs (without, then with checksums), its overhead is
+the median over the pairs, and it is checked against the target of costing
+less than 10%.
+
+Usage: zbench [n_operations]
+
+The benchmark works on scratch images (zbench.img and zbench-crc.img, 64 MiB
+of 4 KiB blocks each) in the current directory, which are removed afterwards.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "oufs_lib.h"
+#include "vdisk.h"
+
+#define BENCH_IMAGE "zbench.img"
+#define BENCH_CRC_IMAGE "zbench-crc.img"
+#define DEFAULT_OPERATIONS 100000
+#define MAX_DEPTH 64
+#define BENCH_BLOCK_SIZE 4096
+#define BENCH_N_BLOCKS 16384
+
+// Runs averaged for each checksum measurement
+#define BENCH_RUNS 5
+
+// File workload: files written once, then read back a few times.  Its time
+// is mostly spent in fdatasync(), which varies a lot from one run to the
+// next: it gets more runs, and the median of the paired runs rather than
+// the mean, which a single slow sync would skew
+#define BENCH_FILE_RUNS 20
+#define BENCH_FILES 32
+#define BENCH_FILE_SIZE (256 * 1024)
+#define BENCH_READ_PASSES 2
+
+// Largest acceptable cost of checksums on the file workload, in percent.
+// Every block written is checksummed (about 2% of the elapsed time) and the
+// blocks of the checksum area that changed are written back each time a
+// transaction settles, some 100 times a run (about 3%), which is what keeps
+// them durable; the two leave no room for the noise of fdatasync() under 5%
+#define BENCH_TARGET 10.0
+
+// Checksum area of BENCH_CRC_IMAGE: one CRC per block, at the end of the disk
+#define BENCH_N_CHECKSUM_BLOCKS                                                \
+  (BENCH_N_BLOCKS * VDISK_CHECKSUM_SIZE / BENCH_BLOCK_SIZE)
+#define BENCH_N_DATA_BLOCKS (BENCH_N_BLOCKS - BENCH_N_CHECKSUM_BLOCKS)
+
+// Requests in flight for the current run
+static int completed;
+static int errors;
+static int free_slot[MAX_DEPTH];
+static int n_free_slots;
+
+/**
+ * Completion callback: count the request and recycle its buffer
+ */
+static void bench_done(BLOCK_REFERENCE block_ref __attribute__((unused)),
+                       void *block __attribute__((unused)), int result,
+                       void *arg) {
+  if (result != 0)
+    ++errors;
+  ++completed;
+  free_slot[n_free_slots++] = (int)(long)arg;
+}
+
+/**
+ * Time one engine/depth/direction combination
+ *
+ * @return Operations per second; <0 on error
+ */
+static double bench_run(char *image, int backend, int depth, int write,
+                        int n_operations) {
+  unsigned char *buffers[MAX_DEPTH];
+
+  vdisk_backend_select(backend);
+  vdisk_queue_depth_set(depth);
+  vdisk_cache_set_size(0);
+  if (vdisk_disk_open(image) != 0) {
+    return (-1);
+  }
+  if (vdisk_backend_active() != backend) {
+    fprintf(stderr, "zbench: engine unavailable; measuring pread instead\n");
+  }
+
+  completed = errors = 0;
+  n_free_slots = depth;
+  for (int i = 0; i < depth; ++i) {
+    free_slot[i] = i;
+    buffers[i] = malloc(BLOCK_SIZE);
+    memset(buffers[i], i, BLOCK_SIZE);
+  }
+  srand(42);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int issued = 0;
+  while (completed < n_operations) {
+    // Top the queue up to the requested depth
+    while (issued < n_operations && n_free_slots > 0) {
+      int slot = free_slot[--n_free_slots];
+      // Block 0 holds the superblock: leave it alone.  Both images use the
+      // same blocks (the checksum area is off limits)
+      BLOCK_REFERENCE block_ref = 1 + rand() % (BENCH_N_DATA_BLOCKS - 1);
+      int ret = write ? vdisk_write_block_async(block_ref, buffers[slot],
+                                                bench_done, (void *)(long)slot)
+                      : vdisk_read_block_async(block_ref, buffers[slot],
+                                               bench_done, (void *)(long)slot);
+      if (ret != 0) {
+        fprintf(stderr, "zbench: request failed\n");
+        vdisk_drain();
+        vdisk_disk_close();
+        return (-1);
+      }
+      ++issued;
+    }
+    if (completed < n_operations && vdisk_wait(1) < 0) {
+      vdisk_disk_close();
+      return (-1);
+    }
+  }
+  vdisk_drain();
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  vdisk_disk_close();
+  for (int i = 0; i < depth; ++i) {
+    free(buffers[i]);
+  }
+
+  if (errors > 0) {
+    fprintf(stderr, "zbench: %d requests failed\n", errors);
+  }
+  double seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  return (n_operations / seconds);
+}
+
+/**
+ * Create a scratch image: the full disk, written once.  Block 0 carries the
+ * superblock so that later opens see the same geometry
+ *
+ * @param checksums 1 to give the image a checksum area
+ * @return 0 on success; <0 on error
+ */
+static int bench_create(char *image, int checksums) {
+  // No file system: only the checksum area is laid out
+  VDISK_SUPERBLOCK superblock = {VDISK_MAGIC,
+                                 BENCH_BLOCK_SIZE,
+                                 BENCH_N_BLOCKS,
+                                 0,
+                                 0,
+                                 0,
+                                 0,
+                                 checksums ? BENCH_N_DATA_BLOCKS : 0,
+                                 checksums ? BENCH_N_CHECKSUM_BLOCKS : 0,
+                                 0,
+                                 0,
+                                 0};
+  vdisk_backend_select(VDISK_BACKEND_PREAD);
+  vdisk_cache_set_size(-1);
+  if (vdisk_disk_create(image, &superblock) != 0) {
+    return (-1);
+  }
+  unsigned char *block = calloc(1, BLOCK_SIZE);
+  memcpy(block, &vdisk_default->superblock, sizeof(VDISK_SUPERBLOCK));
+  vdisk_write_block(0, block);
+  memset(block, 0, BLOCK_SIZE);
+  for (unsigned int i = 1; i < BENCH_N_DATA_BLOCKS; ++i) {
+    vdisk_write_block(i, block);
+  }
+  free(block);
+  return (vdisk_disk_close());
+}
+
+/**
+ * @return Throughput lost to checksums, in percent
+ */
+static double bench_overhead(double plain, double checked) {
+  return (100.0 * (plain - checked) / plain);
+}
+
+/**
+ * @return Mean rate of BENCH_RUNS runs of one combination; <0 on error
+ */
+static double bench_mean(char *image, int backend, int depth, int write,
+                         int n_operations) {
+  double sum = 0;
+  for (int r = 0; r < BENCH_RUNS; ++r) {
+    double rate = bench_run(image, backend, depth, write, n_operations);
+    if (rate < 0)
+      return (-1);
+    sum += rate;
+  }
+  return (sum / BENCH_RUNS);
+}
+
+/**
+ * Order two doubles, for qsort()
+ */
+static int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return ((x > y) - (x < y));
+}
+
+/**
+ * @return Median of n values (which are sorted in place)
+ */
+static double bench_median(double *values, int n) {
+  qsort(values, n, sizeof(double), bench_compare);
+  if (n % 2 == 0)
+    return ((values[n / 2 - 1] + values[n / 2]) / 2);
+  return (values[n / 2]);
+}
+
+/**
+ * @return Seconds between two readings of a clock
+ */
+static double bench_seconds(struct timespec *start, struct timespec *end) {
+  return ((end->tv_sec - start->tv_sec) +
+          (end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+/**
+ * Time the file workload on a freshly formatted image: BENCH_FILES files
+ * are created and written, then read back BENCH_READ_PASSES times, and the
+ * disk is closed (flushed)
+ *
+ * @param checksums 1 to format the image with block checksums
+ * @param seconds Set to the elapsed time
+ * @param cpu_seconds Set to the processor time used
+ * @return 0 on success; <0 on error
+ */
+static int bench_files(char *image, int backend, int checksums,
+                       double *seconds, double *cpu_seconds) {
+  if (oufs_format_disk_geometry(image, BENCH_BLOCK_SIZE, BENCH_N_BLOCKS, 0,
+                                -1, checksums, 1, 0) != 0) {
+    return (-1);
+  }
+  vdisk_backend_select(backend);
+  vdisk_cache_set_size(-1);
+
+  unsigned char *buffer = malloc(BENCH_BLOCK_SIZE);
+  for (int i = 0; i < BENCH_BLOCK_SIZE; ++i) {
+    buffer[i] = 'a' + i % 26;
+  }
+
+  struct timespec start, end, cpu_start, cpu_end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+  if (vdisk_disk_open(image) != 0) {
+    free(buffer);
+    return (-1);
+  }
+
+  int ret = 0;
+  char name[16];
+  for (int i = 0; ret == 0 && i < BENCH_FILES; ++i) {
+    snprintf(name, sizeof(name), "f%d", i);
+    OUFILE f = oufs_fopen("/", name, 'w');
+    if (f.inode_reference == UNALLOCATED_INODE) {
+      ret = -1;
+      break;
+    }
+    for (int n = 0; ret == 0 && n < BENCH_FILE_SIZE; n += BENCH_BLOCK_SIZE) {
+      ret = oufs_fwrite(&f, buffer, BENCH_BLOCK_SIZE);
+    }
+    if (ret == 0) {
+      ret = oufs_fflush(&f);
+    }
+    oufs_fclose(&f);
+  }
+
+  for (int pass = 0; ret == 0 && pass < BENCH_READ_PASSES; ++pass) {
+    for (int i = 0; ret == 0 && i < BENCH_FILES; ++i) {
+      snprintf(name, sizeof(name), "f%d", i);
+      OUFILE f = oufs_fopen("/", name, 'r');
+      if (f.inode_reference == UNALLOCATED_INODE) {
+        ret = -1;
+        break;
+      }
+      int n;
+      long total = 0;
+      while ((n = oufs_fread(&f, buffer, BENCH_BLOCK_SIZE)) > 0) {
+        total += n;
+      }
+      if (n < 0 || total != BENCH_FILE_SIZE) {
+        ret = -1;
+      }
+      oufs_fclose(&f);
+    }
+  }
+
+  if (vdisk_disk_close() != 0) {
+    ret = -1;
+  }
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(buffer);
+  if (ret != 0) {
+    fprintf(stderr, "zbench: file workload failed\n");
+    return (-1);
+  }
+  *seconds = bench_seconds(&start, &end);
+  *cpu_seconds = bench_seconds(&cpu_start, &cpu_end);
+  return (0);
+}
+
+int main(int argc, char **argv) {
+  int n_operations = DEFAULT_OPERATIONS;
+  if (argc == 2 && sscanf(argv[1], "%d", &n_operations) != 1) {
+    fprintf(stderr, "Usage: zbench [n_operations]\n");
+    return (-1);
+  }
+
+  if (bench_create(BENCH_IMAGE, 0) != 0 ||
+      bench_create(BENCH_CRC_IMAGE, 1) != 0) {
+    return (-1);
+  }
+
+  int depths[] = {1, 8, 64};
+  int backends[] = {VDISK_BACKEND_PREAD, VDISK_BACKEND_URING};
+  char *names[] = {"pread", "uring"};
+
+  printf("%d random %u-byte block operations per run\n", n_operations,
+         BENCH_BLOCK_SIZE);
+  printf("%-8s %6s %14s %14s\n", "engine", "depth", "read ops/s",
+         "write ops/s");
+  for (int b = 0; b < 2; ++b) {
+    for (int d = 0; d < 3; ++d) {
+      double reads =
+          bench_run(BENCH_IMAGE, backends[b], depths[d], 0, n_operations);
+      double writes =
+          bench_run(BENCH_IMAGE, backends[b], depths[d], 1, n_operations);
+      printf("%-8s %6d %14.0f %14.0f\n", names[b], depths[d], reads, writes);
+    }
+  }
+
+  // The same runs with checksums computed on every write and verified on
+  // every read (the cache is off, so every read is a fill).  Runs alternate
+  // between the images so that both see the same machine state
+  printf("\nBlock checksums (CRC-32C, %s; mean of %d runs)\n",
+         crc32c_hardware() ? "SSE4.2" : "software", BENCH_RUNS);
+  printf("%-8s %6s %14s %9s %14s %9s\n", "engine", "depth", "read ops/s",
+         "overhead", "write ops/s", "overhead");
+  for (int b = 0; b < 2; ++b) {
+    for (int d = 0; d < 3; d += 2) {
+      double rates[2][2];
+      for (int write = 0; write < 2; ++write) {
+        rates[0][write] = bench_mean(BENCH_IMAGE, backends[b], depths[d],
+                                     write, n_operations);
+        rates[1][write] = bench_mean(BENCH_CRC_IMAGE, backends[b], depths[d],
+                                     write, n_operations);
+      }
+      printf("%-8s %6d %14.0f %8.1f%% %14.0f %8.1f%%\n", names[b], depths[d],
+             rates[1][0], bench_overhead(rates[0][0], rates[1][0]),
+             rates[1][1], bench_overhead(rates[0][1], rates[1][1]));
+    }
+  }
+
+  // Whole-disk verification
+  vdisk_backend_select(VDISK_BACKEND_PREAD);
+  if (vdisk_disk_open(BENCH_CRC_IMAGE) == 0) {
+    unsigned long checked;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long errors = vdisk_scrub(&checked);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("scrub: %lu blocks, %ld errors, %.0f MB/s\n", checked, errors,
+           checked * (double)BENCH_BLOCK_SIZE / seconds / 1e6);
+    vdisk_disk_close();
+  }
+
+  // The file system on top: the cost that users see (the elapsed time),
+  // along with the processor time it includes.  Each run formats fresh
+  // images, alternating between them.  Times are the mean of the runs,
+  // overheads the median of those of each pair
+  printf("\nFile workload (%d files of %d KiB, read back %d times; %d "
+         "paired runs)\n",
+         BENCH_FILES, BENCH_FILE_SIZE / 1024, BENCH_READ_PASSES,
+         BENCH_FILE_RUNS);
+  printf("%-8s %12s %12s %9s %13s\n", "engine", "plain s", "checked s",
+         "overhead", "CPU overhead");
+  int file_backends[] = {VDISK_BACKEND_PREAD, VDISK_BACKEND_MMAP};
+  char *file_names[] = {"pread", "mmap"};
+  int met = 1;
+  for (int b = 0; b < 2; ++b) {
+    double seconds[2] = {0, 0};
+    double cpu_seconds[2] = {0, 0};
+    double overheads[BENCH_FILE_RUNS];
+    double cpu_overheads[BENCH_FILE_RUNS];
+    for (int r = 0; r < BENCH_FILE_RUNS; ++r) {
+      double run[2], cpu[2];
+      for (int checksums = 0; checksums < 2; ++checksums) {
+        if (bench_files(checksums ? BENCH_CRC_IMAGE : BENCH_IMAGE,
+                        file_backends[b], checksums, &run[checksums],
+                        &cpu[checksums]) != 0) {
+          unlink(BENCH_IMAGE);
+          unlink(BENCH_CRC_IMAGE);
+          return (-1);
+        }
+        seconds[checksums] += run[checksums] / BENCH_FILE_RUNS;
+        cpu_seconds[checksums] += cpu[checksums] / BENCH_FILE_RUNS;
+      }
+      // Extra time, as a share of the time without checksums
+      overheads[r] = 100.0 * (run[1] - run[0]) / run[0];
+      cpu_overheads[r] = 100.0 * (cpu[1] - cpu[0]) / cpu[0];
+    }
+    double overhead = bench_median(overheads, BENCH_FILE_RUNS);
+    double cpu_overhead = bench_median(cpu_overheads, BENCH_FILE_RUNS);
+    met = met && overhead < BENCH_TARGET;
+    printf("%-8s %12.4f %12.4f %8.1f%% %12.1f%%\n", file_names[b], seconds[0],
+           seconds[1], overhead, cpu_overhead);
+  }
+  printf("Checksum overhead target (< %.0f%%): %s\n", BENCH_TARGET,
+         met ? "met" : "NOT met");
+
+  unlink(BENCH_IMAGE);
+  unlink(BENCH_CRC_IMAGE);
+  return (0);
+}
@@ -6,6 +6,7 @@ CS3113
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "oufs_lib.h"
@@ -20,26 +21,62 @@ int main(int argc, char **argv) {
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
-  // Check arguments
-  if (argc == 2) {
+  // Check arguments: zcreate [-z] <filename>
+  int compress = (argc == 3 && strcmp(argv[1], "-z") == 0);
+  if (argc == 2 || compress) {
+    char *name = argv[argc - 1];
+
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if (vdisk_disk_open(disk_name) != 0) {
+      return (-1);
+    }
+
+    // Take in all of stdin first, so that a file too large for the disk is
+    // refused before it is created
+    unsigned long limit = compress ? MAX_COMPRESSED_FILE_SIZE(vdisk_default)
+                                   : MAX_FILE_SIZE(vdisk_default);
+    size_t capacity = MAX_BUFFER;
+    size_t size = 0;
+    unsigned char *data = malloc(capacity);
+    size_t n;
+    while(data != NULL && size <= limit &&
+          (n = fread(data + size, 1, capacity - size, stdin)) > 0){
+      size += n;
+      if(size == capacity){
+        capacity *= 2;
+        unsigned char *grown = realloc(data, capacity);
+        if(grown == NULL)
+          free(data);
+        data = grown;
+      }
+    }
+    if(data == NULL){
+      fprintf(stderr, "Not enough memory\n");
+      return -1;
+    }
+    if(size > limit){
+      fprintf(stderr, "File too large\n");
+      free(data);
+      return -1;
+    }
 
     if(debug)
       fprintf(stderr, "opened disk\n");
     // Make the specified directory
-    if(oufs_allocate_new_file(cwd, argv[1]) != 0){
+    if(oufs_allocate_new_file(cwd, name) != 0){
       fprintf(stderr, "Could not allocate file\n");
+      free(data);
       return -1;
     }
 
     if(debug)
       fprintf(stderr, "allocated file\n");
 
-    OUFILE f = oufs_fopen(cwd, argv[1], 'w');
+    OUFILE f = oufs_fopen(cwd, name, compress ? 'z' : 'w');
     OUFILE* fp = &f;
     if(!fp){
       fprintf(stderr, "Could not open file\n");
+      free(data);
       return -1;
     }
 
@@ -50,28 +87,22 @@ int main(int argc, char **argv) {
 
     f.offset = 0;
 
-    char buf[MAX_BUFFER];
-    char fullbuf[MAX_BUFFER];
-    int len = 0;
-    while(!feof(stdin)){
-      if(fgets(buf, MAX_BUFFER, stdin)){
-        int i = 0;
-        while(buf[i] != '\0'){
-          fullbuf[len] = buf[i];
-          i++;
-          len++;
-          if(len == MAX_BUFFER){
-            fprintf(stderr, "Out of memory\n");
-            return (0);
-          }
-        }
-      }
+    // Hand the contents to the library at once: it allocates the file's
+    // blocks in one go when the file is flushed
+    int ret = 0;
+    if(size > 0){
+      ret = oufs_fwrite(fp, data, size);
+    }
+    if(ret == 0){
+      ret = oufs_fflush(fp);
     }
-    fullbuf[len] = '\0';
+    free(data);
 
-    if(oufs_fwrite(fp, fullbuf, len) < 0){
+    // A file that could not be written is not left behind empty
+    if(ret < 0){
       fprintf(stderr, "Could not open file\n");
       oufs_fclose(fp);
+      oufs_remove(cwd, name);
       return -1;
     }
 
@@ -89,6 +120,6 @@ int main(int argc, char **argv) {
     return (0);
   } else {
     // Wrong number of parameters
-    fprintf(stderr, "Usage: zcreate <filename>\n");
+    fprintf(stderr, "Usage: zcreate [-z] <filename>\n");
   }
 }
@@ -0,0 +1,50 @@
+/**
+Report the free space of the OU File System disk.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char **argv __attribute__((unused))) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments: zdf
+  if (argc != 1) {
+    // Wrong parameters
+    fprintf(stderr, "Usage: zdf\n");
+    return (-1);
+  }
+
+  // Open the virtual disk
+  if (vdisk_disk_open(disk_name) != 0) {
+    return (-1);
+  }
+
+  unsigned int free_blocks;
+  unsigned int free_inodes;
+  int ret = oufs_free_space(&free_blocks, &free_inodes);
+  if (ret == 0) {
+    unsigned int n_blocks = N_BLOCKS_IN_DISK;
+    unsigned int n_inodes = N_INODES(vdisk_default);
+    printf("%-8s %10s %10s %10s %5s\n", "", "total", "used", "free", "use%");
+    printf("%-8s %10u %10u %10u %4u%%\n", "blocks", n_blocks,
+           n_blocks - free_blocks, free_blocks,
+           (unsigned int)(100ULL * (n_blocks - free_blocks) / n_blocks));
+    printf("%-8s %10u %10u %10u %4u%%\n", "inodes", n_inodes,
+           n_inodes - free_inodes, free_inodes,
+           (unsigned int)(100ULL * (n_inodes - free_inodes) / n_inodes));
+  } else {
+    fprintf(stderr, "Could not read the free space\n");
+  }
+
+  // Clean up
+  vdisk_disk_close();
+  return (ret == 0 ? 0 : -1);
+}
@@ -17,7 +17,9 @@ int main(int argc, char **argv) {
   oufs_get_environment(cwd, disk_name);
 
   // Open the virtual disk
-  vdisk_disk_open(disk_name);
+  if (vdisk_disk_open(disk_name) != 0) {
+    return (-1);
+  }
 
   // Check arguments
   if (argc == 2) {
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include "oufs_lib.h"
 
 int main(int argc, char** argv) {
@@ -7,7 +8,49 @@ int main(int argc, char** argv) {
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
-  oufs_format_disk(disk_name);
+  // Optional geometry: -b block_size -n n_blocks -i n_inode_blocks
+  // -j n_journal_blocks (0: no journal) -c 0|1 (block checksums; default 1)
+  // -s 0|1 (sparse disk file; default 1) -u stripe_unit (blocks per stripe
+  // unit when ZDISK lists several files)
+  unsigned int block_size = VDISK_DEFAULT_BLOCK_SIZE;
+  unsigned int n_blocks = VDISK_DEFAULT_N_BLOCKS;
+  unsigned int n_inode_blocks = 0;
+  unsigned int n_journal_blocks = 0;
+  int journal_given = 0;
+  unsigned int checksums = 1;
+  unsigned int sparse = 1;
+  unsigned int stripe_unit = 0;
+  for (int i = 1; i < argc; i += 2) {
+    unsigned int *value = NULL;
+    if (strcmp(argv[i], "-b") == 0) {
+      value = &block_size;
+    } else if (strcmp(argv[i], "-n") == 0) {
+      value = &n_blocks;
+    } else if (strcmp(argv[i], "-i") == 0) {
+      value = &n_inode_blocks;
+    } else if (strcmp(argv[i], "-j") == 0) {
+      value = &n_journal_blocks;
+      journal_given = 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      value = &checksums;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      value = &sparse;
+    } else if (strcmp(argv[i], "-u") == 0) {
+      value = &stripe_unit;
+    }
+    if (value == NULL || i + 1 >= argc || sscanf(argv[i + 1], "%u", value) != 1) {
+      fprintf(stderr, "Usage: zformat [-b block_size] [-n n_blocks] [-i n_inode_blocks] [-j n_journal_blocks] [-c 0|1] [-s 0|1] [-u stripe_unit]\n");
+      return(-1);
+    }
+  }
+
+  if (oufs_format_disk_geometry(disk_name, block_size, n_blocks,
+                                n_inode_blocks,
+                                journal_given ? (int)n_journal_blocks : -1,
+                                checksums != 0, sparse != 0,
+                                stripe_unit) != 0) {
+    return(-1);
+  }
 
   return(0);
 }
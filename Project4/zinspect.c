@@ -1,8 +1,40 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "oufs_lib.h"
 
+/**
+ * Print the block references of an inode, naming the indirect ones, or the
+ * root of its extent tree, or how much data it holds itself
+ */
+static void print_blocks(INODE *inode) {
+  if (inode->flags & INODE_INLINE) {
+    printf("Inline data: %u bytes\n", inode->size);
+    return;
+  }
+  if (inode->flags & INODE_EXTENTS) {
+    EXTENT_ROOT root;
+    memcpy(&root, inode->data, sizeof(root));
+    printf("Extent tree depth: %d\n", root.header.depth);
+    for (int i = 0; i < root.header.n_entries && i < EXTENTS_PER_INODE; ++i) {
+      printf("Extent %d: %u (%u blocks)\n", i, root.entry[i].start,
+             root.entry[i].length);
+    }
+    return;
+  }
+  for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
+    if ((inode->flags & INODE_INDIRECT) && i == INDIRECT_SLOT) {
+      printf("Indirect block: %u\n", inode->data[i]);
+    } else if ((inode->flags & INODE_INDIRECT) && i == DOUBLE_INDIRECT_SLOT) {
+      printf("Double indirect block: %u\n", inode->data[i]);
+    } else {
+      printf("Block %d: %u\n", i, inode->data[i]);
+    }
+  }
+}
+
 int main(int argc, char **argv) {
   // Get the key environment variables
   char cwd[MAX_PATH_LENGTH];
@@ -15,32 +47,96 @@ int main(int argc, char **argv) {
 
   if (argc == 2) {
     if (strncmp(argv[1], "-master", 8) == 0) {
-      // Master record
-      BLOCK block;
-      if (vdisk_read_block(0, &block) != 0) {
+      // Master record: the superblock and tables span
+      //  N_MASTER_BLOCKS(vdisk_default) blocks
+      unsigned char *master = malloc((size_t)N_MASTER_BLOCKS(vdisk_default) *
+                                     BLOCK_SIZE);
+      int error = (master == NULL);
+      for (int i = 0; !error && i < N_MASTER_BLOCKS(vdisk_default); ++i) {
+        error = vdisk_read_block(MASTER_BLOCK_REFERENCE + i,
+                                 master + (size_t)i * BLOCK_SIZE) != 0;
+      }
+      if (error) {
         fprintf(stderr, "Error reading master block\n");
       } else {
         // Block read: report state
+        printf("Block size: %u\n", BLOCK_SIZE);
+        printf("Blocks: %u\n", N_BLOCKS_IN_DISK);
+        printf("Master blocks: %u\n", N_MASTER_BLOCKS(vdisk_default));
+        printf("Inode blocks: %u\n", N_INODE_BLOCKS(vdisk_default));
+        printf("Journal blocks: %u\n", N_JOURNAL_BLOCKS(vdisk_default));
+        printf("Checksum blocks: %u\n", N_CHECKSUM_BLOCKS(vdisk_default));
+        printf("Sparse: %s\n",
+               (vdisk_default->superblock.flags & VDISK_SPARSE) ? "yes" : "no");
+        if (vdisk_default->superblock.n_stripes > 1) {
+          // Allocated blocks held by each file
+          unsigned int n_stripes = vdisk_default->superblock.n_stripes;
+          printf("Stripes: %u (unit: %u blocks)\n", n_stripes,
+                 vdisk_default->superblock.stripe_unit);
+          unsigned long count[VDISK_MAX_STRIPES] = {0};
+          for (BLOCK_REFERENCE i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+            if (master[BLOCK_TABLE_OFFSET(vdisk_default) + i / 8] &
+                (1 << (i % 8)))
+              ++count[vdisk_stripe(i)];
+          }
+          for (unsigned int i = 0; i < n_stripes; ++i)
+            printf("Stripe %u: %lu blocks\n", i, count[i]);
+        }
         printf("Inode table:\n");
-        for (int i = 0; i < INODES_PER_BLOCK * N_INODE_BLOCKS / 8; ++i) {
-          printf("%02x\n", block.master.inode_allocated_flag[i]);
+        for (int i = 0; i < INODE_TABLE_BYTES(vdisk_default); ++i) {
+          printf("%02x\n", master[INODE_TABLE_OFFSET + i]);
         }
         printf("Block table:\n");
-        for (int i = 0; i < N_BLOCKS_IN_DISK / 8; ++i) {
-          printf("%02x\n", block.master.block_allocated_flag[i]);
+        for (int i = 0; i < BLOCK_TABLE_BYTES(vdisk_default); ++i) {
+          printf("%02x\n", master[BLOCK_TABLE_OFFSET(vdisk_default) + i]);
         }
       }
+      free(master);
+
+    } else if (strncmp(argv[1], "-scrub", 7) == 0) {
+      // Verify every block against its checksum
+      if (N_CHECKSUM_BLOCKS(vdisk_default) == 0) {
+        fprintf(stderr, "Disk has no block checksums\n");
+      } else {
+        unsigned long checked;
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long errors = vdisk_scrub(&checked);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds =
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (errors < 0) {
+          fprintf(stderr, "Error scrubbing disk\n");
+        } else {
+          printf("Blocks checked: %lu\n", checked);
+          printf("Checksum errors: %ld\n", errors);
+          printf("Rate: %.0f MB/s\n",
+                 seconds > 0 ? checked * (double)BLOCK_SIZE / seconds / 1e6
+                             : 0.0);
+        }
+      }
+
+    } else if (strncmp(argv[1], "-iostats", 9) == 0) {
+      // I/O counters recorded by the tools run with ZSTATS set
+      VDISK_IO_STATS stats;
+      if (vdisk_io_stats_recorded(&stats) != 0) {
+        fprintf(stderr, "Error reading I/O statistics\n");
+      } else {
+        vdisk_io_stats_print(stdout, &stats, 1);
+      }
 
     } else {
       fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
     }
 
   } else if (argc == 3) {
+    // Buffer for one block of the disk
+    BLOCK *block;
     if (strncmp(argv[1], "-inode", 7) == 0) {
       // Inode query
       int index;
       if (sscanf(argv[2], "%d", &index) == 1) {
-        if (index < 0 || index >= N_INODES) {
+        if (index < 0 || index >= N_INODES(vdisk_default)) {
           fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
         } else {
           INODE inode;
@@ -48,10 +144,14 @@ int main(int argc, char **argv) {
 
           printf("Inode: %d\n", index);
           printf("Type: %c\n", inode.type);
-          for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-            printf("Block %d: %d\n", i, inode.data[i]);
-          }
+          print_blocks(&inode);
           printf("Size: %d\n", inode.size);
+          if (inode.flags & INODE_COMPRESSED) {
+            long stored = oufs_stored_size(&inode);
+            printf("Stored size: %ld\n", stored);
+            if (stored > 0)
+              printf("Compression ratio: %.2f\n", (double)inode.size / stored);
+          }
         }
       } else {
         fprintf(stderr, "Unknown argument (-inode %s)\n", argv[2]);
@@ -60,7 +160,7 @@ int main(int argc, char **argv) {
       // Extended Inode query
       int index;
       if (sscanf(argv[2], "%d", &index) == 1) {
-        if (index < 0 || index >= N_INODES) {
+        if (index < 0 || index >= N_INODES(vdisk_default)) {
           fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
         } else {
           INODE inode;
@@ -69,10 +169,14 @@ int main(int argc, char **argv) {
           printf("Inode: %d\n", index);
           printf("Type: %c\n", inode.type);
           printf("N references: %d\n", inode.n_references);
-          for (int i = 0; i < BLOCKS_PER_INODE; ++i) {
-            printf("Block %d: %d\n", i, inode.data[i]);
-          }
+          print_blocks(&inode);
           printf("Size: %d\n", inode.size);
+          if (inode.flags & INODE_COMPRESSED) {
+            long stored = oufs_stored_size(&inode);
+            printf("Stored size: %ld\n", stored);
+            if (stored > 0)
+              printf("Compression ratio: %.2f\n", (double)inode.size / stored);
+          }
         }
       } else {
         fprintf(stderr, "Unknown argument (-inode %s)\n", argv[2]);
@@ -83,17 +187,19 @@ int main(int argc, char **argv) {
       if (sscanf(argv[2], "%d", &index) == 1) {
         if (index < 0 || index >= N_BLOCKS_IN_DISK) {
           fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
+        } else if ((block = malloc(BLOCK_SIZE)) == NULL) {
+          fprintf(stderr, "Not enough memory\n");
         } else {
-          BLOCK block;
-          vdisk_read_block(index, &block);
+          vdisk_read_block(index, block);
           printf("Directory at block %d:\n", index);
-          for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
-            if (block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
-              printf("Entry %d: name=\"%s\", inode=%d\n", i,
-                     block.directory.entry[i].name,
-                     block.directory.entry[i].inode_reference);
+          for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK(vdisk_default); ++i) {
+            DIRECTORY_ENTRY *entry = &block->directory.entry[i];
+            if (entry->inode_reference != UNALLOCATED_INODE) {
+              printf("Entry %d: name=\"%s\", inode=%d\n", i, entry->name,
+                     entry->inode_reference);
             }
           }
+          free(block);
         }
       }
     } else if (strncmp(argv[1], "-raw", 4) == 0) {
@@ -102,17 +208,19 @@ int main(int argc, char **argv) {
       if (sscanf(argv[2], "%d", &index) == 1) {
         if (index < 0 || index >= N_BLOCKS_IN_DISK) {
           fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
+        } else if ((block = malloc(BLOCK_SIZE)) == NULL) {
+          fprintf(stderr, "Not enough memory\n");
         } else {
-          BLOCK block;
-          vdisk_read_block(index, &block);
+          vdisk_read_block(index, block);
           printf("Raw data at block %d:\n", index);
           for (int i = 0; i < BLOCK_SIZE; ++i) {
-            if (block.data.data[i] >= ' ' && block.data.data[i] <= '~')
-              printf("%3d: %02x %c\n", i, block.data.data[i],
-                     block.data.data[i]);
+            if (block->data.data[i] >= ' ' && block->data.data[i] <= '~')
+              printf("%3d: %02x %c\n", i, block->data.data[i],
+                     block->data.data[i]);
             else
-              printf("%3d: %02x\n", i, block.data.data[i]);
+              printf("%3d: %02x\n", i, block->data.data[i]);
           }
+          free(block);
         }
       }
     }
@@ -19,7 +19,9 @@ int main(int argc, char **argv) {
   // Check arguments
   if (argc == 3) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if (vdisk_disk_open(disk_name) != 0) {
+      return (-1);
+    }
 
     // Make the specified directory
     if(oufs_link(cwd, argv[1], argv[2]) != 0){
@@ -19,7 +19,9 @@ int main(int argc, char **argv) {
   // Check arguments
   if (argc == 2) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if (vdisk_disk_open(disk_name) != 0) {
+      return (-1);
+    }
 
     // Make the specified directory
     oufs_mkdir(cwd, argv[1]);
@@ -10,8 +10,6 @@ CS3113
 
 #include "oufs_lib.h"
 
-#define MAX_BUFFER ((BLOCK_SIZE - 2)*BLOCKS_PER_INODE)
-
 int main(int argc, char **argv) {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
@@ -21,7 +19,9 @@ int main(int argc, char **argv) {
   // Check arguments
   if (argc == 2) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    if (vdisk_disk_open(disk_name) != 0) {
+      return (-1);
+    }
 
     OUFILE f = oufs_fopen(cwd, argv[1], 'r');
     OUFILE *fp = &f;
@@ -42,21 +42,21 @@ int main(int argc, char **argv) {
     }
     fp->offset = 0;
 
-    unsigned char buf[MAX_BUFFER];
-    for(int i = 0; i < MAX_BUFFER; i++){
-      buf[i] = 0xff;
+    // Read a block's worth at a time; oufs_fread() reads ahead
+    unsigned char buf[BLOCK_SIZE];
+    int n;
+    while((n = oufs_fread(fp, buf, BLOCK_SIZE)) > 0){
+      for(int i = 0; i < n; i++){
+        if(buf[i] != 0xff){
+          fprintf(stdout, "%c", buf[i]);
+        }
+      }
     }
-    if(oufs_fread(fp, buf, MAX_BUFFER) != 0){
+    if(n < 0){
       fprintf(stderr, "Could not read file\n");
       return (-1);
     }
 
-    for(int i = 0; i < MAX_BUFFER; i++){
-      if(buf[i] != 0xff){
-        fprintf(stdout, "%c", buf[i]);
-      }
-    }
-
     oufs_fclose(fp);
 
     // Clean up
@@ -0,0 +1,55 @@
+/**
+Manage the snapshots of the OU File System disk.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char **argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments: zsnap list | zsnap create|rollback|delete <name>
+  int list = (argc == 2 && strcmp(argv[1], "list") == 0);
+  int named = (argc == 3 && (strcmp(argv[1], "create") == 0 ||
+                             strcmp(argv[1], "rollback") == 0 ||
+                             strcmp(argv[1], "delete") == 0));
+  if (!list && !named) {
+    // Wrong parameters
+    fprintf(stderr,
+            "Usage: zsnap list | zsnap create|rollback|delete <name>\n");
+    return (-1);
+  }
+
+  // Open the virtual disk
+  if (vdisk_disk_open(disk_name) != 0) {
+    return (-1);
+  }
+
+  int ret = 0;
+  if (list) {
+    VDISK_SNAPSHOT snapshots[VDISK_MAX_SNAPSHOTS];
+    int n = vdisk_snapshot_list(snapshots);
+    for (int i = 0; i < n; ++i) {
+      printf("%s (%u blocks changed since)\n", snapshots[i].name,
+             snapshots[i].n_blocks);
+    }
+  } else if (strcmp(argv[1], "create") == 0) {
+    ret = vdisk_snapshot_create(argv[2]);
+  } else if (strcmp(argv[1], "rollback") == 0) {
+    ret = vdisk_snapshot_rollback(argv[2]);
+  } else {
+    ret = vdisk_snapshot_delete(argv[2]);
+  }
+
+  // Clean up
+  vdisk_disk_close();
+  return (ret == 0 ? 0 : -1);
+}